@@ -0,0 +1,69 @@
+#ifndef LBS_ACTIONLOG_H
+#define LBS_ACTIONLOG_H
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// 64-bit FNV-1a; used to notice when an action's command changes.
+constexpr auto hash_command(std::string_view command) -> uint64_t {
+    uint64_t hash{0xcbf29ce484222325};
+    for (const char c : command) {
+        hash ^= uint64_t((unsigned char)c);
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+// Hash of the contents of the files at paths, one after the other (see
+// hash_file()); 0 if any of them can't be read. Used to notice when an
+// action's outputs come out the same as the last time it ran.
+auto hash_files(const std::vector<std::string>& paths) -> uint64_t;
+
+// Persistent record of how each action went the last time it ran, keyed by
+// BuildCommands::Action::key(). The log file is only ever appended to while
+// building, so that an interrupted build still remembers what it did; later
+// lines for the same key replace earlier ones.
+struct ActionLog {
+    struct Entry {
+        uint64_t command_hash{};
+        // When the action last finished, in nanoseconds since the epoch.
+        int64_t finished{};
+        // How long it took, in milliseconds.
+        int64_t duration{};
+        bool failed{};
+        // Hash of its outputs once it finished (see hash_files()); 0 if
+        // unknown.
+        uint64_t output_hash{};
+        // When it wrote its outputs over with the same contents, their
+        // modification times were put back to what they were before, so
+        // that whatever reads them stays up to date. They count as written
+        // when they were (in nanoseconds since the epoch), or 0.
+        int64_t modified{};
+        // Hash of its inputs (see hash_action_inputs()) as it read them; 0
+        // if unknown.
+        uint64_t input_hash{};
+    };
+
+    std::unordered_map<std::string, Entry> entries{};
+
+    // Load the log file at path; a missing or unreadable log is empty. Unless
+    // not writable, results recorded afterwards are appended to the same file.
+    static auto Load(std::string path, bool writable = true) -> ActionLog;
+
+    // Returns nullptr if the action with the given key has never run.
+    auto find(const std::string& key) const -> const Entry*;
+
+    // Remember the result of an action, both here and in the log file.
+    void record(const std::string& key, Entry entry);
+
+private:
+    std::string path{};
+    std::unique_ptr<FILE, int (*)(FILE*)> file{nullptr, fclose};
+};
+
+#endif /* LBS_ACTIONLOG_H */
@@ -0,0 +1,24 @@
+#ifndef LBS_BENCH_H
+#define LBS_BENCH_H
+
+#include <cstddef>
+#include <string>
+
+// Microbenchmarks of the paths every build goes through: lexing and parsing
+// the build description, looking up targets, planning the commands of deep
+// and wide targets, and expanding compiler templates. Each reports how long
+// one operation takes, and how many allocations (and bytes) it makes.
+struct BenchOptions {
+    // Only run benchmarks whose names contain this.
+    std::string filter{};
+    // The largest input, in sources; inputs go up by factors of ten from a
+    // thousand.
+    size_t max_sources{1000000};
+    // Repeat each operation for at least this long, three times over
+    // (unless once takes longer), and report the fastest.
+    double min_time_ms{100};
+};
+
+void bench_run(const BenchOptions& options);
+
+#endif /* LBS_BENCH_H */
@@ -0,0 +1,85 @@
+#ifndef LBS_CONTENTHASH_H
+#define LBS_CONTENTHASH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// 128-bit hash of contents, computed a 64 byte stripe at a time in eight
+// independent lanes (the way XXH3 does), two at a time with vector
+// instructions; not meant to withstand anyone trying to make two files hash
+// the same.
+struct ContentHash {
+    uint64_t low{};
+    uint64_t high{};
+
+    bool operator==(const ContentHash& other) const {
+        return low == other.low and high == other.high;
+    }
+    bool operator!=(const ContentHash& other) const {
+        return not (*this == other);
+    }
+};
+
+auto hash_contents(const void* data, size_t size, uint64_t seed = 0)
+    -> ContentHash;
+
+// Files bigger than this are hashed a chunk of this size at a time, then the
+// hashes of the chunks together; so a file hashes the same however many
+// threads hash it.
+static constexpr size_t content_hash_chunk = size_t(1) << 20;
+
+// Hash of the contents of the file at path, mapped into memory, with its
+// chunks spread over up to threads threads. Returns false if it can't be
+// read.
+bool hash_file(const std::string& path, ContentHash& hash, size_t threads = 1);
+
+// Hashes of files, remembered (in a file) for as long as each keeps the same
+// device, inode, size and modification time.
+struct ContentHashes {
+    struct Entry {
+        uint64_t device{};
+        uint64_t inode{};
+        int64_t size{-1};
+        // In nanoseconds since the epoch; 0 if the hash can't be trusted, as
+        // the file may have changed within the same tick of the file
+        // system's clock as it was hashed.
+        int64_t modified{};
+        ContentHash hash{};
+    };
+
+    std::unordered_map<std::string, Entry> entries{};
+
+    // Load the hashes saved at path; missing or unreadable hashes are empty.
+    static auto Load(std::string path) -> ContentHashes;
+
+    // Set entry to what we know about the file at path, hashing it again
+    // only if it changed since. Returns false if it can't be read.
+    // If given, state is the file's device, inode, size and modification
+    // time as last stat'ed (say, by FileStates), with a negative size if
+    // there is no such file; then it isn't stat'ed again.
+    bool hash(
+        const std::string& path,
+        Entry& entry,
+        const Entry* state = nullptr
+    );
+
+    // Hash those of paths that changed since, all at once: several files at
+    // a time, and each big one a chunk at a time, on as many threads as
+    // there are CPUs. If given, states are those of paths (as for hash()).
+    void hash_all(
+        const std::vector<std::string>& paths,
+        const std::vector<Entry>* states = nullptr
+    );
+
+    // Write the hashes back to where they were loaded from, if any changed.
+    void save();
+
+private:
+    std::string path{};
+    bool changed{false};
+};
+
+#endif /* LBS_CONTENTHASH_H */
@@ -0,0 +1,33 @@
+#ifndef LBS_COPY_H
+#define LBS_COPY_H
+
+#include <string>
+
+// Copies files for (copy ...) requisites, without running cp for each. Where
+// the file system allows, the copy is a reflink (sharing the source's blocks
+// until either is written to) or, failing that, done by the kernel with
+// copy_file_range(); only then are the contents read and written here.
+// A copy gets the modification time of its source, so that a destination
+// with the same size and modification time can be left alone.
+
+enum class CopyResult {
+    FAILED,
+    // The destination already had the source's contents.
+    UNCHANGED,
+    COPIED,
+};
+
+// Copy the file at source to destination, creating the directories it goes
+// in, unless destination is the same already: of the same size and
+// modification time, or of the same contents (in which case it just gets the
+// modification time). If hard_link, destination is made a hard link to
+// source instead, unless they are on different file systems. On failure,
+// error says why.
+auto copy_file(
+    const std::string& source,
+    const std::string& destination,
+    bool hard_link,
+    std::string& error
+) -> CopyResult;
+
+#endif /* LBS_COPY_H */
@@ -0,0 +1,38 @@
+#ifndef LBS_DAEMON_H
+#define LBS_DAEMON_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+// Where the daemon of a build directory listens, relative to that directory.
+#define LBS_DAEMON_SOCKET ".lbs_daemon"
+
+// If a daemon is listening in the current directory, have it handle a request
+// with the given command line arguments, with its output going to our stdout
+// and stderr, and with our environment. Returns false if there is no daemon
+// to ask; otherwise, status is set to the exit status of the request.
+bool daemon_request(const std::vector<std::string>& arguments, int& status);
+
+struct DaemonHandlers {
+    // Handles a request. While it does, stdout, stderr and the environment
+    // (which is also given, as NAME=VALUE entries) are those of the client.
+    // Returns the exit status for the client; set stop to shut down once the
+    // request is handled.
+    std::function<int(
+        const std::vector<std::string>& arguments,
+        const std::vector<std::string>& environment,
+        bool& stop
+    )>
+        request{};
+    // Readable whenever there is something to do outside of a request (e.g.
+    // changed files to hear about), or -1.
+    int event_fd{-1};
+    std::function<void()> event{};
+};
+
+// Listen in the current directory and handle requests one at a time until
+// told to stop. Returns an exit status.
+int daemon_serve(const DaemonHandlers& handlers);
+
+#endif /* LBS_DAEMON_H */
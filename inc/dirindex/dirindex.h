@@ -0,0 +1,62 @@
+#ifndef LBS_DIRINDEX_H
+#define LBS_DIRINDEX_H
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <lbs/build_scenario.h>
+
+// What is in the directories sources are found in (see
+// Target::source_directories), remembered (in a file) for as long as each
+// directory keeps the same inode and modification time, which changes
+// whenever an entry is added to, removed from or renamed within it. So
+// finding the sources in a tree that didn't change takes a stat() of each
+// directory in it, rather than reading them all.
+struct DirectoryIndex {
+    struct Entry {
+        std::string name;
+        bool directory;
+    };
+    struct Directory {
+        uint64_t device{};
+        uint64_t inode{};
+        // In nanoseconds since the epoch; 0 if what's listed can't be
+        // trusted, as the directory may have changed within the same tick of
+        // the file system's clock as it was read.
+        int64_t modified{};
+        std::vector<Entry> entries{};
+    };
+
+    std::unordered_map<std::string, Directory> directories{};
+    // The directories looked at since the last expand_sources().
+    std::vector<std::string> listed{};
+
+    // Load the index saved at path; a missing or unreadable index is empty.
+    static auto Load(std::string path) -> DirectoryIndex;
+
+    // The files (and no directories) within directory, and if recursive
+    // within its subdirectories too, whose names match one of patterns, or
+    // any if there are none; sorted. Hidden files and directories (like .git)
+    // are left out. Directories are read again only if they changed, those of
+    // a large tree several at a time.
+    auto files(
+        const std::string& directory,
+        const std::vector<std::string>& patterns,
+        bool recursive
+    ) -> std::vector<std::string>;
+
+    // Add the sources found in the source directories of every target of
+    // build_scenario to its sources. Exits if a source directory is missing.
+    void expand_sources(BuildScenario& build_scenario);
+
+    // Write the index back to where it was loaded from, if anything changed.
+    void save();
+
+private:
+    std::string path{};
+    bool changed{false};
+};
+
+#endif /* LBS_DIRINDEX_H */
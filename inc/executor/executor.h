@@ -0,0 +1,74 @@
+#ifndef LBS_EXECUTOR_H
+#define LBS_EXECUTOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <actionlog/actionlog.h>
+#include <filestate/filestate.h>
+#include <lbs/build_scenario.h>
+
+// More jobs than this are taken to be a mistake.
+constexpr size_t executor_jobs_limit{1024};
+
+struct ExecutorOptions {
+    // Maximum number of actions running at once (up to executor_jobs_limit).
+    size_t jobs{1};
+    // Stop starting new actions once this many have failed; 0 means never
+    // stop. Actions that depend on a failed action are never started.
+    size_t failures_allowed{1};
+    bool verbose{false};
+    // Where to look up how actions went last time, and to record how they
+    // went this time; may be null.
+    ActionLog* log{nullptr};
+    // Where to look up the states of inputs and outputs (what actions write
+    // is forgotten, so that only that is stat'ed again); may be null.
+    FileStates* file_states{nullptr};
+    // The hash of an action's inputs to record once it succeeded (see
+    // ActionLog::Entry::input_hash), given when it started (in nanoseconds
+    // since the epoch); if unset, none is.
+    std::function<uint64_t(
+        const BuildScenario::BuildCommands::Action& action,
+        int64_t started
+    )>
+        input_hash{};
+    // Whenever cancel_fd becomes readable, cancelled() is called to decide
+    // whether to give up on the build, killing whatever is running. It must
+    // leave cancel_fd unreadable (i.e. consume what made it readable).
+    int cancel_fd{-1};
+    std::function<bool()> cancelled{};
+    // Addresses of lbs-workers that may compile objects, in addition to the
+    // jobs run here.
+    std::vector<std::string> workers{};
+};
+
+// Run every action in build_commands, starting an action only once all of
+// its dependencies have finished and running up to options.jobs of them at
+// once. The stdout and stderr of each action is captured and written out in
+// one piece when that action finishes, so the output of concurrent actions
+// never interleaves.
+// Of the actions that may start, those that failed last time go first, then
+// those with the most recently edited inputs, so that errors show up as soon
+// as possible; the order never changes the end result.
+// Object actions may be preprocessed here and compiled by one of
+// options.workers instead, whichever of them (or this machine) is expected to
+// be done soonest, given its capacity and how long it took so far; when a
+// worker goes away, what it had is compiled here instead.
+// Once an action fails, every action depending on it (directly or not) is
+// skipped, while independent actions keep going until
+// options.failures_allowed is reached.
+// An action that is conditional on others is skipped (and counts as done)
+// when none of them changed their outputs: when they came out the same as
+// the last time (by their hash in options.log), or the action producing them
+// was skipped, too. Outputs that came out the same keep their previous
+// modification times.
+// Returns true iff every action ran and succeeded.
+bool execute(
+    const BuildScenario::BuildCommands& build_commands,
+    const ExecutorOptions& options
+);
+
+#endif /* LBS_EXECUTOR_H */
@@ -0,0 +1,136 @@
+#ifndef LBS_FILESTATE_H
+#define LBS_FILESTATE_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <actionlog/actionlog.h>
+#include <contenthash/contenthash.h>
+#include <lbs/build_scenario.h>
+
+struct FileState {
+    bool exists{false};
+    // In nanoseconds since the epoch.
+    int64_t modified{0};
+    int64_t size{0};
+    // Which file it is, so that its content hash can be looked up without
+    // stat'ing it again (see ContentHashes::Entry).
+    uint64_t device{0};
+    uint64_t inode{0};
+};
+
+// The state of the file at path, stat'ed right now.
+auto stat_file(const std::string& path) -> FileState;
+
+// The states of the files at paths, stat'ed all at once: as batches of statx
+// requests through io_uring where the kernel allows it, or else spread over
+// a few threads (or just one, for a handful of paths or a single CPU).
+auto stat_files(const std::vector<std::string>& paths)
+    -> std::vector<FileState>;
+
+// What we know about the files a build reads and writes, so that no file is
+// stat'ed (and no dependency file read) more than once. For a single build it
+// lives just as long as planning does; the build daemon keeps one around for
+// good and invalidates whatever changes.
+struct FileStates {
+    // Called before a path is first looked at. Returns false when the answer
+    // mustn't be remembered, because we wouldn't find out when it changes.
+    // If unset, everything is remembered.
+    std::function<bool(const std::string& path)> keep_fresh{};
+
+    auto state(const std::string& path) -> FileState;
+
+    // Look up the states of those of paths we know nothing about yet, all at
+    // once (see stat_files()), so that state() finds them already known.
+    void prefetch(const std::vector<std::string>& paths);
+
+    // The files listed as prerequisites in the Makefile-style dependency file
+    // at path (empty if there is no such file).
+    auto dependency_file(const std::string& path)
+        -> const std::vector<std::string>&;
+
+    // Forget what we know about path and, if it's a directory, everything
+    // within it. Returns true iff we knew anything to forget.
+    bool invalidate(const std::string& path);
+    // Forget what we know about the file at path alone, say, as the build
+    // just wrote it.
+    void forget(const std::string& path);
+    void clear();
+
+private:
+    std::unordered_map<std::string, FileState> states{};
+    std::unordered_map<std::string, std::vector<std::string>> dependencies{};
+    std::vector<std::string> unremembered_dependencies{};
+};
+
+// The files listed as prerequisites in the Makefile-style dependency file at
+// path, read just now (empty if there is no such file).
+auto read_dependency_file(const std::string& path) -> std::vector<std::string>;
+
+// Hash of the contents of action's inputs, including those listed in its
+// dependency file (as read just now), looked up in hashes by their states in
+// file_states; 0 if any can't be read, or was modified after not_after (in
+// nanoseconds since the epoch), as then an action that started then may have
+// read something else.
+auto hash_action_inputs(
+    const BuildScenario::BuildCommands::Action& action,
+    ContentHashes& hashes,
+    FileStates& file_states,
+    int64_t not_after = INT64_MAX
+) -> uint64_t;
+
+// Lexically normalised path, so that "./a.c" and "a.c" refer to the same
+// file state.
+auto normal_path(const std::string& path) -> std::string;
+
+// Which actions must run for their outputs to be up to date: those with
+// neither inputs nor outputs, those with a missing output, those whose command
+// changed or that failed last time, those with an input (including ones from
+// their dependency file) newer than their oldest output (or, lacking outputs,
+// than when they last ran), and those with an input produced by an action
+// that must run.
+// If given, conditional is set to, for each action that must run only because
+// of inputs produced by actions that must run, the indices of those actions
+// (and is empty for every other action).
+// If given content_hashes, an action whose inputs are newer than its outputs
+// but hash the same as when it last ran (say, after checking out another
+// branch and back again) needn't run; those inputs are hashed all at once.
+// If given, reasons is set to, for each action that must run, why (and is
+// empty for every other action).
+auto outdated_actions(
+    const BuildScenario::BuildCommands& build_commands,
+    const ActionLog& log,
+    FileStates& file_states,
+    std::vector<std::vector<size_t>>* conditional = nullptr,
+    ContentHashes* content_hashes = nullptr,
+    std::vector<std::string>* reasons = nullptr
+) -> std::vector<bool>;
+
+// The names of the members of the archive at path, in order. Returns false if
+// there is no archive there, or not one we can read (like a thin one).
+bool archive_members(
+    const std::string& path,
+    std::vector<std::string>& members
+);
+
+// Have the (outdated) archive actions of build_commands that can update the
+// existing archive in place do so: put in again just the objects that are
+// compiled again (or are newer than, or missing from, the archive), and
+// delete the members that are no longer objects of it. An archive is still
+// written anew when there is none, its last update failed, its objects don't
+// all have different file names (as that's what members go by), or the
+// objects to put in again or the members to delete would take up at least
+// response_file_threshold characters on the command line (see
+// BuildScenario::response_file_threshold); writing it anew reads them from a
+// response file instead.
+void update_archives_in_place(
+    BuildScenario::BuildCommands& build_commands,
+    const ActionLog& log,
+    FileStates& file_states,
+    size_t response_file_threshold
+);
+
+#endif /* LBS_FILESTATE_H */
@@ -0,0 +1,46 @@
+#ifndef LBS_INCLUDECOST_H
+#define LBS_INCLUDECOST_H
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Which headers (and templates) compiling a project spends its time on,
+// gathered from the traces the compiler writes of each translation unit (see
+// the Time Trace Flag of a Compiler), and from the headers the dependency
+// file of each lists.
+struct IncludeCosts {
+    struct Header {
+        // Time spent in the frontend on this header, including whatever it
+        // includes, over every translation unit.
+        double frontend_ms{0};
+        // Translation units including it, directly or not.
+        size_t translation_units{0};
+    };
+    struct Instantiation {
+        // Including the instantiations it caused.
+        double ms{0};
+        size_t count{0};
+    };
+
+    std::unordered_map<std::string, Header> headers{};
+    // Keyed by what's instantiated (e.g. "std::vector<int>").
+    std::unordered_map<std::string, Instantiation> instantiations{};
+    size_t translation_units{0};
+    double frontend_ms{0};
+
+    // Add a translation unit, given the trace of compiling it and the headers
+    // its dependency file lists (which, unlike the trace, tells of headers
+    // the compiler didn't spend any time on). Returns false if trace isn't
+    // one, in which case nothing is added.
+    bool add(std::string_view trace, const std::vector<std::string>& includes);
+
+    // The top (most costly) headers and instantiations, as a table, and as
+    // JSON.
+    auto text(size_t top) const -> std::string;
+    auto json(size_t top) const -> std::string;
+};
+
+#endif /* LBS_INCLUDECOST_H */
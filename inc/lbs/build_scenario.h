@@ -2,18 +2,155 @@
 #define LBS_BUILD_SCENARIO_H
 
 #include <algorithm>
+#include <cstdint>
 #include <cstdio>
+#include <filesystem>
 #include <string>
 #include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
 #include <lbs/compiler.h>
 #include <lbs/target.h>
 
+// Split sources into batches of about batch_size, each to be compiled as one
+// translation unit. Whether a batch ends after a source depends on nothing
+// but that source's path, so adding or removing a source only ever changes
+// the batch it's in (and the objects of all other batches stay valid).
+static auto unity_batches(
+    const std::vector<std::string>& sources,
+    size_t batch_size
+) -> std::vector<std::vector<std::string>> {
+    std::vector<std::vector<std::string>> batches{};
+    std::vector<std::string> batch{};
+    for (const auto& source : sources) {
+        batch.push_back(source);
+        // 64-bit FNV-1a
+        uint64_t hash{0xcbf29ce484222325};
+        for (const char c : source) {
+            hash ^= uint64_t((unsigned char)c);
+            hash *= 0x100000001b3;
+        }
+        if (hash % batch_size == 0 or batch.size() >= 2 * batch_size) {
+            batches.push_back(std::move(batch));
+            batch.clear();
+        }
+    }
+    if (batch.size()) batches.push_back(std::move(batch));
+    return batches;
+}
+
+// Where an output that would be at path goes once outputs go in directory
+// (which ends in a slash, if not empty): within it, even if path is absolute
+// or leads out of the working directory.
+static auto path_within(std::string_view directory, const std::string& path)
+    -> std::string {
+    if (directory.empty()) return path;
+    std::string within{directory};
+    for (const auto& part :
+         std::filesystem::path(path).lexically_normal().relative_path()) {
+        const auto name = part.string();
+        if (name.empty() or name == ".") continue;
+        if (within.back() != '/') within += '/';
+        within += name == ".." ? "__" : name;
+    }
+    return within;
+}
+
+// The source of a batch is written under unity_directory (keeping the source
+// tree clean), named after the first source in it and with the same
+// extension, so that the compiler treats it the same.
+static constexpr const char* unity_directory = ".lbs_unity";
+static auto unity_source_path(const std::string& first) -> std::string {
+    const auto extension = std::filesystem::path(first).extension().string();
+    return path_within(unity_directory, first) + ".unity" + extension;
+}
+
+// A command that writes a source at path which includes every one of
+// sources (like the source of a unity batch).
+static auto including_source_command(
+    const std::string& path,
+    const std::vector<std::string>& sources
+) -> std::string {
+    const auto quote = [](const std::string& text) {
+        std::string quoted{"'"};
+        for (const char c : text) {
+            if (c == '\'') quoted += "'\\''";
+            else quoted += c;
+        }
+        return quoted + "'";
+    };
+    const auto directory = std::filesystem::path(path).parent_path();
+    std::string command{};
+    if (not directory.empty()) {
+        command += "mkdir -p ";
+        command += quote(directory.string());
+        command += " && ";
+    }
+    command += "printf '%s\\n'";
+    for (const auto& source : sources) {
+        auto relative = std::filesystem::path(source);
+        if (relative.is_relative())
+            relative = relative.lexically_relative(directory);
+        command += ' ';
+        command += quote("#include \"" + relative.string() + '"');
+    }
+    command += " > ";
+    command += quote(path);
+    return command;
+}
+
+// What the preamble of a C++20 module unit declares (see lib/modscan).
+struct ModuleUnit {
+    // Module (or "module:partition") whose interface compiling this source
+    // produces; empty for an implementation unit.
+    std::string provides{};
+    // Modules (and partitions) it imports, including the module an
+    // implementation unit implements.
+    std::vector<std::string> imports{};
+
+    bool operator==(const ModuleUnit& other) const {
+        return provides == other.provides and imports == other.imports;
+    }
+};
+
 struct BuildScenario {
+    // A way of building every target (say, debug or release): flags and
+    // defines added to those of every compiled target, with everything built
+    // into a directory named after the profile, so that profiles don't
+    // overwrite each other's outputs.
+    struct Profile {
+        std::string name;
+        std::vector<std::string> flags{};
+        std::vector<std::string> defines{};
+    };
+
     std::vector<Compiler> compilers;
     std::vector<Target> targets;
     std::vector<std::string> targets_built;
+    std::vector<Profile> profiles{};
+    // Where outputs go (ending in a slash), or empty for next to the sources;
+    // see apply_profile().
+    std::string output_directory{};
+    // The batch size of unity builds for targets that don't pick their own
+    // (see Target::unity); 0 for none.
+    size_t unity{0};
+    // Make libraries thin archives, which only refer to their objects.
+    bool thin_archives{false};
+    // Compile objects with the compiler's Time Trace Flag, if it's one of
+    // these (by name), which had better accept it.
+    std::vector<std::string> time_trace_compilers{};
+    // Inputs of archive and link commands (see %@) that would take up at
+    // least this many characters go in a response file instead. A command
+    // runs as a single argument of the shell, and Linux limits any one
+    // argument to 128 KiB.
+    size_t response_file_threshold{32768};
+    // Sources of any target that are module units, keyed by path; filled in
+    // by scanning them before planning. Module units are compiled after
+    // whatever provides the modules they import.
+    std::unordered_map<std::string, ModuleUnit> modules{};
 
     // Check return value against targets.end()
     auto target(const std::string_view name) {
@@ -48,6 +185,30 @@ struct BuildScenario {
     }
     void mark_target_built(const Target& t) { mark_target_built(t.name); }
 
+    // Returns nullptr if there is no such profile.
+    auto profile(const std::string_view name) const -> const Profile* {
+        for (const auto& profile : profiles)
+            if (profile.name == name) return &profile;
+        return nullptr;
+    }
+
+    // Build every target the profile's way, into its directory. Targets are
+    // known by their name within that directory (like "release/app"), so
+    // that several profiles may be built at once.
+    void apply_profile(const Profile& profile) {
+        output_directory = profile.name + '/';
+        for (auto& target : targets) {
+            if (not target.compiled()) continue;
+            target.flags.insert(
+                target.flags.end(), profile.flags.begin(), profile.flags.end()
+            );
+            target.defines.insert(
+                target.defines.end(), profile.defines.begin(),
+                profile.defines.end()
+            );
+        }
+    }
+
     // Check return value against compilers.end()
     auto compiler(const std::string_view name) {
         return std::find_if(
@@ -56,39 +217,381 @@ struct BuildScenario {
         );
     };
 
+    // Returns nullptr if no source of any target provides the module.
+    auto module_provider(const std::string& module) const -> const Target* {
+        for (const auto& target : targets) {
+            for (const auto& source : target.sources) {
+                auto unit = modules.find(source);
+                if (unit != modules.end() and unit->second.provides == module)
+                    return &target;
+            }
+        }
+        return nullptr;
+    }
+
     static void Print(const BuildScenario& build_scenario) {
         for (const auto& target : build_scenario.targets) Target::Print(target);
     }
 
     struct BuildCommands {
-        std::vector<std::string> commands;
+        struct Action {
+            // Name of the target this action was planned for.
+            std::string target;
+            std::string command;
+            // Indices into `actions` of actions that must finish before this
+            // one may start.
+            std::vector<size_t> dependencies;
+            // Targets every action of which must finish before this one may
+            // start. A dependency that was already planned elsewhere isn't
+            // part of our `actions`, so it can only be referred to by name.
+            std::vector<std::string> target_dependencies;
+            // Targets only the requisites of which (see `requisite`) must
+            // finish before this one may start. That's what compiling waits
+            // for, since requisites are what may generate the headers a
+            // source includes, while archiving and linking wait for
+            // everything.
+            std::vector<std::string> requisite_dependencies{};
+            // Set for the actions doing a target's requisites (commands and
+            // copies).
+            bool requisite{false};
+            // Files read and written by the command, where known.
+            std::vector<std::string> inputs;
+            std::vector<std::string> outputs;
+            // Dependency file written by the command, listing further inputs
+            // (i.e. headers) discovered while running it; may be empty.
+            std::string dependency_file{};
+            // Set for object actions a worker may compile instead: locally,
+            // preprocess_command writes the self-contained remote_input, which
+            // remote_command then compiles into the (only) output elsewhere.
+            std::string preprocess_command{};
+            std::string remote_input{};
+            std::string remote_command{};
+            // Set for object actions that may be compiled along with others
+            // by one invocation of the compiler (see batched()): the batch
+            // object command, with %i left for the sources, and the source
+            // as it should be given to it.
+            std::string batch_command{};
+            std::string batch_source{};
+            // For an action compiling a batch, the keys and commands of the
+            // object actions it stands in for, as that's what the log
+            // remembers. An archive updated in place has itself (with the
+            // command writing it anew) as its only member.
+            std::vector<std::pair<std::string, std::string>> batch_members{};
+            // Set for archive actions that may update an existing archive in
+            // place instead: commands replacing (or adding) the objects %i,
+            // and deleting the members %i.
+            std::string archive_update_command{};
+            std::string archive_delete_command{};
+            // Set for actions whose command reads its inputs from a response
+            // file (which is one of the inputs, too), to what the file must
+            // say. Before building, it's written unless it already says just
+            // that, so that it's only newer than the outputs when the inputs
+            // listed changed.
+            std::string response_file{};
+            std::string response_file_contents{};
+            // Set for object actions compiled with the compiler's Time Trace
+            // Flag, to the trace it writes.
+            std::string time_trace{};
+            // Set for actions that copy files rather than run their command
+            // (which just describes the copy): each of copy_sources goes to
+            // the output at the same index, hard linked if hard_link. The
+            // sources are the first inputs; any after them are the
+            // directories copied.
+            std::vector<std::string> copy_sources{};
+            bool hard_link{false};
+            // For actions that only have to run because actions producing
+            // some of their inputs do (see outdated_actions()), the indices of
+            // those actions, so that they may be skipped if none of those
+            // changed their outputs after all.
+            std::vector<size_t> conditional_on{};
+
+            // Identifies this action from one build to the next.
+            auto key() const -> const std::string& {
+                return outputs.empty() ? command : outputs.front();
+            }
+        };
+
+        std::vector<Action> actions;
         std::vector<std::string> artifacts;
+        // The artifacts that are executables (or shared libraries, which they
+        // load), which are never intermediates (another target may depend on
+        // one, say to build a helper program).
+        std::vector<std::string> executables;
 
-        void push_back(std::string new_command) {
-            commands.push_back(new_command);
+        // Returns the index of the new action.
+        auto push_back(Action new_action) -> size_t {
+            actions.push_back(std::move(new_action));
+            return actions.size() - 1;
         }
         void push_back(BuildCommands new_build_commands) {
-            commands.insert(
-                commands.end(), new_build_commands.commands.begin(),
-                new_build_commands.commands.end()
-            );
+            const auto offset = actions.size();
+            for (auto& action : new_build_commands.actions) {
+                for (auto& dependency : action.dependencies)
+                    dependency += offset;
+                actions.push_back(std::move(action));
+            }
             artifacts.insert(
                 artifacts.end(), new_build_commands.artifacts.begin(),
                 new_build_commands.artifacts.end()
             );
+            executables.insert(
+                executables.end(), new_build_commands.executables.begin(),
+                new_build_commands.executables.end()
+            );
         }
 
         auto as_one_command(const std::string_view separator = " && ")
             -> std::string {
             std::string out_command{};
             bool notfirst{false};
-            for (const auto& command : commands) {
+            for (const auto& action : actions) {
                 if (notfirst) out_command += separator;
-                out_command += command;
+                out_command += action.command;
                 notfirst = true;
             }
             return out_command;
         }
+
+        // The actions for which keep is true, with dependencies on dropped
+        // actions dropped as well (they count as already done).
+        auto only(const std::vector<bool>& keep) const -> BuildCommands {
+            BuildCommands out{};
+            out.artifacts = artifacts;
+            out.executables = executables;
+            // Dependencies may come after their dependents (say, when a
+            // module is imported from a source listed before its own).
+            std::vector<size_t> new_index(actions.size());
+            for (size_t i = 0, kept = 0; i < actions.size(); ++i)
+                if (keep[i]) new_index[i] = kept++;
+            for (size_t i = 0; i < actions.size(); ++i) {
+                if (not keep[i]) continue;
+                auto action = actions[i];
+                action.dependencies.clear();
+                for (auto dependency : actions[i].dependencies)
+                    if (keep[dependency])
+                        action.dependencies.push_back(new_index[dependency]);
+                action.conditional_on.clear();
+                for (auto producer : actions[i].conditional_on)
+                    if (keep[producer])
+                        action.conditional_on.push_back(new_index[producer]);
+                out.actions.push_back(std::move(action));
+            }
+            return out;
+        }
+
+        // Where batches are compiled, each in a directory of its own.
+        static constexpr const char* batch_directory = ".lbs_batch";
+
+        // These actions, but with object actions that share a target and
+        // batch command compiled in batches, each by one invocation of the
+        // compiler. Batches are made just big enough to keep all jobs busy,
+        // up to a limit, so that one failing source doesn't fail too many
+        // others along with it.
+        auto batched(size_t jobs) const -> BuildCommands {
+            constexpr size_t batch_size_limit{32};
+            std::vector<std::vector<size_t>> groups{};
+            std::unordered_map<std::string, size_t> group_of{};
+            size_t candidates{0};
+            for (size_t i = 0; i < actions.size(); ++i) {
+                const auto& action = actions[i];
+                if (action.batch_command.empty()) continue;
+                auto found = group_of.emplace(
+                    action.target + '\0' + action.batch_command, groups.size()
+                );
+                if (found.second) groups.emplace_back();
+                groups[found.first->second].push_back(i);
+                ++candidates;
+            }
+            if (not jobs) jobs = 1;
+            const size_t batch_size = std::min(
+                (candidates + jobs - 1) / jobs, batch_size_limit
+            );
+            if (batch_size < 2) return *this;
+            std::error_code ec{};
+            const auto working_directory =
+                std::filesystem::current_path(ec).string();
+            if (ec) return *this;
+
+            // Objects are named after the file names of their sources, so a
+            // batch mustn't have two sources of the same name.
+            const auto name_of = [](const std::string& source) {
+                return std::filesystem::path(source).stem().string();
+            };
+            std::vector<std::vector<size_t>> batches{};
+            std::vector<std::unordered_set<std::string>> names{};
+            for (const auto& group : groups) {
+                size_t open = batches.size();
+                for (auto i : group) {
+                    const auto name = name_of(actions[i].batch_source);
+                    while (open < batches.size()
+                           and batches[open].size() == batch_size)
+                        ++open;
+                    size_t b = open;
+                    while (b < batches.size()
+                           and (batches[b].size() == batch_size
+                                or names[b].count(name)))
+                        ++b;
+                    if (b == batches.size()) {
+                        batches.emplace_back();
+                        names.emplace_back();
+                    }
+                    batches[b].push_back(i);
+                    names[b].insert(name);
+                }
+            }
+
+            // Each batch takes the place of its first action.
+            constexpr size_t unbatched = SIZE_MAX;
+            std::vector<size_t> batch_of(actions.size(), unbatched);
+            for (size_t b = 0; b < batches.size(); ++b)
+                if (batches[b].size() > 1)
+                    for (auto i : batches[b]) batch_of[i] = b;
+            std::vector<size_t> new_index(actions.size());
+            std::vector<size_t> batch_index(batches.size(), unbatched);
+            size_t kept{0};
+            for (size_t i = 0; i < actions.size(); ++i) {
+                const auto b = batch_of[i];
+                if (b == unbatched) new_index[i] = kept++;
+                else {
+                    if (batch_index[b] == unbatched) batch_index[b] = kept++;
+                    new_index[i] = batch_index[b];
+                }
+            }
+
+            BuildCommands out{};
+            out.artifacts = artifacts;
+            out.executables = executables;
+            size_t batch_number{0};
+            for (size_t i = 0; i < actions.size(); ++i) {
+                const auto b = batch_of[i];
+                if (b != unbatched and batches[b].front() != i) continue;
+                const auto members =
+                    b == unbatched ? std::vector<size_t>{i} : batches[b];
+
+                auto action = actions[i];
+                action.dependencies.clear();
+                action.conditional_on.clear();
+                // A batch is only conditional if all of it is.
+                const bool conditional = std::all_of(
+                    members.begin(), members.end(),
+                    [&](size_t member) {
+                        return actions[member].conditional_on.size();
+                    }
+                );
+                for (auto member : members) {
+                    for (auto dependency : actions[member].dependencies)
+                        if (new_index[dependency] != new_index[i])
+                            action.dependencies.push_back(
+                                new_index[dependency]
+                            );
+                    if (conditional)
+                        for (auto producer : actions[member].conditional_on)
+                            action.conditional_on.push_back(
+                                new_index[producer]
+                            );
+                }
+                if (b == unbatched) {
+                    out.actions.push_back(std::move(action));
+                    continue;
+                }
+
+                const auto directory = std::string(batch_directory) + '/'
+                                     + std::to_string(batch_number++);
+                std::string sources{};
+                std::string moves{};
+                action.inputs.clear();
+                action.outputs.clear();
+                action.preprocess_command.clear();
+                action.remote_input.clear();
+                action.remote_command.clear();
+                action.dependency_file.clear();
+                for (auto member : members) {
+                    const auto& batched = actions[member];
+                    if (sources.size()) sources += ' ';
+                    sources += batched.batch_source;
+                    const auto name = name_of(batched.batch_source);
+                    moves += " && mv " + directory + '/'
+                           + object_output_from_source_path(name) + ' '
+                           + batched.outputs.front();
+                    if (batched.dependency_file.size())
+                        moves += " && mv " + directory + '/' + name + ".d "
+                               + batched.dependency_file;
+
+                    for (const auto& target : batched.target_dependencies)
+                        if (std::find(
+                                action.target_dependencies.begin(),
+                                action.target_dependencies.end(), target
+                            )
+                            == action.target_dependencies.end())
+                            action.target_dependencies.push_back(target);
+                    for (const auto& target : batched.requisite_dependencies)
+                        if (std::find(
+                                action.requisite_dependencies.begin(),
+                                action.requisite_dependencies.end(), target
+                            )
+                            == action.requisite_dependencies.end())
+                            action.requisite_dependencies.push_back(target);
+                    action.inputs.insert(
+                        action.inputs.end(), batched.inputs.begin(),
+                        batched.inputs.end()
+                    );
+                    action.outputs.insert(
+                        action.outputs.end(), batched.outputs.begin(),
+                        batched.outputs.end()
+                    );
+                    action.batch_members.emplace_back(
+                        batched.key(), batched.command
+                    );
+                }
+
+                std::string command{};
+                const auto& format = action.batch_command;
+                for (size_t c = 0; c < format.size(); ++c) {
+                    if (format.compare(c, 2, "%i") == 0) {
+                        command += sources;
+                        ++c;
+                    } else if (format.compare(c, 2, "%b") == 0) {
+                        command += working_directory + '/' + directory;
+                        ++c;
+                    } else command += format[c];
+                }
+                action.command = "mkdir -p " + directory + " && (cd "
+                               + directory + " && " + command + ")" + moves
+                               + " && rm -rf " + directory;
+                action.batch_command.clear();
+                action.batch_source.clear();
+                out.actions.push_back(std::move(action));
+            }
+            return out;
+        }
+
+        // For each action, the indices of every action that must finish
+        // before it may start (with target dependencies resolved).
+        auto dependency_graph() const -> std::vector<std::vector<size_t>> {
+            std::vector<std::vector<size_t>> graph{};
+            graph.reserve(actions.size());
+            for (const auto& action : actions) {
+                auto dependencies = action.dependencies;
+                for (const auto& target_name : action.target_dependencies) {
+                    for (size_t i = 0; i < actions.size(); ++i)
+                        if (actions[i].target == target_name)
+                            dependencies.push_back(i);
+                }
+                for (const auto& target_name : action.requisite_dependencies) {
+                    for (size_t i = 0; i < actions.size(); ++i)
+                        if (actions[i].requisite
+                            and actions[i].target == target_name)
+                            dependencies.push_back(i);
+                }
+                std::sort(dependencies.begin(), dependencies.end());
+                dependencies.erase(
+                    std::unique(dependencies.begin(), dependencies.end()),
+                    dependencies.end()
+                );
+                graph.push_back(std::move(dependencies));
+            }
+            return graph;
+        }
     };
 
     static auto Commands(
@@ -124,6 +627,78 @@ struct BuildScenario {
         }
 
         BuildCommands build_commands{};
+
+        // Everything is written to the output directory, and targets are
+        // known by their name within it.
+        const auto& output_directory = build_scenario.output_directory;
+        const auto output_path = [&](const std::string& path) {
+            return path_within(output_directory, path);
+        };
+
+        // Requisites happen in the order they are written, and the target
+        // itself is only built once all of them are done.
+        std::vector<size_t> requisite_actions{};
+        std::vector<std::string> requisite_targets{};
+        const auto action = [&](std::string command,
+                                std::vector<std::string> inputs = {},
+                                std::vector<std::string> outputs = {}) {
+            return BuildCommands::Action{
+                output_directory + std::string(target_name),
+                std::move(command),
+                requisite_actions,
+                requisite_targets,
+                {},
+                false,
+                std::move(inputs),
+                std::move(outputs)};
+        };
+        // Compiling (and whatever writes sources to compile) only waits for
+        // the requisites of the targets depended on, and of those they
+        // depend on in turn, as their headers may include each other's.
+        std::vector<std::string> header_targets{};
+        const auto compile_action = [&](std::string command,
+                                        std::vector<std::string> inputs = {},
+                                        std::vector<std::string> outputs = {}) {
+            auto out = action(
+                std::move(command), std::move(inputs), std::move(outputs)
+            );
+            out.target_dependencies.clear();
+            out.requisite_dependencies = header_targets;
+            return out;
+        };
+        const auto add_header_targets = [&](const std::string& name) {
+            std::vector<std::string> stack{name};
+            while (stack.size()) {
+                const auto next = stack.back();
+                stack.pop_back();
+                if (std::find(
+                        header_targets.begin(), header_targets.end(),
+                        output_directory + next
+                    )
+                    != header_targets.end())
+                    continue;
+                header_targets.push_back(output_directory + next);
+                auto found = build_scenario.target(next);
+                if (found == build_scenario.targets.end()) continue;
+                for (const auto& requisite : found->requisites)
+                    if (requisite.kind == Target::Requisite::DEPENDENCY)
+                        stack.push_back(requisite.text);
+            }
+        };
+        // Response files go next to the output of the action reading them.
+        const auto response_file = [&](const std::string& output) {
+            return ResponseFile{
+                output + ".rsp", build_scenario.response_file_threshold};
+        };
+        const auto read_response_file = [&](BuildCommands::Action& action,
+                                            ResponseFile& response_file) {
+            if (response_file.contents.empty()) return;
+            build_commands.artifacts.push_back(response_file.path);
+            action.inputs.push_back(response_file.path);
+            action.response_file = std::move(response_file.path);
+            action.response_file_contents = std::move(response_file.contents);
+        };
+
         for (const auto& requisite : target->requisites) {
             switch (requisite.kind) {
             case Target::Requisite::COMMAND: {
@@ -132,36 +707,263 @@ struct BuildScenario {
                     command += ' ';
                     command += arg;
                 }
-                build_commands.push_back(command);
+                // A command is only known to read what the target watches.
+                auto command_action = action(command, target->watches);
+                command_action.requisite = true;
+                requisite_actions.push_back(
+                    build_commands.push_back(std::move(command_action))
+                );
             } break;
             case Target::Requisite::COPY: {
-                // TODO: Handle (directory), (directory-contents)
-                std::string copy_command{"cp "};
-                copy_command += requisite.text;
-                copy_command += ' ';
-                copy_command += requisite.destination;
-                build_commands.push_back(copy_command);
-                // Record artifact(s)
-                build_commands.artifacts.push_back(requisite.destination);
+                // The files to copy are those there are while planning; the
+                // directories copied are inputs as well, so that files added
+                // to or removed from them make the copy run again.
+                namespace fs = std::filesystem;
+                auto copy_action =
+                    action(Target::Requisite::CopyDescription(requisite));
+                copy_action.hard_link = requisite.hard_link;
+                copy_action.requisite = true;
+                const auto copy = [&](const std::string& source,
+                                      const std::string& destination) {
+                    copy_action.copy_sources.push_back(source);
+                    copy_action.inputs.push_back(source);
+                    copy_action.outputs.push_back(destination);
+                    build_commands.artifacts.push_back(destination);
+                };
+                if (requisite.source == Target::Requisite::FILE)
+                    copy(requisite.text, output_path(requisite.destination));
+                else {
+                    fs::path into{output_path(requisite.destination)};
+                    if (requisite.source == Target::Requisite::DIRECTORY)
+                        into /= fs::path(requisite.text).filename();
+                    std::vector<std::string> directories{requisite.text};
+                    std::error_code error{};
+                    std::vector<std::pair<std::string, std::string>> files{};
+                    for (fs::recursive_directory_iterator it{
+                             requisite.text, error};
+                         not error and it != fs::recursive_directory_iterator();
+                         it.increment(error)) {
+                        const auto path = it->path().string();
+                        const auto relative =
+                            it->path().lexically_relative(requisite.text);
+                        if (it->is_directory(error))
+                            directories.push_back(path);
+                        else
+                            files.emplace_back(
+                                path, (into / relative).string()
+                            );
+                    }
+                    if (error) {
+                        printf(
+                            "ERROR: Cannot read directory %s to copy (for "
+                            "target %s)\n",
+                            requisite.text.data(), target_name.data()
+                        );
+                        exit(1);
+                    }
+                    // The same plan, whatever order the directory lists in.
+                    std::sort(files.begin(), files.end());
+                    for (const auto& [source, destination] : files)
+                        copy(source, destination);
+                    copy_action.inputs.insert(
+                        copy_action.inputs.end(), directories.begin(),
+                        directories.end()
+                    );
+                }
+                requisite_actions.push_back(
+                    build_commands.push_back(std::move(copy_action))
+                );
             } break;
             case Target::Requisite::DEPENDENCY:
                 // FIXME: what compiler to use for dependency.
                 build_commands.push_back(BuildScenario::Commands(
                     build_scenario, requisite.text, compiler_name
                 ));
+                requisite_targets.push_back(output_directory + requisite.text);
+                add_header_targets(requisite.text);
                 break;
             }
         }
-        if (target->kind == Target::Kind::EXECUTABLE
-            or target->kind == Target::Kind::LIBRARY) {
+        if (target->compiled()) {
+            const bool shared = target->kind == Target::Kind::SHARED_LIBRARY;
+            if (shared and compiler->shared_template.empty()) {
+                printf(
+                    "ERROR: Compiler %s can't link shared libraries (like "
+                    "%s)\n",
+                    compiler->name.data(), target->name.data()
+                );
+                exit(1);
+            }
+            // Objects of a shared library are compiled position independent,
+            // and named apart from those of any other target compiling the
+            // same sources.
+            auto compiled = *target;
+            if (shared and compiler->position_independent_flag.size())
+                compiled.flags.push_back(compiler->position_independent_flag);
+
+            // Each source is compiled on its own, or in a batch with others
+            // (see Target::unity).
+            const size_t unity =
+                target->unity ? target->unity : build_scenario.unity;
+            std::vector<std::vector<std::string>> translation_units{};
+            std::vector<std::string> batched{};
+            for (const auto& source : target->sources) {
+                // A module unit's preamble must come first, so it can't be
+                // merged with others.
+                const auto& excludes = target->unity_excludes;
+                if (unity > 1
+                    and std::find(excludes.begin(), excludes.end(), source)
+                            == excludes.end()
+                    and not build_scenario.modules.count(source))
+                    batched.push_back(source);
+                else translation_units.push_back({source});
+            }
+            if (batched.size()) {
+                auto batches = unity_batches(batched, unity);
+                translation_units.insert(
+                    translation_units.end(), batches.begin(), batches.end()
+                );
+            }
+
+            // Objects include the precompiled header through a stub in a
+            // directory of the target's own, next to which the compiler finds
+            // the target's precompiled header. Whatever can't use that (like
+            // preprocessing for workers) reads the header through the stub.
+            std::string precompiled_header{};
+            std::string precompiled_header_stub{};
+            std::string precompiled_header_flags{};
+            size_t precompiled_header_action{0};
+            if (target->precompiled_header.size()
+                and compiler->precompiled_header_template.empty()) {
+                printf(
+                    "WARNING: Compiler %s can't precompile headers, so %s "
+                    "won't be\n",
+                    compiler->name.data(), target->precompiled_header.data()
+                );
+            } else if (target->precompiled_header.size()) {
+                const auto stub = output_path(
+                    std::string(target_name) + ".pch/"
+                    + std::filesystem::path(target->precompiled_header)
+                          .filename()
+                          .string()
+                );
+                build_commands.artifacts.push_back(stub);
+                precompiled_header_stub = stub;
+                const auto writer = build_commands.push_back(compile_action(
+                    including_source_command(
+                        stub, {target->precompiled_header}
+                    ),
+                    {}, {stub}
+                ));
+
+                precompiled_header =
+                    stub + compiler->precompiled_header_extension;
+                build_commands.artifacts.push_back(precompiled_header);
+                std::string dependency_file{};
+                if (compiler->precompiled_header_template.find("%M")
+                    != std::string::npos) {
+                    dependency_file =
+                        dependency_file_from_object_path(precompiled_header);
+                    build_commands.artifacts.push_back(dependency_file);
+                }
+                auto command = expand_compiler_object_format(
+                    compiler->precompiled_header_template, stub,
+                    precompiled_header, compiled
+                );
+                for (const auto& include_dir : target->include_directories) {
+                    command += " -I";
+                    command += include_dir;
+                }
+                auto precompile = compile_action(
+                    command, {stub, target->precompiled_header},
+                    {precompiled_header}
+                );
+                precompile.dependency_file = std::move(dependency_file);
+                precompile.dependencies.push_back(writer);
+                precompiled_header_action =
+                    build_commands.push_back(std::move(precompile));
+
+                precompiled_header_flags = ' ';
+                precompiled_header_flags +=
+                    expand_compiler_precompiled_header_include_format(
+                        compiler->precompiled_header_include_template, stub
+                    );
+            }
+
+            // Objects may also be compiled in batches from a directory of
+            // their own (see BuildCommands::batched()), so the batch command
+            // refers to everything by absolute path.
+            std::string batch_command{};
+            std::error_code ec{};
+            const auto working_directory =
+                std::filesystem::current_path(ec).string();
+            const auto absolute = [&](const std::string& path) {
+                if (path.size() and path[0] == '/') return path;
+                return working_directory + '/' + path;
+            };
+            if (compiler->batch_object_template.size() and not ec) {
+                batch_command = expand_compiler_batch_object_format(
+                    compiler->batch_object_template, compiled,
+                    working_directory
+                );
+                for (const auto& include_dir : target->include_directories) {
+                    batch_command += " -I";
+                    batch_command += absolute(include_dir);
+                }
+                if (precompiled_header.size()) {
+                    batch_command += ' ';
+                    batch_command +=
+                        expand_compiler_precompiled_header_include_format(
+                            compiler->precompiled_header_include_template,
+                            absolute(precompiled_header_stub)
+                        );
+                }
+            }
+
             std::vector<std::string> object_outputs{};
-            for (auto source : target->sources) {
-                auto object_path = object_output_from_source_path(source);
+            std::vector<size_t> object_actions{};
+            // Module units of this target, by the index of their object
+            // action, and the actions producing the module interfaces they
+            // provide.
+            std::vector<std::pair<size_t, const ModuleUnit*>> module_units{};
+            std::unordered_map<std::string, size_t> module_interfaces{};
+            const auto module_interface = [&](const std::string& module) {
+                if (compiler->module_interface_template.empty())
+                    return std::string{};
+                return expand_compiler_module_interface_format(
+                    compiler->module_interface_template, module
+                );
+            };
+            for (const auto& translation_unit : translation_units) {
+                std::string source = translation_unit.front();
+                // What the object is named after.
+                std::string compiled_source = source;
+                size_t writer{0};
+                if (translation_unit.size() > 1) {
+                    compiled_source =
+                        unity_source_path(translation_unit.front());
+                    source = output_path(compiled_source);
+                    build_commands.artifacts.push_back(source);
+                    writer = build_commands.push_back(compile_action(
+                        including_source_command(source, translation_unit), {},
+                        {source}
+                    ));
+                }
+
+                auto object_path = output_path(object_output_from_source_path(
+                    shared ? compiled_source + ".pic" : compiled_source
+                ));
                 object_outputs.push_back(object_path);
+                std::string dependency_file{};
+                if (compiler_writes_dependency_files(*compiler)) {
+                    dependency_file =
+                        dependency_file_from_object_path(object_path);
+                    build_commands.artifacts.push_back(dependency_file);
+                }
                 // Record object artifact
                 build_commands.artifacts.push_back(object_path);
                 auto object_build_command = expand_compiler_object_format(
-                    compiler->object_template, source, object_path, *target
+                    compiler->object_template, source, object_path, compiled
                 );
 
                 // Include directories.
@@ -170,24 +972,216 @@ struct BuildScenario {
                     object_build_command += include_dir;
                 }
 
-                build_commands.push_back(object_build_command);
+                object_build_command += precompiled_header_flags;
+
+                auto object_action = compile_action(
+                    object_build_command, {source}, {object_path}
+                );
+                if (precompiled_header.size()) {
+                    object_action.inputs.push_back(precompiled_header);
+                    object_action.dependencies.push_back(
+                        precompiled_header_action
+                    );
+                }
+                if (translation_unit.size() > 1) {
+                    object_action.inputs.insert(
+                        object_action.inputs.end(), translation_unit.begin(),
+                        translation_unit.end()
+                    );
+                    object_action.dependencies.push_back(writer);
+                }
+
+                // Workers only get paths within this directory, as that's
+                // what their scratch directory stands in for.
+                const bool remote_path = source.size() and source[0] != '/'
+                                     and source.find("..") == std::string::npos;
+                if (compiler->preprocessed_extension.size() and remote_path) {
+                    object_action.remote_input =
+                        output_path(compiled_source)
+                        + compiler->preprocessed_extension;
+                    object_action.preprocess_command =
+                        expand_compiler_object_format(
+                            compiler->object_template, source,
+                            object_action.remote_input, compiled,
+                            dependency_file
+                        )
+                        + " -E";
+                    for (const auto& include_dir :
+                         target->include_directories) {
+                        object_action.preprocess_command += " -I";
+                        object_action.preprocess_command += include_dir;
+                    }
+                    object_action.preprocess_command +=
+                        precompiled_header_flags;
+                    // Includes are already resolved, and the dependency file
+                    // comes from preprocessing.
+                    object_action.remote_command =
+                        expand_compiler_object_format(
+                            compiler->object_template,
+                            object_action.remote_input, object_path, compiled
+                        );
+                }
+
+                if (batch_command.size()) {
+                    object_action.batch_command = batch_command;
+                    object_action.batch_source = absolute(source);
+                }
+
+                const ModuleUnit* module_unit{nullptr};
+                if (translation_unit.size() == 1) {
+                    auto found = build_scenario.modules.find(source);
+                    if (found != build_scenario.modules.end())
+                        module_unit = &found->second;
+                }
+                if (module_unit) {
+                    // Workers would need the interfaces of whatever is
+                    // imported, and don't write the ones provided.
+                    object_action.preprocess_command.clear();
+                    object_action.remote_input.clear();
+                    object_action.remote_command.clear();
+                    // Nor would batches be compiled in order.
+                    object_action.batch_command.clear();
+                    const auto interface =
+                        module_interface(module_unit->provides);
+                    if (module_unit->provides.size() and interface.size()) {
+                        object_action.outputs.push_back(interface);
+                        build_commands.artifacts.push_back(interface);
+                    }
+                }
+
+                // Traced objects are compiled here and on their own, so that
+                // the trace ends up next to the object.
+                const auto& traced = build_scenario.time_trace_compilers;
+                if (compiler->time_trace_flag.size()
+                    and std::find(traced.begin(), traced.end(), compiler->name)
+                            != traced.end()) {
+                    object_action.command += ' ';
+                    object_action.command += compiler->time_trace_flag;
+                    object_action.time_trace =
+                        time_trace_from_object_path(object_path);
+                    object_action.preprocess_command.clear();
+                    object_action.remote_input.clear();
+                    object_action.remote_command.clear();
+                    object_action.batch_command.clear();
+                }
+
+                object_action.dependency_file = std::move(dependency_file);
+                object_actions.push_back(
+                    build_commands.push_back(std::move(object_action))
+                );
+                if (module_unit) {
+                    module_units.emplace_back(
+                        object_actions.back(), module_unit
+                    );
+                    if (module_unit->provides.size())
+                        module_interfaces[module_unit->provides] =
+                            object_actions.back();
+                }
             }
 
-            // Create archive
-            auto archive_path = archive_output_from_target_name(target_name);
-            auto archive_build_command = expand_compiler_archive_format(
-                compiler->archive_template, object_outputs, archive_path
+            // Order module units after whatever provides the modules they
+            // import, be it a source of this target or another one (which is
+            // then planned as if it were a dependency). Modules nobody here
+            // provides are left to the compiler to find.
+            for (const auto& [index, module_unit] : module_units) {
+                for (const auto& module : module_unit->imports) {
+                    std::string provider_target{};
+                    auto provider = module_interfaces.find(module);
+                    if (provider == module_interfaces.end()) {
+                        const auto* other =
+                            build_scenario.module_provider(module);
+                        if (not other or other->name == target_name) continue;
+                        provider_target = other->name;
+                        build_commands.push_back(BuildScenario::Commands(
+                            build_scenario, provider_target,
+                            other->language.empty() ? compiler_name
+                                                    : other->language
+                        ));
+                    }
+
+                    auto& object_action = build_commands.actions[index];
+                    if (provider_target.size())
+                        object_action.target_dependencies.push_back(
+                            output_directory + provider_target
+                        );
+                    else if (provider->second != index)
+                        object_action.dependencies.push_back(provider->second);
+                    const auto interface = module_interface(module);
+                    if (interface.size())
+                        object_action.inputs.push_back(interface);
+                }
+            }
+
+            // Create archive (which a shared library has no use for)
+            std::vector<size_t> link_dependencies{};
+            if (not shared) {
+                auto archive_path =
+                    output_path(archive_output_from_target_name(target_name));
+                const bool thin = build_scenario.thin_archives
+                              and compiler->thin_archive_template.size();
+                // Written anew, the archive mustn't keep members that are
+                // gone.
+                const auto& archive_template =
+                    thin ? compiler->thin_archive_template
+                         : compiler->archive_template;
+                auto archive_response_file = response_file(archive_path);
+                auto archive_build_command =
+                    "rm -f " + archive_path + " && "
+                    + expand_compiler_archive_format(
+                        archive_template, object_outputs, archive_path,
+                        &archive_response_file
+                    );
+                // Record archive artifact
+                build_commands.artifacts.push_back(archive_path);
+                auto archive_action = action(
+                    archive_build_command, object_outputs, {archive_path}
+                );
+                read_response_file(archive_action, archive_response_file);
+                // A thin archive is cheap to write anew anyway.
+                if (not thin and compiler->archive_update_template.size()
+                    and compiler->archive_delete_template.size()) {
+                    archive_action.archive_update_command =
+                        expand_compiler_archive_format(
+                            compiler->archive_update_template, {"%i"},
+                            archive_path
+                        );
+                    archive_action.archive_delete_command =
+                        expand_compiler_archive_format(
+                            compiler->archive_delete_template, {"%i"},
+                            archive_path
+                        );
+                }
+                archive_action.dependencies.insert(
+                    archive_action.dependencies.end(), object_actions.begin(),
+                    object_actions.end()
+                );
+                link_dependencies.push_back(
+                    build_commands.push_back(std::move(archive_action))
+                );
+            }
+            link_dependencies.insert(
+                link_dependencies.end(), object_actions.begin(),
+                object_actions.end()
             );
-            // Record archive artifact
-            build_commands.artifacts.push_back(archive_path);
-            build_commands.push_back(archive_build_command);
 
-            if (target->kind == Target::Kind::EXECUTABLE) {
+            if (target->kind == Target::Kind::EXECUTABLE or shared) {
+                const auto output = output_path(
+                    shared ? shared_output_from_target_name(target_name)
+                           : std::string(target_name)
+                );
                 // Record artifact(s)
-                build_commands.artifacts.push_back(std::string(target_name));
+                build_commands.artifacts.push_back(output);
+                build_commands.executables.push_back(output);
 
+                // An executable is named after its target, unless it goes
+                // elsewhere.
+                auto link_response_file = response_file(output);
                 auto build_command = expand_compiler_executable_format(
-                    compiler->executable_template, *target
+                    shared ? compiler->shared_template
+                           : compiler->executable_template,
+                    object_outputs, *target,
+                    shared or output_directory.size() ? output : "",
+                    &link_response_file
                 );
 
                 // Include directories.
@@ -196,16 +1190,88 @@ struct BuildScenario {
                     build_command += include_dir;
                 }
 
-                // Linked libraries.
+                // Linked libraries. A shared library is read through its
+                // interface stub, so that whatever links it is only linked
+                // again when what it exports changes, and is looked for next
+                // to where it was linked from when run.
+                auto link_inputs = object_outputs;
+                std::vector<std::string> runtime_paths{};
                 for (const auto& library_name : target->linked_libraries) {
+                    auto library = build_scenario.target(library_name);
+                    std::string library_path{};
+                    if (library != build_scenario.targets.end()
+                        and library->kind == Target::Kind::SHARED_LIBRARY) {
+                        library_path = output_path(
+                            shared_output_from_target_name(library_name)
+                        );
+                        link_inputs.push_back(
+                            interface_stub_from_shared_path(library_path)
+                        );
+                        std::string directory{"$ORIGIN"};
+                        const auto relative =
+                            std::filesystem::path(library_path)
+                                .parent_path()
+                                .lexically_relative(
+                                    std::filesystem::path(output).parent_path()
+                                )
+                                .string();
+                        if (relative.size() and relative != ".")
+                            directory += '/' + relative;
+                        auto flag = expand_compiler_runtime_path_format(
+                            compiler->runtime_path_template, directory
+                        );
+                        if (flag.size()
+                            and std::find(
+                                    runtime_paths.begin(), runtime_paths.end(),
+                                    flag
+                                )
+                                    == runtime_paths.end())
+                            runtime_paths.push_back(std::move(flag));
+                    } else {
+                        library_path = output_path(
+                            archive_output_from_target_name(library_name)
+                        );
+                        link_inputs.push_back(library_path);
+                    }
+                    build_command += ' ';
+                    build_command += library_path;
+                }
+                for (const auto& flag : runtime_paths) {
                     build_command += ' ';
-                    build_command +=
-                        archive_output_from_target_name(library_name);
+                    build_command += flag;
                 }
 
-                build_commands.push_back(build_command);
+                auto link_action =
+                    action(build_command, std::move(link_inputs), {output});
+                read_response_file(link_action, link_response_file);
+                link_action.dependencies.insert(
+                    link_action.dependencies.end(), link_dependencies.begin(),
+                    link_dependencies.end()
+                );
+                const auto link_index =
+                    build_commands.push_back(std::move(link_action));
+
+                // Whatever links the library only has to be linked again when
+                // its interface stub changes (see execute()). A compiler that
+                // can't tell what a library exports makes do with a copy of
+                // the whole library.
+                if (shared) {
+                    const auto stub = interface_stub_from_shared_path(output);
+                    build_commands.artifacts.push_back(stub);
+                    auto stub_action = action(
+                        expand_compiler_archive_format(
+                            compiler->interface_stub_template.size()
+                                ? compiler->interface_stub_template
+                                : "cp %i %o",
+                            {output}, stub
+                        ),
+                        {output}, {stub}
+                    );
+                    stub_action.dependencies.push_back(link_index);
+                    build_commands.push_back(std::move(stub_action));
+                }
             }
-        } else {
+        } else if (target->kind != Target::Kind::GENERIC) {
             printf(
                 "ERROR: Unhandled target kind %d in BuildScenario::Commands(), "
                 "sorry\n",
@@ -1,6 +1,7 @@
 #ifndef LBS_COMPILER_H
 #define LBS_COMPILER_H
 
+#include <filesystem>
 #include <string>
 
 #include <lbs/target.h>
@@ -9,16 +10,82 @@
 // - Object Compilation Template with %o (output filename) and %i
 //   (input source filename), probably eventually flags, defines, etc.
 //   "cc -c %i -o %o"
+//   %M expands to the path of a Makefile-style dependency file the compiler
+//   should write, listing the headers it read, so we know when to rebuild.
+//   "cc -c %i -o %o -MMD -MF %M"
 // - Executable Compilation Template with %o (output filename),
 //   %i (input object(s)).
 //   "cc %i -o %o"
+//   %@ expands to the inputs as well, but once they get too long for the
+//   command line, to a response file listing them (@file) instead. The same
+//   goes for the Archive and Shared Library Templates.
+//   "cc %@ -o %o"
 // Using a BuildScenario and these templates, we should be able to produce
 // build commands.
+// - Preprocessed Extension, the extension the compiler recognizes
+//   preprocessed sources by (".i" for cc). Only a compiler that has one, and
+//   which preprocesses when -E is added to its object template, gets its
+//   objects compiled by workers (see lbs-worker).
+// - Precompiled Header Template, like the Object Compilation Template but
+//   compiling a header (%i) into a precompiled header (%o), which the
+//   compiler looks for at the header's path plus Precompiled Header
+//   Extension whenever it's included by the Precompiled Header Include
+//   Template (with %i for the header).
+//   "cc -x c-header %f %d %i -o %o -MMD -MF %M", ".gch", "-include %i"
+// - Module Interface Template, the path of the built module interface (BMI)
+//   the compiler writes when compiling the interface of a C++20 module %m,
+//   and reads when compiling anything importing it. A partition's name has
+//   its colon replaced by a dash.
+//   "gcm.cache/%m.gcm"
+// - Batch Object Compilation Template, like the Object Compilation Template
+//   but compiling any number of sources (%i) at once, each into an object
+//   named after the source's file name (a.c into a.o) in the current
+//   directory, along with a dependency file (a.d) if the Object Compilation
+//   Template writes one. As that directory (%b) is not the one the build
+//   runs in (%w), sources are given by absolute path.
+//   "cc -c %f %d %i -MMD -ffile-prefix-map=%w/= -fdebug-prefix-map=%b=%w"
+// - Shared Library Template, like the Executable Compilation Template but
+//   linking a shared library (%o, whose file name is %n) from objects
+//   compiled with the Position Independent Flag added to their flags.
+//   "cc -shared %f %d %i -o %o -Wl,-soname,%n", "-fPIC"
+// - Runtime Path Template, the flag that makes whatever links a shared
+//   library look for it in directory %r when run.
+//   "-Wl,-rpath,'%r'"
+// - Interface Stub Template, writing what a shared library (%i) exports to
+//   %o, such that the stub only changes when whatever links it has to be
+//   linked again.
+//   "nm -gDP --defined-only %i | cut -d' ' -f1-2 > %o"
+// - Archive Update and Archive Delete Templates, replacing (or adding) the
+//   objects %i in an existing archive %o, and deleting its members %i (known
+//   by file name), so that an archive needn't be written anew when only some
+//   of its objects changed.
+//   "ar rs %o %i", "ar ds %o %i"
+// - Thin Archive Template, like the Archive Template but referring to the
+//   objects where they are rather than copying them into the archive.
+//   "ar crsT %o %i"
+// - Time Trace Flag, the flag that makes the compiler write where its time
+//   went compiling an object, as Chrome trace events, to the object's path
+//   with its extension replaced by .json (as clang's does).
+//   "-ftime-trace"
 struct Compiler {
     const std::string name;
     const std::string object_template{};
     const std::string archive_template{};
     const std::string executable_template{};
+    const std::string preprocessed_extension{};
+    const std::string precompiled_header_template{};
+    const std::string precompiled_header_extension{};
+    const std::string precompiled_header_include_template{};
+    const std::string module_interface_template{};
+    const std::string batch_object_template{};
+    const std::string shared_template{};
+    const std::string position_independent_flag{};
+    const std::string runtime_path_template{};
+    const std::string interface_stub_template{};
+    const std::string archive_update_template{};
+    const std::string archive_delete_template{};
+    const std::string thin_archive_template{};
+    const std::string time_trace_flag{};
 };
 
 static auto object_output_from_source_path(std::string_view source)
@@ -42,13 +109,99 @@ static auto archive_output_from_target_name(std::string_view target_name) {
         ;
 }
 
+static auto shared_output_from_target_name(std::string_view target_name)
+    -> std::string {
+    return std::string(target_name)
+#if defined(_WIN32)
+        + ".dll"
+#elif defined(__APPLE__)
+        + ".dylib"
+#else
+        + ".so"
+#endif
+        ;
+}
+
+static auto interface_stub_from_shared_path(std::string_view shared)
+    -> std::string {
+    return std::string(shared) + ".interface";
+}
+
+static auto dependency_file_from_object_path(std::string_view object)
+    -> std::string {
+    return std::string(object) + ".d";
+}
+
+static auto time_trace_from_object_path(std::string_view object)
+    -> std::string {
+    return std::filesystem::path(object).replace_extension(".json").string();
+}
+
+// Whether objects compiled by the given compiler come with a dependency file
+// (see %M).
+static auto compiler_writes_dependency_files(const Compiler& compiler) {
+    return compiler.object_template.find("%M") != std::string::npos;
+}
+
+// Flags that make an object include the given header first, using the
+// precompiled header built from it.
+static auto expand_compiler_precompiled_header_include_format(
+    std::string_view format,
+    std::string_view header
+) -> std::string {
+    std::string flags{};
+    for (size_t i = 0; i < format.size(); ++i) {
+        if (format[i] == '%' and i + 1 < format.size()
+            and format[i + 1] == 'i') {
+            flags += header;
+            ++i;
+        } else flags += format[i];
+    }
+    return flags;
+}
+
+// Path of the built module interface of the given module (or partition).
+static auto expand_compiler_module_interface_format(
+    std::string_view format,
+    std::string_view module
+) -> std::string {
+    std::string path{};
+    for (size_t i = 0; i < format.size(); ++i) {
+        if (format[i] == '%' and i + 1 < format.size()
+            and format[i + 1] == 'm') {
+            for (const char c : module) path += c == ':' ? '-' : c;
+            ++i;
+        } else path += format[i];
+    }
+    return path;
+}
+
+// Flag that makes whatever links a shared library look for it in the given
+// directory (relative to its own, as $ORIGIN) when run.
+static auto expand_compiler_runtime_path_format(
+    std::string_view format,
+    std::string_view directory
+) -> std::string {
+    std::string flag{};
+    for (size_t i = 0; i < format.size(); ++i) {
+        if (format[i] == '%' and i + 1 < format.size()
+            and format[i + 1] == 'r') {
+            flag += directory;
+            ++i;
+        } else flag += format[i];
+    }
+    return flag;
+}
+
 // FIXME: We should move this to lib/lbs/compiler.cpp, or something...
 // For now it's static.
+// %M expands to dependency_file, if given.
 static auto expand_compiler_object_format(
     std::string format,
     std::string_view source,
     std::string_view output,
-    const Target& target
+    const Target& target,
+    std::string_view dependency_file = {}
 ) -> std::string {
     std::string build_command{};
 
@@ -81,6 +234,11 @@ static auto expand_compiler_object_format(
                 build_command += output;
             } break;
 
+            case 'M': {
+                if (dependency_file.size()) build_command += dependency_file;
+                else build_command += dependency_file_from_object_path(output);
+            } break;
+
             case 'f': {
                 format_has_flags = true;
                 bool notfirst{false};
@@ -150,12 +308,91 @@ static auto expand_compiler_object_format(
     return build_command;
 }
 
+// The batch object command for sources of the given target, with %i and %b
+// left for those of a batch to be filled in (see BuildCommands::batched()).
+static auto expand_compiler_batch_object_format(
+    std::string_view format,
+    const Target& target,
+    std::string_view working_directory
+) -> std::string {
+    std::string build_command{};
+    for (size_t i = 0; i < format.size(); ++i) {
+        if (format[i] != '%' or i + 1 >= format.size()) {
+            build_command += format[i];
+            continue;
+        }
+        const char nextc = format[++i];
+        switch (nextc) {
+        case 'i': build_command += "%i"; break;
+        case 'b': build_command += "%b"; break;
+        case 'w': build_command += working_directory; break;
+        case 'f':
+        case 'd': {
+            const auto& words = nextc == 'f' ? target.flags : target.defines;
+            bool notfirst{false};
+            for (const auto& word : words) {
+                if (notfirst) build_command += ' ';
+                build_command += word;
+                notfirst = true;
+            }
+        } break;
+        default:
+            printf(
+                "ERROR: Unrecognized format specifier in "
+                "compiler template string\n"
+                "    format specifier: %c\n"
+                "    template string: %s\n",
+                nextc, format.data()
+            );
+            exit(1);
+            break;
+        }
+    }
+    return build_command;
+}
+
+// Where %@ puts the inputs when they're too long for the command line.
+struct ResponseFile {
+    std::string path{};
+    // Inputs that take up at least this many characters on the command line
+    // go in the file.
+    size_t threshold{};
+    // Set when expanding %@ put the inputs in the file, to what it must say.
+    std::string contents{};
+};
+
+// The inputs as they go in place of %@: on the command line, or in a response
+// file (one per line, quoted the way GCC and binutils read them).
+static auto expand_response_file_inputs(
+    const std::vector<std::string>& inputs,
+    ResponseFile* response_file
+) -> std::string {
+    std::string joined{};
+    for (const auto& input : inputs) {
+        if (joined.size()) joined += ' ';
+        joined += input;
+    }
+    if (not response_file or joined.size() < response_file->threshold)
+        return joined;
+    response_file->contents.clear();
+    for (const auto& input : inputs) {
+        for (const char c : input) {
+            if (c == ' ' or c == '\t' or c == '\'' or c == '"' or c == '\\')
+                response_file->contents += '\\';
+            response_file->contents += c;
+        }
+        response_file->contents += '\n';
+    }
+    return '@' + response_file->path;
+}
+
 // FIXME: We should move this to lib/lbs/compiler.cpp, or something...
 // For now it's static.
 static auto expand_compiler_archive_format(
     std::string format,
     std::vector<std::string> sources,
-    std::string_view output
+    std::string_view output,
+    ResponseFile* response_file = nullptr
 ) -> std::string {
     std::string build_command{};
 
@@ -184,6 +421,12 @@ static auto expand_compiler_archive_format(
                 }
             } break;
 
+            case '@': {
+                format_has_input = true;
+                build_command +=
+                    expand_response_file_inputs(sources, response_file);
+            } break;
+
             case 'o': {
                 format_has_output = true;
                 build_command += output;
@@ -226,15 +469,22 @@ static auto expand_compiler_archive_format(
 
 // FIXME: We should move this to lib/lbs/compiler.cpp, or something...
 // For now it's static.
+// The output is named after the target unless given (like a shared library
+// is); %n expands to its file name.
 static auto expand_compiler_executable_format(
     std::string format,
-    const Target& target
+    const std::vector<std::string>& objects,
+    const Target& target,
+    std::string_view output = {},
+    ResponseFile* response_file = nullptr
 ) -> std::string {
-    const std::string output_name = target.name
+    std::string output_name{output};
+    if (output_name.empty())
+        output_name = target.name
 #ifdef _WIN32
-        + ".exe"
+                    + ".exe"
 #endif
-        ;
+            ;
 
     std::string build_command{};
 
@@ -258,18 +508,30 @@ static auto expand_compiler_executable_format(
             case 'i': {
                 format_has_input = true;
                 bool notfirst{false};
-                for (const auto& source : target.sources) {
+                for (const auto& object : objects) {
                     if (notfirst) build_command += ' ';
-                    build_command += source;
+                    build_command += object;
                     notfirst = true;
                 }
             } break;
 
+            case '@': {
+                format_has_input = true;
+                build_command +=
+                    expand_response_file_inputs(objects, response_file);
+            } break;
+
             case 'o': {
                 format_has_output = true;
                 build_command += output_name;
             } break;
 
+            case 'n': {
+                build_command += std::filesystem::path(output_name)
+                                     .filename()
+                                     .string();
+            } break;
+
             case 'f': {
                 format_has_flags = true;
                 bool notfirst{false};
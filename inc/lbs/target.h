@@ -10,15 +10,37 @@ struct Target {
         GENERIC,
         LIBRARY,
         EXECUTABLE,
+        SHARED_LIBRARY,
     } kind;
 
     const std::string name;
     std::string language;
     std::vector<std::string> sources;
+    // Sources found while planning (and added to sources then): the files
+    // within directory, and if recursive within its subdirectories too,
+    // whose names match one of patterns (shell wildcards), or any if there
+    // are none.
+    struct SourceDirectory {
+        std::string directory;
+        std::vector<std::string> patterns;
+        bool recursive;
+    };
+    std::vector<SourceDirectory> source_directories;
     std::vector<std::string> include_directories;
     std::vector<std::string> linked_libraries;
     std::vector<std::string> flags;
     std::vector<std::string> defines;
+    // Files that, when changed, make the target's commands run again.
+    std::vector<std::string> watches;
+    // Compile the sources in batches of about this many, each batch as one
+    // translation unit (a unity build); 0 leaves it to the build scenario,
+    // and 1 compiles every source on its own.
+    size_t unity;
+    // Sources that are always compiled on their own.
+    std::vector<std::string> unity_excludes;
+    // Header every source includes first, which is compiled once (per
+    // target) ahead of the sources; may be empty.
+    std::string precompiled_header;
 
     struct Requisite {
         enum Kind {
@@ -30,6 +52,16 @@ struct Target {
         std::string text;
         std::vector<std::string> arguments;
         std::string destination;
+        // What a copy's text names: a file, copied to destination, or a
+        // directory, copied into destination as a whole or just its
+        // contents, recursively.
+        enum Source {
+            FILE,
+            DIRECTORY,
+            DIRECTORY_CONTENTS,
+        } source{FILE};
+        // Hard link the files instead of copying them, where possible.
+        bool hard_link{false};
 
         static void Print(const Requisite& requisite) {
             switch (requisite.kind) {
@@ -42,12 +74,27 @@ struct Target {
                     printf(" %s", arg.data());
                 break;
             case COPY:
-                printf(
-                    "copy %s %s", requisite.text.data(),
-                    requisite.destination.data()
-                );
+                printf("%s", CopyDescription(requisite).data());
+                break;
+            }
+        }
+
+        // Describes a copy the way it was written (minus the target).
+        static auto CopyDescription(const Requisite& requisite)
+            -> std::string {
+            std::string description{"copy "};
+            switch (requisite.source) {
+            case FILE: description += requisite.text; break;
+            case DIRECTORY:
+                description += "(directory " + requisite.text + ")";
+                break;
+            case DIRECTORY_CONTENTS:
+                description += "(directory-contents " + requisite.text + ")";
                 break;
             }
+            description += ' ' + requisite.destination;
+            if (requisite.hard_link) description += " hard-link";
+            return description;
         }
     };
 
@@ -55,11 +102,18 @@ struct Target {
 
     Target() = delete;
 
+    // Whether the target is built from sources (rather than just its
+    // requisites).
+    bool compiled() const {
+        return kind == EXECUTABLE or kind == LIBRARY or kind == SHARED_LIBRARY;
+    }
+
     static auto
     NamedTarget(Target::Kind kind, std::string name, std::string language)
         -> Target {
         return Target{
-            kind, std::move(name), std::move(language), {}, {}, {}, {}, {}, {}};
+            kind, std::move(name), std::move(language), {}, {}, {}, {}, {}, {},
+            {}, 0, {}, {}, {}};
     }
 
     static void Print(const Target& target) {
@@ -71,6 +125,7 @@ struct Target {
             printf("EXECUTABLE ");
             break;
             break;
+        case SHARED_LIBRARY: printf("SHARED LIBRARY "); break;
         }
         printf("%s\n", target.name.data());
         if (target.sources.size()) {
@@ -78,6 +133,18 @@ struct Target {
             for (const auto& source : target.sources)
                 printf("- %s\n", source.data());
         }
+        if (target.source_directories.size()) {
+            printf("Source Directories:\n");
+            for (const auto& directory : target.source_directories) {
+                printf(
+                    "- %s%s", directory.directory.data(),
+                    directory.recursive ? " (recursively)" : ""
+                );
+                for (const auto& pattern : directory.patterns)
+                    printf(" %s", pattern.data());
+                printf("\n");
+            }
+        }
         if (target.include_directories.size()) {
             printf("Include Directories:\n");
             for (const auto& include_dir : target.include_directories)
@@ -88,6 +155,16 @@ struct Target {
             for (const auto& library : target.linked_libraries)
                 printf("- %s\n", library.data());
         }
+        if (target.unity) printf("Unity: %zu\n", target.unity);
+        if (target.precompiled_header.size())
+            printf(
+                "Precompiled Header: %s\n", target.precompiled_header.data()
+            );
+        if (target.watches.size()) {
+            printf("Watches:\n");
+            for (const auto& watched : target.watches)
+                printf("- %s\n", watched.data());
+        }
         if (target.requisites.size()) {
             printf("Requisites:\n");
             for (const auto& requisite : target.requisites) {
@@ -0,0 +1,58 @@
+#ifndef LBS_MODSCAN_H
+#define LBS_MODSCAN_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include <filestate/filestate.h>
+#include <lbs/build_scenario.h>
+
+// Finds out which C++20 modules a source provides and imports, by reading
+// just its preamble: the module declaration and imports must come before
+// anything else (but preprocessor directives and the global module
+// fragment), so scanning stops at the first declaration. Imports within
+// preprocessor conditionals count whether or not they are compiled, and
+// header units (import <header>;) are left to the compiler.
+
+// Sets unit to what the given start of a source declares. Returns false if
+// contents ended before the preamble did, in which case more of the source
+// may declare more.
+bool scan_module_preamble(std::string_view contents, ModuleUnit& unit);
+
+// Scan results, remembered (in a file) for as long as the source keeps the
+// same size and modification time.
+struct ModuleScans {
+    struct Entry {
+        int64_t size{-1};
+        // In nanoseconds since the epoch.
+        int64_t modified{};
+        ModuleUnit unit{};
+    };
+
+    std::unordered_map<std::string, Entry> entries{};
+
+    // Load the scans saved at path; missing or unreadable scans are empty.
+    static auto Load(std::string path) -> ModuleScans;
+
+    // What the source at path declares, scanning it again only if it changed
+    // since. A missing source declares nothing.
+    auto scan(const std::string& path) -> const ModuleUnit&;
+    // Likewise, given the source's current state.
+    auto scan(const std::string& path, const FileState& state)
+        -> const ModuleUnit&;
+
+    // Write the scans back to where they were loaded from, if any changed.
+    void save();
+
+    // Fill in build_scenario.modules from the sources of all its targets,
+    // which are looked up in (and so remembered by) file_states.
+    void scan_sources(BuildScenario& build_scenario, FileStates& file_states);
+
+private:
+    std::string path{};
+    bool changed{false};
+};
+
+#endif /* LBS_MODSCAN_H */
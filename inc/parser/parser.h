@@ -10,6 +10,53 @@
 #include <lbs/build_scenario.h>
 #include <lbs/target.h>
 
+// TODO: string syntax for identifiers with delimiters whitespace in them.
+struct Token {
+    enum Kind {
+        UNKNOWN,
+        EOF_,
+        LIST,
+        IDENTIFIER,
+    } kind;
+
+    std::string identifier;
+    std::vector<Token> elements;
+
+    static auto eof() -> Token { return {Token::Kind::EOF_, "", {}}; }
+
+    static void Print(const Token& token) {
+        switch (token.kind) {
+        case UNKNOWN: printf("Unknown"); break;
+        case EOF_: printf("EOF"); break;
+        case LIST: {
+            printf("(");
+            bool notfirst = false;
+            for (const auto& elem : token.elements) {
+                if (notfirst) printf(", ");
+                Token::Print(elem);
+                notfirst = true;
+            }
+            printf(")");
+        } break;
+        case IDENTIFIER: printf("ID:\"%s\"", token.identifier.data()); break;
+        }
+    }
+};
+
+constexpr bool token_is_eof(const Token& token) {
+    return token.kind == Token::Kind::EOF_;
+}
+constexpr bool token_is_list(const Token& token) {
+    return token.kind == Token::Kind::LIST;
+}
+constexpr bool token_is_identifier(const Token& token) {
+    return token.kind == Token::Kind::IDENTIFIER;
+}
+
+// Lex the next token off the front of source (a whole list, if it starts
+// with one), or EOF once there is nothing left but whitespace and comments.
+auto lex(std::string_view& source) -> Token;
+
 auto parse(std::string_view source, std::string language) -> BuildScenario;
 
 #endif /* LBS_PARSER_H */
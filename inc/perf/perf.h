@@ -0,0 +1,85 @@
+#ifndef LBS_PERF_H
+#define LBS_PERF_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// lbs-perf times builds of generated projects, with lbs and with Ninja (from
+// the build.ninja lbs --ninja writes), so that a change to lbs that makes
+// builds slower shows up as a number rather than a feeling.
+// The commands a build runs (cc, c++ and ar) are run through lbs-perf
+// itself, which records how long each took; what's left of the time the
+// build took is the overhead of the build system.
+
+// A generated project: targets libraries, each of sources sources, in depth
+// layers, with every library depending on those of the layer below; and an
+// executable linking all of them. Each source includes headers headers (its
+// own library's, then those of its dependencies).
+struct SyntheticProject {
+    size_t targets{8};
+    size_t sources{50};
+    size_t depth{3};
+    size_t headers{4};
+    // Sources that instantiate a few standard containers and algorithms
+    // (and take a good fraction of a second to compile) rather than next to
+    // nothing.
+    bool heavy{false};
+};
+
+// Write project into directory, replacing whatever was in it. Returns false
+// if a file can't be written.
+bool generate_project(
+    const std::string& directory, const SyntheticProject& project
+);
+
+// The source (of a library in the middle) and the header (of the bottom
+// library, included the most) edited to time incremental builds, relative
+// to the project's directory.
+auto edited_source(const SyntheticProject& project) -> std::string;
+auto edited_header(const SyntheticProject& project) -> std::string;
+
+struct BuildTiming {
+    double wall_ms{};
+    // CPU time of the build system and everything it ran.
+    double cpu_ms{};
+    // How many commands ran, and their CPU and (summed) wall time.
+    size_t commands{};
+    double command_cpu_ms{};
+    double command_wall_ms{};
+
+    // CPU time the build system itself took.
+    auto overhead_cpu_ms() const -> double { return cpu_ms - command_cpu_ms; }
+};
+
+// Where commands run through lbs-perf record their times, and the PATH to
+// find the real commands with.
+static constexpr const char* perf_log_variable = "LBS_PERF_LOG";
+static constexpr const char* perf_path_variable = "LBS_PERF_PATH";
+
+// Make the commands of builds run from now on go through the lbs-perf at
+// self: link cc, c++ and ar to it in directory, put that first in PATH,
+// and have them record their times in log. Returns false if the links
+// can't be made.
+bool time_commands(
+    const std::string& self, const std::string& directory,
+    const std::string& log
+);
+
+// Whether lbs-perf was run as one of the commands it stands in for, in
+// which case run_timed_command() does what it should.
+bool running_as_command(const char* argv0);
+
+// Run the real command named by argv[0], and append how long it took to
+// the log. Returns its exit status.
+int run_timed_command(int argc, const char** argv);
+
+// Run argv in directory, with its output thrown away, and measure it
+// (including the commands recorded in the log meanwhile). Returns false if
+// it can't be run or fails.
+bool time_build(
+    const std::vector<std::string>& argv, const std::string& directory,
+    const std::string& log, BuildTiming& timing
+);
+
+#endif /* LBS_PERF_H */
@@ -0,0 +1,73 @@
+#ifndef LBS_STATS_H
+#define LBS_STATS_H
+
+#include <atomic>
+#include <cstdint>
+
+// What lbs did, for --stats: counters of the work it did, which are always
+// counted (that's cheap enough), and, once turned on, the wall and CPU time,
+// allocations and peak memory of each of its phases.
+
+enum StatCounter {
+    STAT_TOKENS_LEXED,
+    STAT_TARGETS,
+    STAT_ACTIONS_PLANNED,
+    // Actions that were up to date already.
+    STAT_ACTIONS_SKIPPED,
+    STAT_ACTIONS_RUN,
+    STAT_PROCESSES_SPAWNED,
+    STAT_FILES_STATED,
+    STAT_FILE_STATE_HITS,
+    STAT_FILES_HASHED,
+    STAT_CONTENT_HASH_HITS,
+    STAT_SOURCES_SCANNED,
+    STAT_MODULE_SCAN_HITS,
+    // Counted where the program counts them (as lbs does, in its operator
+    // new).
+    STAT_ALLOCATIONS,
+    STAT_COUNTERS
+};
+
+// The counters are shared by every thread, which count in them without
+// ordering anything (the cheapest an atomic increment gets), so that whatever
+// happens on any thread (like an allocation) is counted.
+struct StatCounts {
+    std::atomic<uint64_t> counts[STAT_COUNTERS];
+};
+inline StatCounts stat_counts{};
+
+inline void stat_count(StatCounter counter, uint64_t n = 1) {
+    stat_counts.counts[counter].fetch_add(n, std::memory_order_relaxed);
+}
+
+inline auto stat_counted(StatCounter counter) -> uint64_t {
+    return stat_counts.counts[counter].load(std::memory_order_relaxed);
+}
+
+// Start measuring phases from scratch, with the counters at zero.
+void stats_start();
+
+// Measures a phase, from construction to destruction, once stats are
+// started. Phases don't nest.
+struct StatPhase {
+    explicit StatPhase(const char* name);
+    ~StatPhase() { end(); }
+    StatPhase(const StatPhase&) = delete;
+    StatPhase& operator=(const StatPhase&) = delete;
+
+    // End the phase before its destruction.
+    void end();
+
+private:
+    const char* name;
+    bool measuring;
+    int64_t wall_ns{};
+    int64_t cpu_us{};
+    int64_t children_cpu_us{};
+    uint64_t allocations{};
+};
+
+// Print the phases measured since stats_start(), and the counters.
+void stats_print();
+
+#endif /* LBS_STATS_H */
@@ -0,0 +1,22 @@
+#ifndef LBS_TONINJA_H
+#define LBS_TONINJA_H
+
+#include <string>
+#include <vector>
+
+#include <lbs/build_scenario.h>
+
+// A build.ninja doing what build_commands do: an edge per action (or, for
+// copies, per file copied), each reading its inputs and waiting on the
+// actions it depends on, with headers tracked through the compiler's
+// dependency files (deps = gcc). Actions without outputs write a stamp under
+// .lbs_ninja/ instead, and every target gets a phony edge of its name (unless
+// that's the name of its output already). The manifest regenerates itself,
+// by running regenerate, whenever .lbs changes.
+std::string toninja(
+    const BuildScenario::BuildCommands& build_commands,
+    const std::vector<std::string>& targets,
+    const std::string& regenerate
+);
+
+#endif /* LBS_TONINJA_H */
@@ -0,0 +1,37 @@
+#ifndef LBS_WATCHER_H
+#define LBS_WATCHER_H
+
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+// Tells us when files change, using inotify. Directories are watched rather
+// than files, as editors often replace a file instead of writing to it.
+struct Watcher {
+    Watcher();
+    ~Watcher();
+    Watcher(const Watcher&) = delete;
+    Watcher& operator=(const Watcher&) = delete;
+
+    // Readable whenever there are changes to drain(); -1 if we can't watch
+    // anything (on this platform, or at all).
+    int fd() const { return inotify_fd; }
+
+    // Start watching the directory containing path. Returns true iff that
+    // directory is watched, i.e. we will hear about path changing.
+    bool watch_directory_of(const std::string& path);
+
+    // Call changed() with the path of everything that changed since the last
+    // drain, without blocking. Returns false if changes were lost (the kernel
+    // queue overflowed), in which case everything must be assumed changed.
+    bool drain(const std::function<void(const std::string& path)>& changed);
+
+private:
+    int inotify_fd{-1};
+    // Watch descriptor to watched directory, and the other way around.
+    std::unordered_map<int, std::string> directories{};
+    std::unordered_set<std::string> watched{};
+};
+
+#endif /* LBS_WATCHER_H */
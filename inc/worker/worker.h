@@ -0,0 +1,77 @@
+#ifndef LBS_WORKER_H
+#define LBS_WORKER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// lbs-worker compiles objects for builds running elsewhere. The coordinating
+// lbs preprocesses a source locally, so that the worker needs nothing but
+// the compiler, and ships the resulting translation unit along with the
+// command to compile it; the worker answers with the object and whatever
+// the command printed.
+// Workers are found at an address, either unix:<path> or <host>:<port>.
+// NOTE: A worker runs whatever command it is sent, so only ever let trusted
+// machines reach it.
+
+// One translation unit to compile. The command runs in a scratch directory
+// on the worker, in which input and output are relative paths.
+struct WorkerJob {
+    std::string command;
+    std::string input;
+    std::string output;
+    // Contents of input.
+    std::string source;
+};
+
+struct WorkerResult {
+    int status{};
+    // What the command wrote to stdout and stderr.
+    std::string output{};
+    // Contents of the output file, if the command succeeded.
+    std::string object{};
+};
+
+// Connect to the worker at address, giving up after a few seconds. On
+// success, returns the connection and sets capacity to how many jobs the
+// worker runs at once, and resolved (if given) to the socket address that
+// answered, to connect to again with worker_connect_start(); otherwise -1.
+int worker_connect(
+    const std::string& address,
+    uint32_t& capacity,
+    std::string* resolved = nullptr
+);
+
+// Send a job over a connection from worker_connect(); the result then
+// arrives over the same connection. Returns false if the worker went away.
+bool worker_send(int fd, const WorkerJob& job);
+
+// For those waiting on many things at once, like the executor: start
+// connecting to a socket address from worker_connect() without waiting for
+// it. Returns a non-blocking socket, which becomes writable once connected
+// (or not; see worker_connected()), or -1. Then send the message of a job
+// over it; what it receives is the worker's hello (worker_hello_size bytes;
+// see worker_parse_hello()), then the result.
+int worker_connect_start(const std::string& resolved);
+bool worker_connected(int fd);
+auto worker_job_message(const WorkerJob& job) -> std::string;
+constexpr size_t worker_hello_size{12};
+// A worker claiming to run more jobs at once than this is taken at no more.
+constexpr uint32_t worker_capacity_limit{256};
+// Whether hello is from a worker we understand; if so, sets capacity (up to
+// worker_capacity_limit).
+bool worker_parse_hello(const char* hello, uint32_t& capacity);
+
+// Parse the result of a job out of everything received over its connection
+// so far. Returns false if it hasn't all arrived yet.
+bool worker_parse_result(const std::string& received, WorkerResult& result);
+
+// Serve jobs at address, compiling up to capacity of them at once, until
+// killed. Returns an exit status.
+int worker_serve(const std::string& address, uint32_t capacity);
+
+// Serve the one client connected over fd (say, one end of a socket pair),
+// telling it the worker runs up to capacity jobs at once.
+void worker_serve_connection(int fd, uint32_t capacity);
+
+#endif /* LBS_WORKER_H */
@@ -0,0 +1,130 @@
+#include <actionlog/actionlog.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <contenthash/contenthash.h>
+
+// Every line after the header is
+//   <finished>\t<duration>\t<failed>\t<command hash>\t<output hash>\t
+//   <modified>\t<input hash>\t<key>
+// The key goes last, as it's the only field that could contain a tab.
+static constexpr const char* action_log_header = "# lbs action log v3\n";
+
+static void write_entry(
+    FILE* f,
+    const std::string& key,
+    const ActionLog::Entry& entry
+) {
+    fprintf(
+        f,
+        "%" PRId64 "\t%" PRId64 "\t%d\t%" PRIx64 "\t%" PRIx64 "\t%" PRId64
+        "\t%" PRIx64 "\t%s\n",
+        entry.finished, entry.duration, int(entry.failed), entry.command_hash,
+        entry.output_hash, entry.modified, entry.input_hash, key.data()
+    );
+}
+
+auto hash_files(const std::vector<std::string>& paths) -> uint64_t {
+    std::vector<ContentHash> hashes(paths.size());
+    // Outputs (like executables) may be big enough to be worth hashing on
+    // every CPU.
+    const size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    for (size_t i = 0; i < paths.size(); ++i)
+        if (not hash_file(paths[i], hashes[i], threads)) return 0;
+    const auto hash =
+        hash_contents(hashes.data(), hashes.size() * sizeof(ContentHash)).low;
+    return hash ? hash : 1;
+}
+
+auto ActionLog::Load(std::string path, bool writable) -> ActionLog {
+    ActionLog log{};
+    log.path = std::move(path);
+
+    size_t lines{0};
+    bool compatible{false};
+    if (auto f = fopen(log.path.data(), "rb")) {
+        char* line{nullptr};
+        size_t capacity{0};
+        ssize_t length{0};
+        while ((length = getline(&line, &capacity, f)) > 0) {
+            if (line[length - 1] == '\n') line[--length] = '\0';
+            if (not lines++) {
+                compatible = strncmp(
+                                 line, action_log_header,
+                                 strlen(action_log_header) - 1
+                             )
+                          == 0;
+                if (not compatible) break;
+                continue;
+            }
+
+            Entry entry{};
+            int failed{0};
+            int key_offset{0};
+            if (sscanf(
+                    line,
+                    "%" SCNd64 "\t%" SCNd64 "\t%d\t%" SCNx64 "\t%" SCNx64
+                    "\t%" SCNd64 "\t%" SCNx64 "\t%n",
+                    &entry.finished, &entry.duration, &failed,
+                    &entry.command_hash, &entry.output_hash, &entry.modified,
+                    &entry.input_hash, &key_offset
+                )
+                    != 7
+                or not key_offset) {
+                // Most likely the tail of a log from an interrupted build.
+                continue;
+            }
+            entry.failed = failed;
+            log.entries[std::string(line + key_offset)] = entry;
+        }
+        free(line);
+        fclose(f);
+    }
+
+    if (not compatible) log.entries.clear();
+    if (not writable) return log;
+
+    // Start over if the log is from an incompatible version, and compact it
+    // when it's mostly made up of lines that have since been replaced.
+    const bool rewrite =
+        not compatible or lines > 2 * log.entries.size() + 1024;
+    log.file.reset(fopen(log.path.data(), rewrite ? "wb" : "ab"));
+    if (not log.file) {
+        printf(
+            "WARNING: Cannot open action log at %s; results of this build "
+            "won't be remembered\n",
+            log.path.data()
+        );
+        return log;
+    }
+    if (rewrite) {
+        fputs(action_log_header, log.file.get());
+        for (const auto& [key, entry] : log.entries)
+            write_entry(log.file.get(), key, entry);
+        fflush(log.file.get());
+    }
+
+    return log;
+}
+
+auto ActionLog::find(const std::string& key) const -> const Entry* {
+    auto found = entries.find(key);
+    if (found == entries.end()) return nullptr;
+    return &found->second;
+}
+
+void ActionLog::record(const std::string& key, Entry entry) {
+    entries[key] = entry;
+
+    // A newline would split the entry across two lines, so it's only
+    // remembered for this run.
+    if (not file or key.find('\n') != std::string::npos) return;
+    write_entry(file.get(), key, entry);
+    fflush(file.get());
+}
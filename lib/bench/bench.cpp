@@ -0,0 +1,293 @@
+#include <bench/bench.h>
+
+#include <lbs/build_scenario.h>
+#include <parser/parser.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Every allocation the program makes is counted, so that a benchmark can
+// tell how many its operation made.
+static std::atomic<size_t> allocations{0};
+static std::atomic<size_t> allocated_bytes{0};
+
+void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    if (void* allocated = malloc(size ? size : 1)) return allocated;
+    throw std::bad_alloc{};
+}
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* allocated) noexcept { free(allocated); }
+void operator delete[](void* allocated) noexcept { free(allocated); }
+void operator delete(void* allocated, size_t) noexcept { free(allocated); }
+void operator delete[](void* allocated, size_t) noexcept { free(allocated); }
+
+namespace {
+
+// Written to with whatever an operation produced, so that it can't be
+// optimised away.
+volatile size_t sink{0};
+
+const Compiler compiler{
+    "c",
+    "cc -c %f %d %i -o %o -MMD -MF %M",
+    "ar crs %o %@",
+    "cc %f %d %@ -o %o",
+    ".i",
+    "cc -x c-header %f %d %i -o %o -MMD -MF %M",
+    ".gch",
+    "-include %i",
+    "gcm.cache/%m.gcm",
+    "cc -c %f %d %i -MMD -ffile-prefix-map=%w/= -fdebug-prefix-map=%b=%w",
+    "cc -shared %f %d %@ -o %o -Wl,-soname,%n",
+    "-fPIC",
+    "-Wl,-rpath,'$ORIGIN/%r'",
+    "nm -gD --defined-only %i > %o"};
+
+// Sources spread over directories of a thousand, the way a big tree is.
+auto source_path(size_t index) -> std::string {
+    return "src/module" + std::to_string(index / 1000) + "/file" +
+           std::to_string(index) + ".c";
+}
+
+auto target_description(
+    std::string_view kind, const std::string& name, size_t first, size_t count
+) -> std::string {
+    std::string out{"("};
+    out += kind;
+    out += ' ' + name + "\n (include-directories inc)";
+    out += "\n (flags -O2 -g -Wall -Wextra)\n (defines -DNDEBUG)\n (sources";
+    for (size_t i = first; i < first + count; ++i)
+        out += "\n  " + source_path(i);
+    return out + "))\n";
+}
+
+// A chain of depth libraries, each depending on the one before, with the
+// sources spread evenly over them, and an executable depending on the last.
+auto deep_description(size_t sources, size_t depth) -> std::string {
+    std::string out{};
+    const size_t each = sources / depth;
+    for (size_t level = 0; level < depth; ++level) {
+        const auto name = "lib" + std::to_string(level);
+        out += target_description("library", name, level * each, each);
+        if (level)
+            out += "(dependency " + name + " lib" +
+                   std::to_string(level - 1) + ")\n";
+    }
+    out += "(executable app (sources main.c))\n";
+    out += "(dependency app lib" + std::to_string(depth - 1) + ")\n";
+    return out;
+}
+
+auto with_compiler(BuildScenario build_scenario) -> BuildScenario {
+    build_scenario.compilers.push_back(compiler);
+    return build_scenario;
+}
+
+struct Runner {
+    const BenchOptions& options;
+
+    bool wanted(const std::string& name) const {
+        return name.find(options.filter) != std::string::npos;
+    }
+
+    // Time operation, running reset (untimed, and with its allocations not
+    // counted) before each run if given, or else running it in batches that
+    // double in size, so as not to time the clock.
+    void run(
+        const std::string& name, const std::function<void()>& reset,
+        const std::function<void()>& operation
+    ) const {
+        if (not wanted(name)) return;
+        double best_ns{0};
+        double allocations_per_op{0};
+        double bytes_per_op{0};
+        size_t iterations{0};
+        for (size_t repetition = 0; repetition < 3; ++repetition) {
+            double elapsed_ns{0};
+            size_t operations{0};
+            size_t allocated{0};
+            size_t bytes{0};
+            size_t batch{1};
+            while (elapsed_ns < options.min_time_ms * 1e6) {
+                if (reset) reset();
+                const auto allocations_before =
+                    allocations.load(std::memory_order_relaxed);
+                const auto bytes_before =
+                    allocated_bytes.load(std::memory_order_relaxed);
+                const auto started = std::chrono::steady_clock::now();
+                for (size_t i = 0; i < batch; ++i) operation();
+                elapsed_ns += std::chrono::duration<double, std::nano>(
+                                  std::chrono::steady_clock::now() - started
+                )
+                                  .count();
+                allocated += allocations.load(std::memory_order_relaxed) -
+                             allocations_before;
+                bytes += allocated_bytes.load(std::memory_order_relaxed) -
+                         bytes_before;
+                operations += batch;
+                if (not reset) batch *= 2;
+            }
+            const double ns = elapsed_ns / double(operations);
+            if (repetition and ns >= best_ns) continue;
+            best_ns = ns;
+            allocations_per_op = double(allocated) / double(operations);
+            bytes_per_op = double(bytes) / double(operations);
+            iterations = operations;
+            // An operation that takes that long on its own varies little
+            // from one run to the next, so it's only timed once.
+            if (operations == 1) break;
+        }
+        printf(
+            "%-28s %10zu %16.1f %14.1f %16.1f\n", name.data(), iterations,
+            best_ns, allocations_per_op, bytes_per_op
+        );
+        fflush(stdout);
+    }
+};
+
+}  // namespace
+
+void bench_run(const BenchOptions& options) {
+    const Runner runner{options};
+    printf(
+        "%-28s %10s %16s %14s %16s\n", "benchmark", "iterations", "ns/op",
+        "allocs/op", "bytes/op"
+    );
+
+    // Expanding the compiler templates for a single source.
+    Target target = Target::NamedTarget(Target::LIBRARY, "lib", "c");
+    target.flags = {"-O2", "-g", "-Wall", "-Wextra", "-Iinc", "-Iinclude"};
+    target.defines = {"-DNDEBUG", "-DLBS_BENCH"};
+    const auto source = source_path(123456);
+    const auto object = object_output_from_source_path(source);
+    runner.run("expand/object", {}, [&] {
+        sink = expand_compiler_object_format(
+                   compiler.object_template, source, object, target
+        )
+                   .size();
+    });
+    runner.run("expand/batch_object", {}, [&] {
+        sink = expand_compiler_batch_object_format(
+                   compiler.batch_object_template, target,
+                   "/home/user/project"
+        )
+                   .size();
+    });
+    runner.run("expand/precompiled_header", {}, [&] {
+        sink = expand_compiler_precompiled_header_include_format(
+                   compiler.precompiled_header_include_template,
+                   "lib.pch/include.h"
+        )
+                   .size();
+    });
+    runner.run("expand/module_interface", {}, [&] {
+        sink = expand_compiler_module_interface_format(
+                   compiler.module_interface_template, "foo.bar:baz"
+        )
+                   .size();
+    });
+    runner.run("expand/runtime_path", {}, [&] {
+        sink = expand_compiler_runtime_path_format(
+                   compiler.runtime_path_template, "../lib"
+        )
+                   .size();
+    });
+
+    for (size_t sources = 1000; sources <= options.max_sources; sources *= 10) {
+        const auto n = std::to_string(sources);
+
+        if (runner.wanted("lex/" + n) or runner.wanted("parse/" + n)) {
+            const auto description =
+                target_description("library", "lib", 0, sources);
+            runner.run("lex/" + n, {}, [&] {
+                std::string_view rest{description};
+                for (auto token = lex(rest); not token_is_eof(token);
+                     token = lex(rest))
+                    sink = token.elements.size();
+            });
+            runner.run("parse/" + n, {}, [&] {
+                sink = parse(description, "c").targets.size();
+            });
+        }
+
+        // Looking up a target by name, among one for every hundred sources.
+        const size_t targets = sources / 100;
+        const auto t = "target/" + std::to_string(targets);
+        if (runner.wanted(t)) {
+            std::string description{};
+            std::vector<std::string> names{};
+            for (size_t i = 0; i < targets; ++i) {
+                names.push_back("target" + std::to_string(i));
+                description += "(library " + names.back() + " (sources " +
+                               source_path(i) + "))\n";
+            }
+            const auto build_scenario = parse(description, "c");
+            size_t next{0};
+            runner.run(t, {}, [&] {
+                // Every target in turn, in an order the branch predictor
+                // doesn't learn.
+                next = (next + 7919) % targets;
+                sink = size_t(build_scenario.target(names[next])->kind);
+            });
+        }
+
+        if (runner.wanted("commands/wide/" + n)) {
+            auto build_scenario = with_compiler(
+                parse(target_description("executable", "app", 0, sources), "c")
+            );
+            runner.run(
+                "commands/wide/" + n,
+                [&] { build_scenario.targets_built.clear(); },
+                [&] {
+                    sink = BuildScenario::Commands(build_scenario, "app", "c")
+                               .actions.size();
+                }
+            );
+        }
+        if (runner.wanted("commands/deep/" + n)) {
+            auto build_scenario =
+                with_compiler(parse(deep_description(sources, 100), "c"));
+            runner.run(
+                "commands/deep/" + n,
+                [&] { build_scenario.targets_built.clear(); },
+                [&] {
+                    sink = BuildScenario::Commands(build_scenario, "app", "c")
+                               .actions.size();
+                }
+            );
+        }
+
+        if (runner.wanted("expand/archive/" + n)
+            or runner.wanted("expand/executable/" + n)) {
+            std::vector<std::string> objects{};
+            for (size_t i = 0; i < sources; ++i)
+                objects.push_back(object_output_from_source_path(source_path(i))
+                );
+            runner.run("expand/archive/" + n, {}, [&] {
+                ResponseFile response_file{"lib.a.rsp", 32768};
+                sink = expand_compiler_archive_format(
+                           compiler.archive_template, objects, "lib.a",
+                           &response_file
+                )
+                           .size();
+            });
+            runner.run("expand/executable/" + n, {}, [&] {
+                ResponseFile response_file{"app.rsp", 32768};
+                sink = expand_compiler_executable_format(
+                           compiler.executable_template, objects, target,
+                           "app", &response_file
+                )
+                           .size();
+            });
+        }
+    }
+}
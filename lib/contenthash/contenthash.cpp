@@ -0,0 +1,500 @@
+#include <contenthash/contenthash.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <stats/stats.h>
+
+static constexpr uint64_t prime_1 = 0x9e3779b185ebca87;
+static constexpr uint64_t prime_2 = 0xc2b2ae3d27d4eb4f;
+static constexpr uint64_t prime_3 = 0x165667b19e3779f9;
+static constexpr uint64_t prime_32 = 0x9e3779b1;
+
+// Enough for the keys of a block of stripes (one word further along for each
+// stripe), the one it's scrambled with, and the two final merges.
+static constexpr uint64_t secret[32] = {
+    0xbe4ba423396cfeb8, 0x1cad21f72c81017c, 0xdb979083e96dd4de,
+    0x1f67b3b7a4a44072, 0x78e5c0cc4ee679cb, 0x2172ffcc7dd05a82,
+    0x8e2443f7744608b8, 0x4c263a81e69035e0, 0xcb00c391bb52283c,
+    0xa32e531b8b65d088, 0x4ef90da297486471, 0xd8acdea946ef1938,
+    0x3f349ce33f76faa8, 0x1d4f0bc7c7bbdcf9, 0x3159b4cd4be0518a,
+    0x647378d9c97e9fc8, 0xc3ebd33483acc5ea, 0xeb6313faffa081c5,
+    0x49daf0b751dd0d17, 0x9e68d429265516d3, 0xfca1477d58be162b,
+    0xce31d07ad1b8f88f, 0x280416958f3acb45, 0x7e404bbbcafbd7af,
+    0x5d9fa3c9f5b7c2e1, 0x96b2e1f1a2c3d4e5, 0x3c6ef372fe94f82b,
+    0xa54ff53a5f1d36f1, 0x510e527fade682d1, 0x9b05688c2b3e6c1f,
+    0x1f83d9abfb41bd6b, 0x5be0cd19137e2179};
+
+static constexpr size_t stripe = 64;
+static constexpr size_t stripes_per_block = 16;
+
+static auto avalanche(uint64_t h) -> uint64_t {
+    h ^= h >> 37;
+    h *= prime_3;
+    h ^= h >> 32;
+    return h;
+}
+
+// Low and high halves of the 128-bit product, folded together.
+static auto multiply_fold(uint64_t a, uint64_t b) -> uint64_t {
+    __extension__ using uint128 = unsigned __int128;
+    const auto product = uint128(a) * b;
+    return uint64_t(product) ^ uint64_t(product >> 64);
+}
+
+// Each lane takes the product of the halves of its (keyed) word, and its
+// neighbour's word as is, so that no input bit gets lost in the product.
+// Written with (GCC's) vector types, as compilers only vectorize the plain
+// loop when optimizing hard.
+using lanes = uint64_t __attribute__((vector_size(16)));
+static void accumulate(
+    uint64_t acc[8],
+    const unsigned char* data,
+    const uint64_t* key
+) {
+    for (size_t i = 0; i < 8; i += 2) {
+        lanes words, keys, sums;
+        memcpy(&words, data + 8 * i, sizeof(words));
+        memcpy(&keys, key + i, sizeof(keys));
+        memcpy(&sums, acc + i, sizeof(sums));
+        const lanes keyed = words ^ keys;
+        const lanes swapped = {words[1], words[0]};
+        sums += (keyed & 0xffffffff) * (keyed >> 32) + swapped;
+        memcpy(acc + i, &sums, sizeof(sums));
+    }
+}
+
+static void scramble(uint64_t acc[8]) {
+    for (size_t i = 0; i < 8; ++i) {
+        acc[i] ^= acc[i] >> 47;
+        acc[i] ^= secret[stripes_per_block + i];
+        acc[i] *= prime_32;
+    }
+}
+
+static auto merge(const uint64_t acc[8], const uint64_t* key, uint64_t start)
+    -> uint64_t {
+    uint64_t result = start;
+    for (size_t i = 0; i < 8; i += 2)
+        result += multiply_fold(acc[i] ^ key[i], acc[i + 1] ^ key[i + 1]);
+    return avalanche(result);
+}
+
+auto hash_contents(const void* data, size_t size, uint64_t seed)
+    -> ContentHash {
+    const auto* bytes = static_cast<const unsigned char*>(data);
+    uint64_t acc[8] = {prime_32, prime_1, prime_2, prime_3,
+                       ~prime_32, ~prime_1, ~prime_2, ~prime_3};
+    for (auto& lane : acc) lane ^= seed;
+
+    size_t offset{0};
+    size_t stripes{0};
+    for (; offset + stripe <= size; offset += stripe) {
+        accumulate(acc, bytes + offset, secret + stripes);
+        if (++stripes == stripes_per_block) {
+            scramble(acc);
+            stripes = 0;
+        }
+    }
+    // The rest goes in a stripe of its own, padded with zeros (the size
+    // tells it apart from one that really ends in them).
+    unsigned char last[stripe]{};
+    if (size > offset) memcpy(last, bytes + offset, size - offset);
+    accumulate(acc, last, secret + stripes);
+
+    return {
+        merge(acc, secret + 16, uint64_t(size) * prime_1),
+        merge(acc, secret + 24, ~(uint64_t(size) * prime_2))};
+}
+
+static auto chunk_count(size_t size) -> size_t {
+    return std::max<size_t>(
+        1, (size + content_hash_chunk - 1) / content_hash_chunk
+    );
+}
+
+// The hash of a file from the hashes of its chunks.
+static auto combine(const std::vector<ContentHash>& chunks, size_t size)
+    -> ContentHash {
+    if (chunks.size() == 1) return chunks.front();
+    return hash_contents(
+        chunks.data(), chunks.size() * sizeof(ContentHash), uint64_t(size)
+    );
+}
+
+// Run work(i) for every i below count, on up to threads threads.
+template <typename Work>
+static void in_parallel(size_t count, size_t threads, const Work& work) {
+    std::atomic<size_t> next{0};
+    const auto run = [&] {
+        for (size_t i = next++; i < count; i = next++) work(i);
+    };
+    threads = std::min(threads, count);
+    std::vector<std::thread> helpers{};
+    for (size_t t = 1; t < threads; ++t) helpers.emplace_back(run);
+    run();
+    for (auto& helper : helpers) helper.join();
+}
+
+static auto cpus() -> size_t {
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+static auto modification_time(const struct stat& st) -> int64_t {
+#ifdef __linux__
+    return int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#else
+    return int64_t(st.st_mtime) * 1000000000;
+#endif
+}
+
+static auto now() -> int64_t {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::system_clock::now().time_since_epoch()
+    )
+        .count();
+}
+
+// The state of a file (see ContentHashes::hash()); a regular one, or else
+// none at all.
+static auto state_of(const struct stat& st) -> ContentHashes::Entry {
+    ContentHashes::Entry state{};
+    if (not S_ISREG(st.st_mode)) return state;
+    state.device = uint64_t(st.st_dev);
+    state.inode = uint64_t(st.st_ino);
+    state.size = int64_t(st.st_size);
+    state.modified = modification_time(st);
+    return state;
+}
+
+static bool same_state(
+    const ContentHashes::Entry& a,
+    const ContentHashes::Entry& b
+) {
+    return a.device == b.device and a.inode == b.inode and a.size == b.size
+       and a.modified == b.modified;
+}
+
+// Whether entry still holds for the file in state. A file may change within
+// the same tick of the file system's clock as it was hashed (which can be
+// slow), so a hash taken right after is never trusted.
+static bool still_holds(
+    const ContentHashes::Entry& entry,
+    const ContentHashes::Entry& state
+) {
+    return entry.modified and same_state(entry, state);
+}
+
+static auto fresh_entry(const ContentHashes::Entry& state)
+    -> ContentHashes::Entry {
+    auto entry = state;
+    entry.hash = {};
+    if (now() - state.modified <= 2000000000) entry.modified = 0;
+    return entry;
+}
+
+// Small files are read rather than mapped, which takes fewer system calls.
+static constexpr size_t mapped_size = size_t(64) << 10;
+
+// A file open to be hashed: mapped into memory whole (and closed again) if
+// it's big, or else open as fd, to be read a chunk at a time.
+// NOTE: A file truncated while mapped makes reading it raise SIGBUS; sources
+// and outputs aren't, while we hash them.
+struct OpenFile {
+    int fd{-1};
+    size_t size{0};
+    const unsigned char* data{nullptr};
+};
+
+// Open the (regular) file at path, if it's still in state (when given).
+static bool open_file(
+    const std::string& path,
+    const ContentHashes::Entry* state,
+    OpenFile& file
+) {
+    file = {};
+    const int fd = open(path.data(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    struct stat st {};
+    if (fstat(fd, &st) != 0 or not S_ISREG(st.st_mode)
+        or (state and not same_state(state_of(st), *state))) {
+        close(fd);
+        return false;
+    }
+    file.size = size_t(st.st_size);
+    if (file.size >= mapped_size) {
+        void* data = mmap(nullptr, file.size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            madvise(data, file.size, MADV_SEQUENTIAL);
+            file.data = static_cast<const unsigned char*>(data);
+            close(fd);
+            return true;
+        }
+    }
+    file.fd = fd;
+    return true;
+}
+
+static void close_file(OpenFile& file) {
+    if (file.data)
+        munmap(const_cast<unsigned char*>(file.data), file.size);
+    if (file.fd >= 0) close(file.fd);
+    file = {};
+}
+
+// Hash of the index'th chunk of file. Returns false if it can't be read.
+static bool hash_chunk(const OpenFile& file, size_t index, ContentHash& hash) {
+    const size_t offset = index * content_hash_chunk;
+    const size_t length = std::min(content_hash_chunk, file.size - offset);
+    if (file.data) {
+        hash = hash_contents(file.data + offset, length, index);
+        return true;
+    }
+    std::vector<unsigned char> buffer(length);
+    size_t done{0};
+    while (done < length) {
+        const auto n = pread(
+            file.fd, buffer.data() + done, length - done, off_t(offset + done)
+        );
+        if (n <= 0) return false;
+        done += size_t(n);
+    }
+    hash = hash_contents(buffer.data(), length, index);
+    return true;
+}
+
+// Hash of the file at path (if still in state, when given), with its chunks
+// spread over up to threads threads.
+static bool hash_path(
+    const std::string& path,
+    const ContentHashes::Entry* state,
+    ContentHash& hash,
+    size_t threads
+) {
+    OpenFile file{};
+    if (not open_file(path, state, file)) return false;
+    std::vector<ContentHash> chunks(chunk_count(file.size));
+    std::atomic<bool> read{true};
+    in_parallel(chunks.size(), threads, [&](size_t i) {
+        if (not hash_chunk(file, i, chunks[i])) read = false;
+    });
+    const auto size = file.size;
+    close_file(file);
+    if (not read) return false;
+    hash = combine(chunks, size);
+    return true;
+}
+
+bool hash_file(const std::string& path, ContentHash& hash, size_t threads) {
+    return hash_path(path, nullptr, hash, threads);
+}
+
+// Every line after the header is
+//   <device>\t<inode>\t<size>\t<modified>\t<hash high>\t<hash low>\t<path>
+// The path goes last, as it's the only field that could contain a tab.
+static constexpr const char* content_hashes_header =
+    "# lbs content hashes v1\n";
+
+auto ContentHashes::Load(std::string path) -> ContentHashes {
+    ContentHashes hashes{};
+    hashes.path = std::move(path);
+
+    auto f = fopen(hashes.path.data(), "rb");
+    if (not f) return hashes;
+    char* line{nullptr};
+    size_t capacity{0};
+    ssize_t length{0};
+    size_t lines{0};
+    while ((length = getline(&line, &capacity, f)) > 0) {
+        if (line[length - 1] == '\n') line[--length] = '\0';
+        if (not lines++) {
+            if (strncmp(
+                    line, content_hashes_header,
+                    strlen(content_hashes_header) - 1
+                )
+                != 0)
+                break;
+            continue;
+        }
+
+        Entry entry{};
+        int offset{0};
+        if (sscanf(
+                line,
+                "%" SCNu64 "\t%" SCNu64 "\t%" SCNd64 "\t%" SCNd64 "\t%" SCNx64
+                "\t%" SCNx64 "\t%n",
+                &entry.device, &entry.inode, &entry.size, &entry.modified,
+                &entry.hash.high, &entry.hash.low, &offset
+            )
+                != 6
+            or not offset)
+            continue;
+        hashes.entries[line + offset] = entry;
+    }
+    free(line);
+    fclose(f);
+    return hashes;
+}
+
+bool ContentHashes::hash(
+    const std::string& file,
+    Entry& entry,
+    const Entry* state
+) {
+    Entry stated{};
+    if (not state) {
+        struct stat st {};
+        if (stat(file.data(), &st) == 0) stated = state_of(st);
+        state = &stated;
+    }
+    if (state->size < 0) return false;
+    auto known = entries.find(file);
+    if (known != entries.end() and still_holds(known->second, *state)) {
+        stat_count(STAT_CONTENT_HASH_HITS);
+        entry = known->second;
+        return true;
+    }
+
+    // What's read must be the file in that state.
+    stat_count(STAT_FILES_HASHED);
+    auto fresh = fresh_entry(*state);
+    if (not hash_path(file, state, fresh.hash, cpus())) return false;
+    entry = entries[file] = fresh;
+    changed = true;
+    return true;
+}
+
+void ContentHashes::hash_all(
+    const std::vector<std::string>& paths,
+    const std::vector<Entry>* given_states
+) {
+    // Each file just once, however often it's listed (say, a header for
+    // every translation unit including it).
+    std::vector<size_t> unique{};
+    {
+        std::unordered_set<std::string_view> listed{};
+        for (size_t i = 0; i < paths.size(); ++i)
+            if (listed.insert(paths[i]).second) unique.push_back(i);
+    }
+
+    // Which files changed, looked at on all threads (entries is only read
+    // from), each stat'ed first unless its state was given.
+    struct Stale {
+        std::string path;
+        // As stat'ed (or given), and as it goes into entries.
+        Entry state;
+        Entry entry;
+        OpenFile file;
+        std::vector<ContentHash> chunks;
+        std::atomic<bool> read;
+    };
+    std::vector<Entry> states(unique.size());
+    std::vector<char> stale(unique.size(), false);
+    const auto threads = std::min(cpus(), unique.size() / 64 + 1);
+    in_parallel(unique.size(), threads, [&](size_t u) {
+        const auto& path = paths[unique[u]];
+        auto& state = states[u];
+        struct stat st {};
+        if (given_states) state = (*given_states)[unique[u]];
+        else if (stat(path.data(), &st) == 0) state = state_of(st);
+        if (state.size < 0) return;
+        auto known = entries.find(path);
+        stale[u] =
+            known == entries.end() or not still_holds(known->second, state);
+    });
+
+    std::vector<Stale> files(std::count(stale.begin(), stale.end(), true));
+    // Every chunk of every stale file, by file and chunk index.
+    std::vector<std::pair<size_t, size_t>> chunks{};
+    for (size_t u = 0, f = 0; u < unique.size(); ++u) {
+        if (not stale[u]) {
+            if (states[u].size >= 0) stat_count(STAT_CONTENT_HASH_HITS);
+            continue;
+        }
+        auto& file = files[f];
+        file.path = paths[unique[u]];
+        file.state = states[u];
+        file.entry = fresh_entry(states[u]);
+        file.chunks.resize(chunk_count(size_t(file.entry.size)));
+        file.read = true;
+        for (size_t c = 0; c < file.chunks.size(); ++c)
+            chunks.emplace_back(f, c);
+        ++f;
+    }
+
+    // Files of many chunks are opened (mapped) once, up front, and their
+    // chunks handed out from there; the rest are opened when hashed.
+    in_parallel(files.size(), threads, [&](size_t f) {
+        auto& file = files[f];
+        if (file.chunks.size() > 1
+            and not open_file(file.path, &file.state, file.file))
+            file.read = false;
+    });
+    in_parallel(chunks.size(), cpus(), [&](size_t i) {
+        auto& file = files[chunks[i].first];
+        if (not file.read) return;
+        if (file.chunks.size() > 1) {
+            if (not hash_chunk(
+                    file.file, chunks[i].second, file.chunks[chunks[i].second]
+                ))
+                file.read = false;
+            return;
+        }
+        // It mustn't have changed since.
+        OpenFile single{};
+        if (not open_file(file.path, &file.state, single)
+            or not hash_chunk(single, 0, file.chunks.front()))
+            file.read = false;
+        close_file(single);
+    });
+
+    stat_count(STAT_FILES_HASHED, files.size());
+    for (auto& file : files) {
+        close_file(file.file);
+        if (not file.read) continue;
+        file.entry.hash = combine(file.chunks, size_t(file.entry.size));
+        entries[file.path] = file.entry;
+        changed = true;
+    }
+}
+
+void ContentHashes::save() {
+    if (not changed or path.empty()) return;
+    // Written aside and renamed, so that nothing ever sees half of it.
+    const auto partial = path + ".partial";
+    auto f = fopen(partial.data(), "wb");
+    if (not f) return;
+    fputs(content_hashes_header, f);
+    for (const auto& [file, entry] : entries) {
+        // Such a path couldn't be read back.
+        if (file.find('\n') != std::string::npos) continue;
+        fprintf(
+            f,
+            "%" PRIu64 "\t%" PRIu64 "\t%" PRId64 "\t%" PRId64 "\t%" PRIx64
+            "\t%" PRIx64 "\t%s\n",
+            entry.device, entry.inode, entry.size, entry.modified,
+            entry.hash.high, entry.hash.low, file.data()
+        );
+    }
+    const bool written = not ferror(f);
+    if (fclose(f) != 0 or not written
+        or rename(partial.data(), path.data()) != 0) {
+        std::remove(partial.data());
+        return;
+    }
+    changed = false;
+}
@@ -0,0 +1,192 @@
+#include <copy/copy.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#    include <linux/fs.h>
+#    include <sys/ioctl.h>
+#endif
+
+namespace {
+
+auto modification_time(const struct stat& st) -> struct timespec {
+#ifdef __linux__
+    return st.st_mtim;
+#else
+    return {st.st_mtime, 0};
+#endif
+}
+
+bool same_time(const struct timespec& a, const struct timespec& b) {
+    return a.tv_sec == b.tv_sec and a.tv_nsec == b.tv_nsec;
+}
+
+bool set_modification_time(int fd, const struct timespec& modified) {
+    struct timespec times[2] {};
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1] = modified;
+    return futimens(fd, times) == 0;
+}
+
+// Whether the files open at a and b (of the same size) have the same
+// contents; false if either can't be read.
+bool same_contents(int a, int b) {
+    char buffer_a[65536];
+    char buffer_b[65536];
+    while (true) {
+        const auto n = read(a, buffer_a, sizeof(buffer_a));
+        if (n < 0 and errno == EINTR) continue;
+        if (n < 0) return false;
+        // Short reads of regular files only happen at the end.
+        ssize_t m{0};
+        while (m < n) {
+            const auto r = read(b, buffer_b + m, size_t(n - m));
+            if (r < 0 and errno == EINTR) continue;
+            if (r <= 0) return false;
+            m += r;
+        }
+        if (n == 0) {
+            char c{};
+            return read(b, &c, 1) == 0;
+        }
+        if (memcmp(buffer_a, buffer_b, size_t(n)) != 0) return false;
+    }
+}
+
+// Copy the contents of the file open at from into the (empty) one open at
+// to, of size bytes.
+bool copy_contents(int from, int to, off_t size) {
+#ifdef __linux__
+    if (ioctl(to, FICLONE, from) == 0) return true;
+    off_t copied{0};
+    while (copied < size) {
+        const auto n = copy_file_range(
+            from, nullptr, to, nullptr, size_t(size - copied), 0
+        );
+        if (n < 0 and errno == EINTR) continue;
+        // Not supported between these files (or at all); copy what's left
+        // by hand.
+        if (n < 0 and copied == 0
+            and (errno == EXDEV or errno == ENOSYS or errno == EINVAL
+                 or errno == EOPNOTSUPP))
+            break;
+        if (n < 0) return false;
+        // The source got shorter.
+        if (n == 0) return true;
+        copied += n;
+    }
+    if (copied >= size) return true;
+#else
+    (void)size;
+#endif
+    char buffer[65536];
+    while (true) {
+        const auto n = read(from, buffer, sizeof(buffer));
+        if (n < 0 and errno == EINTR) continue;
+        if (n < 0) return false;
+        if (n == 0) return true;
+        ssize_t written{0};
+        while (written < n) {
+            const auto w = write(to, buffer + written, size_t(n - written));
+            if (w < 0 and errno == EINTR) continue;
+            if (w < 0) return false;
+            written += w;
+        }
+    }
+}
+
+}  // namespace
+
+auto copy_file(
+    const std::string& source,
+    const std::string& destination,
+    bool hard_link,
+    std::string& error
+) -> CopyResult {
+    const auto fail = [&](const std::string& what) {
+        error = what + ": " + strerror(errno);
+        return CopyResult::FAILED;
+    };
+
+    struct stat source_stat {};
+    if (stat(source.data(), &source_stat) != 0)
+        return fail("cannot read " + source);
+    if (not S_ISREG(source_stat.st_mode)) {
+        errno = EINVAL;
+        return fail("cannot copy " + source + ", which isn't a regular file");
+    }
+
+    struct stat destination_stat {};
+    const bool exists = stat(destination.data(), &destination_stat) == 0;
+    if (exists and source_stat.st_dev == destination_stat.st_dev
+        and source_stat.st_ino == destination_stat.st_ino)
+        return CopyResult::UNCHANGED;
+    if (exists and not hard_link and S_ISREG(destination_stat.st_mode)
+        and source_stat.st_size == destination_stat.st_size) {
+        if (same_time(
+                modification_time(source_stat),
+                modification_time(destination_stat)
+            ))
+            return CopyResult::UNCHANGED;
+        const int from = open(source.data(), O_RDONLY | O_CLOEXEC);
+        const int to = open(destination.data(), O_RDONLY | O_CLOEXEC);
+        const bool same =
+            from >= 0 and to >= 0 and same_contents(from, to)
+            and set_modification_time(to, modification_time(source_stat));
+        if (from >= 0) close(from);
+        if (to >= 0) close(to);
+        if (same) return CopyResult::UNCHANGED;
+    }
+
+    std::error_code ignored{};
+    const auto directory = std::filesystem::path(destination).parent_path();
+    if (not directory.empty())
+        std::filesystem::create_directories(directory, ignored);
+
+    // Made aside and renamed, so that the destination is never seen
+    // half-written.
+    const auto partial = destination + ".partial";
+    std::remove(partial.data());
+    if (hard_link) {
+        if (link(source.data(), partial.data()) == 0) {
+            if (rename(partial.data(), destination.data()) == 0)
+                return CopyResult::COPIED;
+            const auto result = fail("cannot write " + destination);
+            std::remove(partial.data());
+            return result;
+        }
+        if (errno != EXDEV and errno != EPERM and errno != EMLINK)
+            return fail("cannot link " + destination);
+    }
+
+    const int from = open(source.data(), O_RDONLY | O_CLOEXEC);
+    if (from < 0) return fail("cannot read " + source);
+    const int to = open(
+        partial.data(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+        source_stat.st_mode & 07777
+    );
+    if (to < 0) {
+        const auto result = fail("cannot write " + destination);
+        close(from);
+        return result;
+    }
+    bool copied = copy_contents(from, to, source_stat.st_size)
+              and set_modification_time(to, modification_time(source_stat));
+    const auto copy_errno = errno;
+    close(from);
+    copied = close(to) == 0 and copied;
+    if (copied and rename(partial.data(), destination.data()) == 0)
+        return CopyResult::COPIED;
+    if (not copied) errno = copy_errno;
+    const auto result = fail("cannot write " + destination);
+    std::remove(partial.data());
+    return result;
+}
@@ -0,0 +1,291 @@
+#include <daemon/daemon.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifdef __linux__
+#    include <signal.h>
+#    include <sys/epoll.h>
+#    include <sys/socket.h>
+#    include <sys/time.h>
+#    include <sys/un.h>
+#    include <unistd.h>
+#endif
+
+// A request is a header, carrying the client's stdout and stderr as
+// SCM_RIGHTS, followed by the arguments, then the client's environment (each
+// argument and variable terminated by a NUL byte). The header is the size of
+// the arguments, then that of the environment, in bytes. The daemon answers
+// with the exit status of the request once it is done.
+
+#ifdef __linux__
+
+extern char** environ;
+
+// A client sends its whole request right away and reads the answer as soon as
+// it is done, so one that takes longer than this, either way, has stalled
+// (e.g. it was stopped); it is dropped rather than holding up everyone else.
+static constexpr time_t client_timeout_seconds{2};
+// No command line and environment come anywhere near this.
+static constexpr size_t payload_limit{64 << 20};
+
+static bool write_all(int fd, const void* data, size_t size) {
+    auto bytes = static_cast<const char*>(data);
+    while (size) {
+        auto n = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (n < 0 and errno == EINTR) continue;
+        if (n <= 0) return false;
+        bytes += n;
+        size -= size_t(n);
+    }
+    return true;
+}
+
+static bool read_all(int fd, void* data, size_t size) {
+    auto bytes = static_cast<char*>(data);
+    while (size) {
+        auto n = read(fd, bytes, size);
+        if (n < 0 and errno == EINTR) continue;
+        if (n <= 0) return false;
+        bytes += n;
+        size -= size_t(n);
+    }
+    return true;
+}
+
+static auto daemon_address() -> sockaddr_un {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    strncpy(
+        address.sun_path, LBS_DAEMON_SOCKET, sizeof(address.sun_path) - 1
+    );
+    return address;
+}
+
+// Returns a socket connected to the daemon, or -1.
+static int daemon_connect() {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    const auto address = daemon_address();
+    if (connect(fd, (const sockaddr*)&address, sizeof(address)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool daemon_request(const std::vector<std::string>& arguments, int& status) {
+    int fd = daemon_connect();
+    if (fd < 0) return false;
+
+    std::string payload{};
+    for (const auto& argument : arguments) {
+        payload += argument;
+        payload += '\0';
+    }
+    const auto arguments_size = payload.size();
+    for (char** variable = environ; *variable; ++variable) {
+        payload += *variable;
+        payload += '\0';
+    }
+    uint32_t header[2]{
+        uint32_t(arguments_size), uint32_t(payload.size() - arguments_size)};
+
+    // Send the header along with our stdout and stderr.
+    iovec iov{header, sizeof(header)};
+    alignas(cmsghdr) char control[CMSG_SPACE(2 * sizeof(int))]{};
+    msghdr message{};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    cmsghdr* control_message = CMSG_FIRSTHDR(&message);
+    control_message->cmsg_level = SOL_SOCKET;
+    control_message->cmsg_type = SCM_RIGHTS;
+    control_message->cmsg_len = CMSG_LEN(2 * sizeof(int));
+    const int fds[2]{STDOUT_FILENO, STDERR_FILENO};
+    memcpy(CMSG_DATA(control_message), fds, sizeof(fds));
+
+    fflush(stdout);
+    if (sendmsg(fd, &message, MSG_NOSIGNAL) != ssize_t(sizeof(header))
+        or not write_all(fd, payload.data(), payload.size())) {
+        close(fd);
+        return false;
+    }
+
+    int32_t response{1};
+    if (not read_all(fd, &response, sizeof(response))) {
+        printf("ERROR: lbs daemon went away before finishing the request\n");
+        response = 1;
+    }
+    close(fd);
+    status = response;
+    return true;
+}
+
+// Split NUL terminated strings.
+static auto split(std::string_view payload) -> std::vector<std::string> {
+    std::vector<std::string> out{};
+    size_t begin{0};
+    for (size_t end = 0; end < payload.size(); ++end) {
+        if (payload[end]) continue;
+        out.emplace_back(payload.substr(begin, end - begin));
+        begin = end + 1;
+    }
+    return out;
+}
+
+// Make environment that of this process, until replaced again. The strings
+// it holds become part of the environment, so they must outlive that.
+static void set_environment(std::vector<std::string>& environment) {
+    clearenv();
+    for (auto& variable : environment) putenv(variable.data());
+}
+
+// Handle the request of a newly connected client.
+static void handle(int client, const DaemonHandlers& handlers, bool& stop) {
+    const timeval timeout{client_timeout_seconds, 0};
+    if (setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout))
+        or setsockopt(
+            client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)
+        ))
+        return;
+
+    uint32_t header[2]{};
+    iovec iov{header, sizeof(header)};
+    alignas(cmsghdr) char control[CMSG_SPACE(2 * sizeof(int))]{};
+    msghdr message{};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    if (recvmsg(client, &message, MSG_CMSG_CLOEXEC) != ssize_t(sizeof(header)))
+        return;
+
+    int fds[2]{-1, -1};
+    cmsghdr* control_message = CMSG_FIRSTHDR(&message);
+    if (not control_message or control_message->cmsg_type != SCM_RIGHTS
+        or control_message->cmsg_len != CMSG_LEN(sizeof(fds)))
+        return;
+    memcpy(fds, CMSG_DATA(control_message), sizeof(fds));
+
+    const size_t size = size_t(header[0]) + header[1];
+    std::string payload(std::min(size, payload_limit), '\0');
+    if (size <= payload_limit
+        and read_all(client, payload.data(), payload.size())) {
+        const std::string_view all{payload};
+        const auto arguments = split(all.substr(0, header[0]));
+        auto environment = split(all.substr(header[0]));
+
+        // Everything printed while handling the request goes to the client,
+        // and every command it runs gets the client's environment.
+        fflush(stdout);
+        fflush(stderr);
+        const int our_stdout = dup(STDOUT_FILENO);
+        const int our_stderr = dup(STDERR_FILENO);
+        dup2(fds[0], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        // Ours is put back afterwards, as it was before the first request.
+        static std::vector<std::string> our_environment = [] {
+            std::vector<std::string> variables{};
+            for (char** variable = environ; *variable; ++variable)
+                variables.emplace_back(*variable);
+            return variables;
+        }();
+        set_environment(environment);
+
+        int32_t status = handlers.request(arguments, environment, stop);
+
+        set_environment(our_environment);
+        fflush(stdout);
+        fflush(stderr);
+        dup2(our_stdout, STDOUT_FILENO);
+        dup2(our_stderr, STDERR_FILENO);
+        close(our_stdout);
+        close(our_stderr);
+
+        write_all(client, &status, sizeof(status));
+    }
+    close(fds[0]);
+    close(fds[1]);
+}
+
+int daemon_serve(const DaemonHandlers& handlers) {
+    // Don't die when writing to a client that went away.
+    signal(SIGPIPE, SIG_IGN);
+
+    // A socket nobody listens on is left over from a daemon that didn't shut
+    // down cleanly.
+    if (int other = daemon_connect(); other >= 0) {
+        close(other);
+        printf(
+            "ERROR: An lbs daemon is already running in this directory\n"
+        );
+        return 1;
+    }
+    unlink(LBS_DAEMON_SOCKET);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    const auto address = daemon_address();
+    if (listen_fd < 0
+        or bind(listen_fd, (const sockaddr*)&address, sizeof(address)) != 0
+        or listen(listen_fd, 16) != 0) {
+        perror("ERROR: Cannot listen on " LBS_DAEMON_SOCKET);
+        if (listen_fd >= 0) close(listen_fd);
+        return 1;
+    }
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = listen_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+    if (handlers.event_fd >= 0) {
+        event.data.fd = handlers.event_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, handlers.event_fd, &event);
+    }
+
+    bool stop{false};
+    while (not stop) {
+        epoll_event events[2];
+        int count = epoll_wait(epoll_fd, events, 2, -1);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            perror("ERROR: epoll_wait");
+            break;
+        }
+        for (int e = 0; e < count; ++e) {
+            if (events[e].data.fd == handlers.event_fd) {
+                handlers.event();
+                continue;
+            }
+            int client = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client < 0) continue;
+            handle(client, handlers, stop);
+            close(client);
+        }
+    }
+
+    close(epoll_fd);
+    close(listen_fd);
+    unlink(LBS_DAEMON_SOCKET);
+    return 0;
+}
+
+#else  // #ifdef __linux__
+
+bool daemon_request(const std::vector<std::string>&, int&) { return false; }
+
+int daemon_serve(const DaemonHandlers&) {
+    printf("ERROR: The lbs daemon is not supported on this platform\n");
+    return 1;
+}
+
+#endif  // #ifdef __linux__
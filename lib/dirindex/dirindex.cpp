@@ -0,0 +1,315 @@
+#include <dirindex/dirindex.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#    include <sys/syscall.h>
+#endif
+
+// Every directory takes a line
+//   <device>\t<inode>\t<modified>\t<path>
+// followed by a line for each of its entries
+//   \t<d for a directory, f for anything else><name>
+// The path goes last, as it's the only field that could contain a tab.
+static constexpr const char* directory_index_header =
+    "# lbs directory index v1\n";
+
+// Sources, when a source directory doesn't say which files are.
+static const std::vector<std::string> source_patterns{
+    "*.c", "*.cc", "*.cpp", "*.cxx", "*.c++", "*.C", "*.cppm", "*.ixx", "*.s",
+    "*.S"};
+
+static auto modification_time(const struct stat& st) -> int64_t {
+#ifdef __linux__
+    return int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#else
+    return int64_t(st.st_mtime) * 1000000000;
+#endif
+}
+
+// The entries of the directory at path, but . and .. and hidden ones.
+// Symbolic links count as what they point to, except that a link to a
+// directory is left out (as following it may well lead in circles).
+static bool read_directory(
+    const std::string& path,
+    std::vector<DirectoryIndex::Entry>& entries
+) {
+    entries.clear();
+    const auto add = [&](int fd, const char* name, bool known, bool directory) {
+        if (name[0] == '.') return;
+        if (not known) {
+            struct stat st {};
+            if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) return;
+            if (S_ISLNK(st.st_mode)) {
+                if (fstatat(fd, name, &st, 0) != 0 or S_ISDIR(st.st_mode))
+                    return;
+            }
+            directory = S_ISDIR(st.st_mode);
+        }
+        entries.push_back({name, directory});
+    };
+
+#ifdef __linux__
+    // getdents64 hands us entries by the buffer full, each
+    //   d_ino (8 bytes), d_off (8), d_reclen (2), d_type (1), d_name
+    // with no need for an allocation per directory, as opendir() has.
+    const int fd = open(path.data(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return false;
+    alignas(8) char buffer[32768];
+    while (true) {
+        const auto n = syscall(SYS_getdents64, fd, buffer, sizeof(buffer));
+        if (n < 0) {
+            close(fd);
+            return false;
+        }
+        if (n == 0) break;
+        for (long offset = 0; offset < n;) {
+            unsigned short length{0};
+            memcpy(&length, buffer + offset + 16, sizeof(length));
+            const auto type = (unsigned char)buffer[offset + 18];
+            const char* name = buffer + offset + 19;
+            offset += length;
+            if (type == DT_DIR) add(fd, name, true, true);
+            else if (type == DT_REG) add(fd, name, true, false);
+            else add(fd, name, false, false);
+        }
+    }
+    close(fd);
+#else
+    auto directory = opendir(path.data());
+    if (not directory) return false;
+    while (auto entry = readdir(directory))
+        add(dirfd(directory), entry->d_name, false, false);
+    closedir(directory);
+#endif
+    std::sort(
+        entries.begin(), entries.end(),
+        [](const auto& a, const auto& b) { return a.name < b.name; }
+    );
+    return true;
+}
+
+// Bring what we know about the directory at path up to date. Returns false
+// if it isn't a directory (anymore); sets changed if it read it again.
+static bool refresh(
+    const std::string& path,
+    DirectoryIndex::Directory& directory,
+    std::atomic<bool>& changed
+) {
+    struct stat st {};
+    if (stat(path.data(), &st) != 0 or not S_ISDIR(st.st_mode)) return false;
+    const auto modified = modification_time(st);
+    if (directory.modified and directory.modified == modified
+        and directory.device == uint64_t(st.st_dev)
+        and directory.inode == uint64_t(st.st_ino))
+        return true;
+
+    if (not read_directory(path, directory.entries)) return false;
+    directory.device = uint64_t(st.st_dev);
+    directory.inode = uint64_t(st.st_ino);
+    // An entry added right after we read the directory may leave its
+    // modification time as it is (file system clocks tick slowly), so a
+    // directory that changed just now is read again next time.
+    const auto now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         std::chrono::system_clock::now().time_since_epoch()
+    )
+                         .count();
+    directory.modified = now - modified > 2000000000 ? modified : 0;
+    changed = true;
+    return true;
+}
+
+auto DirectoryIndex::Load(std::string path) -> DirectoryIndex {
+    DirectoryIndex index{};
+    index.path = std::move(path);
+
+    auto f = fopen(index.path.data(), "rb");
+    if (not f) return index;
+    char* line{nullptr};
+    size_t capacity{0};
+    ssize_t length{0};
+    size_t lines{0};
+    Directory* directory{nullptr};
+    while ((length = getline(&line, &capacity, f)) > 0) {
+        if (line[length - 1] == '\n') line[--length] = '\0';
+        if (not lines++) {
+            if (strncmp(
+                    line, directory_index_header,
+                    strlen(directory_index_header) - 1
+                )
+                != 0)
+                break;
+            continue;
+        }
+
+        if (line[0] == '\t') {
+            if (directory and length >= 3)
+                directory->entries.push_back({line + 2, line[1] == 'd'});
+            continue;
+        }
+        Directory entry{};
+        int offset{0};
+        if (sscanf(
+                line, "%" SCNu64 "\t%" SCNu64 "\t%" SCNd64 "\t%n",
+                &entry.device, &entry.inode, &entry.modified, &offset
+            )
+                != 3
+            or not offset) {
+            directory = nullptr;
+            continue;
+        }
+        directory = &(index.directories[line + offset] = std::move(entry));
+    }
+    free(line);
+    fclose(f);
+    return index;
+}
+
+auto DirectoryIndex::files(
+    const std::string& directory,
+    const std::vector<std::string>& patterns,
+    bool recursive
+) -> std::vector<std::string> {
+    std::string root{directory};
+    while (root.size() > 1 and root.back() == '/') root.pop_back();
+    if (root.empty()) root = ".";
+
+    std::vector<std::string> out{};
+    std::atomic<bool> read_again{false};
+    // A level of the tree at a time, each directory of it on any thread.
+    std::vector<std::string> level{root};
+    while (level.size()) {
+        // Entries are made here first, so that every thread only ever
+        // touches its own (and references to them stay valid).
+        std::vector<Directory*> entries{};
+        for (const auto& path : level) entries.push_back(&directories[path]);
+        std::vector<char> present(level.size(), false);
+        std::atomic<size_t> next{0};
+        const auto work = [&] {
+            for (size_t i = next++; i < level.size(); i = next++)
+                present[i] = refresh(level[i], *entries[i], read_again);
+        };
+        // Threads only pay off for a good number of directories.
+        const size_t threads = std::min<size_t>(
+            std::max(1u, std::thread::hardware_concurrency()),
+            level.size() / 16 + 1
+        );
+        std::vector<std::thread> helpers{};
+        for (size_t t = 1; t < threads; ++t) helpers.emplace_back(work);
+        work();
+        for (auto& helper : helpers) helper.join();
+
+        if (not present.front() and level.front() == root) {
+            printf(
+                "ERROR: Source directory %s does not exist\n", root.data()
+            );
+            exit(1);
+        }
+
+        std::vector<std::string> next_level{};
+        for (size_t i = 0; i < level.size(); ++i) {
+            listed.push_back(level[i]);
+            if (not present[i]) {
+                directories.erase(level[i]);
+                continue;
+            }
+            const auto prefix = level[i] == "." ? "" : level[i] + "/";
+            for (const auto& entry : entries[i]->entries) {
+                if (entry.directory) {
+                    if (recursive) next_level.push_back(prefix + entry.name);
+                    continue;
+                }
+                const auto& wanted = patterns.empty() ? source_patterns
+                                                      : patterns;
+                if (std::any_of(
+                        wanted.begin(), wanted.end(),
+                        [&](const std::string& pattern) {
+                            return fnmatch(
+                                       pattern.data(), entry.name.data(), 0
+                                   )
+                                == 0;
+                        }
+                    ))
+                    out.push_back(prefix + entry.name);
+            }
+        }
+        level = std::move(next_level);
+    }
+    if (read_again) changed = true;
+
+    std::sort(out.begin(), out.end());
+    return out;
+}
+
+void DirectoryIndex::expand_sources(BuildScenario& build_scenario) {
+    listed.clear();
+    for (auto& target : build_scenario.targets) {
+        for (const auto& source_directory : target.source_directories) {
+            const auto found = files(
+                source_directory.directory, source_directory.patterns,
+                source_directory.recursive
+            );
+            for (const auto& source : found) {
+                if (std::find(
+                        target.sources.begin(), target.sources.end(), source
+                    )
+                    == target.sources.end())
+                    target.sources.push_back(source);
+            }
+        }
+    }
+    std::sort(listed.begin(), listed.end());
+    listed.erase(std::unique(listed.begin(), listed.end()), listed.end());
+}
+
+void DirectoryIndex::save() {
+    if (not changed or path.empty()) return;
+    // Written aside and renamed, so that a build interrupted while saving
+    // doesn't leave half an index behind.
+    const auto partial = path + ".partial";
+    auto f = fopen(partial.data(), "wb");
+    if (not f) return;
+    fputs(directory_index_header, f);
+    for (const auto& [directory_path, directory] : directories) {
+        // Such names couldn't be read back.
+        const auto has_newline = [](const std::string& text) {
+            return text.find('\n') != std::string::npos;
+        };
+        if (has_newline(directory_path)
+            or std::any_of(
+                directory.entries.begin(), directory.entries.end(),
+                [&](const Entry& entry) { return has_newline(entry.name); }
+            ))
+            continue;
+        fprintf(
+            f, "%" PRIu64 "\t%" PRIu64 "\t%" PRId64 "\t%s\n", directory.device,
+            directory.inode, directory.modified, directory_path.data()
+        );
+        for (const auto& entry : directory.entries)
+            fprintf(
+                f, "\t%c%s\n", entry.directory ? 'd' : 'f', entry.name.data()
+            );
+    }
+    const bool written = not ferror(f);
+    if (fclose(f) != 0 or not written
+        or rename(partial.data(), path.data()) != 0) {
+        std::remove(partial.data());
+        return;
+    }
+    changed = false;
+}
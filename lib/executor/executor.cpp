@@ -0,0 +1,1227 @@
+#include <executor/executor.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include <actionlog/actionlog.h>
+#include <copy/copy.h>
+#include <lbs/build_scenario.h>
+#include <stats/stats.h>
+#include <worker/worker.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#    include <signal.h>
+#    include <spawn.h>
+#    include <sys/epoll.h>
+#    include <sys/ioctl.h>
+#    include <sys/socket.h>
+#    include <sys/wait.h>
+#    include <unistd.h>
+
+extern char** environ;
+#endif
+
+namespace {
+
+// Shows how far along the build is. On a terminal the status is redrawn in
+// place; otherwise every status gets a line of its own.
+struct StatusLine {
+    bool smart_terminal{false};
+    bool verbose{false};
+    // Whether something is currently drawn on the status line.
+    bool drawn{false};
+
+    void print(
+        size_t done,
+        size_t total,
+        size_t running,
+        std::string_view description
+    ) {
+        char prefix[64];
+        snprintf(
+            prefix, sizeof(prefix), "[%zu/%zu, %zu running] ", done, total,
+            running
+        );
+        std::string line{prefix};
+        line += description;
+
+        if (not smart_terminal or verbose) {
+            clear();
+            printf("%s\n", line.data());
+            fflush(stdout);
+            return;
+        }
+
+        // Keep the status to one row, otherwise \r can't take us back to the
+        // start of it.
+        size_t width{80};
+#ifdef __linux__
+        struct winsize size {};
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 and size.ws_col)
+            width = size.ws_col;
+#endif
+        if (line.size() >= width) {
+            line.resize(width > 4 ? width - 4 : 0);
+            line += "...";
+        }
+        printf("\r%s\x1b[K", line.data());
+        fflush(stdout);
+        drawn = true;
+    }
+
+    // Clear the status line so that something else may be printed.
+    void clear() {
+        if (not drawn) return;
+        printf("\r\x1b[K");
+        drawn = false;
+    }
+
+    // Leave whatever is on the status line there for good.
+    void finish() {
+        if (not drawn) return;
+        printf("\n");
+        fflush(stdout);
+        drawn = false;
+    }
+};
+
+// In nanoseconds since the epoch; 0 if the file doesn't exist. Looked up in
+// file_states, if given.
+auto modification_time(
+    const std::string& path,
+    FileStates* file_states = nullptr
+) -> int64_t {
+    if (file_states) return file_states->state(path).modified;
+    struct stat st {};
+    if (stat(path.data(), &st) != 0) return 0;
+#ifdef __linux__
+    return int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#else
+    return int64_t(st.st_mtime) * 1000000000;
+#endif
+}
+
+auto now() -> int64_t {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::system_clock::now().time_since_epoch()
+    )
+        .count();
+}
+
+// The modification times of the given outputs, as they are now.
+auto modification_times(
+    const std::vector<std::string>& outputs,
+    FileStates* file_states = nullptr
+) -> std::vector<int64_t> {
+    std::vector<int64_t> out{};
+    for (const auto& output : outputs)
+        out.push_back(modification_time(output, file_states));
+    return out;
+}
+
+// Make the directories outputs go in, as the compiler won't (say, those of a
+// profile; see BuildScenario::apply_profile()). Those in made are known to
+// exist already.
+void make_output_directories(
+    const std::vector<std::string>& outputs,
+    std::unordered_set<std::string>& made
+) {
+    for (const auto& output : outputs) {
+        auto directory = std::filesystem::path(output).parent_path().string();
+        if (directory.empty() or not made.insert(directory).second) continue;
+        std::error_code ignored{};
+        std::filesystem::create_directories(directory, ignored);
+    }
+}
+
+void set_modification_time(const std::string& path, int64_t modified) {
+    struct timespec times[2] {};
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = time_t(modified / 1000000000);
+    times[1].tv_nsec = long(modified % 1000000000);
+    utimensat(AT_FDCWD, path.data(), times, 0);
+}
+
+// Remember how the action went. Returns whether it (possibly) changed its
+// outputs: one that wrote them over with the same contents as after it last
+// ran gets their modification times put back to what they were before it
+// started (modified), so that whatever reads them stays up to date, and
+// whatever only waits on them needn't run now either. A copy action changed
+// its outputs iff it copied any file (see run_copies()).
+auto record(
+    const ExecutorOptions& options,
+    const BuildScenario::BuildCommands::Action& action,
+    std::chrono::steady_clock::time_point started,
+    bool failed,
+    const std::vector<int64_t>& modified = {},
+    bool copied = true
+) -> bool {
+    // Whatever the action wrote is stat'ed again when next looked at.
+    if (options.file_states) {
+        for (const auto& output : action.outputs)
+            options.file_states->forget(output);
+        if (action.dependency_file.size())
+            options.file_states->forget(action.dependency_file);
+    }
+    auto* log = options.log;
+    if (not log) return true;
+    const auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - started
+    );
+    // Copies keep the modification times of their sources, so they count as
+    // written when they were made, and changed anything only if they did.
+    if (action.copy_sources.size()) {
+        ActionLog::Entry entry{
+            hash_command(action.command), now(), duration.count(), failed};
+        if (not failed)
+            entry.modified = entry.finished - duration.count() * 1000000;
+        log->record(action.key(), entry);
+        return copied;
+    }
+    // Each object of a batch is remembered as if compiled on its own, so
+    // that whether it's outdated doesn't depend on whether it was batched.
+    auto members = action.batch_members;
+    if (members.empty()) members.emplace_back(action.key(), action.command);
+
+    bool changed{false};
+    for (const auto& [key, command] : members) {
+        ActionLog::Entry entry{
+            hash_command(command), now(), duration.count(), failed};
+        // Indices of the member's outputs.
+        std::vector<size_t> outputs{};
+        for (size_t o = 0; o < action.outputs.size(); ++o)
+            if (action.batch_members.empty() or action.outputs[o] == key)
+                outputs.push_back(o);
+        std::vector<std::string> paths{};
+        for (auto o : outputs) paths.push_back(action.outputs[o]);
+
+        // A batch's inputs are those of all of its members.
+        if (not failed and action.batch_members.empty()
+            and options.input_hash)
+            entry.input_hash = options.input_hash(
+                action, entry.finished - (duration.count() + 1) * 1000000
+            );
+
+        bool same{false};
+        if (not failed and paths.size()) {
+            entry.output_hash = hash_files(paths);
+            const auto* previous = log->find(key);
+            same = entry.output_hash and previous and not previous->failed
+               and previous->output_hash == entry.output_hash;
+            for (auto o : outputs)
+                if (o >= modified.size() or not modified[o]) same = false;
+        }
+        if (same) {
+            entry.modified = INT64_MAX;
+            for (auto o : outputs) {
+                entry.modified = std::min(
+                    entry.modified, modification_time(action.outputs[o])
+                );
+                set_modification_time(action.outputs[o], modified[o]);
+            }
+        }
+        changed = changed or not same;
+        log->record(key, entry);
+    }
+    return changed;
+}
+
+// How many threads the copies of a copy action take, given up to threads.
+auto copy_threads(
+    const BuildScenario::BuildCommands::Action& action,
+    size_t threads
+) -> size_t {
+    // Too few files aren't worth starting threads for.
+    return std::max<size_t>(
+        1, std::min(threads, action.copy_sources.size() / 16)
+    );
+}
+
+// Do the copies of a copy action, on up to threads threads (as a directory
+// may hold thousands of files), appending what went wrong to output and
+// giving up early once stop is set. Returns an exit status like a command's,
+// and sets copied to whether any file was written.
+auto run_copies(
+    const BuildScenario::BuildCommands::Action& action,
+    std::string& output,
+    bool& copied,
+    size_t threads,
+    const std::atomic<bool>* stop = nullptr
+) -> int {
+    const size_t total = action.copy_sources.size();
+    threads = copy_threads(action, threads);
+
+    std::atomic<size_t> next{0};
+    std::atomic<bool> failed{false};
+    std::atomic<bool> any_copied{false};
+    std::mutex output_mutex{};
+    const auto work = [&] {
+        for (size_t i = next++; i < total; i = next++) {
+            if (stop and *stop) {
+                failed = true;
+                return;
+            }
+            std::string error{};
+            switch (copy_file(
+                action.copy_sources[i], action.outputs[i], action.hard_link,
+                error
+            )) {
+            case CopyResult::FAILED: {
+                failed = true;
+                std::lock_guard<std::mutex> lock{output_mutex};
+                output += error + "\n";
+            } break;
+            case CopyResult::UNCHANGED: break;
+            case CopyResult::COPIED: any_copied = true; break;
+            }
+        }
+    };
+    std::vector<std::thread> helpers{};
+    for (size_t t = 1; t < threads; ++t) helpers.emplace_back(work);
+    work();
+    for (auto& helper : helpers) helper.join();
+
+    copied = any_copied;
+    return failed ? 1 : 0;
+}
+
+// Higher priorities are started first.
+struct Priority {
+    // 2 if the action failed last time it ran, 1 if one of its inputs was
+    // edited since then (or it never ran), otherwise 0.
+    int tier{0};
+    // When the most recently edited of those inputs was edited.
+    int64_t edited{0};
+    // Whether this priority was handed down from a dependent action; an
+    // action's own priority beats an equal one that was handed down.
+    bool inherited{false};
+
+    bool operator<(const Priority& other) const {
+        if (tier != other.tier) return tier < other.tier;
+        if (edited != other.edited) return edited < other.edited;
+        return inherited and not other.inherited;
+    }
+};
+
+// Every action gets the highest priority of itself and anything that depends
+// on it, so that the way to a failed or edited action is cleared first, too.
+auto priorities(
+    const BuildScenario::BuildCommands& build_commands,
+    const std::vector<std::vector<size_t>>& graph,
+    const std::vector<std::vector<size_t>>& dependents,
+    const ActionLog* log,
+    FileStates* file_states
+) -> std::vector<Priority> {
+    const auto& actions = build_commands.actions;
+    std::vector<Priority> out(actions.size());
+    if (not log) return out;
+
+    for (size_t i = 0; i < actions.size(); ++i) {
+        const auto* entry = log->find(actions[i].key());
+        if (entry and entry->failed) out[i].tier = 2;
+        int64_t edited{0};
+        for (const auto& input : actions[i].inputs)
+            edited = std::max(edited, modification_time(input, file_states));
+        if (not entry or edited > entry->finished) {
+            out[i].tier = std::max(out[i].tier, 1);
+            out[i].edited = edited;
+        }
+    }
+
+    // Hand priorities down to dependencies, dependents first.
+    std::vector<size_t> unfinished_dependents(actions.size());
+    std::vector<size_t> order{};
+    for (size_t i = 0; i < actions.size(); ++i) {
+        unfinished_dependents[i] = dependents[i].size();
+        if (not unfinished_dependents[i]) order.push_back(i);
+    }
+    for (size_t o = 0; o < order.size(); ++o) {
+        const auto i = order[o];
+        auto handed_down = out[i];
+        handed_down.inherited = true;
+        for (auto dependency : graph[i]) {
+            out[dependency] = std::max(out[dependency], handed_down);
+            if (not --unfinished_dependents[dependency])
+                order.push_back(dependency);
+        }
+    }
+
+    return out;
+}
+
+}  // namespace
+
+#ifdef __linux__
+
+namespace {
+
+struct RunningAction {
+    size_t index{};
+    // -1 once the child has been waited for.
+    pid_t pid{-1};
+    std::chrono::steady_clock::time_point started{};
+    // Read ends of the pipes connected to the action's stdout and stderr;
+    // -1 once the child has closed its end.
+    int fds[2]{-1, -1};
+    // Both streams, in the order they arrived in.
+    std::string output{};
+    // Index of the worker compiling this action (the child only preprocesses
+    // it), or -1 if it runs here.
+    int worker{-1};
+    // Connection to the worker, once the translation unit was preprocessed.
+    // It's made, and the job's message sent, a bit at a time as the socket
+    // allows, so that a slow worker holds up nothing else; a connection that
+    // doesn't go through by the deadline is given up on.
+    int connection{-1};
+    bool connecting{false};
+    std::chrono::steady_clock::time_point connect_deadline{};
+    std::string message{};
+    size_t message_sent{0};
+    std::chrono::steady_clock::time_point sent{};
+    // What the worker sent, but its hello once it was checked.
+    std::string received{};
+    bool greeted{false};
+    // When the action's outputs were modified before it started.
+    std::vector<int64_t> modified{};
+    // For a copy action, the thread doing the copies (rather than a child),
+    // which writes whatever went wrong to the stdout pipe; once it's joined,
+    // how it went.
+    std::thread copier{};
+    int copy_status{0};
+    bool copied{true};
+    // The jobs it takes up here: those threads, or the one action.
+    size_t jobs{1};
+};
+
+struct Worker {
+    std::string address{};
+    // The socket address that answered (see worker_connect()).
+    std::string resolved{};
+    uint32_t capacity{};
+    size_t running{0};
+    // Moving average of how long the worker took to answer, in milliseconds;
+    // 0 until it first did.
+    double latency{0};
+    bool alive{true};
+};
+
+// Roughly how long until a new job would be done by something that runs up
+// to capacity jobs at once, of which running are already taken.
+auto expected_done(double latency, size_t running, size_t capacity) -> double {
+    return latency * double(running + 1) / double(capacity);
+}
+
+void observe_latency(
+    double& latency,
+    std::chrono::steady_clock::duration took
+) {
+    const double ms = std::chrono::duration<double, std::milli>(took).count();
+    latency = latency ? 0.8 * latency + 0.2 * ms : ms;
+}
+
+bool read_file(const std::string& path, std::string& contents) {
+    auto f = fopen(path.data(), "rb");
+    if (not f) return false;
+    char buffer[65536];
+    size_t n{0};
+    while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+        contents.append(buffer, n);
+    const bool ok = not ferror(f);
+    fclose(f);
+    return ok;
+}
+
+// Written next to path first, so that nothing ever sees half of it.
+bool write_file(const std::string& path, const std::string& contents) {
+    const auto partial = path + ".partial";
+    auto f = fopen(partial.data(), "wb");
+    if (not f) return false;
+    bool ok = fwrite(contents.data(), 1, contents.size(), f) == contents.size();
+    ok = fclose(f) == 0 and ok;
+    if (ok) ok = rename(partial.data(), path.data()) == 0;
+    if (not ok) std::remove(partial.data());
+    return ok;
+}
+
+// Returns the pid of the spawned `/bin/sh -c command`, or -1.
+auto spawn(const std::string& command, int stdout_fd, int stderr_fd)
+    -> pid_t {
+    posix_spawn_file_actions_t file_actions;
+    posix_spawn_file_actions_init(&file_actions);
+    // Actions run concurrently, so none of them get to read our stdin.
+    posix_spawn_file_actions_addopen(
+        &file_actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0
+    );
+    posix_spawn_file_actions_adddup2(&file_actions, stdout_fd, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&file_actions, stderr_fd, STDERR_FILENO);
+
+    const char* argv[] = {"/bin/sh", "-c", command.data(), nullptr};
+    pid_t pid{-1};
+    int rc = posix_spawn(
+        &pid, "/bin/sh", &file_actions, nullptr, const_cast<char**>(argv),
+        environ
+    );
+    posix_spawn_file_actions_destroy(&file_actions);
+    if (rc != 0) return -1;
+    stat_count(STAT_PROCESSES_SPAWNED);
+    return pid;
+}
+
+}  // namespace
+
+bool execute(
+    const BuildScenario::BuildCommands& build_commands,
+    const ExecutorOptions& options
+) {
+    const auto& actions = build_commands.actions;
+    const auto graph = build_commands.dependency_graph();
+    const size_t total = actions.size();
+    const size_t jobs =
+        std::min(std::max<size_t>(options.jobs, 1), executor_jobs_limit);
+
+    // How many dependencies of each action have yet to finish, and which
+    // actions are waiting on each action.
+    std::vector<size_t> unfinished_dependencies(total);
+    std::vector<std::vector<size_t>> dependents(total);
+    for (size_t i = 0; i < total; ++i) {
+        unfinished_dependencies[i] = graph[i].size();
+        for (auto dependency : graph[i]) dependents[dependency].push_back(i);
+    }
+
+    // Ready actions are started highest priority first, and otherwise in the
+    // order they were planned in.
+    const auto priority =
+        priorities(
+            build_commands, graph, dependents, options.log, options.file_states
+        );
+    const auto runs_later = [&](size_t a, size_t b) {
+        if (priority[a] < priority[b]) return true;
+        if (priority[b] < priority[a]) return false;
+        return a > b;
+    };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(runs_later)>
+        ready{runs_later};
+    for (size_t i = 0; i < total; ++i)
+        if (not unfinished_dependencies[i]) ready.push(i);
+
+    StatusLine status{};
+    status.smart_terminal = isatty(STDOUT_FILENO);
+    status.verbose = options.verbose;
+    std::unordered_set<std::string> made_directories{};
+
+    const int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("[BUILD]:ERROR: epoll_create1");
+        return false;
+    }
+
+    // Events for the cancel fd are told apart by this (impossible) slot.
+    constexpr uint64_t cancel_event = UINT64_MAX;
+    if (options.cancel_fd >= 0 and options.cancelled) {
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.u64 = cancel_event;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, options.cancel_fd, &event);
+    }
+
+    // Only bother with workers when there is something for them to do.
+    std::vector<Worker> workers{};
+    size_t worker_capacity{0};
+    const bool distributable = std::any_of(
+        actions.begin(), actions.end(),
+        [](const auto& action) { return action.remote_command.size(); }
+    );
+    for (const auto& address : options.workers) {
+        if (not distributable) break;
+        uint32_t capacity{0};
+        std::string resolved{};
+        int fd = worker_connect(address, capacity, &resolved);
+        if (fd < 0) {
+            printf(
+                "[BUILD]:WARNING: No lbs-worker at %s, going without it\n",
+                address.data()
+            );
+            continue;
+        }
+        close(fd);
+        if (not capacity) continue;
+        workers.push_back({address, resolved, capacity});
+        worker_capacity += capacity;
+    }
+
+    // Slots for running actions; epoll events refer to (slot, stream), or to
+    // slot for the connection to a worker.
+    std::vector<RunningAction> slots(jobs + worker_capacity);
+    std::vector<bool> slot_used(slots.size(), false);
+    // Jobs taken up here (see RunningAction::jobs), as opposed to on a
+    // worker, and how long the actions that could have been compiled by a
+    // worker took.
+    size_t local_running{0};
+    double local_latency{0};
+    size_t running{0};
+    size_t done{0};
+    size_t failures{0};
+    size_t skipped{0};
+    bool interrupted{false};
+    bool cancelled{false};
+
+    const auto stopped = [&] {
+        return interrupted or cancelled
+            or (options.failures_allowed
+                and failures >= options.failures_allowed);
+    };
+
+    // Whether each finished action (possibly) changed its outputs.
+    std::vector<bool> changed(total, true);
+
+    // Skip everything that (transitively) depends on a failed action.
+    std::vector<bool> was_skipped(total, false);
+    const auto fail = [&](size_t index) {
+        ++failures;
+        std::vector<size_t> stack{dependents[index]};
+        while (stack.size()) {
+            const auto dependent = stack.back();
+            stack.pop_back();
+            if (was_skipped[dependent]) continue;
+            was_skipped[dependent] = true;
+            ++skipped;
+            stack.insert(
+                stack.end(), dependents[dependent].begin(),
+                dependents[dependent].end()
+            );
+        }
+    };
+
+    // Run command in slot, its output going to the slot's pipes.
+    const auto launch = [&](size_t slot, const std::string& command) -> bool {
+        int stdout_pipe[2];
+        int stderr_pipe[2];
+        if (pipe2(stdout_pipe, O_CLOEXEC) != 0) return false;
+        if (pipe2(stderr_pipe, O_CLOEXEC) != 0) {
+            close(stdout_pipe[0]);
+            close(stdout_pipe[1]);
+            return false;
+        }
+
+        pid_t pid = spawn(command, stdout_pipe[1], stderr_pipe[1]);
+        close(stdout_pipe[1]);
+        close(stderr_pipe[1]);
+        if (pid < 0) {
+            close(stdout_pipe[0]);
+            close(stderr_pipe[0]);
+            return false;
+        }
+
+        RunningAction& running_action = slots[slot];
+        running_action.pid = pid;
+        running_action.fds[0] = stdout_pipe[0];
+        running_action.fds[1] = stderr_pipe[0];
+        for (int stream = 0; stream < 2; ++stream) {
+            epoll_event event{};
+            event.events = EPOLLIN;
+            event.data.u64 = slot * 2 + stream;
+            epoll_ctl(
+                epoll_fd, EPOLL_CTL_ADD, running_action.fds[stream], &event
+            );
+        }
+        return true;
+    };
+
+    // Have a thread do the copies of the action in slot, its output going to
+    // the slot's stdout pipe.
+    std::atomic<bool> stop_copying{false};
+    const auto launch_copies = [&](size_t slot) -> bool {
+        int output_pipe[2];
+        if (pipe2(output_pipe, O_CLOEXEC) != 0) return false;
+
+        RunningAction& running_action = slots[slot];
+        const auto& action = actions[running_action.index];
+        running_action.fds[0] = output_pipe[0];
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.u64 = slot * 2;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, running_action.fds[0], &event);
+        // Each copier thread counts as a job, so only the idle ones are
+        // taken, and nothing else starts until they're given back.
+        running_action.jobs = copy_threads(
+            action, local_running < jobs ? jobs - local_running : 1
+        );
+        running_action.copier = std::thread([&, fd = output_pipe[1]] {
+            std::string output{};
+            running_action.copy_status = run_copies(
+                action, output, running_action.copied, running_action.jobs,
+                &stop_copying
+            );
+            size_t written{0};
+            while (written < output.size()) {
+                const auto n =
+                    write(fd, output.data() + written, output.size() - written);
+                if (n < 0 and errno == EINTR) continue;
+                if (n < 0) break;
+                written += size_t(n);
+            }
+            close(fd);
+        });
+        return true;
+    };
+
+    // Where the action would be done soonest: a worker, here (-1), or
+    // nowhere (-2) as everything is busy.
+    const auto place = [&](size_t index) -> int {
+        int best_place{-2};
+        double best{0};
+        if (local_running < jobs) {
+            best_place = -1;
+            best = expected_done(local_latency, local_running, jobs);
+        }
+        if (actions[index].remote_command.empty()) return best_place;
+        for (size_t w = 0; w < workers.size(); ++w) {
+            const auto& worker = workers[w];
+            if (not worker.alive or worker.running >= worker.capacity)
+                continue;
+            const auto expected =
+                expected_done(worker.latency, worker.running, worker.capacity);
+            if (best_place == -2 or expected < best) {
+                best_place = int(w);
+                best = expected;
+            }
+        }
+        return best_place;
+    };
+    const auto busy = [&] {
+        if (local_running < jobs) return false;
+        for (const auto& worker : workers)
+            if (worker.alive and worker.running < worker.capacity)
+                return false;
+        return true;
+    };
+
+    const auto start = [&](size_t index, int worker) -> bool {
+        const auto& action = actions[index];
+        size_t slot{0};
+        while (slot_used[slot]) ++slot;
+
+        RunningAction& running_action = slots[slot];
+        running_action = {};
+        running_action.index = index;
+        running_action.started = std::chrono::steady_clock::now();
+        running_action.worker = worker;
+        running_action.modified =
+            modification_times(action.outputs, options.file_states);
+        make_output_directories(action.outputs, made_directories);
+        // A worker's action is preprocessed here first.
+        if (action.copy_sources.size()) {
+            if (not launch_copies(slot)) return false;
+        } else if (not launch(
+                       slot,
+                       worker < 0 ? action.command : action.preprocess_command
+                   ))
+            return false;
+        slot_used[slot] = true;
+        stat_count(STAT_ACTIONS_RUN);
+        ++running;
+        if (worker < 0) local_running += running_action.jobs;
+        else ++workers[worker].running;
+
+        if (worker < 0) status.print(done, total, running, action.command);
+        else {
+            status.print(
+                done, total, running,
+                "[" + workers[worker].address + "] " + action.command
+            );
+        }
+        return true;
+    };
+
+    const auto release = [&](size_t index) {
+        for (auto dependent : dependents[index])
+            if (not --unfinished_dependencies[dependent]) ready.push(dependent);
+    };
+
+    const auto complete = [&](size_t slot, int rc) {
+        RunningAction& running_action = slots[slot];
+        const auto& action = actions[running_action.index];
+
+        slot_used[slot] = false;
+        --running;
+        ++done;
+        if (running_action.worker < 0) {
+            local_running -= running_action.jobs;
+            if (action.remote_command.size() and not rc)
+                observe_latency(
+                    local_latency,
+                    std::chrono::steady_clock::now() - running_action.started
+                );
+        } else --workers[running_action.worker].running;
+
+        // Killed actions may have left broken outputs behind, so they are
+        // remembered as having failed, which means they'll run again.
+        if (cancelled) {
+            record(options, action, running_action.started, true);
+            return;
+        }
+        changed[running_action.index] = record(
+            options, action, running_action.started, rc != 0,
+            running_action.modified, running_action.copied
+        );
+
+        if (rc or running_action.output.size()) {
+            status.clear();
+            if (rc) {
+                printf(
+                    "[BUILD]:ERROR: command failed with status %d\n    %s\n",
+                    rc, action.command.data()
+                );
+            }
+            // Written in one go so the output of an action stays together.
+            fwrite(
+                running_action.output.data(), 1, running_action.output.size(),
+                stdout
+            );
+            fflush(stdout);
+        }
+
+        if (rc) {
+            fail(running_action.index);
+            return;
+        }
+        release(running_action.index);
+    };
+
+    // Start handing the preprocessed translation unit to the slot's worker
+    // (see transfer()).
+    const auto ship = [&](size_t slot, std::string source) -> bool {
+        RunningAction& running_action = slots[slot];
+        const auto& action = actions[running_action.index];
+        const auto& worker = workers[running_action.worker];
+
+        int fd = worker_connect_start(worker.resolved);
+        if (fd < 0) return false;
+        running_action.connection = fd;
+        running_action.connecting = true;
+        running_action.connect_deadline =
+            std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        running_action.message = worker_job_message(
+            {action.remote_command, action.remote_input,
+             action.outputs.front(), std::move(source)}
+        );
+        running_action.message_sent = 0;
+        epoll_event event{};
+        event.events = EPOLLOUT;
+        event.data.u64 = slot * 2;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+        return true;
+    };
+
+    const auto disconnect = [&](size_t slot) {
+        RunningAction& running_action = slots[slot];
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, running_action.connection, nullptr);
+        close(running_action.connection);
+        running_action.connection = -1;
+        running_action.connecting = false;
+    };
+
+    // The slot's worker went away; compile its action here instead, and
+    // don't bother the worker again.
+    const auto retreat = [&](size_t slot) {
+        RunningAction& running_action = slots[slot];
+        const auto& action = actions[running_action.index];
+        auto& worker = workers[running_action.worker];
+        if (worker.alive) {
+            status.clear();
+            printf(
+                "[BUILD]:WARNING: Lost lbs-worker at %s, compiling here "
+                "instead\n",
+                worker.address.data()
+            );
+            worker.alive = false;
+        }
+        --worker.running;
+        ++local_running;
+        running_action.worker = -1;
+        running_action.output.clear();
+        if (not launch(slot, action.command)) {
+            running_action.output = "could not run command\n";
+            complete(slot, 127);
+        }
+    };
+
+    const auto finish = [&](size_t slot) {
+        RunningAction& running_action = slots[slot];
+        const auto& action = actions[running_action.index];
+
+        if (running_action.copier.joinable()) {
+            running_action.copier.join();
+            complete(slot, running_action.copy_status);
+            return;
+        }
+
+        int wait_status{0};
+        while (waitpid(running_action.pid, &wait_status, 0) < 0
+               and errno == EINTR)
+            ;
+        running_action.pid = -1;
+        int rc{0};
+        if (WIFEXITED(wait_status)) rc = WEXITSTATUS(wait_status);
+        else if (WIFSIGNALED(wait_status)) rc = 128 + WTERMSIG(wait_status);
+
+        if (running_action.worker < 0) {
+            complete(slot, rc);
+            return;
+        }
+
+        // Done preprocessing.
+        std::string source{};
+        const bool preprocessed =
+            rc == 0 and read_file(action.remote_input, source);
+        std::remove(action.remote_input.data());
+        if (cancelled or rc) complete(slot, rc);
+        else if (not preprocessed or not ship(slot, std::move(source)))
+            retreat(slot);
+    };
+
+    // The slot's worker answered, or went away.
+    const auto receive = [&](size_t slot) {
+        RunningAction& running_action = slots[slot];
+        const auto& action = actions[running_action.index];
+
+        char buffer[65536];
+        auto n = read(running_action.connection, buffer, sizeof(buffer));
+        if (n < 0 and (errno == EINTR or errno == EAGAIN)) return;
+        auto& received = running_action.received;
+        if (n > 0) received.append(buffer, size_t(n));
+        // A worker that isn't one counts as gone.
+        bool gone{n <= 0};
+        if (not running_action.greeted
+            and received.size() >= worker_hello_size) {
+            uint32_t capacity{0};
+            running_action.greeted =
+                worker_parse_hello(received.data(), capacity);
+            gone = gone or not running_action.greeted;
+            received.erase(0, worker_hello_size);
+        }
+        WorkerResult result{};
+        const bool answered = running_action.greeted
+                          and worker_parse_result(received, result);
+        if (not answered and not gone) return;
+
+        disconnect(slot);
+        if (cancelled) {
+            complete(slot, 1);
+            return;
+        }
+        if (not answered) {
+            retreat(slot);
+            return;
+        }
+
+        observe_latency(
+            workers[running_action.worker].latency,
+            std::chrono::steady_clock::now() - running_action.sent
+        );
+        running_action.output += result.output;
+        if (result.status == 0
+            and not write_file(action.outputs.front(), result.object)) {
+            running_action.output +=
+                "cannot write " + action.outputs.front() + "\n";
+            result.status = 1;
+        }
+        complete(slot, result.status);
+    };
+
+    // The slot's connection to its worker is ready: it went through (or
+    // not), takes more of the job, or has more of the result.
+    const auto transfer = [&](size_t slot) {
+        RunningAction& running_action = slots[slot];
+        if (cancelled) {
+            disconnect(slot);
+            complete(slot, 1);
+            return;
+        }
+        if (running_action.connecting) {
+            if (not worker_connected(running_action.connection)) {
+                disconnect(slot);
+                retreat(slot);
+                return;
+            }
+            running_action.connecting = false;
+        }
+        auto& message = running_action.message;
+        auto& message_sent = running_action.message_sent;
+        if (message_sent == message.size()) {
+            receive(slot);
+            return;
+        }
+        auto n = send(
+            running_action.connection, message.data() + message_sent,
+            message.size() - message_sent, MSG_NOSIGNAL
+        );
+        if (n < 0 and (errno == EINTR or errno == EAGAIN)) return;
+        if (n <= 0) {
+            disconnect(slot);
+            retreat(slot);
+            return;
+        }
+        message_sent += size_t(n);
+        if (message_sent < message.size()) return;
+        // All sent; now for the result.
+        message.clear();
+        message_sent = 0;
+        running_action.sent = std::chrono::steady_clock::now();
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.u64 = slot * 2;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, running_action.connection, &event);
+    };
+
+    while (true) {
+        // Once we've had too many failures, let whatever is running finish,
+        // but don't start anything new. Actions with nowhere to go right now
+        // wait for the next round.
+        std::vector<size_t> waiting{};
+        while (not stopped() and not busy() and ready.size()) {
+            const auto index = ready.top();
+            ready.pop();
+            // Nothing the action reads was written after all, so its outputs
+            // are still up to date.
+            const auto& conditional_on = actions[index].conditional_on;
+            if (conditional_on.size()
+                and std::none_of(
+                    conditional_on.begin(), conditional_on.end(),
+                    [&](size_t producer) { return changed[producer]; }
+                )) {
+                ++done;
+                changed[index] = false;
+                if (options.verbose)
+                    status.print(
+                        done, total, running,
+                        "[UP TO DATE] " + actions[index].command
+                    );
+                release(index);
+                continue;
+            }
+            const int where = place(index);
+            if (where == -2) {
+                waiting.push_back(index);
+                continue;
+            }
+            if (not start(index, where)) {
+                status.clear();
+                printf(
+                    "[BUILD]:ERROR: could not run command\n    %s\n",
+                    actions[index].command.data()
+                );
+                ++done;
+                record(
+                    options, actions[index],
+                    std::chrono::steady_clock::now(), true
+                );
+                fail(index);
+            }
+        }
+        for (auto index : waiting) ready.push(index);
+        if (not running) break;
+
+        // Wake up in time to give up on connections that don't go through.
+        int timeout{-1};
+        const auto now = std::chrono::steady_clock::now();
+        for (size_t slot = 0; slot < slots.size(); ++slot) {
+            if (not slot_used[slot] or not slots[slot].connecting) continue;
+            const auto left =
+                std::chrono::duration_cast<std::chrono::milliseconds>(
+                    slots[slot].connect_deadline - now
+                )
+                    .count();
+            const int wait = int(std::max<int64_t>(left + 1, 0));
+            if (timeout < 0 or wait < timeout) timeout = wait;
+        }
+
+        epoll_event events[16];
+        int count = epoll_wait(epoll_fd, events, 16, timeout);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            perror("[BUILD]:ERROR: epoll_wait");
+            interrupted = true;
+            break;
+        }
+        for (int e = 0; e < count; ++e) {
+            if (events[e].data.u64 == cancel_event) {
+                if (not options.cancelled()) continue;
+                cancelled = true;
+                // Whatever happens from here on is the caller's business.
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, options.cancel_fd, nullptr);
+                status.clear();
+                printf("[BUILD]: Cancelled\n");
+                stop_copying = true;
+                for (size_t slot = 0; slot < slots.size(); ++slot) {
+                    if (not slot_used[slot]) continue;
+                    if (slots[slot].pid >= 0) kill(slots[slot].pid, SIGTERM);
+                    if (slots[slot].connection >= 0)
+                        shutdown(slots[slot].connection, SHUT_RDWR);
+                }
+                continue;
+            }
+
+            const size_t slot = events[e].data.u64 / 2;
+            const int stream = int(events[e].data.u64 % 2);
+            RunningAction& running_action = slots[slot];
+            if (running_action.connection >= 0) {
+                transfer(slot);
+                continue;
+            }
+
+            char buffer[4096];
+            auto n = read(running_action.fds[stream], buffer, sizeof(buffer));
+            if (n > 0) {
+                running_action.output.append(buffer, size_t(n));
+                continue;
+            }
+            if (n < 0 and errno == EINTR) continue;
+
+            // End of stream (or an error reading it, which we treat the same).
+            epoll_ctl(
+                epoll_fd, EPOLL_CTL_DEL, running_action.fds[stream], nullptr
+            );
+            close(running_action.fds[stream]);
+            running_action.fds[stream] = -1;
+            if (running_action.fds[0] < 0 and running_action.fds[1] < 0)
+                finish(slot);
+        }
+        for (size_t slot = 0; slot < slots.size(); ++slot) {
+            if (not slot_used[slot] or not slots[slot].connecting
+                or slots[slot].connect_deadline
+                       > std::chrono::steady_clock::now())
+                continue;
+            disconnect(slot);
+            if (cancelled) complete(slot, 1);
+            else retreat(slot);
+        }
+    }
+    // Copies still going (when we gave up early) are stopped and waited for.
+    stop_copying = true;
+    for (auto& slot : slots)
+        if (slot.copier.joinable()) slot.copier.join();
+    close(epoll_fd);
+
+    status.finish();
+    if (cancelled) return false;
+    if (failures) {
+        printf("[BUILD]:ERROR: %zu of %zu actions failed", failures, total);
+        if (skipped)
+            printf(
+                ", %zu skipped because something they depend on failed",
+                skipped
+            );
+        printf("\n");
+    }
+    if (not stopped() and done + skipped != total) {
+        printf(
+            "[BUILD]:ERROR: %zu actions could never run (dependency cycle?)\n",
+            total - done - skipped
+        );
+        return false;
+    }
+
+    return not failures and not interrupted and not cancelled;
+}
+
+#else  // #ifdef __linux__
+
+// Without epoll, fall back to running each action one at a time, in the
+// order they were planned in as far as their dependencies allow.
+bool execute(
+    const BuildScenario::BuildCommands& build_commands,
+    const ExecutorOptions& options
+) {
+    const auto& actions = build_commands.actions;
+    const auto graph = build_commands.dependency_graph();
+    std::vector<size_t> unfinished_dependencies(actions.size());
+    std::vector<std::vector<size_t>> dependents(actions.size());
+    std::vector<size_t> order{};
+    for (size_t i = 0; i < actions.size(); ++i) {
+        unfinished_dependencies[i] = graph[i].size();
+        for (auto dependency : graph[i]) dependents[dependency].push_back(i);
+        if (not unfinished_dependencies[i]) order.push_back(i);
+    }
+    for (size_t o = 0; o < order.size(); ++o)
+        for (auto dependent : dependents[order[o]])
+            if (not --unfinished_dependencies[dependent])
+                order.push_back(dependent);
+    if (order.size() != actions.size()) {
+        printf(
+            "[BUILD]:ERROR: %zu actions could never run (dependency cycle?)\n",
+            actions.size() - order.size()
+        );
+        return false;
+    }
+
+    StatusLine status{};
+    status.verbose = options.verbose;
+    std::unordered_set<std::string> made_directories{};
+    size_t done{0};
+    size_t failures{0};
+    std::vector<bool> failed(actions.size(), false);
+    // See the epoll version.
+    std::vector<bool> changed(actions.size(), true);
+    for (auto i : order) {
+        // Anything depending on a failure fails (is skipped) with it.
+        for (auto dependency : graph[i])
+            if (failed[dependency]) failed[i] = true;
+        if (failed[i]) continue;
+
+        const auto& action = actions[i];
+        if (action.conditional_on.size()
+            and std::none_of(
+                action.conditional_on.begin(), action.conditional_on.end(),
+                [&](size_t producer) { return changed[producer]; }
+            )) {
+            ++done;
+            changed[i] = false;
+            continue;
+        }
+        const auto modified =
+            modification_times(action.outputs, options.file_states);
+        make_output_directories(action.outputs, made_directories);
+
+        status.print(done, actions.size(), 1, actions[i].command);
+        const auto started = std::chrono::steady_clock::now();
+        int rc{0};
+        bool copied{true};
+        if (action.copy_sources.size()) {
+            std::string output{};
+            rc = run_copies(action, output, copied, 1);
+            fwrite(output.data(), 1, output.size(), stdout);
+        } else rc = std::system(actions[i].command.data());
+        ++done;
+        changed[i] = record(
+            options, actions[i], started, rc != 0, modified, copied
+        );
+        if (rc) {
+            printf(
+                "[BUILD]:ERROR: command failed with status %d\n    %s\n",
+                int(rc), actions[i].command.data()
+            );
+            failed[i] = true;
+            if (++failures == options.failures_allowed) break;
+        }
+    }
+    return not failures;
+}
+
+#endif  // #ifdef __linux__
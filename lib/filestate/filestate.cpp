@@ -0,0 +1,853 @@
+#include <filestate/filestate.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <actionlog/actionlog.h>
+#include <lbs/build_scenario.h>
+#include <stats/stats.h>
+
+#include <sys/stat.h>
+
+#ifdef __linux__
+#    include <fcntl.h>
+#    include <linux/io_uring.h>
+#    include <sys/mman.h>
+#    include <sys/syscall.h>
+#    include <sys/sysmacros.h>
+#    include <unistd.h>
+#endif
+
+auto normal_path(const std::string& path) -> std::string {
+    // Most paths are already normal, and this is on the hot path of every
+    // file state lookup.
+    const bool maybe_abnormal = path.empty()
+                             or path.find("//") != std::string::npos
+                             or path.find("./") != std::string::npos
+                             or path.back() == '/' or path.back() == '.';
+    if (not maybe_abnormal) return path;
+
+    auto normal = std::filesystem::path(path).lexically_normal().string();
+    if (normal.size() > 1 and normal.back() == '/') normal.pop_back();
+    return normal;
+}
+
+auto stat_file(const std::string& path) -> FileState {
+    FileState file_state{};
+    struct stat st {};
+    if (stat(path.data(), &st) == 0) {
+        file_state.exists = true;
+#ifdef __linux__
+        file_state.modified =
+            int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#else
+        file_state.modified = int64_t(st.st_mtime) * 1000000000;
+#endif
+        file_state.size = int64_t(st.st_size);
+        file_state.device = uint64_t(st.st_dev);
+        file_state.inode = uint64_t(st.st_ino);
+    }
+    return file_state;
+}
+
+#if defined(__linux__) and defined(IORING_OP_STATX)
+// Stat paths through an io_uring of our own, a batch of statx requests per
+// system call (which the kernel then works through on threads of its own).
+// Returns false, having stat'ed nothing, if there is no io_uring to be had
+// (too old a kernel, or one that forbids it).
+static bool stat_files_io_uring(
+    const std::vector<std::string>& paths,
+    std::vector<FileState>& states
+) {
+    io_uring_params params{};
+    const int ring = int(syscall(__NR_io_uring_setup, 256, &params));
+    if (ring < 0) return false;
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) sq_size = cq_size = std::max(sq_size, cq_size);
+    const size_t sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    const auto map = [&](size_t size, off_t offset) {
+        return mmap(
+            nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ring, offset
+        );
+    };
+    void* sq = map(sq_size, IORING_OFF_SQ_RING);
+    void* cq = single_mmap ? sq : map(cq_size, IORING_OFF_CQ_RING);
+    void* sqe_memory = map(sqes_size, IORING_OFF_SQES);
+    const auto close_ring = [&] {
+        if (sqe_memory != MAP_FAILED) munmap(sqe_memory, sqes_size);
+        if (cq != MAP_FAILED and cq != sq) munmap(cq, cq_size);
+        if (sq != MAP_FAILED) munmap(sq, sq_size);
+        close(ring);
+    };
+    if (sq == MAP_FAILED or cq == MAP_FAILED or sqe_memory == MAP_FAILED) {
+        close_ring();
+        return false;
+    }
+
+    const auto sq_field = [&](unsigned offset) {
+        return reinterpret_cast<unsigned*>(static_cast<char*>(sq) + offset);
+    };
+    const auto cq_field = [&](unsigned offset) {
+        return reinterpret_cast<unsigned*>(static_cast<char*>(cq) + offset);
+    };
+    unsigned* sq_tail = sq_field(params.sq_off.tail);
+    const unsigned sq_mask = *sq_field(params.sq_off.ring_mask);
+    unsigned* sq_array = sq_field(params.sq_off.array);
+    unsigned* cq_head = cq_field(params.cq_off.head);
+    unsigned* cq_tail = cq_field(params.cq_off.tail);
+    const unsigned cq_mask = *cq_field(params.cq_off.ring_mask);
+    auto* cqes = reinterpret_cast<io_uring_cqe*>(
+        static_cast<char*>(cq) + params.cq_off.cqes
+    );
+    auto* sqes = static_cast<io_uring_sqe*>(sqe_memory);
+
+    std::vector<struct statx> results(params.sq_entries);
+    for (size_t start = 0; start < paths.size();
+         start += params.sq_entries) {
+        const auto count = unsigned(
+            std::min<size_t>(params.sq_entries, paths.size() - start)
+        );
+        const unsigned tail = *sq_tail;
+        for (unsigned i = 0; i < count; ++i) {
+            const unsigned index = (tail + i) & sq_mask;
+            auto& sqe = sqes[index];
+            memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = IORING_OP_STATX;
+            sqe.fd = AT_FDCWD;
+            sqe.addr = uint64_t(uintptr_t(paths[start + i].data()));
+            sqe.len = STATX_TYPE | STATX_MTIME | STATX_SIZE | STATX_INO;
+            sqe.off = uint64_t(uintptr_t(&results[i]));
+            sqe.user_data = i;
+            sq_array[index] = index;
+        }
+        __atomic_store_n(sq_tail, tail + count, __ATOMIC_RELEASE);
+
+        unsigned unsubmitted = count;
+        unsigned completed = 0;
+        while (completed < count) {
+            const long entered = syscall(
+                __NR_io_uring_enter, ring, unsubmitted, count - completed,
+                IORING_ENTER_GETEVENTS, nullptr, 0
+            );
+            if (entered < 0) {
+                if (errno == EINTR or errno == EAGAIN) continue;
+                // Whatever went wrong, stat() still works.
+                for (size_t i = start; i < paths.size(); ++i)
+                    states[i] = stat_file(paths[i]);
+                close_ring();
+                return true;
+            }
+            unsubmitted -= std::min(unsubmitted, unsigned(entered));
+
+            unsigned head = *cq_head;
+            const unsigned available =
+                __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            for (; head != available; ++head, ++completed) {
+                const auto& cqe = cqes[head & cq_mask];
+                const auto i = size_t(cqe.user_data);
+                auto& state = states[start + i];
+                if (cqe.res == 0) {
+                    const auto& st = results[i];
+                    state.exists = true;
+                    state.modified = int64_t(st.stx_mtime.tv_sec) * 1000000000
+                                   + st.stx_mtime.tv_nsec;
+                    state.size = int64_t(st.stx_size);
+                    state.device = uint64_t(
+                        makedev(st.stx_dev_major, st.stx_dev_minor)
+                    );
+                    state.inode = uint64_t(st.stx_ino);
+                } else if (cqe.res == -ENOENT or cqe.res == -ENOTDIR)
+                    state = {};
+                // Say, a kernel that has io_uring but can't statx through it.
+                else state = stat_file(paths[start + i]);
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        }
+    }
+    close_ring();
+    return true;
+}
+#endif
+
+auto stat_files(const std::vector<std::string>& paths)
+    -> std::vector<FileState> {
+    std::vector<FileState> states(paths.size());
+    // Not worth setting anything up for; and with a single CPU, statx
+    // requests would just queue up behind one another anyway.
+    const unsigned cpus = std::thread::hardware_concurrency();
+    if (paths.size() < 32 or cpus == 1) {
+        for (size_t i = 0; i < paths.size(); ++i)
+            states[i] = stat_file(paths[i]);
+        return states;
+    }
+#if defined(__linux__) and defined(IORING_OP_STATX)
+    if (stat_files_io_uring(paths, states)) return states;
+#endif
+    std::atomic<size_t> next{0};
+    const auto work = [&] {
+        for (size_t i = next++; i < paths.size(); i = next++)
+            states[i] = stat_file(paths[i]);
+    };
+    const size_t threads = std::min<size_t>(
+        std::max(1u, cpus), paths.size() / 64 + 1
+    );
+    std::vector<std::thread> helpers{};
+    for (size_t t = 1; t < threads; ++t) helpers.emplace_back(work);
+    work();
+    for (auto& helper : helpers) helper.join();
+    return states;
+}
+
+auto FileStates::state(const std::string& path) -> FileState {
+    const auto normal = normal_path(path);
+    auto found = states.find(normal);
+    if (found != states.end()) {
+        stat_count(STAT_FILE_STATE_HITS);
+        return found->second;
+    }
+
+    stat_count(STAT_FILES_STATED);
+    const bool remember = not keep_fresh or keep_fresh(normal);
+
+    const auto file_state = stat_file(normal);
+    if (remember) states[normal] = file_state;
+    return file_state;
+}
+
+void FileStates::prefetch(const std::vector<std::string>& paths) {
+    std::vector<std::string> unknown{};
+    for (const auto& path : paths) {
+        auto normal = normal_path(path);
+        if (states.count(normal)) continue;
+        // Those not to be remembered are stat'ed when they're looked at.
+        if (keep_fresh and not keep_fresh(normal)) continue;
+        // Made now, so that duplicates are known already.
+        states[normal] = {};
+        unknown.push_back(std::move(normal));
+    }
+    stat_count(STAT_FILES_STATED, unknown.size());
+    const auto found = stat_files(unknown);
+    for (size_t i = 0; i < unknown.size(); ++i)
+        states[unknown[i]] = found[i];
+}
+
+// Parse the prerequisites out of a Makefile-style dependency file, as written
+// by `cc -MD`. Besides rules, compilers of C++20 modules write phony targets
+// standing for modules (say, `foo.c++m: gcm.cache/foo.gcm`), order-only
+// prerequisites and variable assignments; only the prerequisites of real
+// files are kept.
+static auto parse_dependency_file(const std::string& contents)
+    -> std::vector<std::string> {
+    // Each rule (or assignment) is one logical line.
+    std::vector<std::vector<std::string>> lines{{}};
+    std::string word{};
+    const auto finish_word = [&] {
+        if (word.empty()) return;
+        lines.back().push_back(word);
+        word.clear();
+    };
+    for (size_t i = 0; i < contents.size(); ++i) {
+        const char c = contents[i];
+        if (c == '\\' and i + 1 < contents.size()) {
+            const char next = contents[i + 1];
+            // Line continuation.
+            if (next == '\n' or next == '\r') {
+                finish_word();
+                ++i;
+                continue;
+            }
+            // Escaped space or hash.
+            if (next == ' ' or next == '#') {
+                word += next;
+                ++i;
+                continue;
+            }
+            word += c;
+            continue;
+        }
+        if (c == '$' and i + 1 < contents.size() and contents[i + 1] == '$') {
+            word += '$';
+            ++i;
+            continue;
+        }
+        if (c == ' ' or c == '\t' or c == '\r') {
+            finish_word();
+            continue;
+        }
+        if (c == '\n') {
+            finish_word();
+            lines.emplace_back();
+            continue;
+        }
+        word += c;
+    }
+    finish_word();
+
+    struct Rule {
+        std::vector<std::string> targets{};
+        std::vector<std::string> prerequisites{};
+    };
+    std::vector<Rule> rules{};
+    // Words that don't stand for files: phony targets, and modules imported.
+    std::vector<std::string> phony{};
+    for (const auto& line : lines) {
+        if (line.size() > 1
+            and (line[1] == "=" or line[1] == "+=" or line[1] == ":=")) {
+            if (line[0] == "CXX_IMPORTS")
+                phony.insert(phony.end(), line.begin() + 2, line.end());
+            continue;
+        }
+        Rule rule{};
+        bool prerequisites{false};
+        for (const auto& w : line) {
+            // Order-only prerequisites don't make anything outdated.
+            const bool order_only =
+                w.size() > 1 and w.compare(w.size() - 2, 2, ":|") == 0;
+            if (w == "|" or order_only) break;
+            if (prerequisites) rule.prerequisites.push_back(w);
+            else if (w.back() == ':') {
+                rule.targets.push_back(w.substr(0, w.size() - 1));
+                prerequisites = true;
+            } else rule.targets.push_back(w);
+        }
+        if (not prerequisites) continue;
+        if (rule.targets == std::vector<std::string>{".PHONY"}) {
+            phony.insert(
+                phony.end(), rule.prerequisites.begin(),
+                rule.prerequisites.end()
+            );
+        } else rules.push_back(std::move(rule));
+    }
+
+    const auto is_phony = [&](const std::string& w) {
+        return std::find(phony.begin(), phony.end(), w) != phony.end();
+    };
+    std::vector<std::string> out{};
+    for (const auto& rule : rules) {
+        if (std::all_of(rule.targets.begin(), rule.targets.end(), is_phony))
+            continue;
+        for (const auto& w : rule.prerequisites)
+            if (not is_phony(w)) out.push_back(w);
+    }
+    return out;
+}
+
+auto read_dependency_file(const std::string& path)
+    -> std::vector<std::string> {
+    std::string contents{};
+    if (auto f = fopen(path.data(), "rb")) {
+        char buffer[4096];
+        size_t n{0};
+        while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+            contents.append(buffer, n);
+        fclose(f);
+    }
+    return parse_dependency_file(contents);
+}
+
+auto FileStates::dependency_file(const std::string& path)
+    -> const std::vector<std::string>& {
+    const auto normal = normal_path(path);
+    auto found = dependencies.find(normal);
+    if (found != dependencies.end()) return found->second;
+
+    const bool remember = not keep_fresh or keep_fresh(normal);
+
+    if (not remember) {
+        // Only kept around until the next lookup.
+        unremembered_dependencies = read_dependency_file(normal);
+        return unremembered_dependencies;
+    }
+    return dependencies[normal] = read_dependency_file(normal);
+}
+
+// The inputs of action, and those listed in its dependency file as read just
+// now.
+static auto action_inputs(const BuildScenario::BuildCommands::Action& action)
+    -> std::vector<std::string> {
+    auto inputs = action.inputs;
+    if (action.dependency_file.size()) {
+        const auto listed = read_dependency_file(action.dependency_file);
+        inputs.insert(inputs.end(), listed.begin(), listed.end());
+    }
+    return inputs;
+}
+
+// What content hashes know a file in state by (see ContentHashes::hash()).
+static auto content_state(const FileState& state) -> ContentHashes::Entry {
+    ContentHashes::Entry entry{};
+    if (not state.exists) return entry;
+    entry.device = state.device;
+    entry.inode = state.inode;
+    entry.size = state.size;
+    entry.modified = state.modified;
+    return entry;
+}
+
+auto hash_action_inputs(
+    const BuildScenario::BuildCommands::Action& action,
+    ContentHashes& hashes,
+    FileStates& file_states,
+    int64_t not_after
+) -> uint64_t {
+    // Names count, too: a source including another header with the same
+    // contents still changed.
+    std::string hashed{};
+    for (const auto& input : action_inputs(action)) {
+        const auto state = file_states.state(input);
+        if (state.modified > not_after) return 0;
+        const auto known = content_state(state);
+        ContentHashes::Entry entry{};
+        if (not hashes.hash(input, entry, &known)) return 0;
+        hashed += input;
+        hashed += '\0';
+        hashed.append(
+            reinterpret_cast<const char*>(&entry.hash), sizeof(entry.hash)
+        );
+    }
+    const auto hash = hash_contents(hashed.data(), hashed.size()).low;
+    return hash ? hash : 1;
+}
+
+bool FileStates::invalidate(const std::string& path) {
+    const auto normal = normal_path(path);
+    bool known = states.erase(normal) + dependencies.erase(normal);
+
+    // Anything within, if it was a directory.
+    const auto prefix = normal + '/';
+    const auto within = [&](const auto& entry) {
+        return entry.first.compare(0, prefix.size(), prefix) == 0;
+    };
+    for (auto it = states.begin(); it != states.end();) {
+        if (not within(*it)) ++it;
+        else {
+            it = states.erase(it);
+            known = true;
+        }
+    }
+    for (auto it = dependencies.begin(); it != dependencies.end();) {
+        if (not within(*it)) ++it;
+        else {
+            it = dependencies.erase(it);
+            known = true;
+        }
+    }
+    return known;
+}
+
+void FileStates::forget(const std::string& path) {
+    const auto normal = normal_path(path);
+    states.erase(normal);
+    dependencies.erase(normal);
+}
+
+void FileStates::clear() {
+    states.clear();
+    dependencies.clear();
+}
+
+auto outdated_actions(
+    const BuildScenario::BuildCommands& build_commands,
+    const ActionLog& log,
+    FileStates& file_states,
+    std::vector<std::vector<size_t>>* conditional,
+    ContentHashes* content_hashes,
+    std::vector<std::string>* reasons
+) -> std::vector<bool> {
+    const auto& actions = build_commands.actions;
+    const auto graph = build_commands.dependency_graph();
+
+    std::unordered_map<std::string, size_t> producers{};
+    for (size_t i = 0; i < actions.size(); ++i)
+        for (const auto& output : actions[i].outputs)
+            producers[normal_path(output)] = i;
+
+    // Actions are checked dependencies first, so that we already know whether
+    // the producer of an input must run.
+    std::vector<size_t> unfinished_dependencies(actions.size());
+    std::vector<std::vector<size_t>> dependents(actions.size());
+    std::vector<size_t> order{};
+    for (size_t i = 0; i < actions.size(); ++i) {
+        unfinished_dependencies[i] = graph[i].size();
+        for (auto dependency : graph[i]) dependents[dependency].push_back(i);
+        if (not unfinished_dependencies[i]) order.push_back(i);
+    }
+    for (size_t o = 0; o < order.size(); ++o)
+        for (auto dependent : dependents[order[o]])
+            if (not --unfinished_dependencies[dependent])
+                order.push_back(dependent);
+
+    // Everything checked below is stat'ed up front, all at once: first the
+    // inputs, outputs and dependency files, then what those list.
+    std::vector<std::string> paths{};
+    for (const auto& action : actions) {
+        paths.insert(paths.end(), action.inputs.begin(), action.inputs.end());
+        paths.insert(
+            paths.end(), action.outputs.begin(), action.outputs.end()
+        );
+        if (action.dependency_file.size())
+            paths.push_back(action.dependency_file);
+    }
+    file_states.prefetch(paths);
+    paths.clear();
+    for (const auto& action : actions) {
+        if (action.dependency_file.empty()
+            or not file_states.state(action.dependency_file).exists)
+            continue;
+        const auto& listed =
+            file_states.dependency_file(action.dependency_file);
+        paths.insert(paths.end(), listed.begin(), listed.end());
+    }
+    file_states.prefetch(paths);
+
+    // Likewise, the inputs of actions that may only seem outdated are hashed
+    // up front.
+    if (content_hashes) {
+        paths.clear();
+        for (const auto& action : actions) {
+            const auto* entry = log.find(action.key());
+            if (not entry or entry->failed or not entry->input_hash
+                or entry->command_hash != hash_command(action.command))
+                continue;
+            // (An action missing an output must run anyway.)
+            int64_t written{action.outputs.empty() ? entry->finished : 0};
+            if (action.outputs.size()) {
+                written = INT64_MAX;
+                for (const auto& output : action.outputs) {
+                    const auto output_state = file_states.state(output);
+                    if (not output_state.exists) written = INT64_MIN;
+                    written = std::min(written, output_state.modified);
+                }
+                if (written == INT64_MIN) continue;
+                written = std::max(written, entry->modified);
+            }
+            static const std::vector<std::string> none{};
+            const auto& listed =
+                action.dependency_file.empty()
+                    ? none
+                    : file_states.dependency_file(action.dependency_file);
+            const auto newer = [&](const std::vector<std::string>& inputs) {
+                return std::any_of(
+                    inputs.begin(), inputs.end(),
+                    [&](const std::string& input) {
+                        return file_states.state(input).modified > written;
+                    }
+                );
+            };
+            if (not newer(action.inputs) and not newer(listed)) continue;
+            paths.insert(
+                paths.end(), action.inputs.begin(), action.inputs.end()
+            );
+            paths.insert(paths.end(), listed.begin(), listed.end());
+        }
+        std::vector<ContentHashes::Entry> states{};
+        for (const auto& path : paths)
+            states.push_back(content_state(file_states.state(path)));
+        content_hashes->hash_all(paths, &states);
+    }
+
+    // Anything caught in a dependency cycle is outdated; the executor will
+    // complain about it.
+    std::vector<bool> outdated(actions.size(), true);
+    if (conditional) conditional->assign(actions.size(), {});
+    if (reasons) reasons->assign(actions.size(), "in a dependency cycle");
+
+    // The producers of inputs that must run, which alone don't settle whether
+    // the action checked must run, too.
+    std::vector<size_t> outdated_producers{};
+    const auto input_outdated = [&](size_t action_index,
+                                    const std::string& input,
+                                    int64_t oldest_output) {
+        auto producer = producers.find(normal_path(input));
+        if (producer != producers.end() and producer->second != action_index
+            and outdated[producer->second]) {
+            if (std::find(
+                    outdated_producers.begin(), outdated_producers.end(),
+                    producer->second
+                )
+                == outdated_producers.end())
+                outdated_producers.push_back(producer->second);
+            return false;
+        }
+        const auto input_state = file_states.state(input);
+        return not input_state.exists or input_state.modified > oldest_output;
+    };
+
+    for (auto i : order) {
+        const auto& action = actions[i];
+        outdated_producers.clear();
+        // Only spelled out when asked for.
+        std::string reason{};
+        const auto because = [&](const char* what, const std::string& path) {
+            if (reasons) reason = what + path;
+            return true;
+        };
+        const bool own_reason = [&] {
+            // Nothing tells us whether an action with neither inputs nor
+            // outputs needs to run, so it always does.
+            if (action.outputs.empty() and action.inputs.empty())
+                return because("it has neither inputs nor outputs", "");
+
+            const auto* entry = log.find(action.key());
+            if (not entry) return because("no prior record of it", "");
+            if (entry->failed) return because("it failed last time", "");
+            if (entry->command_hash != hash_command(action.command))
+                return because("its command changed", "");
+
+            // Without outputs, when the action last ran stands in for when its
+            // outputs were written.
+            int64_t oldest_output{entry->finished};
+            if (action.outputs.size()) {
+                oldest_output = INT64_MAX;
+                for (const auto& output : action.outputs) {
+                    const auto output_state = file_states.state(output);
+                    if (not output_state.exists)
+                        return because("output missing: ", output);
+                    oldest_output =
+                        std::min(oldest_output, output_state.modified);
+                }
+                // Outputs that came out the same last time have their
+                // previous modification times, but count as written when they
+                // were.
+                oldest_output = std::max(oldest_output, entry->modified);
+            }
+
+            // Newer inputs settle it, unless their hashes may tell otherwise
+            // (which takes knowing the producers of all of them, too).
+            const bool hashed = content_hashes and entry->input_hash;
+            // The first newer input, and whether it's a header (or whatever
+            // else the dependency file lists).
+            const std::string* newer{nullptr};
+            bool listed{false};
+            const auto settled = [&](const std::string& input, bool header) {
+                if (input_outdated(i, input, oldest_output) and not newer) {
+                    newer = &input;
+                    listed = header;
+                }
+                return newer and not hashed;
+            };
+            const auto changed = [&] {
+                if (not file_states.state(*newer).exists)
+                    return because("input missing: ", *newer);
+                // Only all of them together are hashed.
+                if (hashed)
+                    return because(
+                        listed ? "input hash changed, header newer: "
+                               : "input hash changed, source newer: ",
+                        *newer
+                    );
+                return because(
+                    listed ? "header changed: " : "source changed: ", *newer
+                );
+            };
+            for (const auto& input : action.inputs)
+                if (settled(input, false)) return changed();
+
+            if (action.outputs.size() and action.dependency_file.size()) {
+                if (not file_states.state(action.dependency_file).exists)
+                    return because(
+                        "dependency file missing: ", action.dependency_file
+                    );
+                for (const auto& input :
+                     file_states.dependency_file(action.dependency_file))
+                    if (settled(input, true)) return changed();
+            }
+
+            return newer
+               and hash_action_inputs(action, *content_hashes, file_states)
+                       != entry->input_hash
+               and changed();
+        }();
+        outdated[i] = own_reason or outdated_producers.size();
+        if (conditional and not own_reason)
+            (*conditional)[i] = outdated_producers;
+        if (reasons and not own_reason and outdated_producers.size()) {
+            const auto& producer = actions[outdated_producers.front()];
+            reason = "dependency output rebuilt: ";
+            reason += producer.outputs.size() ? producer.outputs.front()
+                                              : producer.command;
+        }
+        if (reasons) (*reasons)[i] = outdated[i] ? std::move(reason) : "";
+    }
+
+    return outdated;
+}
+
+bool archive_members(
+    const std::string& path,
+    std::vector<std::string>& members
+) {
+    members.clear();
+    auto f = fopen(path.data(), "rb");
+    if (not f) return false;
+    const auto fail = [&] {
+        fclose(f);
+        members.clear();
+        return false;
+    };
+
+    char magic[8];
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic)
+        or memcmp(magic, "!<arch>\n", sizeof(magic)) != 0)
+        return fail();
+
+    // Only the headers are read; the members themselves are skipped over.
+    // GNU archives keep names longer than 15 characters in a member of their
+    // own ("//"), BSD ones right after the header.
+    std::string long_names{};
+    char header[60];
+    size_t n{0};
+    while ((n = fread(header, 1, sizeof(header), f)) == sizeof(header)) {
+        if (header[58] != '`' or header[59] != '\n') return fail();
+        const std::string size_field(header + 48, 10);
+        char* end{nullptr};
+        const auto size = strtoll(size_field.data(), &end, 10);
+        if (end == size_field.data() or size < 0) return fail();
+        auto data = size;
+
+        std::string name(header, 16);
+        name.erase(name.find_last_not_of(' ') + 1);
+        if (name == "/" or name == "/SYM64/" or name == "__.SYMDEF"
+            or name == "__.SYMDEF SORTED") {
+            // The symbol table.
+        } else if (name == "//") {
+            long_names.resize(size_t(size));
+            if (fread(long_names.data(), 1, long_names.size(), f)
+                != long_names.size())
+                return fail();
+            data = 0;
+        } else if (name.size() > 1 and name[0] == '/') {
+            const auto offset = strtoull(name.data() + 1, &end, 10);
+            const auto name_end = long_names.find("/\n", offset);
+            if (*end or offset >= long_names.size()
+                or name_end == std::string::npos)
+                return fail();
+            members.push_back(long_names.substr(offset, name_end - offset));
+        } else if (name.compare(0, 3, "#1/") == 0) {
+            const auto length = strtoll(name.data() + 3, &end, 10);
+            if (*end or length < 0 or length > size) return fail();
+            std::string long_name(size_t(length), '\0');
+            if (fread(long_name.data(), 1, long_name.size(), f)
+                != long_name.size())
+                return fail();
+            long_name.erase(long_name.find_last_not_of('\0') + 1);
+            members.push_back(std::move(long_name));
+            data -= length;
+        } else {
+            if (name.size() and name.back() == '/') name.pop_back();
+            members.push_back(std::move(name));
+        }
+        // Members start at even offsets.
+        if (fseek(f, long(data + size % 2), SEEK_CUR) != 0) return fail();
+    }
+    const bool ok = n == 0 and not ferror(f);
+    fclose(f);
+    if (not ok) members.clear();
+    return ok;
+}
+
+void update_archives_in_place(
+    BuildScenario::BuildCommands& build_commands,
+    const ActionLog& log,
+    FileStates& file_states,
+    size_t response_file_threshold
+) {
+    const auto name_of = [](const std::string& path) {
+        return std::filesystem::path(path).filename().string();
+    };
+    const auto join = [](const std::vector<std::string>& paths) {
+        std::string joined{};
+        for (const auto& path : paths) {
+            if (joined.size()) joined += ' ';
+            joined += path;
+        }
+        return joined;
+    };
+    const auto expand = [](const std::string& format,
+                           const std::string& joined) {
+        std::string command{};
+        for (size_t c = 0; c < format.size(); ++c) {
+            if (format.compare(c, 2, "%i") == 0) {
+                command += joined;
+                ++c;
+            } else command += format[c];
+        }
+        return command;
+    };
+
+    for (auto& action : build_commands.actions) {
+        if (action.archive_update_command.empty()
+            or action.outputs.size() != 1)
+            continue;
+        const auto& archive = action.outputs.front();
+        const auto* entry = log.find(action.key());
+        const auto archive_state = file_states.state(archive);
+        if (not entry or entry->failed or not archive_state.exists) continue;
+        std::vector<std::string> members{};
+        if (not archive_members(archive, members)) continue;
+
+        // The objects, that is.
+        std::vector<std::string> inputs{};
+        for (const auto& input : action.inputs)
+            if (input != action.response_file) inputs.push_back(input);
+        std::unordered_set<std::string> names{};
+        bool unique{true};
+        for (const auto& input : inputs)
+            unique = names.insert(name_of(input)).second and unique;
+        const std::unordered_set<std::string> member_names{
+            members.begin(), members.end()};
+        if (not unique or member_names.size() != members.size()) continue;
+
+        // Whatever the archive still depends on has yet to run.
+        std::unordered_set<std::string> compiled{};
+        for (auto dependency : action.dependencies) {
+            const auto& outputs = build_commands.actions[dependency].outputs;
+            for (const auto& output : outputs)
+                compiled.insert(normal_path(output));
+        }
+
+        std::vector<std::string> replaced{};
+        std::vector<std::string> deleted{};
+        for (const auto& input : inputs)
+            if (compiled.count(normal_path(input))
+                or not member_names.count(name_of(input))
+                or file_states.state(input).modified > archive_state.modified)
+                replaced.push_back(input);
+        for (const auto& member : members)
+            if (not names.count(member)) deleted.push_back(member);
+        // Say, the objects are in another order now.
+        if (replaced.empty() and deleted.empty()) continue;
+        // Too many for the command line.
+        const auto replaced_joined = join(replaced);
+        const auto deleted_joined = join(deleted);
+        if (replaced_joined.size() >= response_file_threshold
+            or deleted_joined.size() >= response_file_threshold)
+            continue;
+
+        std::string command{};
+        if (deleted.size())
+            command = expand(action.archive_delete_command, deleted_joined);
+        if (replaced.size()) {
+            if (command.size()) command += " && ";
+            command += expand(action.archive_update_command, replaced_joined);
+        }
+        action.batch_members = {{action.key(), action.command}};
+        action.command = std::move(command);
+    }
+}
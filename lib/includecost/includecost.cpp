@@ -0,0 +1,326 @@
+#include <includecost/includecost.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <utility>
+
+namespace {
+
+// Just enough JSON for traces.
+struct Json {
+    enum Kind { NONE, STRING, NUMBER, LITERAL, ARRAY, OBJECT } kind{NONE};
+    std::string string{};
+    double number{0};
+    std::vector<Json> elements{};
+    std::vector<std::pair<std::string, Json>> members{};
+
+    auto member(std::string_view name) const -> const Json* {
+        for (const auto& [key, value] : members)
+            if (key == name) return &value;
+        return nullptr;
+    }
+};
+
+void skip_whitespace(std::string_view& in) {
+    while (in.size()
+           and (in[0] == ' ' or in[0] == '\t' or in[0] == '\n'
+                or in[0] == '\r'))
+        in.remove_prefix(1);
+}
+
+void append_utf8(std::string& out, unsigned code_point) {
+    if (code_point < 0x80) out += char(code_point);
+    else if (code_point < 0x800) {
+        out += char(0xc0 | (code_point >> 6));
+        out += char(0x80 | (code_point & 0x3f));
+    } else if (code_point < 0x10000) {
+        out += char(0xe0 | (code_point >> 12));
+        out += char(0x80 | ((code_point >> 6) & 0x3f));
+        out += char(0x80 | (code_point & 0x3f));
+    } else {
+        out += char(0xf0 | (code_point >> 18));
+        out += char(0x80 | ((code_point >> 12) & 0x3f));
+        out += char(0x80 | ((code_point >> 6) & 0x3f));
+        out += char(0x80 | (code_point & 0x3f));
+    }
+}
+
+bool parse_hex(std::string_view& in, unsigned& out) {
+    if (in.size() < 4) return false;
+    out = 0;
+    for (size_t i = 0; i < 4; ++i) {
+        const char c = in[i];
+        out <<= 4;
+        if (c >= '0' and c <= '9') out |= unsigned(c - '0');
+        else if (c >= 'a' and c <= 'f') out |= unsigned(c - 'a' + 10);
+        else if (c >= 'A' and c <= 'F') out |= unsigned(c - 'A' + 10);
+        else return false;
+    }
+    in.remove_prefix(4);
+    return true;
+}
+
+bool parse_string(std::string_view& in, std::string& out) {
+    if (in.empty() or in[0] != '"') return false;
+    in.remove_prefix(1);
+    while (in.size() and in[0] != '"') {
+        if (in[0] != '\\') {
+            out += in[0];
+            in.remove_prefix(1);
+            continue;
+        }
+        in.remove_prefix(1);
+        if (in.empty()) return false;
+        const char c = in[0];
+        in.remove_prefix(1);
+        switch (c) {
+        case 'b': out += '\b'; break;
+        case 'f': out += '\f'; break;
+        case 'n': out += '\n'; break;
+        case 'r': out += '\r'; break;
+        case 't': out += '\t'; break;
+        case 'u': {
+            unsigned code_point{0};
+            if (not parse_hex(in, code_point)) return false;
+            // A surrogate pair stands for one code point.
+            unsigned low{0};
+            if (code_point >= 0xd800 and code_point < 0xdc00
+                and in.substr(0, 2) == "\\u") {
+                in.remove_prefix(2);
+                if (not parse_hex(in, low)) return false;
+                code_point =
+                    0x10000 + ((code_point - 0xd800) << 10) + (low - 0xdc00);
+            }
+            append_utf8(out, code_point);
+        } break;
+        default: out += c; break;
+        }
+    }
+    if (in.empty()) return false;
+    in.remove_prefix(1);
+    return true;
+}
+
+bool parse_value(std::string_view& in, Json& out, size_t depth) {
+    // Nothing a compiler writes nests anywhere near this deep.
+    if (depth > 64) return false;
+    skip_whitespace(in);
+    if (in.empty()) return false;
+    if (in[0] == '"') {
+        out.kind = Json::STRING;
+        return parse_string(in, out.string);
+    }
+    if (in[0] == '[' or in[0] == '{') {
+        const bool object = in[0] == '{';
+        const char end = object ? '}' : ']';
+        out.kind = object ? Json::OBJECT : Json::ARRAY;
+        in.remove_prefix(1);
+        skip_whitespace(in);
+        if (in.size() and in[0] == end) {
+            in.remove_prefix(1);
+            return true;
+        }
+        while (true) {
+            Json value{};
+            if (object) {
+                std::string key{};
+                skip_whitespace(in);
+                if (not parse_string(in, key)) return false;
+                skip_whitespace(in);
+                if (in.empty() or in[0] != ':') return false;
+                in.remove_prefix(1);
+                if (not parse_value(in, value, depth + 1)) return false;
+                out.members.emplace_back(std::move(key), std::move(value));
+            } else {
+                if (not parse_value(in, value, depth + 1)) return false;
+                out.elements.push_back(std::move(value));
+            }
+            skip_whitespace(in);
+            if (in.empty()) return false;
+            const char c = in[0];
+            in.remove_prefix(1);
+            if (c == end) return true;
+            if (c != ',') return false;
+        }
+    }
+    // A number, true, false or null.
+    size_t length{0};
+    while (length < in.size()
+           and (std::isalnum((unsigned char)in[length]) or in[length] == '-'
+                or in[length] == '+' or in[length] == '.'))
+        ++length;
+    if (not length) return false;
+    const std::string text{in.substr(0, length)};
+    in.remove_prefix(length);
+    if (text == "true" or text == "false" or text == "null") {
+        out.kind = Json::LITERAL;
+        return true;
+    }
+    char* end{nullptr};
+    out.kind = Json::NUMBER;
+    out.number = std::strtod(text.data(), &end);
+    return *end == '\0';
+}
+
+auto normal(const std::string& path) -> std::string {
+    return std::filesystem::path(path).lexically_normal().string();
+}
+
+void append_json_string(std::string& out, std::string_view text) {
+    out += '"';
+    for (const char c : text) {
+        if (c == '"' or c == '\\') {
+            out += '\\';
+            out += c;
+        } else if ((unsigned char)c < 0x20) {
+            char escaped[7];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", unsigned(c));
+            out += escaped;
+        } else out += c;
+    }
+    out += '"';
+}
+
+template<typename Value>
+auto most_costly(
+    const std::unordered_map<std::string, Value>& entries,
+    double Value::*ms,
+    size_t top
+) -> std::vector<const std::pair<const std::string, Value>*> {
+    std::vector<const std::pair<const std::string, Value>*> out{};
+    for (const auto& entry : entries) out.push_back(&entry);
+    std::sort(out.begin(), out.end(), [&](auto a, auto b) {
+        if (a->second.*ms != b->second.*ms)
+            return a->second.*ms > b->second.*ms;
+        return a->first < b->first;
+    });
+    if (out.size() > top) out.resize(top);
+    return out;
+}
+
+}  // namespace
+
+bool IncludeCosts::add(
+    std::string_view trace,
+    const std::vector<std::string>& includes
+) {
+    Json root{};
+    if (not parse_value(trace, root, 0)) return false;
+    // Either an object with the events, or just the events.
+    const Json* events = &root;
+    if (root.kind == Json::OBJECT) events = root.member("traceEvents");
+    if (not events or events->kind != Json::ARRAY) return false;
+
+    // Over this translation unit, so that it counts once for each header.
+    std::unordered_map<std::string, double> header_ms{};
+    for (const auto& include : includes) header_ms[normal(include)];
+    for (const auto& event : events->elements) {
+        const auto* name = event.member("name");
+        const auto* duration = event.member("dur");
+        if (not name or not duration or duration->kind != Json::NUMBER)
+            continue;
+        const auto* args = event.member("args");
+        const auto* detail = args ? args->member("detail") : nullptr;
+        const double ms = duration->number / 1000.0;
+        if (name->string == "Frontend") frontend_ms += ms;
+        if (not detail or detail->kind != Json::STRING) continue;
+        if (name->string == "Source") header_ms[normal(detail->string)] += ms;
+        else if (name->string == "InstantiateClass"
+                 or name->string == "InstantiateFunction") {
+            auto& instantiation = instantiations[detail->string];
+            instantiation.ms += ms;
+            ++instantiation.count;
+        }
+    }
+    for (const auto& [path, ms] : header_ms) {
+        auto& header = headers[path];
+        header.frontend_ms += ms;
+        ++header.translation_units;
+    }
+    ++translation_units;
+    return true;
+}
+
+auto IncludeCosts::text(size_t top) const -> std::string {
+    std::string out{};
+    char line[128];
+    snprintf(
+        line, sizeof(line),
+        "INCLUDE COSTS: %zu translation units, %.1f ms in the frontend\n",
+        translation_units, frontend_ms
+    );
+    out += line;
+    snprintf(
+        line, sizeof(line), "  %12s %6s  %s\n", "frontend ms", "TUs", "header"
+    );
+    out += line;
+    for (const auto* header :
+         most_costly(headers, &Header::frontend_ms, top)) {
+        snprintf(
+            line, sizeof(line), "  %12.1f %6zu  ", header->second.frontend_ms,
+            header->second.translation_units
+        );
+        out += line;
+        out += header->first;
+        out += '\n';
+    }
+
+    out += "\nTEMPLATE INSTANTIATIONS:\n";
+    snprintf(
+        line, sizeof(line), "  %12s %6s  %s\n", "ms", "count", "instantiation"
+    );
+    out += line;
+    for (const auto* instantiation :
+         most_costly(instantiations, &Instantiation::ms, top)) {
+        snprintf(
+            line, sizeof(line), "  %12.1f %6zu  ", instantiation->second.ms,
+            instantiation->second.count
+        );
+        out += line;
+        out += instantiation->first;
+        out += '\n';
+    }
+    return out;
+}
+
+auto IncludeCosts::json(size_t top) const -> std::string {
+    std::string out{};
+    char number[64];
+    snprintf(
+        number, sizeof(number),
+        "{\"translation_units\":%zu,\"frontend_ms\":%.3f,\"headers\":[",
+        translation_units, frontend_ms
+    );
+    out += number;
+    bool first{true};
+    for (const auto* header :
+         most_costly(headers, &Header::frontend_ms, top)) {
+        out += first ? "{\"path\":" : ",{\"path\":";
+        first = false;
+        append_json_string(out, header->first);
+        snprintf(
+            number, sizeof(number),
+            ",\"frontend_ms\":%.3f,\"translation_units\":%zu}",
+            header->second.frontend_ms, header->second.translation_units
+        );
+        out += number;
+    }
+    out += "],\"instantiations\":[";
+    first = true;
+    for (const auto* instantiation :
+         most_costly(instantiations, &Instantiation::ms, top)) {
+        out += first ? "{\"name\":" : ",{\"name\":";
+        first = false;
+        append_json_string(out, instantiation->first);
+        snprintf(
+            number, sizeof(number), ",\"ms\":%.3f,\"count\":%zu}",
+            instantiation->second.ms, instantiation->second.count
+        );
+        out += number;
+    }
+    out += "]}\n";
+    return out;
+}
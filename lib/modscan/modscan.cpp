@@ -0,0 +1,266 @@
+#include <modscan/modscan.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <stats/stats.h>
+
+static bool identifier_char(char c) {
+    return (c >= 'a' and c <= 'z') or (c >= 'A' and c <= 'Z')
+        or (c >= '0' and c <= '9') or c == '_';
+}
+
+bool scan_module_preamble(std::string_view contents, ModuleUnit& unit) {
+    unit = {};
+    // The module being declared, for partitions named without it.
+    std::string module{};
+    const auto add_import = [&](std::string name) {
+        if (std::find(unit.imports.begin(), unit.imports.end(), name)
+            == unit.imports.end())
+            unit.imports.push_back(std::move(name));
+    };
+
+    size_t i{0};
+    if (contents.substr(0, 3) == "\xef\xbb\xbf") i = 3;
+    const auto skip_space = [&] {
+        while (i < contents.size()
+               and (contents[i] == ' ' or contents[i] == '\t'
+                    or contents[i] == '\n' or contents[i] == '\r'
+                    or contents[i] == '\f' or contents[i] == '\v'))
+            ++i;
+    };
+    const auto word = [&] {
+        const auto start = i;
+        while (i < contents.size() and identifier_char(contents[i])) ++i;
+        return contents.substr(start, i - start);
+    };
+    // A module name, possibly with a partition: foo.bar:baz
+    const auto name = [&] {
+        std::string out{};
+        while (i < contents.size()
+               and (identifier_char(contents[i]) or contents[i] == '.'
+                    or contents[i] == ':'
+                    or contents[i] == ' ' or contents[i] == '\t')) {
+            if (contents[i] != ' ' and contents[i] != '\t') out += contents[i];
+            ++i;
+        }
+        return out;
+    };
+
+    while (true) {
+        skip_space();
+        if (i >= contents.size()) return false;
+
+        if (contents.compare(i, 2, "//") == 0) {
+            const auto end = contents.find('\n', i);
+            if (end == std::string_view::npos) return false;
+            i = end + 1;
+            continue;
+        }
+        if (contents.compare(i, 2, "/*") == 0) {
+            const auto end = contents.find("*/", i + 2);
+            if (end == std::string_view::npos) return false;
+            i = end + 2;
+            continue;
+        }
+        if (contents[i] == '#') {
+            // Up to the end of the line, minus continuations.
+            while (i < contents.size() and contents[i] != '\n') {
+                if (contents[i] == '\\' and i + 1 < contents.size()
+                    and contents[i + 1] == '\n')
+                    ++i;
+                ++i;
+            }
+            if (i >= contents.size()) return false;
+            continue;
+        }
+
+        const auto start = i;
+        auto keyword = word();
+        bool exported{false};
+        if (keyword == "export") {
+            exported = true;
+            skip_space();
+            keyword = word();
+        }
+        if (keyword != "module" and keyword != "import") return true;
+        // Not a declaration at all, rather something like `module = 0;`.
+        if (i < contents.size() and not strchr(" \t\r\n;:<\"", contents[i]))
+            return true;
+
+        const auto end = contents.find(';', i);
+        if (end == std::string_view::npos) {
+            i = start;
+            return false;
+        }
+        skip_space();
+        auto declared = name();
+        i = end + 1;
+
+        if (keyword == "module") {
+            // The global module fragment starts, or the private one (after
+            // which nothing is imported anymore).
+            if (declared.empty()) continue;
+            if (declared.front() == ':') return true;
+            module = declared.substr(0, declared.find(':'));
+            // Only interfaces and partitions produce an interface; any other
+            // implementation unit implicitly imports its module's.
+            if (exported or declared.find(':') != std::string::npos)
+                unit.provides = declared;
+            else add_import(declared);
+        } else if (declared.size()) {
+            // Header units have no name, and so are skipped.
+            if (declared.front() == ':') declared = module + declared;
+            add_import(declared);
+        }
+    }
+}
+
+// Every line after the header is
+//   <size>\t<modified>\t<provides>\t<imports, space separated>\t<path>
+// The path goes last, as it's the only field that could contain a tab.
+static constexpr const char* module_scans_header = "# lbs module scans v1\n";
+
+auto ModuleScans::Load(std::string path) -> ModuleScans {
+    ModuleScans scans{};
+    scans.path = std::move(path);
+
+    auto f = fopen(scans.path.data(), "rb");
+    if (not f) return scans;
+    char* line{nullptr};
+    size_t capacity{0};
+    ssize_t length{0};
+    size_t lines{0};
+    while ((length = getline(&line, &capacity, f)) > 0) {
+        if (line[length - 1] == '\n') line[--length] = '\0';
+        if (not lines++) {
+            if (strncmp(
+                    line, module_scans_header, strlen(module_scans_header) - 1
+                )
+                != 0)
+                break;
+            continue;
+        }
+
+        Entry entry{};
+        int offset{0};
+        // Not "\t%n", which would skip the tabs around empty fields too.
+        if (sscanf(
+                line, "%" SCNd64 "\t%" SCNd64 "%n", &entry.size,
+                &entry.modified, &offset
+            )
+                != 2
+            or not offset or line[offset] != '\t')
+            continue;
+        ++offset;
+        const std::string_view rest{line + offset, size_t(length - offset)};
+        const auto provides_end = rest.find('\t');
+        if (provides_end == std::string_view::npos) continue;
+        const auto imports_end = rest.find('\t', provides_end + 1);
+        if (imports_end == std::string_view::npos) continue;
+        entry.unit.provides = rest.substr(0, provides_end);
+        const auto imports =
+            rest.substr(provides_end + 1, imports_end - provides_end - 1);
+        for (size_t start = 0; start < imports.size();) {
+            auto end = imports.find(' ', start);
+            if (end == std::string_view::npos) end = imports.size();
+            if (end > start)
+                entry.unit.imports.emplace_back(
+                    imports.substr(start, end - start)
+                );
+            start = end + 1;
+        }
+        scans.entries[std::string(rest.substr(imports_end + 1))] =
+            std::move(entry);
+    }
+    free(line);
+    fclose(f);
+    return scans;
+}
+
+auto ModuleScans::scan(const std::string& source) -> const ModuleUnit& {
+    return scan(source, stat_file(source));
+}
+
+auto ModuleScans::scan(const std::string& source, const FileState& state)
+    -> const ModuleUnit& {
+    auto& entry = entries[source];
+
+    Entry fresh{};
+    if (state.exists) {
+        fresh.size = state.size;
+        fresh.modified = state.modified;
+    }
+    if (entry.size == fresh.size and entry.modified == fresh.modified) {
+        stat_count(STAT_MODULE_SCAN_HITS);
+        return entry.unit;
+    }
+    stat_count(STAT_SOURCES_SCANNED);
+
+    // The preamble is almost always within the first few kilobytes, so only
+    // read the rest of the source if it isn't.
+    if (auto f = fopen(source.data(), "rb")) {
+        std::string contents(16384, '\0');
+        contents.resize(fread(contents.data(), 1, contents.size(), f));
+        if (not scan_module_preamble(contents, fresh.unit)
+            and contents.size() == 16384) {
+            char buffer[65536];
+            size_t n{0};
+            while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+                contents.append(buffer, n);
+            scan_module_preamble(contents, fresh.unit);
+        }
+        fclose(f);
+    }
+    entry = std::move(fresh);
+    changed = true;
+    return entry.unit;
+}
+
+void ModuleScans::save() {
+    if (not changed or path.empty()) return;
+    auto f = fopen(path.data(), "wb");
+    if (not f) return;
+    fputs(module_scans_header, f);
+    for (const auto& [source, entry] : entries) {
+        // Such a path couldn't be read back.
+        if (source.find('\n') != std::string::npos) continue;
+        std::string imports{};
+        for (const auto& module : entry.unit.imports) {
+            if (imports.size()) imports += ' ';
+            imports += module;
+        }
+        fprintf(
+            f, "%" PRId64 "\t%" PRId64 "\t%s\t%s\t%s\n", entry.size,
+            entry.modified, entry.unit.provides.data(), imports.data(),
+            source.data()
+        );
+    }
+    fclose(f);
+    changed = false;
+}
+
+void ModuleScans::scan_sources(
+    BuildScenario& build_scenario,
+    FileStates& file_states
+) {
+    build_scenario.modules.clear();
+    std::vector<std::string> sources{};
+    for (const auto& target : build_scenario.targets)
+        sources.insert(
+            sources.end(), target.sources.begin(), target.sources.end()
+        );
+    file_states.prefetch(sources);
+    for (const auto& target : build_scenario.targets) {
+        for (const auto& source : target.sources) {
+            const auto& unit = scan(source, file_states.state(source));
+            if (unit.provides.size() or unit.imports.size())
+                build_scenario.modules[source] = unit;
+        }
+    }
+}
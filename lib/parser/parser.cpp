@@ -1,8 +1,10 @@
 #include <parser/parser.h>
 
+#include <stats/stats.h>
+
 #include <algorithm>
 #include <cctype>
-#include <format>
+#include <cstdlib>
 #include <string>
 #include <string_view>
 #include <vector>
@@ -14,49 +16,6 @@ struct IteratePastHelper {
     auto end() { return container.end(); }
 };
 
-// TODO: string syntax for identifiers with delimiters whitespace in them.
-struct Token {
-    enum Kind {
-        UNKNOWN,
-        EOF_,
-        LIST,
-        IDENTIFIER,
-    } kind;
-
-    std::string identifier;
-    std::vector<Token> elements;
-
-    static auto eof() -> Token { return {Token::Kind::EOF_, "", {}}; }
-
-    static void Print(const Token& token) {
-        switch (token.kind) {
-        case UNKNOWN: printf("Unknown"); break;
-        case EOF_: printf("EOF"); break;
-        case LIST: {
-            printf("(");
-            bool notfirst = false;
-            for (const auto& elem : token.elements) {
-                if (notfirst) printf(", ");
-                Token::Print(elem);
-                notfirst = true;
-            }
-            printf(")");
-        } break;
-        case IDENTIFIER: printf("ID:\"%s\"", token.identifier.data()); break;
-        }
-    }
-};
-
-constexpr bool token_is_eof(const Token& token) {
-    return token.kind == Token::Kind::EOF_;
-}
-constexpr bool token_is_list(const Token& token) {
-    return token.kind == Token::Kind::LIST;
-}
-constexpr bool token_is_identifier(const Token& token) {
-    return token.kind == Token::Kind::IDENTIFIER;
-}
-
 #define LEX_LIST_BEGIN '('
 #define LEX_LIST_END ')'
 #define LEX_LINE_COMMENT_BEGIN ';'
@@ -99,6 +58,7 @@ auto lex(std::string_view& source) -> Token {
 
     // Cannot lex a token from an empty source.
     if (source.empty()) return Token::eof();
+    stat_count(STAT_TOKENS_LEXED);
 
     // Get first character from source.
     const auto c = source.data()[0];
@@ -181,6 +141,68 @@ auto lex(std::string_view& source) -> Token {
     return out;
 }
 
+// Add what a source within (sources ...) stands for to target: a file path,
+// (directory-contents directory patterns...) for the files within directory
+// and its subdirectories, or (glob patterns...), where a pattern is a path
+// with wildcards in its last part only, before which `**` means within any
+// subdirectory as well (say, src/**/*.c).
+static void add_source(Target& target, const Token& source) {
+    if (token_is_identifier(source)) {
+        target.sources.push_back(source.identifier);
+        return;
+    }
+    const bool form = token_is_list(source) and source.elements.size() >= 2
+                  and std::all_of(
+                          source.elements.begin(), source.elements.end(),
+                          token_is_identifier
+                  );
+    const auto& name = form ? source.elements[0].identifier : std::string{};
+    if (name == "directory-contents") {
+        Target::SourceDirectory directory{
+            source.elements[1].identifier, {}, true};
+        for (size_t i = 2; i < source.elements.size(); ++i)
+            directory.patterns.push_back(source.elements[i].identifier);
+        target.source_directories.push_back(std::move(directory));
+        return;
+    }
+    if (name == "glob") {
+        for (size_t i = 1; i < source.elements.size(); ++i) {
+            std::string pattern = source.elements[i].identifier;
+            Target::SourceDirectory directory{".", {}, false};
+            const auto slash = pattern.rfind('/');
+            if (slash != std::string::npos) {
+                directory.directory = pattern.substr(0, slash);
+                pattern = pattern.substr(slash + 1);
+            }
+            const std::string parent = directory.directory;
+            if (parent == "**") {
+                directory.directory = ".";
+                directory.recursive = true;
+            } else if (parent.size() > 3
+                       and parent.compare(parent.size() - 3, 3, "/**") == 0) {
+                directory.directory = parent.substr(0, parent.size() - 3);
+                directory.recursive = true;
+            }
+            if (directory.directory.find_first_of("*?[") != std::string::npos) {
+                printf(
+                    "ERROR: Only the last part of glob pattern %s may have "
+                    "wildcards (after an optional **/)\n",
+                    source.elements[i].identifier.data()
+                );
+                exit(1);
+            }
+            directory.patterns.push_back(std::move(pattern));
+            target.source_directories.push_back(std::move(directory));
+        }
+        return;
+    }
+    printf(
+        "ERROR: Sources must be an identifier (just a file path), "
+        "(directory-contents directory patterns...) or (glob patterns...)\n"
+    );
+    exit(1);
+}
+
 auto parse(std::string_view source, std::string language) -> BuildScenario {
     // The idea is this will parse the source into a list of actions to
     // perform (i.e. shell commands to run for targets and that sort of
@@ -214,9 +236,9 @@ auto parse(std::string_view source, std::string language) -> BuildScenario {
         const auto identifier = token.elements[0].identifier;
 
         // TARGET CREATION
-        // "executable", "library", "target"
+        // "executable", "library", "shared-library", "target"
         if (identifier == "executable" or identifier == "library"
-            or identifier == "target") {
+            or identifier == "shared-library" or identifier == "target") {
             // Ensure second element is an identifier.
             if (token.elements.size() < 2
                 or not token_is_identifier(token.elements[1])) {
@@ -241,6 +263,8 @@ auto parse(std::string_view source, std::string language) -> BuildScenario {
             else if (identifier == "executable")
                 t_kind = Target::Kind::EXECUTABLE;
             else if (identifier == "library") t_kind = Target::Kind::LIBRARY;
+            else if (identifier == "shared-library")
+                t_kind = Target::Kind::SHARED_LIBRARY;
             else {
                 printf(
                     "ERROR: Unhandled target creation identifier %s\n",
@@ -282,8 +306,7 @@ auto parse(std::string_view source, std::string language) -> BuildScenario {
                 auto identifier = subtoken.elements[0].identifier;
 
                 if (identifier == "sources") {
-                    if (target->kind != Target::Kind::EXECUTABLE
-                        and target->kind != Target::Kind::LIBRARY) {
+                    if (not target->compiled()) {
                         printf(
                             "ERROR: %s is only applicable to executable and "
                             "library targets",
@@ -296,20 +319,10 @@ auto parse(std::string_view source, std::string language) -> BuildScenario {
                     IteratePastHelper<typeof subtoken.elements, 1> it_helper{
                         subtoken.elements  //
                     };
-                    for (const auto& source : it_helper) {
-                        // TODO: Handle (directory-contents)
-                        if (not token_is_identifier(source)) {
-                            printf(
-                                "ERROR: Sources must be an identifier "
-                                "(just a file path)\n"
-                            );
-                            exit(1);
-                        }
-                        target->sources.push_back(source.identifier);
-                    }
+                    for (const auto& source : it_helper)
+                        add_source(*target, source);
                 } else if (identifier == "include-directories") {
-                    if (target->kind != Target::Kind::EXECUTABLE
-                        and target->kind != Target::Kind::LIBRARY) {
+                    if (not target->compiled()) {
                         printf(
                             "ERROR: %s is only applicable to executable and "
                             "library targets",
@@ -333,8 +346,7 @@ auto parse(std::string_view source, std::string language) -> BuildScenario {
                         );
                     }
                 } else if (identifier == "flags") {
-                    if (target->kind != Target::Kind::EXECUTABLE
-                        and target->kind != Target::Kind::LIBRARY) {
+                    if (not target->compiled()) {
                         printf(
                             "ERROR: %s is only applicable to executable and "
                             "library targets",
@@ -354,8 +366,7 @@ auto parse(std::string_view source, std::string language) -> BuildScenario {
                         target->flags.push_back(flag.identifier);
                     }
                 } else if (identifier == "defines") {
-                    if (target->kind != Target::Kind::EXECUTABLE
-                        and target->kind != Target::Kind::LIBRARY) {
+                    if (not target->compiled()) {
                         printf(
                             "ERROR: %s is only applicable to executable and "
                             "library targets",
@@ -375,8 +386,7 @@ auto parse(std::string_view source, std::string language) -> BuildScenario {
                         target->defines.push_back(define.identifier);
                     }
                 } else if (identifier == "language") {
-                    if (target->kind != Target::Kind::EXECUTABLE
-                        and target->kind != Target::Kind::LIBRARY) {
+                    if (not target->compiled()) {
                         printf(
                             "ERROR: %s is only applicable to executable and "
                             "library targets",
@@ -393,6 +403,76 @@ auto parse(std::string_view source, std::string language) -> BuildScenario {
                         exit(1);
                     }
                     target->language = subtoken.elements.at(1).identifier;
+                } else if (identifier == "unity") {
+                    if (not target->compiled()) {
+                        printf(
+                            "ERROR: %s is only applicable to executable and "
+                            "library targets",
+                            identifier.data()
+                        );
+                        exit(1);
+                    }
+                    char* end{nullptr};
+                    if (subtoken.elements.size() == 2
+                        and token_is_identifier(subtoken.elements.at(1))) {
+                        const auto& size = subtoken.elements.at(1).identifier;
+                        target->unity = std::strtoul(size.data(), &end, 10);
+                    }
+                    if (not end or *end or not target->unity) {
+                        printf(
+                            "ERROR: unity must have one argument: the number "
+                            "of sources to compile together\n"
+                        );
+                        exit(1);
+                    }
+                } else if (identifier == "precompiled-header") {
+                    if (not target->compiled()) {
+                        printf(
+                            "ERROR: %s is only applicable to executable and "
+                            "library targets",
+                            identifier.data()
+                        );
+                        exit(1);
+                    }
+                    if (subtoken.elements.size() != 2
+                        or not token_is_identifier(subtoken.elements.at(1))) {
+                        printf(
+                            "ERROR: precompiled-header must have one "
+                            "identifier argument: the header\n"
+                        );
+                        exit(1);
+                    }
+                    target->precompiled_header =
+                        subtoken.elements.at(1).identifier;
+                } else if (identifier == "unity-exclude") {
+                    IteratePastHelper<typeof subtoken.elements, 1> it_helper{
+                        subtoken.elements  //
+                    };
+                    for (const auto& source : it_helper) {
+                        if (not token_is_identifier(source)) {
+                            printf(
+                                "ERROR: Excluded sources must be an identifier "
+                                "(just a file path)\n"
+                            );
+                            exit(1);
+                        }
+                        target->unity_excludes.push_back(source.identifier);
+                    }
+                } else if (identifier == "watches") {
+                    // Iterate all elements past operator position.
+                    IteratePastHelper<typeof subtoken.elements, 1> it_helper{
+                        subtoken.elements  //
+                    };
+                    for (const auto& watched : it_helper) {
+                        if (not token_is_identifier(watched)) {
+                            printf(
+                                "ERROR: Watched files must be an identifier "
+                                "(just a file path)\n"
+                            );
+                            exit(1);
+                        }
+                        target->watches.push_back(watched.identifier);
+                    }
                 } else {
                     printf(
                         "ERROR: Unrecognized operator %s within target "
@@ -430,6 +510,101 @@ auto parse(std::string_view source, std::string language) -> BuildScenario {
                 );
         }
 
+        // "watches" for targets of any kind
+        else if (identifier == "watches") {
+            // Ensure second element is an identifier.
+            if (token.elements.size() < 2
+                or not token_is_identifier(token.elements[1])) {
+                printf("ERROR: Second element must be an identifier");
+                exit(1);
+            }
+            std::string name = token.elements[1].identifier;
+            auto target = build_scenario.target(name);
+            if (target == build_scenario.targets.end()) {
+                printf(
+                    "ERROR: Second element must refer to an existing target "
+                    "(which \"%s\" does not)\n",
+                    name.data()
+                );
+                exit(1);
+            }
+            // Begin iterating all elements past target name.
+            IteratePastHelper<typeof token.elements, 2> it_helper{
+                token.elements  //
+            };
+            for (const auto& watched : it_helper) {
+                if (not token_is_identifier(watched)) {
+                    printf(
+                        "ERROR: Watched files must be an identifier "
+                        "(just a file path)\n"
+                    );
+                    exit(1);
+                }
+                target->watches.push_back(watched.identifier);
+            }
+            continue;
+        }
+
+        // "profile", flags and defines added to those of every target
+        else if (identifier == "profile") {
+            // Ensure second element is an identifier.
+            if (token.elements.size() < 2
+                or not token_is_identifier(token.elements[1])) {
+                printf("ERROR: Second element must be an identifier");
+                exit(1);
+            }
+            std::string name = token.elements[1].identifier;
+            // Its outputs go in a directory by that name.
+            if (name.empty() or name == "." or name == ".."
+                or name.find('/') != std::string::npos) {
+                printf("ERROR: Invalid profile name \"%s\"\n", name.data());
+                exit(1);
+            }
+            if (build_scenario.profile(name)) {
+                printf(
+                    "ERROR: Profiles must not share a name (hint: %s)\n",
+                    name.data()
+                );
+                exit(1);
+            }
+            BuildScenario::Profile profile{name};
+
+            // Begin iterating all elements past profile name.
+            IteratePastHelper<typeof token.elements, 2> it_helper{
+                token.elements  //
+            };
+            for (const auto& subtoken : it_helper) {
+                if (not token_is_list(subtoken) or subtoken.elements.empty()
+                    or not token_is_identifier(subtoken.elements[0])
+                    or (subtoken.elements[0].identifier != "flags"
+                        and subtoken.elements[0].identifier != "defines")) {
+                    printf(
+                        "ERROR: Expected (flags ...) or (defines ...) within "
+                        "profile %s\n",
+                        name.data()
+                    );
+                    exit(1);
+                }
+                auto& into = subtoken.elements[0].identifier == "flags"
+                               ? profile.flags
+                               : profile.defines;
+                IteratePastHelper<typeof subtoken.elements, 1> it_helper{
+                    subtoken.elements  //
+                };
+                for (const auto& element : it_helper) {
+                    if (not token_is_identifier(element)) {
+                        printf(
+                            "ERROR: Flags and defines must be identifiers\n"
+                        );
+                        exit(1);
+                    }
+                    into.push_back(element.identifier);
+                }
+            }
+            build_scenario.profiles.push_back(std::move(profile));
+            continue;
+        }
+
         // TARGET RELATED
         // "sources", "include-directories", "defines", "flags" for
         // executables and libraries
@@ -452,8 +627,7 @@ auto parse(std::string_view source, std::string language) -> BuildScenario {
                 );
                 exit(1);
             }
-            if (target->kind != Target::Kind::EXECUTABLE
-                and target->kind != Target::Kind::LIBRARY) {
+            if (not target->compiled()) {
                 printf(
                     "ERROR: %s is only applicable to executable and library "
                     "targets",
@@ -468,17 +642,8 @@ auto parse(std::string_view source, std::string language) -> BuildScenario {
                 IteratePastHelper<typeof token.elements, 2> it_helper{
                     token.elements  //
                 };
-                for (const auto& source : it_helper) {
-                    // TODO: Handle (directory-contents)
-                    if (not token_is_identifier(source)) {
-                        printf(
-                            "ERROR: Sources must be an identifier "
-                            "(just a file path)\n"
-                        );
-                        exit(1);
-                    }
-                    target->sources.push_back(source.identifier);
-                }
+                for (const auto& source : it_helper)
+                    add_source(*target, source);
             }
 
             // Register include directories in target
@@ -592,25 +757,56 @@ auto parse(std::string_view source, std::string language) -> BuildScenario {
                 }
             } else if (identifier == "copy") {
                 requisite.kind = Target::Requisite::Kind::COPY;
-                // TODO: Handle (directory ...), (directory-contents ...)
-                // Ensure third element is an identifier.
-                if (not token_is_identifier(token.elements[2])) {
+                if (token.elements.size() < 4 or token.elements.size() > 5) {
                     printf(
-                        "ERROR: copy source argument must be an identifier for "
-                        "now, sorry\n"
+                        "ERROR: copy takes a source and a destination, and "
+                        "optionally hard-link\n"
+                    );
+                    exit(1);
+                }
+                // The source is a file, (directory path) or
+                // (directory-contents path).
+                const auto& source = token.elements[2];
+                if (token_is_identifier(source)) {
+                    requisite.text = source.identifier;
+                } else if (token_is_list(source)
+                           and source.elements.size() == 2
+                           and token_is_identifier(source.elements[0])
+                           and token_is_identifier(source.elements[1])
+                           and (source.elements[0].identifier == "directory"
+                                or source.elements[0].identifier
+                                       == "directory-contents")) {
+                    requisite.source =
+                        source.elements[0].identifier == "directory"
+                            ? Target::Requisite::DIRECTORY
+                            : Target::Requisite::DIRECTORY_CONTENTS;
+                    requisite.text = source.elements[1].identifier;
+                } else {
+                    printf(
+                        "ERROR: copy source argument must be an identifier, "
+                        "(directory path) or (directory-contents path)\n"
                     );
                     exit(1);
                 }
-                requisite.text = token.elements[2].identifier;
                 // Ensure fourth element is an identifier.
                 if (not token_is_identifier(token.elements[3])) {
                     printf(
                         "ERROR: copy destination argument must be an "
-                        "identifier for now, sorry\n"
+                        "identifier\n"
                     );
                     exit(1);
                 }
-                requisite.text = token.elements[3].identifier;
+                requisite.destination = token.elements[3].identifier;
+                if (token.elements.size() == 5) {
+                    if (not token_is_identifier(token.elements[4])
+                        or token.elements[4].identifier != "hard-link") {
+                        printf(
+                            "ERROR: copy may only be followed by hard-link\n"
+                        );
+                        exit(1);
+                    }
+                    requisite.hard_link = true;
+                }
             } else if (identifier == "dependency") {
                 requisite.kind = Target::Requisite::Kind::DEPENDENCY;
                 // Ensure third element is an identifier.
@@ -633,7 +829,8 @@ auto parse(std::string_view source, std::string language) -> BuildScenario {
                 }
 
                 // If we are depending on a library target, link with it.
-                if (dep_target->kind == Target::Kind::LIBRARY)
+                if (dep_target->kind == Target::Kind::LIBRARY
+                    or dep_target->kind == Target::Kind::SHARED_LIBRARY)
                     target->linked_libraries.push_back(dep_target->name);
 
                 requisite.text = token.elements[2].identifier;
@@ -648,5 +845,6 @@ auto parse(std::string_view source, std::string language) -> BuildScenario {
         }
     }
     // BuildScenario::Print(build_scenario);
+    stat_count(STAT_TARGETS, build_scenario.targets.size());
     return build_scenario;
 }
@@ -0,0 +1,339 @@
+#include <perf/perf.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#    include <fcntl.h>
+#    include <sys/resource.h>
+#    include <sys/wait.h>
+#    include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+namespace {
+
+bool write_file(const std::string& path, const std::string& contents) {
+    auto f = fopen(path.data(), "wb");
+    if (not f) return false;
+    bool ok = fwrite(contents.data(), 1, contents.size(), f) == contents.size();
+    return fclose(f) == 0 and ok;
+}
+
+auto layer_of(const SyntheticProject& project, size_t target) -> size_t {
+    const size_t depth = std::min(
+        std::max(project.depth, size_t(1)), std::max(project.targets, size_t(1))
+    );
+    return target * depth / project.targets;
+}
+
+// The libraries target depends on: all of those in the layer below.
+auto dependencies_of(const SyntheticProject& project, size_t target)
+    -> std::vector<size_t> {
+    std::vector<size_t> dependencies{};
+    const auto layer = layer_of(project, target);
+    if (not layer) return dependencies;
+    for (size_t other = 0; other < target; ++other)
+        if (layer_of(project, other) + 1 == layer)
+            dependencies.push_back(other);
+    return dependencies;
+}
+
+auto name(size_t target) -> std::string {
+    return "t" + std::to_string(target);
+}
+
+auto function(size_t target, char kind, size_t index) -> std::string {
+    return name(target) + '_' + kind + std::to_string(index);
+}
+
+auto header_count(const SyntheticProject& project) -> size_t {
+    return std::max(project.headers, size_t(1));
+}
+
+// Header index of target declares the function of one of its sources, and
+// defines an inline function of its own.
+auto header(const SyntheticProject& project, size_t target, size_t index)
+    -> std::string {
+    const auto declared = function(target, 's', index % project.sources);
+    const auto defined = function(target, 'h', index);
+    std::string out{"#pragma once\n\n"};
+    if (project.heavy) out += "#include <string>\n#include <vector>\n\n";
+    out += "int " + declared + "(int x);\n\n";
+    out += "inline int " + defined + "(int x) {\n";
+    if (project.heavy) {
+        out += "    std::vector<std::string> digits{std::to_string(x)};\n";
+        out += "    return int(digits.front().size()) * " +
+               std::to_string(index + 1) + ";\n";
+    } else out += "    return x * " + std::to_string(index + 1) + ";\n";
+    out += "}\n";
+    return out;
+}
+
+// Source index of target includes project.headers headers, every other one
+// of a dependency, and calls the functions they declare and define (but
+// only those of sources of other libraries, to keep from recursing).
+auto source(
+    const SyntheticProject& project, size_t target, size_t index,
+    const std::vector<size_t>& dependencies
+) -> std::string {
+    std::vector<std::pair<size_t, size_t>> included{};
+    for (size_t h = 0; h < project.headers; ++h) {
+        const auto owner =
+            h % 2 == 0 or dependencies.empty()
+                ? target
+                : dependencies[(index + h / 2) % dependencies.size()];
+        const std::pair<size_t, size_t> header{
+            owner, (index + h) % header_count(project)};
+        bool seen{false};
+        for (const auto& other : included) seen = seen or other == header;
+        if (not seen) included.push_back(header);
+    }
+
+    std::string out{};
+    for (const auto& [owner, header] : included)
+        out += "#include \"" + name(owner) + "/h" + std::to_string(header) +
+               ".h\"\n";
+    if (project.heavy)
+        out += "\n#include <algorithm>\n#include <map>\n#include <string>\n"
+               "#include <vector>\n";
+    out += "\nint " + function(target, 's', index) + "(int x) {\n";
+    out += "    int result = x + " + std::to_string(index) + ";\n";
+    if (project.heavy) {
+        out += "    std::map<std::string, std::vector<int>> table{};\n";
+        out += "    for (int i = 0; i < x; ++i)\n";
+        out += "        table[std::to_string(i % 7)].push_back(i);\n";
+        out += "    std::vector<std::pair<std::string, int>> sizes{};\n";
+        out += "    for (const auto& [key, values] : table)\n";
+        out += "        sizes.emplace_back(key, int(values.size()));\n";
+        out += "    std::sort(sizes.rbegin(), sizes.rend());\n";
+        out += "    if (not sizes.empty()) result += sizes.front().second;\n";
+    }
+    for (const auto& [owner, header] : included) {
+        out += "    result += " + function(owner, 'h', header) + "(x);\n";
+        if (owner != target)
+            out += "    result += " +
+                   function(owner, 's', header % project.sources) + "(x);\n";
+    }
+    out += "    return result;\n}\n";
+    return out;
+}
+
+auto describe(const SyntheticProject& project) -> std::string {
+    return std::to_string(project.targets) + " libraries of " +
+           std::to_string(project.sources) + " " +
+           (project.heavy ? "heavy" : "tiny") + " sources, " +
+           std::to_string(project.depth) + " layers deep, " +
+           std::to_string(project.headers) + " headers per source";
+}
+
+auto microseconds(const timeval& time) -> long long {
+    return (long long)time.tv_sec * 1000000 + time.tv_usec;
+}
+
+auto cpu_microseconds(const rusage& usage) -> long long {
+    return microseconds(usage.ru_utime) + microseconds(usage.ru_stime);
+}
+
+auto file_name(const char* path) -> const char* {
+    const char* slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+}  // namespace
+
+bool generate_project(
+    const std::string& directory, const SyntheticProject& project
+) {
+    if (not project.targets or not project.sources) return false;
+    std::error_code error{};
+    fs::remove_all(directory, error);
+    if (error) return false;
+
+    std::string lbs{";; Generated by lbs-perf: " + describe(project) + ".\n"};
+    std::string main{};
+    std::string main_body{};
+    for (size_t target = 0; target < project.targets; ++target) {
+        const auto path = directory + '/' + name(target);
+        fs::create_directories(path, error);
+        if (error) return false;
+
+        const auto dependencies = dependencies_of(project, target);
+        for (size_t h = 0; h < header_count(project); ++h)
+            if (not write_file(
+                    path + "/h" + std::to_string(h) + ".h",
+                    header(project, target, h)
+                ))
+                return false;
+        lbs += "\n(library\n " + name(target) +
+               "\n (include-directories .)\n (sources";
+        for (size_t s = 0; s < project.sources; ++s) {
+            const auto file = name(target) + "/s" + std::to_string(s) + ".cpp";
+            if (not write_file(
+                    directory + '/' + file,
+                    source(project, target, s, dependencies)
+                ))
+                return false;
+            lbs += "\n  " + file;
+        }
+        lbs += ")";
+        if (project.heavy) lbs += "\n (flags -O2)";
+        lbs += ")\n";
+        for (auto dependency : dependencies)
+            lbs += "(dependency " + name(target) + ' ' + name(dependency) +
+                   ")\n";
+
+        main += "int " + function(target, 's', 0) + "(int x);\n";
+        main_body += "    result += " + function(target, 's', 0) + "(argc);\n";
+    }
+
+    // The libraries are linked in the order of the dependencies, those that
+    // depend on others first.
+    lbs += "\n(executable app (sources main.cpp))\n";
+    for (size_t target = project.targets; target--;)
+        lbs += "(dependency app " + name(target) + ")\n";
+    main += "\nint main(int argc, char**) {\n    int result{0};\n" + main_body +
+            "    return result == 42;\n}\n";
+
+    return write_file(directory + "/main.cpp", main)
+           and write_file(directory + "/.lbs", lbs);
+}
+
+auto edited_source(const SyntheticProject& project) -> std::string {
+    return name(project.targets / 2) + "/s0.cpp";
+}
+
+auto edited_header(const SyntheticProject&) -> std::string {
+    return name(0) + "/h0.h";
+}
+
+bool time_commands(
+    const std::string& self, const std::string& directory,
+    const std::string& log
+) {
+    std::error_code error{};
+    fs::create_directories(directory, error);
+    if (error) return false;
+    for (const char* command : {"cc", "c++", "ar"}) {
+        const auto link = directory + '/' + command;
+        fs::remove(link, error);
+        fs::create_symlink(self, link, error);
+        if (error) return false;
+    }
+
+    const char* path = getenv("PATH");
+    const std::string original{path ? path : "/usr/bin:/bin"};
+    setenv(perf_path_variable, original.data(), 1);
+    setenv("PATH", (directory + ':' + original).data(), 1);
+    setenv(perf_log_variable, log.data(), 1);
+    return true;
+}
+
+bool running_as_command(const char* argv0) {
+    const std::string name{file_name(argv0)};
+    return getenv(perf_path_variable)
+           and (name == "cc" or name == "c++" or name == "ar");
+}
+
+int run_timed_command(int, const char** argv) {
+    const auto started = std::chrono::steady_clock::now();
+    const std::string log{getenv(perf_log_variable)};
+    setenv("PATH", getenv(perf_path_variable), 1);
+    // Whatever the command runs in turn (say, cc going through ccache)
+    // isn't counted twice.
+    unsetenv(perf_path_variable);
+    unsetenv(perf_log_variable);
+
+    const char* command = file_name(argv[0]);
+    const pid_t pid = fork();
+    if (pid < 0) return 127;
+    if (pid == 0) {
+        execvp(command, const_cast<char**>(argv));
+        fprintf(
+            stderr, "lbs-perf: can't run %s: %s\n", command, strerror(errno)
+        );
+        _exit(127);
+    }
+    int status{0};
+    rusage child{};
+    while (wait4(pid, &status, 0, &child) < 0)
+        if (errno != EINTR) return 127;
+    rusage self{};
+    getrusage(RUSAGE_SELF, &self);
+    const auto wall = std::chrono::duration_cast<std::chrono::microseconds>(
+                          std::chrono::steady_clock::now() - started
+    )
+                          .count();
+
+    // One line per command, appended in a single write so that the lines of
+    // commands running at once don't mix.
+    char line[64];
+    const int size = snprintf(
+        line, sizeof(line), "%lld %lld\n", (long long)wall,
+        cpu_microseconds(child) + cpu_microseconds(self)
+    );
+    const int fd = open(log.data(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd >= 0) {
+        if (write(fd, line, size_t(size)) != size)
+            fprintf(stderr, "lbs-perf: can't write to %s\n", log.data());
+        close(fd);
+    }
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    return 128 + (WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+}
+
+bool time_build(
+    const std::vector<std::string>& argv, const std::string& directory,
+    const std::string& log, BuildTiming& timing
+) {
+    std::vector<char*> args{};
+    for (const auto& arg : argv) args.push_back(const_cast<char*>(arg.data()));
+    args.push_back(nullptr);
+    std::remove(log.data());
+
+    const auto started = std::chrono::steady_clock::now();
+    const pid_t pid = fork();
+    if (pid < 0) return false;
+    if (pid == 0) {
+        const int null = open("/dev/null", O_RDWR);
+        if (null < 0 or chdir(directory.data()) != 0) _exit(127);
+        dup2(null, STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execv(args[0], args.data());
+        _exit(127);
+    }
+    int status{0};
+    // Includes everything it ran (and waited for).
+    rusage usage{};
+    while (wait4(pid, &status, 0, &usage) < 0)
+        if (errno != EINTR) return false;
+    timing = BuildTiming{};
+    timing.wall_ms = std::chrono::duration<double, std::milli>(
+                         std::chrono::steady_clock::now() - started
+    )
+                         .count();
+    timing.cpu_ms = double(cpu_microseconds(usage)) / 1000.0;
+
+    if (auto f = fopen(log.data(), "rb")) {
+        long long wall{0};
+        long long cpu{0};
+        while (fscanf(f, "%lld %lld", &wall, &cpu) == 2) {
+            ++timing.commands;
+            timing.command_wall_ms += double(wall) / 1000.0;
+            timing.command_cpu_ms += double(cpu) / 1000.0;
+        }
+        fclose(f);
+    }
+    return WIFEXITED(status) and WEXITSTATUS(status) == 0;
+}
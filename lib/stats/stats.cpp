@@ -0,0 +1,146 @@
+#include <stats/stats.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+
+namespace {
+
+struct Phase {
+    std::string name;
+    double wall_ms{};
+    double cpu_ms{};
+    double children_cpu_ms{};
+    uint64_t allocations{};
+    int64_t peak_rss_kib{};
+};
+
+const char* counter_names[STAT_COUNTERS]{
+    "tokens lexed",       "targets",
+    "actions planned",    "actions up to date",
+    "actions run",        "processes spawned",
+    "files stat'ed",      "file state cache hits",
+    "files hashed",       "content hash cache hits",
+    "sources scanned",    "module scan cache hits",
+    "allocations",
+};
+
+bool started{false};
+int64_t started_ns{};
+// In the order they were first measured, with those measured more than once
+// added up.
+std::vector<Phase> phases{};
+
+auto now_ns() -> int64_t {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()
+    )
+        .count();
+}
+
+// CPU time of the process (all of its threads), or of its children that
+// were waited for.
+auto cpu_us(bool children) -> int64_t {
+    rusage usage{};
+    getrusage(children ? RUSAGE_CHILDREN : RUSAGE_SELF, &usage);
+    return (int64_t(usage.ru_utime.tv_sec) + usage.ru_stime.tv_sec) * 1000000
+         + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+// Start the peak resident set size over, so that the peak of a phase is its
+// own (if the kernel allows, since Linux 4.0).
+void reset_peak_rss() {
+    if (auto f = fopen("/proc/self/clear_refs", "w")) {
+        fputs("5", f);
+        fclose(f);
+    }
+}
+
+auto peak_rss_kib() -> int64_t {
+    if (auto f = fopen("/proc/self/status", "r")) {
+        char line[256];
+        int64_t peak{-1};
+        while (peak < 0 and fgets(line, sizeof(line), f))
+            if (strncmp(line, "VmHWM:", 6) == 0)
+                peak = std::strtoll(line + 6, nullptr, 10);
+        fclose(f);
+        if (peak >= 0) return peak;
+    }
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+}  // namespace
+
+void stats_start() {
+    started = true;
+    started_ns = now_ns();
+    phases.clear();
+    for (auto& count : stat_counts.counts)
+        count.store(0, std::memory_order_relaxed);
+}
+
+StatPhase::StatPhase(const char* name) : name(name), measuring(started) {
+    if (not measuring) return;
+    reset_peak_rss();
+    allocations = stat_counted(STAT_ALLOCATIONS);
+    cpu_us = ::cpu_us(false);
+    children_cpu_us = ::cpu_us(true);
+    wall_ns = now_ns();
+}
+
+void StatPhase::end() {
+    if (not measuring) return;
+    measuring = false;
+    Phase phase{
+        name,
+        double(now_ns() - wall_ns) / 1e6,
+        double(::cpu_us(false) - cpu_us) / 1e3,
+        double(::cpu_us(true) - children_cpu_us) / 1e3,
+        stat_counted(STAT_ALLOCATIONS) - allocations,
+        peak_rss_kib()};
+    auto known = std::find_if(phases.begin(), phases.end(), [&](auto& p) {
+        return p.name == phase.name;
+    });
+    if (known == phases.end()) {
+        phases.push_back(std::move(phase));
+        return;
+    }
+    known->wall_ms += phase.wall_ms;
+    known->cpu_ms += phase.cpu_ms;
+    known->children_cpu_ms += phase.children_cpu_ms;
+    known->allocations += phase.allocations;
+    known->peak_rss_kib = std::max(known->peak_rss_kib, phase.peak_rss_kib);
+}
+
+void stats_print() {
+    printf(
+        "\nSTATS:\n  %-10s %10s %10s %14s %12s %14s\n", "phase", "wall ms",
+        "cpu ms", "commands cpu", "allocations", "peak rss MiB"
+    );
+    for (const auto& phase : phases)
+        printf(
+            "  %-10s %10.2f %10.2f %14.2f %12llu %14.1f\n", phase.name.data(),
+            phase.wall_ms, phase.cpu_ms, phase.children_cpu_ms,
+            (unsigned long long)phase.allocations,
+            double(phase.peak_rss_kib) / 1024.0
+        );
+    if (started)
+        printf(
+            "  %-10s %10.2f\n", "total", double(now_ns() - started_ns) / 1e6
+        );
+    printf("\n");
+    for (size_t counter = 0; counter < STAT_COUNTERS; ++counter)
+        printf(
+            "  %-24s %llu\n", counter_names[counter],
+            (unsigned long long)stat_counted(StatCounter(counter))
+        );
+    fflush(stdout);
+}
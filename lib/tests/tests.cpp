@@ -1,7 +1,35 @@
 #include <tests/tests.h>
 
+#include <contenthash/contenthash.h>
+#include <copy/copy.h>
+#include <daemon/daemon.h>
+#include <dirindex/dirindex.h>
+#include <executor/executor.h>
+#include <filestate/filestate.h>
+#include <includecost/includecost.h>
+#include <modscan/modscan.h>
 #include <parser/parser.h>
+#include <perf/perf.h>
+#include <stats/stats.h>
+#include <toninja/toninja.h>
+#include <worker/worker.h>
+#include <algorithm>
+#include <chrono>
 #include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <thread>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 struct TestReturnValue {
     bool success{};
@@ -15,6 +43,45 @@ struct TestFunction {
     TestFunctionType function;
 };
 
+// What f() wrote to stdout.
+static auto capture_stdout(const std::function<void()>& f) -> std::string {
+    fflush(stdout);
+    const auto path =
+        (std::filesystem::temp_directory_path() / "lbs_test_stdout").string();
+    const int saved = dup(STDOUT_FILENO);
+    const int file = open(path.data(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    dup2(file, STDOUT_FILENO);
+    close(file);
+    f();
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+
+    std::string output{};
+    if (auto in = fopen(path.data(), "rb")) {
+        char buffer[4096];
+        size_t n{0};
+        while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0)
+            output.append(buffer, n);
+        fclose(in);
+    }
+    std::remove(path.data());
+    return output;
+}
+
+// The contents of the file at path; empty if it can't be read.
+static auto read_contents(const std::string& path) -> std::string {
+    std::string contents{};
+    if (auto f = fopen(path.data(), "rb")) {
+        char buffer[4096];
+        size_t n{0};
+        while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+            contents.append(buffer, n);
+        fclose(f);
+    }
+    return contents;
+}
+
 /// ==BEGIN== PARSER TESTS
 auto test_libparser_empty() -> const TestReturnValue {
     auto build_scenario = parse("", "");
@@ -22,15 +89,1498 @@ auto test_libparser_empty() -> const TestReturnValue {
     // are good.
     return {true};
 }
+auto test_libparser_watches() -> const TestReturnValue {
+    auto build_scenario = parse(
+        "(executable foo (sources foo.c) (watches foo.txt))\n"
+        "(watches foo bar.txt)\n",
+        "c"
+    );
+    auto target = build_scenario.target("foo");
+    if (target == build_scenario.targets.end())
+        return {false, "Missing target foo"};
+    if (target->watches != std::vector<std::string>{"foo.txt", "bar.txt"})
+        return {false, "Expected foo to watch foo.txt and bar.txt"};
+    return {true};
+}
+auto test_libparser_unity() -> const TestReturnValue {
+    auto build_scenario = parse(
+        "(library foo (sources a.c b.c c.c) (unity 2) (unity-exclude b.c))\n",
+        "c"
+    );
+    auto target = build_scenario.target("foo");
+    if (target == build_scenario.targets.end())
+        return {false, "Missing target foo"};
+    if (target->unity != 2) return {false, "Expected foo to have unity 2"};
+    if (target->unity_excludes != std::vector<std::string>{"b.c"})
+        return {false, "Expected foo to exclude b.c from unity batches"};
+    return {true};
+}
+auto test_libparser_copy() -> const TestReturnValue {
+    auto build_scenario = parse(
+        "(executable foo (sources foo.c))\n"
+        "(copy foo readme.txt out/readme.txt)\n"
+        "(copy foo (directory-contents assets) out hard-link)\n",
+        "c"
+    );
+    auto target = build_scenario.target("foo");
+    if (target == build_scenario.targets.end())
+        return {false, "Missing target foo"};
+    if (target->requisites.size() != 2)
+        return {false, "Expected foo to have two copies"};
+    const auto& file = target->requisites[0];
+    if (file.text != "readme.txt" or file.destination != "out/readme.txt"
+        or file.source != Target::Requisite::FILE or file.hard_link)
+        return {false, "Expected readme.txt to be copied to out/readme.txt"};
+    const auto& contents = target->requisites[1];
+    if (contents.text != "assets" or contents.destination != "out"
+        or contents.source != Target::Requisite::DIRECTORY_CONTENTS
+        or not contents.hard_link)
+        return {false, "Expected the contents of assets to be linked to out"};
+    return {true};
+}
+auto test_libparser_glob() -> const TestReturnValue {
+    auto build_scenario = parse(
+        "(library foo (sources foo.c (glob src/**/*.c *.S)"
+        " (directory-contents gen *.cc *.cpp)))\n",
+        "c"
+    );
+    auto target = build_scenario.target("foo");
+    if (target == build_scenario.targets.end())
+        return {false, "Missing target foo"};
+    if (target->sources != std::vector<std::string>{"foo.c"})
+        return {false, "Expected foo.c to be foo's only listed source"};
+    const auto& directories = target->source_directories;
+    if (directories.size() != 3)
+        return {false, "Expected foo to have three source directories"};
+    if (directories[0].directory != "src" or not directories[0].recursive
+        or directories[0].patterns != std::vector<std::string>{"*.c"})
+        return {false, "Expected src/**/*.c to match *.c under src"};
+    if (directories[1].directory != "." or directories[1].recursive
+        or directories[1].patterns != std::vector<std::string>{"*.S"})
+        return {false, "Expected *.S to match *.S in ."};
+    if (directories[2].directory != "gen" or not directories[2].recursive
+        or directories[2].patterns.size() != 2)
+        return {false, "Expected the contents of gen to match two patterns"};
+    return {true};
+}
 // TODO: To better write more tests, we need to not just exit(1) when the
 // parser errors and instead return a meaningful error value. This is
 // fine, however the problem lies in that C++ is still stuck in 1975 and
 // doesn't have string interpolation and formatting figured out yet.
 /// ==FINAL== PARSER TESTS
 
+/// ==BEGIN== MODSCAN TESTS
+auto test_libmodscan_preamble() -> const TestReturnValue {
+    ModuleUnit unit{};
+    const bool complete = scan_module_preamble(
+        "// Interface\n"
+        "module;\n"
+        "#include <cstdio>\n"
+        "export module foo.bar:baz;\n"
+        "import <vector>;\n"
+        "/* import commented; */\n"
+        "export import :qux;\n"
+        "import std;\n"
+        "int import_later;\n"
+        "import never;\n",
+        unit
+    );
+    if (not complete) return {false, "Expected the preamble to end"};
+    if (unit.provides != "foo.bar:baz")
+        return {false, "Expected the unit to provide foo.bar:baz"};
+    if (unit.imports != std::vector<std::string>{"foo.bar:qux", "std"})
+        return {false, "Expected the unit to import foo.bar:qux and std"};
+
+    scan_module_preamble("module foo;\nint x;\n", unit);
+    if (unit.provides.size()
+        or unit.imports != std::vector<std::string>{"foo"})
+        return {false, "Expected an implementation unit to import foo"};
+    return {true};
+}
+auto test_libmodscan_load() -> const TestReturnValue {
+    const auto directory = std::filesystem::temp_directory_path();
+    const auto source = (directory / "lbs_test_modscan.cpp").string();
+    const auto path = (directory / "lbs_test_modscan").string();
+    if (auto f = fopen(source.data(), "wb")) {
+        fputs("int main() {}\n", f);
+        fclose(f);
+    }
+    auto scans = ModuleScans::Load(path);
+    scans.scan(source);
+    scans.save();
+
+    // Neither providing nor importing a module, its fields are empty.
+    const auto loaded = ModuleScans::Load(path);
+    std::remove(source.data());
+    std::remove(path.data());
+    const auto entry = loaded.entries.find(source);
+    if (entry == loaded.entries.end())
+        return {false, "Expected the scan of a plain source to be loaded"};
+    if (entry->second.size != 14)
+        return {false, "Expected the size of the source to be loaded"};
+    return {true};
+}
+/// ==FINAL== MODSCAN TESTS
+
+/// ==BEGIN== INCLUDECOST TESTS
+auto test_libincludecost_add() -> const TestReturnValue {
+    IncludeCosts costs{};
+    const bool added = costs.add(
+        "{\"traceEvents\": [\n"
+        " {\"ph\": \"X\", \"name\": \"Source\", \"dur\": 3000,\n"
+        "  \"args\": {\"detail\": \"./inc/a.h\"}},\n"
+        " {\"ph\": \"X\", \"name\": \"Source\", \"dur\": 1000,\n"
+        "  \"args\": {\"detail\": \"inc/b.h\"}},\n"
+        " {\"ph\": \"X\", \"name\": \"InstantiateClass\", \"dur\": 500,\n"
+        "  \"args\": {\"detail\": \"std::vector<\\\"x\\\">\"}},\n"
+        " {\"ph\": \"X\", \"name\": \"Frontend\", \"dur\": 5000.5},\n"
+        " {\"ph\": \"M\", \"name\": \"process_name\", \"args\": {}}\n"
+        "], \"beginningOfTime\": -1.5e3, \"x\": [true, null]}",
+        {"inc/a.h", "inc/c.h"}
+    );
+    if (not added) return {false, "Expected the trace to be read"};
+    if (costs.add("{\"traceEvents\": [", {}))
+        return {false, "Expected a truncated trace not to be read"};
+    if (costs.translation_units != 1 or costs.frontend_ms != 5.0005)
+        return {false, "Expected one translation unit of 5.0005 ms"};
+    if (costs.headers.size() != 3 or costs.headers["inc/a.h"].frontend_ms != 3
+        or costs.headers["inc/a.h"].translation_units != 1
+        or costs.headers["inc/c.h"].translation_units != 1)
+        return {false, "Expected inc/a.h, inc/b.h and inc/c.h, once each"};
+    const auto& instantiation = costs.instantiations["std::vector<\"x\">"];
+    if (instantiation.count != 1 or instantiation.ms != 0.5)
+        return {false, "Expected an instantiation of std::vector<\"x\">"};
+
+    const auto json = costs.json(1);
+    if (json.find("\"headers\":[{\"path\":\"inc/a.h\",\"frontend_ms\":3.000,")
+            == std::string::npos
+        or json.find("inc/b.h") != std::string::npos)
+        return {false, "Expected only the most costly header in JSON"};
+    return {true};
+}
+/// ==FINAL== INCLUDECOST TESTS
+
+/// ==BEGIN== FILESTATE TESTS
+auto test_libfilestate_archive_members() -> const TestReturnValue {
+    // A GNU archive: a symbol table, long names, then two members.
+    const auto header = [](std::string name, size_t size) {
+        char line[61];
+        snprintf(
+            line, sizeof(line), "%-16s%-12s%-6s%-6s%-8s%-10zu`\n",
+            name.data(), "0", "0", "0", "644", size
+        );
+        return std::string(line);
+    };
+    const std::string long_names = "a_rather_long_name.c.o/\n";
+    const std::string archive = "!<arch>\n" + header("/", 4)
+                              + std::string(4, '\0') + header("//", 24)
+                              + long_names + header("/0", 3) + "abc\n"
+                              + header("b.c.o/", 2) + "bc";
+    const auto path =
+        (std::filesystem::temp_directory_path() / "lbs_test_archive.a")
+            .string();
+    auto f = fopen(path.data(), "wb");
+    if (not f) return {false, "Cannot write " + path};
+    fwrite(archive.data(), 1, archive.size(), f);
+    fclose(f);
+
+    std::vector<std::string> members{};
+    const bool read = archive_members(path, members);
+    std::remove(path.data());
+    if (not read) return {false, "Expected the archive to be read"};
+    if (members != std::vector<std::string>{"a_rather_long_name.c.o", "b.c.o"})
+        return {false, "Expected a_rather_long_name.c.o and b.c.o"};
+    return {true};
+}
+auto test_libfilestate_stat_files() -> const TestReturnValue {
+    const auto directory =
+        std::filesystem::temp_directory_path() / "lbs_test_stat_files";
+    std::filesystem::create_directories(directory);
+    // Enough to be stat'ed in batches, with every other one missing.
+    std::vector<std::string> paths{};
+    for (size_t i = 0; i < 100; ++i) {
+        paths.push_back((directory / std::to_string(i)).string());
+        if (i % 2) continue;
+        auto f = fopen(paths.back().data(), "wb");
+        if (not f) return {false, "Cannot write " + paths.back()};
+        fwrite("lbs", 1, i % 4, f);
+        fclose(f);
+    }
+
+    const auto states = stat_files(paths);
+    std::vector<FileState> expected{};
+    for (const auto& path : paths) expected.push_back(stat_file(path));
+    std::filesystem::remove_all(directory);
+    for (size_t i = 0; i < paths.size(); ++i) {
+        if (states[i].exists != (i % 2 == 0)
+            or states[i].exists != expected[i].exists
+            or states[i].modified != expected[i].modified
+            or states[i].size != expected[i].size
+            or states[i].device != expected[i].device
+            or states[i].inode != expected[i].inode)
+            return {false, "Expected the same state as stat() of " + paths[i]};
+    }
+    return {true};
+}
+auto test_libfilestate_unchanged_inputs() -> const TestReturnValue {
+    const auto directory =
+        std::filesystem::temp_directory_path() / "lbs_test_unchanged_inputs";
+    std::filesystem::create_directories(directory);
+    const auto source = (directory / "a.c").string();
+    const auto object = (directory / "a.c.o").string();
+    const auto write = [](const std::string& path, const char* contents) {
+        auto f = fopen(path.data(), "wb");
+        if (f) {
+            fputs(contents, f);
+            fclose(f);
+        }
+    };
+    const auto age = [](const std::string& path, int seconds) {
+        const auto now = std::filesystem::file_time_type::clock::now();
+        std::filesystem::last_write_time(
+            path, now - std::chrono::seconds(seconds)
+        );
+    };
+
+    BuildScenario::BuildCommands build_commands{};
+    BuildScenario::BuildCommands::Action compile{};
+    compile.command = "cc -c " + source + " -o " + object;
+    compile.inputs = {source};
+    compile.outputs = {object};
+    build_commands.push_back(compile);
+
+    write(source, "int a;\n");
+    write(object, "object");
+    age(source, 20);
+    age(object, 10);
+    auto hashes = ContentHashes::Load("");
+    ActionLog log{};
+    ActionLog::Entry entry{hash_command(compile.command)};
+    FileStates file_states{};
+    entry.input_hash = hash_action_inputs(compile, hashes, file_states);
+    log.record(compile.key(), entry);
+
+    // Touched, but just the same.
+    age(source, 5);
+    file_states.clear();
+    const bool touched = outdated_actions(
+        build_commands, log, file_states, nullptr, &hashes
+    )[0];
+    // Changed.
+    write(source, "int b;\n");
+    age(source, 5);
+    file_states.clear();
+    std::vector<std::string> reasons{};
+    const bool changed = outdated_actions(
+        build_commands, log, file_states, nullptr, &hashes, &reasons
+    )[0];
+    // Its command changed, too.
+    build_commands.actions[0].command += " -O2";
+    std::vector<std::string> command_reasons{};
+    outdated_actions(
+        build_commands, log, file_states, nullptr, &hashes, &command_reasons
+    );
+    std::filesystem::remove_all(directory);
+    if (touched)
+        return {false, "Expected a source touched but unchanged not to count"};
+    if (not changed) return {false, "Expected a changed source to count"};
+    if (reasons != std::vector<std::string>{
+            "input hash changed, source newer: " + source})
+        return {false, "Expected the changed source to be named"};
+    if (command_reasons != std::vector<std::string>{"its command changed"})
+        return {false, "Expected the command change to be the reason"};
+    return {true};
+}
+/// ==FINAL== FILESTATE TESTS
+
+/// ==BEGIN== CONTENTHASH TESTS
+auto test_libcontenthash_chunks() -> const TestReturnValue {
+    const auto path =
+        (std::filesystem::temp_directory_path() / "lbs_test_chunks").string();
+    // A few chunks, and a bit.
+    std::string contents(3 * content_hash_chunk + 100, '\0');
+    for (size_t i = 0; i < contents.size(); ++i)
+        contents[i] = char(i * 2654435761u >> 13);
+    auto f = fopen(path.data(), "wb");
+    if (not f) return {false, "Cannot write " + path};
+    fwrite(contents.data(), 1, contents.size(), f);
+    fclose(f);
+
+    ContentHash alone{};
+    ContentHash together{};
+    const bool hashed =
+        hash_file(path, alone, 1) and hash_file(path, together, 4);
+    // However often it's listed, it's hashed once.
+    auto hashes = ContentHashes::Load("");
+    hashes.hash_all({path, path});
+    const auto known = hashes.entries.find(path);
+    std::remove(path.data());
+    if (not hashed) return {false, "Expected " + path + " to be hashed"};
+    if (alone != together)
+        return {false, "Expected the hash not to depend on the threads"};
+    if (known == hashes.entries.end() or known->second.hash != alone)
+        return {false, "Expected hash_all() to hash the same as hash_file()"};
+    const auto before = hash_contents(contents.data(), contents.size());
+    contents[content_hash_chunk] ^= 1;
+    if (hash_contents(contents.data(), contents.size()) == before)
+        return {false, "Expected a changed byte to change the hash"};
+    return {true};
+}
+auto test_libcontenthash_given_states() -> const TestReturnValue {
+    const auto path =
+        (std::filesystem::temp_directory_path() / "lbs_test_given_states")
+            .string();
+    auto f = fopen(path.data(), "wb");
+    if (not f) return {false, "Cannot write " + path};
+    fputs("int a;\n", f);
+    fclose(f);
+    const auto file_state = stat_file(path);
+    ContentHashes::Entry state{
+        file_state.device, file_state.inode, file_state.size,
+        file_state.modified};
+
+    // Hashed as it was stat'ed before, but not once that's out of date.
+    auto hashes = ContentHashes::Load("");
+    ContentHashes::Entry entry{};
+    const bool hashed = hashes.hash(path, entry, &state);
+    ContentHash expected{};
+    hash_file(path, expected);
+    auto outdated = state;
+    outdated.size += 1;
+    auto fresh = ContentHashes::Load("");
+    const bool hashed_outdated = fresh.hash(path, entry, &outdated);
+    const std::vector<ContentHashes::Entry> states{outdated};
+    fresh.hash_all({path}, &states);
+    std::remove(path.data());
+    if (not hashed or hashes.entries[path].hash != expected)
+        return {false, "Expected the file to be hashed in its given state"};
+    if (hashed_outdated or fresh.entries.count(path))
+        return {false, "Expected an outdated state not to be hashed"};
+    return {true};
+}
+/// ==FINAL== CONTENTHASH TESTS
+
+/// ==BEGIN== DIRINDEX TESTS
+auto test_libdirindex_files() -> const TestReturnValue {
+    const auto directory =
+        (std::filesystem::temp_directory_path() / "lbs_test_dirindex")
+            .string();
+    const auto src = directory + "/src";
+    std::filesystem::remove_all(directory);
+    for (const auto* path : {"sub", ".git", "other"})
+        std::filesystem::create_directories(src + '/' + path);
+    const auto touch = [&](const std::string& path) {
+        auto f = fopen((src + '/' + path).data(), "wb");
+        if (f) fclose(f);
+    };
+    for (const auto* path :
+         {"a.c", "b.h", ".hidden.c", "sub/c.cpp", ".git/d.c", "other/e.c"})
+        touch(path);
+    // Directories changed just now can't be trusted to stay as they were
+    // read, so these are made to look like they haven't changed in a while.
+    for (const auto* path : {"", "/sub", "/.git", "/other"})
+        std::filesystem::last_write_time(
+            src + path, std::filesystem::file_time_type::clock::now()
+                            - std::chrono::hours(1)
+        );
+
+    const auto index_path = directory + "/index";
+    auto index = DirectoryIndex::Load(index_path);
+    const auto all = index.files(src, {}, true);
+    const auto headers = index.files(src, {"*.h"}, false);
+    // What's remembered of a directory that didn't change is what's used,
+    // while one that did is read again.
+    index.directories[src + "/sub"].entries.push_back({"stale.c", false});
+    touch("other/f.c");
+    const auto again = index.files(src, {}, true);
+    index.save();
+    const bool partial_left =
+        std::filesystem::exists(index_path + ".partial");
+    const auto loaded = DirectoryIndex::Load(index_path);
+    std::filesystem::remove_all(directory);
+
+    const std::vector<std::string> expected{
+        src + "/a.c", src + "/other/e.c", src + "/sub/c.cpp"};
+    if (all != expected)
+        return {false, "Expected sources below, but no hidden ones"};
+    if (headers != std::vector<std::string>{src + "/b.h"})
+        return {false, "Expected only matching files, not those below"};
+    const std::vector<std::string> expected_again{
+        src + "/a.c", src + "/other/e.c", src + "/other/f.c",
+        src + "/sub/c.cpp", src + "/sub/stale.c"};
+    if (again != expected_again)
+        return {false, "Expected only the changed directory to be read again"};
+    if (partial_left or loaded.directories.size() != index.directories.size())
+        return {false, "Expected the index to be saved and loaded back"};
+    return {true};
+}
+/// ==FINAL== DIRINDEX TESTS
+
+/// ==BEGIN== COPY TESTS
+auto test_libcopy_files() -> const TestReturnValue {
+    const auto directory =
+        (std::filesystem::temp_directory_path() / "lbs_test_copy").string();
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+    const auto write = [](const std::string& path, const char* contents) {
+        auto f = fopen(path.data(), "wb");
+        if (f) {
+            fputs(contents, f);
+            fclose(f);
+        }
+    };
+    const auto source = directory + "/source.txt";
+    const auto destination = directory + "/out/destination.txt";
+    write(source, "lbs\n");
+    std::filesystem::last_write_time(
+        source,
+        std::filesystem::file_time_type::clock::now() - std::chrono::hours(2)
+    );
+    const auto source_time = std::filesystem::last_write_time(source);
+
+    std::string error{};
+    const auto copied = copy_file(source, destination, false, error);
+    const bool copied_time =
+        std::filesystem::last_write_time(destination) == source_time;
+    const auto again = copy_file(source, destination, false, error);
+    // The same contents, written at another time, just get the source's.
+    std::filesystem::last_write_time(
+        destination,
+        std::filesystem::file_time_type::clock::now() - std::chrono::hours(1)
+    );
+    const auto same = copy_file(source, destination, false, error);
+    const bool same_time =
+        std::filesystem::last_write_time(destination) == source_time;
+    write(destination, "LBS\n");
+    std::filesystem::last_write_time(
+        destination,
+        std::filesystem::file_time_type::clock::now() - std::chrono::hours(1)
+    );
+    const auto different = copy_file(source, destination, false, error);
+    const auto different_contents = read_contents(destination);
+    const auto link = directory + "/link.txt";
+    const auto linked = copy_file(source, link, true, error);
+    const bool same_file = std::filesystem::equivalent(source, link);
+    // A link can't go to another file system, so a copy is made instead.
+    const std::string elsewhere = "/dev/shm/lbs_test_copy.txt";
+    write(elsewhere, "elsewhere\n");
+    struct stat elsewhere_stat {};
+    struct stat directory_stat {};
+    const bool other_file_system =
+        stat(elsewhere.data(), &elsewhere_stat) == 0
+        and stat(directory.data(), &directory_stat) == 0
+        and elsewhere_stat.st_dev != directory_stat.st_dev;
+    const auto across_link = directory + "/across.txt";
+    const auto across = other_file_system
+                          ? copy_file(elsewhere, across_link, true, error)
+                          : CopyResult::COPIED;
+    const bool across_copied =
+        not other_file_system
+        or (read_contents(across_link) == "elsewhere\n"
+            and not std::filesystem::equivalent(elsewhere, across_link));
+    const auto missing =
+        copy_file(directory + "/missing.txt", link, false, error);
+    std::remove(elsewhere.data());
+    std::filesystem::remove_all(directory);
+
+    if (copied != CopyResult::COPIED or not copied_time)
+        return {false, "Expected a copy with the source's time"};
+    if (again != CopyResult::UNCHANGED)
+        return {false, "Expected a copy of the same size and time to stay"};
+    if (same != CopyResult::UNCHANGED or not same_time)
+        return {false, "Expected the same contents to just get the time"};
+    if (different != CopyResult::COPIED or different_contents != "lbs\n")
+        return {false, "Expected different contents to be copied over"};
+    if (linked != CopyResult::COPIED or not same_file)
+        return {false, "Expected a hard link"};
+    if (across != CopyResult::COPIED or not across_copied)
+        return {false, "Expected a copy across file systems instead"};
+    if (missing != CopyResult::FAILED
+        or error.find("missing.txt") == std::string::npos)
+        return {false, "Expected a missing source to fail, and be named"};
+    return {true};
+}
+auto test_libcopy_directories() -> const TestReturnValue {
+    const auto directory =
+        std::filesystem::temp_directory_path() / "lbs_test_copy_directories";
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory / "assets" / "sub");
+    const auto working_directory = std::filesystem::current_path();
+    std::filesystem::current_path(directory);
+    // Enough files to be copied on several threads.
+    std::vector<std::string> files{"sub/deep.txt"};
+    for (size_t i = 0; i < 40; ++i) files.push_back(std::to_string(i) + ".txt");
+    for (const auto& file : files) {
+        auto f = fopen(("assets/" + file).data(), "wb");
+        if (f) {
+            fputs(file.data(), f);
+            fclose(f);
+        }
+    }
+
+    auto build_scenario = parse(
+        "(executable app (sources main.c))\n"
+        "(copy app (directory assets) out)\n"
+        "(copy app (directory-contents assets) flat hard-link)\n",
+        "c"
+    );
+    build_scenario.compilers.push_back(Compiler{
+        "c", "cc -c %f %d %i -o %o", "ar crs %o %i", "cc %f %d %i -o %o"});
+    const auto build_commands =
+        BuildScenario::Commands(build_scenario, "app", "c");
+    std::vector<bool> copies{};
+    for (const auto& action : build_commands.actions)
+        copies.push_back(action.copy_sources.size());
+    ExecutorOptions options{};
+    options.jobs = 4;
+    bool succeeded{false};
+    capture_stdout([&] {
+        succeeded = execute(build_commands.only(copies), options);
+    });
+    bool copied{true};
+    bool linked{true};
+    for (const auto& file : files) {
+        copied = read_contents("out/assets/" + file) == file
+             and not std::filesystem::equivalent(
+                 "assets/" + file, "out/assets/" + file
+             )
+             and copied;
+        linked = std::filesystem::exists("flat/" + file)
+             and std::filesystem::equivalent("assets/" + file, "flat/" + file)
+             and linked;
+    }
+    std::filesystem::current_path(working_directory);
+    std::filesystem::remove_all(directory);
+    if (not succeeded) return {false, "Expected the copies to succeed"};
+    if (not copied) return {false, "Expected assets to be copied into out"};
+    if (not linked)
+        return {false, "Expected what's in assets to be linked into flat"};
+    return {true};
+}
+/// ==FINAL== COPY TESTS
+
+/// ==BEGIN== EXECUTOR TESTS
+auto test_libexecutor_concurrent() -> const TestReturnValue {
+    const auto directory =
+        (std::filesystem::temp_directory_path() / "lbs_test_concurrent")
+            .string();
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+    // Each of the first two waits (up to five seconds) for the other to have
+    // started, which they only both do when run at once; the last runs after
+    // them.
+    const auto meet = [&](const char* self, const char* other) {
+        return "touch " + directory + '/' + self + "; i=0; until [ -e "
+             + directory + '/' + other
+             + " ]; do i=$((i+1)); [ $i -lt 500 ] || exit 1; sleep 0.01; done";
+    };
+    BuildScenario::BuildCommands build_commands{};
+    BuildScenario::BuildCommands::Action action{};
+    action.command = meet("a", "b");
+    build_commands.push_back(action);
+    action.command = meet("b", "a");
+    build_commands.push_back(action);
+    action.command = "touch " + directory + "/c";
+    action.dependencies = {0, 1};
+    build_commands.push_back(action);
+
+    ExecutorOptions options{};
+    options.jobs = 2;
+    const bool succeeded = execute(build_commands, options);
+    const bool last = std::filesystem::exists(directory + "/c");
+    std::filesystem::remove_all(directory);
+    if (not succeeded) return {false, "Expected both to run at once"};
+    if (not last) return {false, "Expected the last to run after them"};
+    return {true};
+}
+auto test_libexecutor_keep_going() -> const TestReturnValue {
+    const auto directory =
+        (std::filesystem::temp_directory_path() / "lbs_test_keep_going")
+            .string();
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+    const auto touch = [&](const char* name) {
+        return "touch " + directory + '/' + name;
+    };
+    BuildScenario::BuildCommands build_commands{};
+    BuildScenario::BuildCommands::Action action{};
+    action.command = "false";
+    build_commands.push_back(action);
+    action.command = touch("dependent");
+    action.dependencies = {0};
+    build_commands.push_back(action);
+    action.dependencies = {};
+    action.command = touch("independent");
+    build_commands.push_back(action);
+    action.command = "exit 2";
+    build_commands.push_back(action);
+    action.command = touch("after");
+    build_commands.push_back(action);
+
+    // One at a time, so that the second failure comes before the last.
+    ExecutorOptions options{};
+    options.failures_allowed = 2;
+    bool succeeded{true};
+    const auto output =
+        capture_stdout([&] { succeeded = execute(build_commands, options); });
+    const auto ran = [&](const char* name) {
+        return std::filesystem::exists(directory + '/' + name);
+    };
+    const bool stopped = not ran("after");
+    const bool dependent = ran("dependent");
+    const bool independent = ran("independent");
+    options.failures_allowed = 0;
+    capture_stdout([&] { execute(build_commands, options); });
+    const bool kept_going = ran("after");
+    std::filesystem::remove_all(directory);
+    if (succeeded) return {false, "Expected the build to fail"};
+    if (dependent) return {false, "Expected the dependent to be skipped"};
+    if (not independent)
+        return {false, "Expected the independent action to run"};
+    if (not stopped) return {false, "Expected to stop after two failures"};
+    if (not kept_going) return {false, "Expected -k 0 never to stop"};
+    if (output.find("command failed with status 2\n    exit 2\n")
+            == std::string::npos
+        or output.find(
+               "2 of 5 actions failed, 1 skipped because something they "
+               "depend on failed\n"
+           ) == std::string::npos)
+        return {false, "Expected each failure, and how many, to be told"};
+    return {true};
+}
+auto test_libexecutor_cutoff() -> const TestReturnValue {
+    const auto directory =
+        (std::filesystem::temp_directory_path() / "lbs_test_cutoff").string();
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+    const auto output = directory + "/out";
+    const auto dependent = directory + "/dependent";
+    BuildScenario::BuildCommands build_commands{};
+    BuildScenario::BuildCommands::Action action{};
+    action.command = "printf same > " + output;
+    action.outputs = {output};
+    build_commands.push_back(action);
+    action.command = "touch " + dependent;
+    action.outputs = {dependent};
+    action.dependencies = {0};
+    action.conditional_on = {0};
+    build_commands.push_back(action);
+
+    ActionLog log{};
+    ExecutorOptions options{};
+    options.log = &log;
+    bool succeeded{true};
+    capture_stdout([&] { succeeded = execute(build_commands, options); });
+    const bool first = std::filesystem::exists(dependent);
+    std::filesystem::remove(dependent);
+    // Written a while ago, so that writing it again would show.
+    std::filesystem::last_write_time(
+        output,
+        std::filesystem::file_time_type::clock::now() - std::chrono::hours(1)
+    );
+    const auto written = std::filesystem::last_write_time(output);
+    // The same again.
+    capture_stdout([&] {
+        succeeded = execute(build_commands, options) and succeeded;
+    });
+    const bool same_skipped = not std::filesystem::exists(dependent);
+    const bool same_kept = std::filesystem::last_write_time(output) == written;
+    // Something else.
+    build_commands.actions[0].command = "printf other > " + output;
+    capture_stdout([&] {
+        succeeded = execute(build_commands, options) and succeeded;
+    });
+    const bool other = std::filesystem::exists(dependent);
+    const bool other_written =
+        std::filesystem::last_write_time(output) != written;
+    std::filesystem::remove_all(directory);
+    if (not succeeded) return {false, "Expected every build to succeed"};
+    if (not first) return {false, "Expected the dependent to run at first"};
+    if (not same_skipped)
+        return {false, "Expected the dependent to be skipped for the same"};
+    if (not same_kept)
+        return {false, "Expected the same output to keep its time"};
+    if (not other or not other_written)
+        return {false, "Expected the dependent to run for another output"};
+    return {true};
+}
+auto test_libexecutor_priorities() -> const TestReturnValue {
+    const auto directory =
+        (std::filesystem::temp_directory_path() / "lbs_test_priorities")
+            .string();
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+    const auto now = std::filesystem::file_time_type::clock::now();
+    const auto input = [&](const char* name, int age) {
+        const auto path = directory + '/' + name;
+        if (auto f = fopen(path.data(), "wb")) fclose(f);
+        std::filesystem::last_write_time(path, now - std::chrono::seconds(age));
+        return path;
+    };
+    const auto old = input("old", 100);
+    const auto edited = input("edited", 10);
+    const auto newer = input("newer", 5);
+
+    BuildScenario::BuildCommands build_commands{};
+    ActionLog log{};
+    const auto finished =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()
+            - std::chrono::seconds(50)
+        )
+            .count();
+    // Each action writes its name to order when it runs. Those that ran
+    // before did so 50 seconds ago.
+    enum Last { NEVER, SUCCEEDED, FAILED };
+    const auto add = [&](const char* name, const std::string& read, Last last,
+                         std::vector<size_t> dependencies = {}) {
+        BuildScenario::BuildCommands::Action action{};
+        action.command =
+            std::string("echo ") + name + " >> " + directory + "/order";
+        action.inputs = {read};
+        action.dependencies = std::move(dependencies);
+        if (last != NEVER)
+            log.record(
+                action.command,
+                {hash_command(action.command), finished, 1, last == FAILED}
+            );
+        build_commands.push_back(action);
+    };
+    add("plain", old, SUCCEEDED);
+    add("edited", edited, SUCCEEDED);
+    add("newer", newer, SUCCEEDED);
+    add("failed", old, FAILED);
+    add("never", old, NEVER);
+    add("dependency", old, SUCCEEDED);
+    add("dependent", old, FAILED, {5});
+
+    ExecutorOptions options{};
+    options.log = &log;
+    options.failures_allowed = 0;
+    capture_stdout([&] { execute(build_commands, options); });
+    std::string order{};
+    if (auto f = fopen((directory + "/order").data(), "rb")) {
+        char buffer[256];
+        while (fgets(buffer, sizeof(buffer), f)) order += buffer;
+        fclose(f);
+    }
+    std::filesystem::remove_all(directory);
+    // What failed goes first (and the way to it is cleared first, too), then
+    // what never ran or had its inputs edited, most recently edited first,
+    // then the rest.
+    if (order
+        != "failed\ndependency\ndependent\nnewer\nedited\nnever\nplain\n")
+        return {false, "Expected failed, then edited actions first"};
+    return {true};
+}
+auto test_libexecutor_worker_fallback() -> const TestReturnValue {
+    const auto directory =
+        (std::filesystem::temp_directory_path() / "lbs_test_worker_fallback")
+            .string();
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+    const auto address = directory + "/worker";
+
+    // A worker's hello, as the real thing says it.
+    char hello[worker_hello_size]{};
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) != 0)
+        return {false, "Cannot create a socket pair"};
+    std::thread([fd = pair[1]] {
+        worker_serve_connection(fd, 1);
+        close(fd);
+    }).detach();
+    const bool greeted = read(pair[0], hello, sizeof(hello))
+                      == ssize_t(sizeof(hello));
+    close(pair[0]);
+
+    // A worker that greets whoever connects, then goes away as soon as it's
+    // sent anything.
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_un sockaddr{};
+    sockaddr.sun_family = AF_UNIX;
+    address.copy(sockaddr.sun_path, sizeof(sockaddr.sun_path) - 1);
+    if (not greeted or listen_fd < 0
+        or bind(listen_fd, (const struct sockaddr*)&sockaddr, sizeof(sockaddr))
+               != 0
+        or listen(listen_fd, 4) != 0) {
+        if (listen_fd >= 0) close(listen_fd);
+        std::filesystem::remove_all(directory);
+        return {false, "Cannot set up a worker"};
+    }
+    std::thread worker([&] {
+        pollfd pending{listen_fd, POLLIN, 0};
+        while (poll(&pending, 1, 5000) > 0) {
+            int client = accept(listen_fd, nullptr, nullptr);
+            if (client < 0) break;
+            char buffer[256];
+            if (write(client, hello, sizeof(hello)) == ssize_t(sizeof(hello)))
+                (void)!read(client, buffer, sizeof(buffer));
+            close(client);
+        }
+    });
+
+    // With one job here, the second object goes to the worker.
+    BuildScenario::BuildCommands build_commands{};
+    for (const char* name : {"a", "b"}) {
+        BuildScenario::BuildCommands::Action action{};
+        const std::string object = std::string(name) + ".o";
+        const std::string input = std::string(name) + ".i";
+        action.command = "echo local > " + object;
+        action.preprocess_command = "echo source > " + input;
+        action.remote_input = input;
+        action.remote_command = "cp " + input + ' ' + object;
+        action.outputs = {object};
+        build_commands.push_back(action);
+    }
+    ExecutorOptions options{};
+    options.workers = {"unix:" + address};
+    const auto cwd = std::filesystem::current_path();
+    std::filesystem::current_path(directory);
+    bool succeeded{false};
+    const auto output =
+        capture_stdout([&] { succeeded = execute(build_commands, options); });
+    std::string compiled{};
+    for (const char* object : {"a.o", "b.o"})
+        if (auto f = fopen(object, "rb")) {
+            char buffer[64];
+            while (fgets(buffer, sizeof(buffer), f)) compiled += buffer;
+            fclose(f);
+        }
+    std::filesystem::current_path(cwd);
+    shutdown(listen_fd, SHUT_RDWR);
+    worker.join();
+    close(listen_fd);
+    std::filesystem::remove_all(directory);
+    if (output.find("Lost lbs-worker at unix:" + address) == std::string::npos)
+        return {false, "Expected the worker to be given up on"};
+    if (not succeeded or compiled != "local\nlocal\n")
+        return {false, "Expected what the worker had to be compiled here"};
+    return {true};
+}
+/// ==FINAL== EXECUTOR TESTS
+
+/// ==BEGIN== WORKER TESTS
+auto test_libworker_protocol() -> const TestReturnValue {
+    // Send job to a worker (running up to advertised jobs at once) over a
+    // socket pair, and take its word for it.
+    const auto serve = [](const WorkerJob& job, uint32_t advertised,
+                          uint32_t& capacity, WorkerResult& result) -> bool {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) != 0)
+            return false;
+        std::thread worker([&] {
+            worker_serve_connection(pair[1], advertised);
+        });
+        char hello[worker_hello_size];
+        bool answered = read(pair[0], hello, sizeof(hello))
+                            == ssize_t(sizeof(hello))
+                    and worker_parse_hello(hello, capacity)
+                    and worker_send(pair[0], job);
+        std::string received{};
+        while (answered and not worker_parse_result(received, result)) {
+            char buffer[4096];
+            const auto n = read(pair[0], buffer, sizeof(buffer));
+            if (n <= 0) answered = false;
+            else received.append(buffer, size_t(n));
+        }
+        close(pair[0]);
+        worker.join();
+        close(pair[1]);
+        return answered;
+    };
+
+    uint32_t capacity{0};
+    WorkerResult result{};
+    if (not serve(
+            {"tr a-z A-Z < in.i > out.o; echo compiled", "in.i", "out.o",
+             "source\n"},
+            3, capacity, result
+        ))
+        return {false, "Expected the worker to answer"};
+    if (capacity != 3) return {false, "Expected the worker's capacity"};
+    if (result.status != 0 or result.output != "compiled\n"
+        or result.object != "SOURCE\n")
+        return {false, "Expected the worker to compile the job"};
+
+    // Nor is a worker taken at its word for running billions of jobs.
+    if (not serve(
+            {"true", "../in.i", "out.o", ""}, UINT32_MAX, capacity, result
+        ))
+        return {false, "Expected the worker to answer"};
+    if (result.status == 0
+        or result.output.find("refusing") == std::string::npos)
+        return {false, "Expected paths outside the scratch directory refused"};
+    if (capacity != worker_capacity_limit)
+        return {false, "Expected an absurd capacity to be limited"};
+    return {true};
+}
+/// ==FINAL== WORKER TESTS
+
+/// ==BEGIN== DAEMON TESTS
+auto test_libdaemon_request() -> const TestReturnValue {
+    const auto directory =
+        std::filesystem::temp_directory_path() / "lbs_test_daemon";
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+    const auto working_directory = std::filesystem::current_path();
+    std::filesystem::current_path(directory);
+
+    // The daemon runs commands in the environment of the client asking,
+    // rather than its own, and prints what it does to the client's stdout.
+    setenv("LBS_TEST_DAEMON", "daemon", 1);
+    fflush(stdout);
+    const pid_t daemon = fork();
+    if (daemon == 0) {
+        DaemonHandlers handlers{};
+        handlers.request = [](const std::vector<std::string>& arguments,
+                              const std::vector<std::string>& environment,
+                              bool& stop) {
+            stop = true;
+            const bool given = std::find(
+                                   environment.begin(), environment.end(),
+                                   "LBS_TEST_DAEMON=client"
+                               )
+                            != environment.end();
+            printf("%s\n", arguments.size() ? arguments[0].data() : "");
+            return given ? std::system("test \"$LBS_TEST_DAEMON\" = client")
+                         : 1;
+        };
+        // Only what it prints while handling the request is of interest.
+        if (not freopen("/dev/null", "w", stdout)) _exit(1);
+        _exit(daemon_serve(handlers));
+    }
+    setenv("LBS_TEST_DAEMON", "client", 1);
+    // A client that connects and then never sends its request is dropped,
+    // rather than keeping the daemon from answering the next one. Until the
+    // daemon listens, there's nothing to connect to.
+    int stalled{-1};
+    for (size_t tries = 0; daemon > 0 and stalled < 0 and tries < 500;
+         ++tries) {
+        stalled = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        strncpy(
+            address.sun_path, LBS_DAEMON_SOCKET, sizeof(address.sun_path) - 1
+        );
+        if (connect(stalled, (const sockaddr*)&address, sizeof(address))) {
+            close(stalled);
+            stalled = -1;
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+    bool asked{false};
+    int status{-1};
+    std::string output{};
+    for (size_t tries = 0; stalled >= 0 and not asked and tries < 500;
+         ++tries) {
+        output = capture_stdout([&] {
+            asked = daemon_request({"--no-clean", "app"}, status);
+        });
+        if (not asked)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    unsetenv("LBS_TEST_DAEMON");
+    if (stalled >= 0) close(stalled);
+    if (daemon > 0 and not asked) kill(daemon, SIGTERM);
+    if (daemon > 0) waitpid(daemon, nullptr, 0);
+    std::filesystem::current_path(working_directory);
+    std::filesystem::remove_all(directory);
+    if (not asked) return {false, "Expected the daemon to answer"};
+    if (output != "--no-clean\n")
+        return {false, "Expected the daemon to print to the client's stdout"};
+    if (status != 0)
+        return {false, "Expected commands to run in the client's environment"};
+    return {true};
+}
+/// ==FINAL== DAEMON TESTS
+
+/// ==BEGIN== STATS TESTS
+auto test_libstats_threads() -> const TestReturnValue {
+    // Counted on whichever thread it happens, allocations (as counted by
+    // lbs's operator new) included.
+    const auto lexed = stat_counted(STAT_TOKENS_LEXED);
+    const auto allocations = stat_counted(STAT_ALLOCATIONS);
+    std::vector<std::vector<std::unique_ptr<int>>> allocated(4);
+    std::vector<std::thread> threads{};
+    for (auto& kept : allocated)
+        threads.emplace_back([&kept] {
+            for (size_t i = 0; i < 1000; ++i) {
+                stat_count(STAT_TOKENS_LEXED);
+                kept.emplace_back(new int{});
+            }
+        });
+    for (auto& thread : threads) thread.join();
+    if (stat_counted(STAT_TOKENS_LEXED) - lexed != 4000)
+        return {false, "Expected what every thread counted to be counted"};
+    if (stat_counted(STAT_ALLOCATIONS) - allocations < 4000)
+        return {false, "Expected allocations on every thread to be counted"};
+    return {true};
+}
+/// ==FINAL== STATS TESTS
+
+/// ==BEGIN== PERF TESTS
+auto test_libperf_generate() -> const TestReturnValue {
+    const auto directory =
+        (std::filesystem::temp_directory_path() / "lbs_test_generate").string();
+    SyntheticProject project{};
+    project.targets = 3;
+    project.sources = 4;
+    project.depth = 2;
+    project.headers = 3;
+    if (not generate_project(directory, project))
+        return {false, "Cannot generate a project in " + directory};
+
+    std::string lbs{};
+    if (auto f = fopen((directory + "/.lbs").data(), "rb")) {
+        char buffer[4096];
+        size_t size{0};
+        while ((size = fread(buffer, 1, sizeof(buffer), f)))
+            lbs.append(buffer, size);
+        fclose(f);
+    }
+    const bool edited_exist =
+        std::filesystem::exists(directory + '/' + edited_source(project))
+        and std::filesystem::exists(directory + '/' + edited_header(project));
+    std::filesystem::remove_all(directory);
+    if (not edited_exist)
+        return {false, "Expected the edited source and header to exist"};
+
+    auto build_scenario = parse(lbs, "c++");
+    if (build_scenario.targets.size() != 4)
+        return {false, "Expected three libraries and an executable"};
+    const auto library = build_scenario.target("t2");
+    if (library == build_scenario.targets.end() or library->sources.size() != 4)
+        return {false, "Expected t2 to have four sources"};
+    const auto app = build_scenario.target("app");
+    if (app == build_scenario.targets.end()
+        or app->kind != Target::EXECUTABLE)
+        return {false, "Expected app to be an executable"};
+    return {true};
+}
+/// ==FINAL== PERF TESTS
+
+/// ==BEGIN== PLANNING TESTS
+auto test_lbs_batched() -> const TestReturnValue {
+    BuildScenario::BuildCommands build_commands{};
+    for (const auto* source : {"a.c", "b.c", "sub/a.c"}) {
+        BuildScenario::BuildCommands::Action object{};
+        object.target = "foo";
+        object.command = std::string("cc -c ") + source;
+        object.outputs = {std::string(source) + ".o"};
+        object.batch_command = "cc -c %i";
+        object.batch_source = std::string("/src/") + source;
+        build_commands.push_back(object);
+    }
+    BuildScenario::BuildCommands::Action link{};
+    link.target = "foo";
+    link.command = "cc a.c.o b.c.o sub/a.c.o -o foo";
+    link.dependencies = {0, 1, 2};
+    build_commands.push_back(link);
+
+    // Both a.c can't be in one batch, as their objects would collide.
+    const auto batched = build_commands.batched(1);
+    if (batched.actions.size() != 3)
+        return {false, "Expected a batch, sub/a.c and the link"};
+    const auto& batch = batched.actions[0];
+    if (batch.command.find("cc -c /src/a.c /src/b.c") == std::string::npos
+        or batch.batch_members.size() != 2)
+        return {false, "Expected a.c and b.c to be compiled in one batch"};
+    if (batched.dependency_graph()[2] != std::vector<size_t>{0, 1})
+        return {false, "Expected the link to depend on the batch and sub/a.c"};
+    return {true};
+}
+auto test_lbs_object_dependencies() -> const TestReturnValue {
+    auto build_scenario = parse(
+        "(library base (sources base.c))\n"
+        "(command base ./generate-header.sh)\n"
+        "(library util (sources util.c))\n"
+        "(dependency util base)\n"
+        "(executable app (sources main.c))\n"
+        "(dependency app util)\n",
+        "c"
+    );
+    build_scenario.compilers.push_back(Compiler{
+        "c", "cc -c %f %d %i -o %o", "ar crs %o %i", "cc %f %d %i -o %o"});
+    const auto build_commands =
+        BuildScenario::Commands(build_scenario, "app", "c");
+    const auto graph = build_commands.dependency_graph();
+
+    const auto index_of = [&](const std::string& output) {
+        for (size_t i = 0; i < build_commands.actions.size(); ++i)
+            if (build_commands.actions[i].outputs
+                == std::vector<std::string>{output})
+                return i;
+        return build_commands.actions.size();
+    };
+    size_t generate{build_commands.actions.size()};
+    for (size_t i = 0; i < build_commands.actions.size(); ++i)
+        if (build_commands.actions[i].command == "./generate-header.sh")
+            generate = i;
+    const auto main_object = index_of("main.c.o");
+    const auto util_archive = index_of("util.a");
+    const auto link = index_of("app");
+    if (generate == build_commands.actions.size()
+        or main_object == build_commands.actions.size()
+        or util_archive == build_commands.actions.size()
+        or link == build_commands.actions.size())
+        return {false, "Missing the command, main.c.o, util.a or app"};
+    // The command of base may write a header util's headers include.
+    if (graph[main_object] != std::vector<size_t>{generate})
+        return {false, "Expected main.c.o to only wait for base's command"};
+    if (std::find(graph[link].begin(), graph[link].end(), util_archive)
+        == graph[link].end())
+        return {false, "Expected app to be linked after util.a"};
+    return {true};
+}
+auto test_lbs_shared_library() -> const TestReturnValue {
+    auto build_scenario = parse(
+        "(shared-library core (sources core.c))\n"
+        "(executable app (sources main.c))\n"
+        "(dependency app core)\n",
+        "c"
+    );
+    build_scenario.compilers.push_back(Compiler{
+        "c", "cc -c %f %d %i -o %o", "ar crs %o %i", "cc %f %d %i -o %o", "",
+        "", "", "", "", "", "cc -shared %f %d %i -o %o", "-fPIC",
+        "-Wl,-rpath,'%r'", "nm -gD %i > %o"});
+    const auto build_commands =
+        BuildScenario::Commands(build_scenario, "app", "c");
+
+    const auto produces = [&](const std::string& output) {
+        return std::find_if(
+            build_commands.actions.begin(), build_commands.actions.end(),
+            [&](const auto& action) {
+                return action.outputs == std::vector<std::string>{output};
+            }
+        );
+    };
+    const auto object = produces("core.c.pic.o");
+    if (object == build_commands.actions.end()
+        or object->command.find("-fPIC") == std::string::npos)
+        return {false, "Expected core.c to be compiled position independent"};
+    const auto stub = produces("core.so.interface");
+    if (stub == build_commands.actions.end())
+        return {false, "Missing core.so's interface stub"};
+    const auto link = produces("app");
+    if (link == build_commands.actions.end())
+        return {false, "Missing link of app"};
+    if (std::find(
+            link->inputs.begin(), link->inputs.end(), "core.so.interface"
+        )
+        == link->inputs.end())
+        return {false, "Expected app to read core.so's interface stub"};
+    if (link->command.find(" core.so -Wl,-rpath,'$ORIGIN'")
+        == std::string::npos)
+        return {false, "Expected app to link core.so with a runtime path"};
+    return {true};
+}
+auto test_lbs_response_file() -> const TestReturnValue {
+    auto build_scenario =
+        parse("(executable app (sources main.c util.c))\n", "c");
+    build_scenario.compilers.push_back(Compiler{
+        "c", "cc -c %f %d %i -o %o", "ar crs %o %@", "cc %f %d %@ -o %o"});
+    build_scenario.response_file_threshold = 1;
+    const auto build_commands =
+        BuildScenario::Commands(build_scenario, "app", "c");
+
+    const auto& link = build_commands.actions.back();
+    if (link.command.find(" @app.rsp -o app") == std::string::npos)
+        return {false, "Expected app to be linked from a response file"};
+    if (link.response_file != "app.rsp"
+        or std::find(link.inputs.begin(), link.inputs.end(), "app.rsp")
+               == link.inputs.end())
+        return {false, "Expected the link to read app.rsp"};
+    if (link.response_file_contents != "main.c.o\nutil.c.o\n")
+        return {false, "Expected app.rsp to list the objects of app"};
+
+    ResponseFile response_file{"x.rsp", 16};
+    if (expand_response_file_inputs({"a.o", "b.o"}, &response_file)
+            != "a.o b.o"
+        or response_file.contents.size())
+        return {false, "Expected short inputs to stay on the command line"};
+    if (expand_response_file_inputs({"my dir/a.o", "b\"c.o"}, &response_file)
+            != "@x.rsp"
+        or response_file.contents != "my\\ dir/a.o\nb\\\"c.o\n")
+        return {false, "Expected spaces and quotes to be escaped"};
+    return {true};
+}
+auto test_lbs_archive_update() -> const TestReturnValue {
+    const auto directory =
+        std::filesystem::temp_directory_path() / "lbs_test_archive_update";
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+    const auto working_directory = std::filesystem::current_path();
+    std::filesystem::current_path(directory);
+
+    auto build_scenario = parse("(library util (sources a.c b.c c.c))\n", "c");
+    build_scenario.compilers.push_back(Compiler{
+        "c", "cc -c %f %d %i -o %o", "ar crs %o %@", "cc %f %d %@ -o %o", {},
+        {}, {}, {}, {}, {}, {}, {}, {}, {}, "ar rs %o %i", "ar ds %o %i"});
+    const auto build_commands =
+        BuildScenario::Commands(build_scenario, "util", "c");
+    // b.c is compiled again, c.c.o isn't in the archive yet, and stale.c.o
+    // no longer belongs in it.
+    std::vector<bool> outdated{};
+    for (const auto& action : build_commands.actions)
+        outdated.push_back(
+            action.outputs == std::vector<std::string>{"b.c.o"}
+            or action.outputs == std::vector<std::string>{"util.a"}
+        );
+    const auto outdated_build_commands = build_commands.only(outdated);
+    for (const auto* object : {"a.c.o", "b.c.o", "c.c.o", "stale.c.o"}) {
+        auto f = fopen(object, "wb");
+        if (f) {
+            fputs(object, f);
+            fclose(f);
+        }
+        std::filesystem::last_write_time(
+            object, std::filesystem::file_time_type::clock::now()
+                        - std::chrono::seconds(10)
+        );
+    }
+    const bool archived =
+        std::system("ar crs util.a a.c.o b.c.o stale.c.o") == 0;
+
+    ActionLog log{};
+    log.record("util.a", {});
+    const auto updated = [&](BuildScenario::BuildCommands commands,
+                             size_t response_file_threshold) {
+        FileStates file_states{};
+        update_archives_in_place(
+            commands, log, file_states, response_file_threshold
+        );
+        for (const auto& action : commands.actions)
+            if (action.outputs == std::vector<std::string>{"util.a"})
+                return action;
+        return BuildScenario::BuildCommands::Action{};
+    };
+    const auto original = outdated_build_commands.actions.back().command;
+    const auto in_place = updated(outdated_build_commands, 32768);
+    // Too many objects for the command line.
+    const auto long_list = updated(outdated_build_commands, 8);
+    // Members go by file name, which sub/b.c.o shares with b.c.o.
+    auto same_names = outdated_build_commands;
+    for (auto& action : same_names.actions)
+        if (action.outputs == std::vector<std::string>{"util.a"})
+            action.inputs.push_back("sub/b.c.o");
+    const auto same_name = updated(same_names, 32768);
+    ActionLog::Entry failed_entry{};
+    failed_entry.failed = true;
+    log.record("util.a", failed_entry);
+    const auto failed = updated(outdated_build_commands, 32768);
+    log.record("util.a", {});
+    std::remove("util.a");
+    const auto missing = updated(outdated_build_commands, 32768);
+    std::filesystem::current_path(working_directory);
+    std::filesystem::remove_all(directory);
+
+    if (not archived) return {false, "Cannot write util.a with ar"};
+    if (original.rfind("rm -f util.a && ar crs util.a ", 0) != 0)
+        return {false, "Expected util.a to be written anew by default"};
+    if (in_place.command
+        != "ar ds util.a stale.c.o && ar rs util.a b.c.o c.c.o")
+        return {false, "Expected just b.c.o, c.c.o and stale.c.o to change"};
+    if (in_place.batch_members
+        != std::vector<std::pair<std::string, std::string>>{
+            {"util.a", original}})
+        return {false, "Expected the update to stand in for the rewrite"};
+    if (long_list.command != original)
+        return {false, "Expected a long list to write util.a anew"};
+    if (same_name.command != original)
+        return {false, "Expected objects of the same name to write it anew"};
+    if (failed.command != original)
+        return {false, "Expected a failed last update to write it anew"};
+    if (missing.command != original)
+        return {false, "Expected a missing archive to be written anew"};
+    return {true};
+}
+auto test_lbs_ninja() -> const TestReturnValue {
+    auto build_scenario = parse(
+        "(library util (sources util.c))\n"
+        "(executable app (sources main.c))\n"
+        "(dependency app util)\n"
+        "(command app echo done)\n",
+        "c"
+    );
+    build_scenario.compilers.push_back(Compiler{
+        "c", "cc -c %f %d %i -o %o -MMD -MF %M", "ar crs %o %i",
+        "cc %f %d %i -o %o"});
+    const auto build_commands =
+        BuildScenario::Commands(build_scenario, "app", "c");
+    const auto ninja = toninja(build_commands, {"app"}, "lbs --ninja");
+
+    const auto has = [&](const std::string& text) {
+        return ninja.find(text) != std::string::npos;
+    };
+    if (not has("build util.c.o: compile util.c\n")
+        or not has("  depfile = util.c.o.d\n"))
+        return {false, "Expected util.c to be compiled with its depfile"};
+    if (not has("build util: phony util.c.o util.a\n"))
+        return {false, "Expected a phony edge for util"};
+    if (not has("build .lbs_ninja/app.2.stamp: run || util.c.o util.a\n"))
+        return {false, "Expected the command to run after util is built"};
+    if (not has("build app: run main.c.o util.a || "))
+        return {false, "Expected app to be linked from its object and util"};
+    if (not has("\ndefault app\n")) return {false, "Expected app by default"};
+    return {true};
+}
+auto test_lbs_profile() -> const TestReturnValue {
+    auto build_scenario = parse(
+        "(library util (sources util.c ../shared/log.c))\n"
+        "(executable app (sources main.c) (flags -Wall))\n"
+        "(dependency app util)\n"
+        "(profile release (flags -O2) (defines -DNDEBUG))\n",
+        "c"
+    );
+    build_scenario.compilers.push_back(Compiler{
+        "c", "cc -c %f %d %i -o %o", "ar crs %o %i", "cc %f %d %i -o %o"});
+    const auto* profile = build_scenario.profile("release");
+    if (not profile or profile->flags != std::vector<std::string>{"-O2"}
+        or profile->defines != std::vector<std::string>{"-DNDEBUG"})
+        return {false, "Expected a release profile with -O2 and -DNDEBUG"};
+    build_scenario.apply_profile(*profile);
+    const auto build_commands =
+        BuildScenario::Commands(build_scenario, "app", "c");
+
+    const auto has = [&](const std::string& command) {
+        return std::any_of(
+            build_commands.actions.begin(), build_commands.actions.end(),
+            [&](const auto& action) { return action.command == command; }
+        );
+    };
+    if (not has("cc -c -O2 -DNDEBUG util.c -o release/util.c.o"))
+        return {false, "Expected util.c to be compiled into release/"};
+    if (not has("cc -c -O2 -DNDEBUG ../shared/log.c "
+                "-o release/__/shared/log.c.o"))
+        return {false, "Expected ../shared/log.c to stay within release/"};
+    if (not has("cc -Wall -O2 -DNDEBUG release/main.c.o -o release/app "
+                "release/util.a"))
+        return {false, "Expected app to be linked into release/"};
+    if (build_commands.actions.back().target != "release/app"
+        or build_commands.actions.back().target_dependencies
+               != std::vector<std::string>{"release/util"})
+        return {false, "Expected targets to go by their name in release/"};
+    return {true};
+}
+auto test_lbs_precompiled_header() -> const TestReturnValue {
+    auto build_scenario = parse(
+        "(executable app (sources main.c util.c) (include-directories inc)\n"
+        " (precompiled-header inc/all.h))\n",
+        "c"
+    );
+    build_scenario.compilers.push_back(Compiler{
+        "c", "cc -c %f %d %i -o %o", "ar crs %o %i", "cc %f %d %i -o %o", "",
+        "cc -x c-header %f %d %i -o %o", ".gch", "-include %i"});
+    const auto build_commands =
+        BuildScenario::Commands(build_scenario, "app", "c");
+    const auto& actions = build_commands.actions;
+    const auto find = [&](const std::string& command) -> size_t {
+        for (size_t i = 0; i < actions.size(); ++i)
+            if (actions[i].command == command) return i;
+        return actions.size();
+    };
+
+    const auto writer = find(
+        "mkdir -p 'app.pch' && printf '%s\\n' '#include \"../inc/all.h\"' "
+        "> 'app.pch/all.h'"
+    );
+    if (writer == actions.size())
+        return {false, "Expected a stub including the header"};
+    const auto precompile =
+        find("cc -x c-header   app.pch/all.h -o app.pch/all.h.gch -Iinc");
+    if (precompile == actions.size()
+        or actions[precompile].dependencies != std::vector<size_t>{writer})
+        return {false, "Expected the header precompiled after the stub"};
+    // Every object includes it through the stub, and is compiled after it
+    // (and again once it changed).
+    for (const char* source : {"main.c", "util.c"}) {
+        const auto object = find(
+            std::string("cc -c   ") + source + " -o " + source
+            + ".o -Iinc -include app.pch/all.h"
+        );
+        if (object == actions.size())
+            return {false, "Expected each object to include the header"};
+        const auto& action = actions[object];
+        if (std::find(
+                action.dependencies.begin(), action.dependencies.end(),
+                precompile
+            )
+                == action.dependencies.end()
+            or std::find(
+                   action.inputs.begin(), action.inputs.end(),
+                   "app.pch/all.h.gch"
+               )
+                   == action.inputs.end())
+            return {false, "Expected each object to depend on the header"};
+    }
+    return {true};
+}
+auto test_lbs_unity() -> const TestReturnValue {
+    auto build_scenario = parse(
+        "(executable app (sources src/a.c src/b.c ../shared/c.c) (unity 8))\n",
+        "c"
+    );
+    build_scenario.compilers.push_back(Compiler{
+        "c", "cc -c %f %d %i -o %o", "ar crs %o %i", "cc %f %d %i -o %o"});
+    const auto build_commands =
+        BuildScenario::Commands(build_scenario, "app", "c");
+    const auto has = [&](const std::string& command) {
+        return std::any_of(
+            build_commands.actions.begin(), build_commands.actions.end(),
+            [&](const auto& action) { return action.command == command; }
+        );
+    };
+    // The batch's source is written out of the source tree, and includes
+    // the sources relative to where it is.
+    if (not has("mkdir -p '.lbs_unity/src' && printf '%s\\n' "
+                "'#include \"../../src/a.c\"' '#include \"../../src/b.c\"' "
+                "'#include \"../../../shared/c.c\"' "
+                "> '.lbs_unity/src/a.c.unity.c'"))
+        return {false, "Expected the batch's source under .lbs_unity/"};
+    if (not has("cc -c   .lbs_unity/src/a.c.unity.c "
+                "-o .lbs_unity/src/a.c.unity.c.o"))
+        return {false, "Expected the batch to be compiled from there"};
+    return {true};
+}
+/// ==FINAL== PLANNING TESTS
+
 void tests_run() {
     const std::vector<TestFunction> tests{
         {"libparser.empty", test_libparser_empty},
+        {"libparser.watches", test_libparser_watches},
+        {"libparser.unity", test_libparser_unity},
+        {"libparser.copy", test_libparser_copy},
+        {"libparser.glob", test_libparser_glob},
+        {"libmodscan.preamble", test_libmodscan_preamble},
+        {"libmodscan.load", test_libmodscan_load},
+        {"libincludecost.add", test_libincludecost_add},
+        {"libfilestate.archive_members", test_libfilestate_archive_members},
+        {"libfilestate.stat_files", test_libfilestate_stat_files},
+        {"libfilestate.unchanged_inputs", test_libfilestate_unchanged_inputs},
+        {"libcontenthash.chunks", test_libcontenthash_chunks},
+        {"libcontenthash.given_states", test_libcontenthash_given_states},
+        {"libdirindex.files", test_libdirindex_files},
+        {"libcopy.files", test_libcopy_files},
+        {"libcopy.directories", test_libcopy_directories},
+        {"libexecutor.concurrent", test_libexecutor_concurrent},
+        {"libexecutor.keep_going", test_libexecutor_keep_going},
+        {"libexecutor.cutoff", test_libexecutor_cutoff},
+        {"libexecutor.priorities", test_libexecutor_priorities},
+        {"libexecutor.worker_fallback", test_libexecutor_worker_fallback},
+        {"libworker.protocol", test_libworker_protocol},
+        {"libdaemon.request", test_libdaemon_request},
+        {"libstats.threads", test_libstats_threads},
+        {"libperf.generate", test_libperf_generate},
+        {"lbs.batched", test_lbs_batched},
+        {"lbs.object_dependencies", test_lbs_object_dependencies},
+        {"lbs.shared_library", test_lbs_shared_library},
+        {"lbs.response_file", test_lbs_response_file},
+        {"lbs.archive_update", test_lbs_archive_update},
+        {"lbs.ninja", test_lbs_ninja},
+        {"lbs.profile", test_lbs_profile},
+        {"lbs.precompiled_header", test_lbs_precompiled_header},
+        {"lbs.unity", test_lbs_unity},
     };
     size_t failed{0};
     size_t succeeded{0};
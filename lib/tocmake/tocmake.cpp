@@ -18,6 +18,11 @@ std::string tocmake_target(const Target& target) {
         out += target.name;
         out += ")\n";
     } break;
+    case Target::SHARED_LIBRARY: {
+        out += "\nadd_library(";
+        out += target.name;
+        out += " SHARED)\n";
+    } break;
     case Target::EXECUTABLE: {
         out += "\nadd_executable(";
         out += target.name;
@@ -84,6 +89,30 @@ std::string tocmake_target(const Target& target) {
         out += ")\n";
     }
 
+    if (target.precompiled_header.size()) {
+        out += "target_precompile_headers(";
+        out += target.name;
+        out += " PRIVATE ";
+        out += target.precompiled_header;
+        out += ")\n";
+    }
+
+    if (target.unity > 1) {
+        out += "set_target_properties(";
+        out += target.name;
+        out += " PROPERTIES UNITY_BUILD ON UNITY_BUILD_BATCH_SIZE ";
+        out += std::to_string(target.unity);
+        out += ")\n";
+        if (target.unity_excludes.size()) {
+            out += "set_source_files_properties(";
+            for (const auto& source : target.unity_excludes) {
+                out += source;
+                out += ' ';
+            }
+            out += "PROPERTIES SKIP_UNITY_BUILD_INCLUSION ON)\n";
+        }
+    }
+
     return out;
 }
 
@@ -0,0 +1,207 @@
+#include <toninja/toninja.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <lbs/build_scenario.h>
+
+// Paths in build lines have ninja's special characters escaped.
+static auto escape_path(const std::string& path) -> std::string {
+    std::string out{};
+    for (const char c : path) {
+        if (c == '$' or c == ' ' or c == ':' or c == '\n') out += '$';
+        out += c;
+    }
+    return out;
+}
+
+// As do variable values, of which only $ is special.
+static auto escape_value(const std::string& value) -> std::string {
+    std::string out{};
+    for (const char c : value) {
+        if (c == '$') out += '$';
+        out += c == '\n' ? ' ' : c;
+    }
+    return out;
+}
+
+static auto shell_quote(const std::string& text) -> std::string {
+    std::string quoted{"'"};
+    for (const char c : text) {
+        if (c == '\'') quoted += "'\\''";
+        else quoted += c;
+    }
+    return quoted + "'";
+}
+
+static void add_paths(
+    std::string& out,
+    const std::vector<std::string>& paths
+) {
+    for (const auto& path : paths) {
+        out += ' ';
+        out += escape_path(path);
+    }
+}
+
+std::string toninja(
+    const BuildScenario::BuildCommands& build_commands,
+    const std::vector<std::string>& targets,
+    const std::string& regenerate
+) {
+    const auto& actions = build_commands.actions;
+    const auto graph = build_commands.dependency_graph();
+
+    std::string out{
+        "# Generated by lbs --ninja from .lbs; edits are lost when it is "
+        "generated again.\n"
+        "ninja_required_version = 1.7\n"
+        "\n"
+        "rule run\n"
+        "  command = $command\n"
+        "rule compile\n"
+        "  command = $command\n"
+        "  depfile = $depfile\n"
+        "  deps = gcc\n"
+        "rule link\n"
+        "  command = $command\n"
+        "  rspfile = $rspfile\n"
+        "  rspfile_content = $rspfile_content\n"
+        "rule regenerate\n"
+        "  command = $command\n"
+        "  generator = 1\n"
+        "\n"};
+    out += "build build.ninja: regenerate .lbs\n";
+    out += "  command = " + escape_value(regenerate) + "\n";
+
+    // What each action leaves behind for others to wait on.
+    std::vector<std::vector<std::string>> produced(actions.size());
+    std::unordered_map<std::string, std::vector<std::string>> target_outputs{};
+    // Target names, in the order they were planned in.
+    std::vector<std::string> target_names{};
+    for (size_t i = 0; i < actions.size(); ++i) {
+        const auto& action = actions[i];
+        if (action.outputs.size()) produced[i] = action.outputs;
+        else
+            produced[i] = {
+                ".lbs_ninja/" + action.target + "." + std::to_string(i)
+                + ".stamp"};
+        if (not target_outputs.count(action.target))
+            target_names.push_back(action.target);
+        auto& outputs = target_outputs[action.target];
+        outputs.insert(outputs.end(), produced[i].begin(), produced[i].end());
+    }
+    // What waiting on each action comes down to: its output, or a phony edge
+    // standing for all of them (as a copy may have thousands).
+    std::vector<std::string> done(actions.size());
+    for (size_t i = 0; i < actions.size(); ++i)
+        done[i] = produced[i].size() == 1 ? produced[i].front()
+                                          : ".lbs_ninja/" + actions[i].target
+                                                + "." + std::to_string(i)
+                                                + ".done";
+
+    for (size_t i = 0; i < actions.size(); ++i) {
+        const auto& action = actions[i];
+        std::vector<std::string> order_only{};
+        for (auto dependency : graph[i]) order_only.push_back(done[dependency]);
+        if (done[i] != produced[i].front()) {
+            out += "\nbuild " + escape_path(done[i]) + ": phony";
+            add_paths(out, produced[i]);
+            out += '\n';
+        }
+        const auto edge = [&](const std::string& rule,
+                              const std::vector<std::string>& outputs,
+                              const std::vector<std::string>& inputs) {
+            out += "\nbuild";
+            add_paths(out, outputs);
+            out += ": " + rule;
+            add_paths(out, inputs);
+            if (order_only.size()) {
+                out += " ||";
+                add_paths(out, order_only);
+            }
+            out += '\n';
+        };
+
+        // Copies are done a file at a time.
+        if (action.copy_sources.size()) {
+            for (size_t c = 0; c < action.copy_sources.size(); ++c) {
+                const auto& source = action.copy_sources[c];
+                const auto& destination = action.outputs[c];
+                const auto directory =
+                    std::filesystem::path(destination).parent_path().string();
+                std::string command{};
+                if (directory.size())
+                    command += "mkdir -p " + shell_quote(directory) + " && ";
+                command += action.hard_link ? "ln -f " : "cp -p ";
+                command += shell_quote(source) + ' ' + shell_quote(destination);
+                edge("run", {destination}, {source});
+                out += "  command = " + escape_value(command) + "\n";
+            }
+            continue;
+        }
+
+        if (action.outputs.empty()) {
+            // A command without inputs runs every time, like it does here;
+            // one that is only known to read some runs when they change.
+            auto command = action.command;
+            if (action.inputs.size())
+                command = "(" + command + ") && mkdir -p .lbs_ninja && touch "
+                        + shell_quote(produced[i].front());
+            edge("run", produced[i], action.inputs);
+            out += "  command = " + escape_value(command) + "\n";
+            continue;
+        }
+
+        // The response file is written by ninja instead.
+        auto inputs = action.inputs;
+        if (action.response_file.size())
+            inputs.erase(
+                std::remove(inputs.begin(), inputs.end(), action.response_file),
+                inputs.end()
+            );
+        const std::string rule = action.dependency_file.size() ? "compile"
+                               : action.response_file.size()   ? "link"
+                                                               : "run";
+        edge(rule, action.outputs, inputs);
+        out += "  command = " + escape_value(action.command) + "\n";
+        if (action.dependency_file.size())
+            out += "  depfile = " + escape_value(action.dependency_file) + "\n";
+        if (action.response_file.size()) {
+            out += "  rspfile = " + escape_value(action.response_file) + "\n";
+            out += "  rspfile_content = "
+                 + escape_value(action.response_file_contents) + "\n";
+        }
+    }
+
+    // Targets by name, as far as they aren't files of the same name.
+    std::unordered_set<std::string> files{};
+    for (const auto& outputs : produced)
+        files.insert(outputs.begin(), outputs.end());
+    std::vector<std::string> defaults{};
+    out += '\n';
+    for (const auto& target : target_names) {
+        const auto& outputs = target_outputs[target];
+        const bool requested =
+            std::find(targets.begin(), targets.end(), target) != targets.end();
+        if (files.count(target)) {
+            if (requested) defaults.push_back(target);
+            continue;
+        }
+        out += "build " + escape_path(target) + ": phony";
+        add_paths(out, outputs);
+        out += '\n';
+        if (requested) defaults.push_back(target);
+    }
+    if (defaults.size()) {
+        std::sort(defaults.begin(), defaults.end());
+        out += "\ndefault";
+        add_paths(out, defaults);
+        out += '\n';
+    }
+    return out;
+}
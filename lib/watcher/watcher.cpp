@@ -0,0 +1,102 @@
+#include <watcher/watcher.h>
+
+#include <cerrno>
+#include <filesystem>
+#include <functional>
+#include <string>
+
+#ifdef __linux__
+#    include <sys/inotify.h>
+#    include <unistd.h>
+#endif
+
+static auto directory_of(const std::string& path) -> std::string {
+    auto directory = std::filesystem::path(path).parent_path().string();
+    return directory.empty() ? "." : directory;
+}
+
+#ifdef __linux__
+
+Watcher::Watcher() {
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+}
+
+Watcher::~Watcher() {
+    if (inotify_fd >= 0) close(inotify_fd);
+}
+
+bool Watcher::watch_directory_of(const std::string& path) {
+    if (inotify_fd < 0) return false;
+    auto directory = directory_of(path);
+    if (watched.count(directory)) return true;
+
+    const int wd = inotify_add_watch(
+        inotify_fd, directory.data(),
+        IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM
+            | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR
+    );
+    // Most likely it doesn't exist (yet).
+    if (wd < 0) return false;
+
+    directories[wd] = directory;
+    watched.insert(std::move(directory));
+    return true;
+}
+
+bool Watcher::drain(
+    const std::function<void(const std::string& path)>& changed
+) {
+    if (inotify_fd < 0) return true;
+
+    bool complete{true};
+    alignas(inotify_event) char buffer[16 * 1024];
+    while (true) {
+        const auto n = read(inotify_fd, buffer, sizeof(buffer));
+        if (n < 0 and errno == EINTR) continue;
+        if (n <= 0) break;
+
+        for (ssize_t offset = 0; offset < n;) {
+            const auto* event =
+                reinterpret_cast<const inotify_event*>(buffer + offset);
+            offset += ssize_t(sizeof(inotify_event) + event->len);
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                complete = false;
+                continue;
+            }
+
+            auto directory = directories.find(event->wd);
+            if (directory == directories.end()) continue;
+
+            // The directory itself went away; so did our watch on it.
+            if (event->mask & IN_IGNORED) {
+                watched.erase(directory->second);
+                changed(directory->second);
+                directories.erase(directory);
+                continue;
+            }
+
+            if (not event->len) {
+                // Paths within a moved directory are stale; IN_IGNORED follows.
+                if (event->mask & IN_MOVE_SELF)
+                    inotify_rm_watch(inotify_fd, event->wd);
+                changed(directory->second);
+                continue;
+            }
+            if (directory->second == ".") changed(event->name);
+            else changed(directory->second + '/' + event->name);
+        }
+    }
+    return complete;
+}
+
+#else  // #ifdef __linux__
+
+Watcher::Watcher() {}
+Watcher::~Watcher() {}
+bool Watcher::watch_directory_of(const std::string&) { return false; }
+bool Watcher::drain(const std::function<void(const std::string&)>&) {
+    return true;
+}
+
+#endif  // #ifdef __linux__
@@ -0,0 +1,460 @@
+#include <worker/worker.h>
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#    include <fcntl.h>
+#    include <netdb.h>
+#    include <poll.h>
+#    include <signal.h>
+#    include <sys/socket.h>
+#    include <sys/un.h>
+#    include <sys/wait.h>
+#    include <unistd.h>
+#endif
+
+// Every connection starts with the worker's hello:
+//   "LBSW" <u32 version> <u32 capacity>
+// after which the client may send one job:
+//   <u32 command size> <u32 input size> <u32 output size> <u64 source size>
+//   <command> <input> <output> <source>
+// which the worker answers with the result:
+//   <u32 status> <u64 output size> <u64 object size> <output> <object>
+// Integers are little endian.
+static constexpr char worker_magic[4]{'L', 'B', 'S', 'W'};
+static constexpr uint32_t worker_version{1};
+static constexpr size_t hello_size{worker_hello_size};
+static constexpr size_t job_header_size{20};
+static constexpr size_t result_header_size{20};
+
+static void put(std::string& out, uint64_t value, size_t bytes) {
+    for (size_t i = 0; i < bytes; ++i) out += char((value >> (8 * i)) & 0xff);
+}
+
+static auto get(const char* in, size_t bytes) -> uint64_t {
+    uint64_t value{0};
+    for (size_t i = 0; i < bytes; ++i)
+        value |= uint64_t((unsigned char)in[i]) << (8 * i);
+    return value;
+}
+
+bool worker_parse_hello(const char* hello, uint32_t& capacity) {
+    if (memcmp(hello, worker_magic, sizeof(worker_magic)) != 0
+        or get(hello + 4, 4) != worker_version)
+        return false;
+    capacity = std::min(uint32_t(get(hello + 8, 4)), worker_capacity_limit);
+    return true;
+}
+
+auto worker_job_message(const WorkerJob& job) -> std::string {
+    std::string message{};
+    put(message, job.command.size(), 4);
+    put(message, job.input.size(), 4);
+    put(message, job.output.size(), 4);
+    put(message, job.source.size(), 8);
+    message += job.command;
+    message += job.input;
+    message += job.output;
+    message += job.source;
+    return message;
+}
+
+bool worker_parse_result(const std::string& received, WorkerResult& result) {
+    if (received.size() < result_header_size) return false;
+    const auto output_size = get(received.data() + 4, 8);
+    const auto object_size = get(received.data() + 12, 8);
+    if (received.size() - result_header_size < output_size
+        or received.size() - result_header_size - output_size < object_size)
+        return false;
+    result.status = int(int32_t(get(received.data(), 4)));
+    result.output = received.substr(result_header_size, output_size);
+    result.object =
+        received.substr(result_header_size + output_size, object_size);
+    return true;
+}
+
+#ifdef __linux__
+
+static bool write_all(int fd, const void* data, size_t size) {
+    auto bytes = static_cast<const char*>(data);
+    while (size) {
+        auto n = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (n < 0 and errno == EINTR) continue;
+        if (n <= 0) return false;
+        bytes += n;
+        size -= size_t(n);
+    }
+    return true;
+}
+
+static bool read_all(int fd, void* data, size_t size) {
+    auto bytes = static_cast<char*>(data);
+    while (size) {
+        auto n = read(fd, bytes, size);
+        if (n < 0 and errno == EINTR) continue;
+        if (n <= 0) return false;
+        bytes += n;
+        size -= size_t(n);
+    }
+    return true;
+}
+
+// The socket addresses (as the bytes of a sockaddr) address stands for, to
+// listen on or to connect to.
+static auto socket_addresses(const std::string& address, bool listening)
+    -> std::vector<std::string> {
+    std::vector<std::string> out{};
+    if (address.compare(0, 5, "unix:") == 0) {
+        const auto path = address.substr(5);
+        sockaddr_un un{};
+        un.sun_family = AF_UNIX;
+        if (path.empty() or path.size() >= sizeof(un.sun_path)) return out;
+        memcpy(un.sun_path, path.data(), path.size());
+        out.emplace_back(reinterpret_cast<const char*>(&un), sizeof(un));
+        return out;
+    }
+
+    const auto colon = address.rfind(':');
+    if (colon == std::string::npos) return out;
+    const auto host = address.substr(0, colon);
+    const auto port = address.substr(colon + 1);
+
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (listening) hints.ai_flags = AI_PASSIVE;
+    addrinfo* found{nullptr};
+    if (getaddrinfo(
+            host.empty() ? nullptr : host.data(), port.data(), &hints, &found
+        )
+        != 0)
+        return out;
+    for (auto* info = found; info; info = info->ai_next)
+        out.emplace_back(
+            reinterpret_cast<const char*>(info->ai_addr), info->ai_addrlen
+        );
+    freeaddrinfo(found);
+    return out;
+}
+
+// A socket of the family of the socket address, or -1.
+static int socket_for(const std::string& socket_address, int flags = 0) {
+    sockaddr_storage storage{};
+    if (socket_address.size() > sizeof(storage)) return -1;
+    memcpy(&storage, socket_address.data(), socket_address.size());
+    return socket(storage.ss_family, SOCK_STREAM | SOCK_CLOEXEC | flags, 0);
+}
+
+// Returns a socket bound to address, or -1.
+static int listen_socket(const std::string& address) {
+    for (const auto& socket_address : socket_addresses(address, true)) {
+        int fd = socket_for(socket_address);
+        if (fd < 0) continue;
+        const auto* bound =
+            reinterpret_cast<const sockaddr*>(socket_address.data());
+        if (bound->sa_family == AF_UNIX)
+            unlink(reinterpret_cast<const sockaddr_un*>(bound)->sun_path);
+        else {
+            int reuse{1};
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        }
+        if (bind(fd, bound, socklen_t(socket_address.size())) == 0) return fd;
+        close(fd);
+    }
+    return -1;
+}
+
+int worker_connect_start(const std::string& resolved) {
+    int fd = socket_for(resolved, SOCK_NONBLOCK);
+    if (fd < 0) return -1;
+    sockaddr_storage storage{};
+    memcpy(&storage, resolved.data(), resolved.size());
+    if (connect(fd, (const sockaddr*)&storage, socklen_t(resolved.size()))
+            != 0
+        and errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool worker_connected(int fd) {
+    int error{0};
+    socklen_t size{sizeof(error)};
+    return getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &size) == 0
+       and error == 0;
+}
+
+// Block until fd is ready for events, or the deadline passes. Returns true
+// iff it is.
+static bool wait_for(
+    int fd,
+    short events,
+    std::chrono::steady_clock::time_point deadline
+) {
+    while (true) {
+        const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now()
+        );
+        if (left.count() <= 0) return false;
+        pollfd poll_fd{fd, events, 0};
+        const int rc = poll(&poll_fd, 1, int(left.count()));
+        if (rc < 0 and errno == EINTR) continue;
+        return rc > 0;
+    }
+}
+
+int worker_connect(
+    const std::string& address,
+    uint32_t& capacity,
+    std::string* resolved
+) {
+    // Don't get stuck on a machine that went away, or doesn't answer.
+    const auto deadline =
+        std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    for (const auto& socket_address : socket_addresses(address, false)) {
+        int fd = worker_connect_start(socket_address);
+        if (fd < 0) continue;
+        char hello[hello_size];
+        size_t received{0};
+        bool connected = wait_for(fd, POLLOUT, deadline)
+                     and worker_connected(fd);
+        while (connected and received < sizeof(hello)) {
+            if (not wait_for(fd, POLLIN, deadline)) connected = false;
+            else {
+                auto n = read(fd, hello + received, sizeof(hello) - received);
+                if (n < 0 and (errno == EINTR or errno == EAGAIN)) continue;
+                if (n <= 0) connected = false;
+                else received += size_t(n);
+            }
+        }
+        if (not connected or not worker_parse_hello(hello, capacity)) {
+            close(fd);
+            continue;
+        }
+        // Those given the connection expect it to block.
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        if (resolved) *resolved = socket_address;
+        return fd;
+    }
+    return -1;
+}
+
+bool worker_send(int fd, const WorkerJob& job) {
+    const auto message = worker_job_message(job);
+    return write_all(fd, message.data(), message.size());
+}
+
+namespace {
+
+// Limits how many jobs compile at once.
+struct Slots {
+    std::mutex mutex{};
+    std::condition_variable available{};
+    uint32_t free{};
+
+    void acquire() {
+        std::unique_lock<std::mutex> lock{mutex};
+        available.wait(lock, [&] { return free > 0; });
+        --free;
+    }
+    void release() {
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            ++free;
+        }
+        available.notify_one();
+    }
+};
+
+}  // namespace
+
+static auto shell_quote(const std::string& text) -> std::string {
+    std::string quoted{"'"};
+    for (const char c : text) {
+        if (c == '\'') quoted += "'\\''";
+        else quoted += c;
+    }
+    quoted += '\'';
+    return quoted;
+}
+
+// Paths in a job must stay within the scratch directory.
+static bool contained(const std::filesystem::path& path) {
+    if (path.empty() or path.is_absolute()) return false;
+    for (const auto& part : path)
+        if (part == "..") return false;
+    return true;
+}
+
+static auto run(const WorkerJob& job) -> WorkerResult {
+    namespace fs = std::filesystem;
+    WorkerResult result{1, {}, {}};
+
+    std::error_code ec{};
+    std::string scratch = (fs::temp_directory_path(ec) / "lbs-worker.XXXXXX");
+    if (ec or not mkdtemp(scratch.data())) {
+        result.output = "lbs-worker: cannot create a scratch directory\n";
+        return result;
+    }
+    const fs::path input = fs::path(scratch) / job.input;
+    const fs::path output = fs::path(scratch) / job.output;
+    fs::create_directories(input.parent_path(), ec);
+    fs::create_directories(output.parent_path(), ec);
+
+    bool written{false};
+    if (auto f = fopen(input.c_str(), "wb")) {
+        written = fwrite(job.source.data(), 1, job.source.size(), f)
+               == job.source.size();
+        written = fclose(f) == 0 and written;
+    }
+    if (not written) {
+        result.output = "lbs-worker: cannot write " + job.input + "\n";
+        fs::remove_all(scratch, ec);
+        return result;
+    }
+
+    const auto command = "cd " + shell_quote(scratch)
+                       + " || exit 1; exec 2>&1; " + job.command;
+    if (auto pipe = popen(command.data(), "r")) {
+        char buffer[4096];
+        size_t n{0};
+        while ((n = fread(buffer, 1, sizeof(buffer), pipe)) > 0)
+            result.output.append(buffer, n);
+        const int status = pclose(pipe);
+        if (WIFEXITED(status)) result.status = WEXITSTATUS(status);
+        else if (WIFSIGNALED(status)) result.status = 128 + WTERMSIG(status);
+    } else result.output = "lbs-worker: cannot run the command\n";
+
+    if (result.status == 0) {
+        if (auto f = fopen(output.c_str(), "rb")) {
+            char buffer[65536];
+            size_t n{0};
+            while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+                result.object.append(buffer, n);
+            fclose(f);
+        } else {
+            result.status = 1;
+            result.output += "lbs-worker: command did not write " + job.output
+                           + "\n";
+        }
+    }
+
+    fs::remove_all(scratch, ec);
+    return result;
+}
+
+static void serve_client(int client, uint32_t capacity, Slots& slots) {
+    std::string hello(worker_magic, sizeof(worker_magic));
+    put(hello, worker_version, 4);
+    put(hello, capacity, 4);
+    if (not write_all(client, hello.data(), hello.size())) return;
+
+    // A client may just be asking for our capacity.
+    char header[job_header_size];
+    if (not read_all(client, header, sizeof(header))) return;
+    WorkerJob job{};
+    job.command.resize(get(header, 4));
+    job.input.resize(get(header + 4, 4));
+    job.output.resize(get(header + 8, 4));
+    // Nobody preprocesses to a gigabyte; it's more likely garbage.
+    const auto source_size = get(header + 12, 8);
+    if (source_size > (uint64_t(1) << 30)) return;
+    job.source.resize(source_size);
+    if (not read_all(client, job.command.data(), job.command.size())
+        or not read_all(client, job.input.data(), job.input.size())
+        or not read_all(client, job.output.data(), job.output.size())
+        or not read_all(client, job.source.data(), job.source.size()))
+        return;
+
+    WorkerResult result{1, {}, {}};
+    if (not contained(job.input) or not contained(job.output)) {
+        result.output = "lbs-worker: refusing paths outside of the scratch "
+                        "directory\n";
+    } else {
+        slots.acquire();
+        result = run(job);
+        slots.release();
+    }
+
+    std::string reply{};
+    put(reply, uint32_t(int32_t(result.status)), 4);
+    put(reply, result.output.size(), 8);
+    put(reply, result.object.size(), 8);
+    if (write_all(client, reply.data(), reply.size()))
+        if (write_all(client, result.output.data(), result.output.size()))
+            write_all(client, result.object.data(), result.object.size());
+}
+
+void worker_serve_connection(int fd, uint32_t capacity) {
+    Slots slots{};
+    slots.free = 1;
+    serve_client(fd, capacity, slots);
+}
+
+int worker_serve(const std::string& address, uint32_t capacity) {
+    // Don't die when answering a client that went away.
+    signal(SIGPIPE, SIG_IGN);
+
+    if (not capacity) capacity = 1;
+    int listen_fd = listen_socket(address);
+    if (listen_fd < 0 or listen(listen_fd, 64) != 0) {
+        printf("ERROR: Cannot listen on %s\n", address.data());
+        if (listen_fd >= 0) close(listen_fd);
+        return 1;
+    }
+    printf(
+        "lbs-worker listening on %s, compiling up to %u at once\n",
+        address.data(), capacity
+    );
+    fflush(stdout);
+
+    // Outlives the detached threads handling clients.
+    static Slots slots{};
+    slots.free = capacity;
+    while (true) {
+        int client = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0) {
+            if (errno == EINTR or errno == ECONNABORTED) continue;
+            perror("ERROR: accept");
+            break;
+        }
+        std::thread([client, capacity] {
+            serve_client(client, capacity, slots);
+            close(client);
+        }).detach();
+    }
+    close(listen_fd);
+    return 1;
+}
+
+#else  // #ifdef __linux__
+
+int worker_connect(const std::string&, uint32_t&, std::string*) {
+    return -1;
+}
+
+bool worker_send(int, const WorkerJob&) { return false; }
+
+int worker_connect_start(const std::string&) { return -1; }
+
+bool worker_connected(int) { return false; }
+
+int worker_serve(const std::string&, uint32_t) {
+    printf("ERROR: lbs-worker is not supported on this platform\n");
+    return 1;
+}
+
+void worker_serve_connection(int, uint32_t) {}
+
+#endif  // #ifdef __linux__
@@ -0,0 +1,51 @@
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+
+#include <bench/bench.h>
+
+int main(int argc, const char** argv) {
+    BenchOptions options{};
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string_view arg{argv[i]};
+
+        if (arg == "-h" or arg.substr(0, 6) == "--help") {
+            // clang-format off
+            printf("USAGE: %s [OPTIONS] [FILTER]\n", argv[0]);
+            printf("Time lexing, parsing, target lookups, planning and compiler template expansion, for those benchmarks whose names contain FILTER (default all).\n");
+            printf("OPTIONS:\n");
+            printf("  --max-sources=<N> :: Go up to inputs of N sources (default 1000000).\n");
+            printf("  --min-time=<MS> :: Repeat each operation for at least MS milliseconds (default 100).\n");
+            // clang-format on
+            return 0;
+        }
+
+        if (arg.substr(0, 14) == "--max-sources=") {
+            std::string value{arg.substr(14)};
+            char* end{nullptr};
+            options.max_sources = std::strtoul(value.data(), &end, 10);
+            if (value.empty() or *end) {
+                printf(
+                    "ERROR: Invalid number of sources \"%s\"\n", value.data()
+                );
+                return 1;
+            }
+        } else if (arg.substr(0, 11) == "--min-time=") {
+            std::string value{arg.substr(11)};
+            char* end{nullptr};
+            options.min_time_ms = std::strtod(value.data(), &end);
+            if (value.empty() or *end or options.min_time_ms < 0) {
+                printf("ERROR: Invalid time \"%s\"\n", value.data());
+                return 1;
+            }
+        } else if (arg.size() and arg.data()[0] == '-') {
+            printf("ERROR: Unknown command line argument \"%s\"\n", arg.data());
+            return 1;
+        } else options.filter = arg;
+    }
+
+    bench_run(options);
+    return 0;
+}
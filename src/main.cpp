@@ -1,12 +1,36 @@
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <filesystem>
+#include <new>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
+#include <poll.h>
+#include <unistd.h>
+
+#include <actionlog/actionlog.h>
+#include <contenthash/contenthash.h>
+#include <daemon/daemon.h>
+#include <dirindex/dirindex.h>
+#include <executor/executor.h>
+#include <filestate/filestate.h>
+#include <includecost/includecost.h>
 #include <lbs/build_scenario.h>
 #include <lbs/compiler.h>
+#include <modscan/modscan.h>
 #include <parser/parser.h>
+#include <stats/stats.h>
 #include <tocmake/tocmake.h>
+#include <toninja/toninja.h>
+#include <watcher/watcher.h>
 
 #ifdef LBS_TEST
 #    include <tests/tests.h>
@@ -35,21 +59,63 @@ auto get_file_contents_or_exit(const std::string_view path) -> std::string {
     return contents;
 }
 
+// Every allocation is counted, for --stats.
+void* operator new(size_t size) {
+    stat_count(STAT_ALLOCATIONS);
+    if (void* allocated = malloc(size ? size : 1)) return allocated;
+    throw std::bad_alloc{};
+}
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* allocated) noexcept { free(allocated); }
+void operator delete[](void* allocated) noexcept { free(allocated); }
+void operator delete(void* allocated, size_t) noexcept { free(allocated); }
+void operator delete[](void* allocated, size_t) noexcept { free(allocated); }
+
 struct Options {
     std::vector<std::string> targets_to_build{};
     std::string language{"c++"};
+    size_t jobs{std::thread::hardware_concurrency()};
+    size_t failures_allowed{1};
     bool dry_run{false};
     bool clean_intermediates{true};
     bool just_clean{false};
     bool tocmake{false};
+    // Write a build.ninja instead of building.
+    bool toninja{false};
     unsigned short verbose{false};
+    // Serve requests as the daemon of this build directory.
+    bool daemon{false};
+    bool stop_daemon{false};
+    // Hand the request to the daemon of this build directory, if there is one.
+    bool use_daemon{true};
+    // Rebuild whenever an input changes.
+    bool watch{false};
+    // Batch size of unity builds, for targets without (unity N); 0 for none.
+    size_t unity{0};
+    // Compile outdated objects in batches, several per compiler invocation.
+    bool batch{false};
+    // Make libraries thin archives.
+    bool thin_archives{false};
+    // Pass inputs to archivers and linkers in a response file once they add
+    // up to this many bytes; 0 leaves it to the build scenario.
+    size_t response_files{0};
+    // Addresses of lbs-workers to compile objects on.
+    std::vector<std::string> workers{};
+    // Report how long each phase took, and how much work it did.
+    bool stats{false};
+    // Compile objects with time tracing, and report which headers cost the
+    // most time; as JSON too, if given a path to write it to.
+    bool include_costs{false};
+    std::string include_costs_json{};
+    // Print why each action that runs has to (-d explain).
+    bool explain{false};
+    // Build profiles to build the targets of, each into its own directory;
+    // none builds them without any.
+    std::vector<std::string> profiles{};
 };
 
-int main(int argc, const char** argv) {
-#ifdef LBS_TEST
-    tests_run();
-#endif
-
+// Exits on invalid arguments.
+auto parse_options(int argc, const char** argv) -> Options {
     Options options{};
 
     if (argc > 1) {
@@ -66,8 +132,36 @@ int main(int argc, const char** argv) {
                     "build is completed.\n");
                 printf("  --cmake :: Best effort to generate a CMakeLists.txt "
                     "from the LISP build system description.\n");
+                printf("  --ninja :: Write a build.ninja that builds the given "
+                    "targets (default all of them) like lbs would.\n");
+                printf("  --daemon :: Serve builds of this directory from memory, "
+                    "for as long as it runs; lbs will then ask it to build.\n");
+                printf("  --stop-daemon :: Stop the daemon of this directory.\n");
+                printf("  --no-daemon :: Build without asking the daemon.\n");
+                printf("  --watch :: Rebuild whenever a source, header, (watches) "
+                    "file or the build description changes.\n");
+                printf("  --unity[=N] :: Compile the sources of targets without (unity N) "
+                    "in batches of about N (default 8).\n");
+                printf("  --batch :: Compile outdated objects of a target a batch "
+                    "at a time, with one compiler invocation each.\n");
+                printf("  --thin-archives :: Make libraries thin archives, "
+                    "which refer to their objects instead of copying them.\n");
+                printf("  --response-files=<N> :: Pass the inputs of archives and "
+                    "links in a response file once they add up to N bytes "
+                    "(default 32768).\n");
+                printf("  --include-costs[=FILE] :: Compile objects with "
+                    "-ftime-trace (which takes clang), then report which "
+                    "headers and template instantiations cost the most time, "
+                    "also as JSON in FILE.\n");
+                printf("  --stats :: Report the time, allocations and peak "
+                    "memory of each phase, and how much work was done.\n");
                 printf("OPTIONS:\n");
                 printf("  -x <lang> :: If a build description doesn't specify a language explicitly, use this language (default c++).\n");
+                printf("  -j <N> :: Run up to N commands at once (default is the number of CPUs).\n");
+                printf("  -d <MODE> :: Debug: \"explain\" prints why each action runs.\n");
+                printf("  -k <N> :: Keep going until N commands fail; 0 means never stop (default 1).\n");
+                printf("  --profile <NAME,...> :: Build the targets of each (profile NAME) at once, each into directory NAME.\n");
+                printf("  --workers <ADDRESS,...> :: Compile objects on the lbs-worker at each address (unix:<path> or <host>:<port>) too.\n");
                 // clang-format on
             }
 
@@ -75,16 +169,169 @@ int main(int argc, const char** argv) {
             else if (arg == "--distclean") options.just_clean = true;
             else if (arg == "--noclean") options.clean_intermediates = false;
             else if (arg == "--cmake") options.tocmake = true;
+            else if (arg == "--ninja") options.toninja = true;
             else if (arg == "--verbose" or arg == "-v") options.verbose = true;
+            else if (arg == "--daemon") options.daemon = true;
+            else if (arg == "--stop-daemon") options.stop_daemon = true;
+            else if (arg == "--no-daemon") options.use_daemon = false;
+            else if (arg == "--watch") options.watch = true;
+            else if (arg == "--batch") options.batch = true;
+            else if (arg == "--thin-archives") options.thin_archives = true;
+            else if (arg == "--unity") options.unity = 8;
+            else if (arg == "--stats") options.stats = true;
+            else if (arg == "--include-costs") options.include_costs = true;
+            else if (arg.substr(0, 16) == "--include-costs=") {
+                options.include_costs = true;
+                options.include_costs_json = arg.substr(16);
+            }
+            else if (arg.substr(0, 17) == "--response-files=") {
+                std::string size{arg.substr(17)};
+                char* end{nullptr};
+                options.response_files = std::strtoul(size.data(), &end, 10);
+                if (size.empty() or *end or not options.response_files) {
+                    printf(
+                        "ERROR: Invalid response file threshold \"%s\"\n",
+                        size.data()
+                    );
+                    exit(1);
+                }
+            }
+            else if (arg.substr(0, 8) == "--unity=") {
+                std::string size{arg.substr(8)};
+                char* end{nullptr};
+                options.unity = std::strtoul(size.data(), &end, 10);
+                if (size.empty() or *end or not options.unity) {
+                    printf(
+                        "ERROR: Invalid unity batch size \"%s\"\n", size.data()
+                    );
+                    exit(1);
+                }
+            }
             else if (arg == "-x") {
                 if (i + 1 >= argc) {
                     printf(
                         "ERROR: Option -x provided at end of command line, "
-                        "expected language"
+                        "expected language\n"
                     );
+                    exit(1);
                 }
                 const std::string_view option{argv[++i]};
                 options.language = option;
+            } else if (arg.substr(0, 2) == "-j") {
+                // Accept both "-j N" and "-jN".
+                std::string jobs{arg.substr(2)};
+                if (jobs.empty()) {
+                    if (i + 1 >= argc) {
+                        printf(
+                            "ERROR: Option -j provided at end of command line, "
+                            "expected number of jobs\n"
+                        );
+                        exit(1);
+                    }
+                    jobs = argv[++i];
+                }
+                char* end{nullptr};
+                options.jobs = std::strtoul(jobs.data(), &end, 10);
+                if (jobs.empty() or not isdigit((unsigned char)jobs[0]) or *end
+                    or not options.jobs) {
+                    printf(
+                        "ERROR: Invalid number of jobs \"%s\"\n", jobs.data()
+                    );
+                    exit(1);
+                }
+                if (options.jobs > executor_jobs_limit) {
+                    printf(
+                        "WARNING: Running no more than %zu jobs at once\n",
+                        executor_jobs_limit
+                    );
+                    options.jobs = executor_jobs_limit;
+                }
+            } else if (arg.substr(0, 2) == "-d") {
+                // Accept both "-d MODE" and "-dMODE".
+                std::string mode{arg.substr(2)};
+                if (mode.empty()) {
+                    if (i + 1 >= argc) {
+                        printf(
+                            "ERROR: Option -d provided at end of command line, "
+                            "expected debug mode\n"
+                        );
+                        exit(1);
+                    }
+                    mode = argv[++i];
+                }
+                if (mode != "explain") {
+                    printf("ERROR: Unknown debug mode \"%s\"\n", mode.data());
+                    exit(1);
+                }
+                options.explain = true;
+            } else if (arg.substr(0, 2) == "-k") {
+                // Accept both "-k N" and "-kN".
+                std::string failures{arg.substr(2)};
+                if (failures.empty()) {
+                    if (i + 1 >= argc) {
+                        printf(
+                            "ERROR: Option -k provided at end of command line, "
+                            "expected number of failures\n"
+                        );
+                        exit(1);
+                    }
+                    failures = argv[++i];
+                }
+                char* end{nullptr};
+                options.failures_allowed =
+                    std::strtoul(failures.data(), &end, 10);
+                if (failures.empty() or *end) {
+                    printf(
+                        "ERROR: Invalid number of failures \"%s\"\n",
+                        failures.data()
+                    );
+                    exit(1);
+                }
+            }
+
+            else if (arg == "--profile") {
+                if (i + 1 >= argc) {
+                    printf(
+                        "ERROR: Option --profile provided at end of command "
+                        "line, expected profile names\n"
+                    );
+                    exit(1);
+                }
+                const std::string_view names{argv[++i]};
+                size_t begin{0};
+                while (begin <= names.size()) {
+                    auto end = names.find(',', begin);
+                    if (end == std::string_view::npos) end = names.size();
+                    const std::string name{names.substr(begin, end - begin)};
+                    if (name.size()
+                        and std::find(
+                                options.profiles.begin(),
+                                options.profiles.end(), name
+                            )
+                                == options.profiles.end())
+                        options.profiles.push_back(name);
+                    begin = end + 1;
+                }
+            }
+            else if (arg == "--workers") {
+                if (i + 1 >= argc) {
+                    printf(
+                        "ERROR: Option --workers provided at end of command "
+                        "line, expected addresses\n"
+                    );
+                    exit(1);
+                }
+                const std::string_view addresses{argv[++i]};
+                size_t begin{0};
+                while (begin <= addresses.size()) {
+                    auto end = addresses.find(',', begin);
+                    if (end == std::string_view::npos) end = addresses.size();
+                    if (end > begin)
+                        options.workers.emplace_back(
+                            addresses.substr(begin, end - begin)
+                        );
+                    begin = end + 1;
+                }
             }
 
             // NOTE: If you want a target that starts with a dash, you can
@@ -102,6 +349,49 @@ int main(int argc, const char** argv) {
         }
     }
 
+    return options;
+}
+
+void add_default_compilers(BuildScenario& build_scenario) {
+    const std::string archive_template = "ar crs %o %@";
+    const std::string archive_update_template = "ar rs %o %i";
+    const std::string archive_delete_template = "ar ds %o %i";
+    const std::string thin_archive_template = "ar crsT %o %@";
+    const std::string runtime_path_template = "-Wl,-rpath,'%r'";
+    const std::string interface_stub_template =
+        "nm -gDP --defined-only %i | cut -d' ' -f1-2 > %o";
+    // Paths are made relative again, so that batched objects come out the
+    // same as any other.
+    const auto batch_template = [](const std::string& compiler) {
+        return compiler
+             + " -c %f %d %i -MMD -ffile-prefix-map=%w/= "
+               "-fdebug-prefix-map=%b=%w";
+    };
+
+    build_scenario.compilers.push_back(Compiler{
+        "c", "cc -c %f %d %i -o %o -MMD -MF %M", archive_template,
+        "cc %f %d %@ -o %o", ".i",
+        "cc -x c-header %f %d %i -o %o -MMD -MF %M", ".gch", "-include %i",
+        "", batch_template("cc"), "cc -shared %f %d %@ -o %o -Wl,-soname,%n",
+        "-fPIC", runtime_path_template, interface_stub_template,
+        archive_update_template, archive_delete_template,
+        thin_archive_template, "-ftime-trace"});
+
+    build_scenario.compilers.push_back(Compiler{
+        "c++", "c++ -c %f %d %i -o %o -MMD -MF %M", archive_template,
+        "c++ %f %d %@ -o %o", ".ii",
+        "c++ -x c++-header %f %d %i -o %o -MMD -MF %M", ".gch",
+        "-include %i", "gcm.cache/%m.gcm",
+        batch_template("c++"), "c++ -shared %f %d %@ -o %o -Wl,-soname,%n",
+        "-fPIC", runtime_path_template, interface_stub_template,
+        archive_update_template, archive_delete_template,
+        thin_archive_template, "-ftime-trace"});
+
+    build_scenario.compilers.push_back(Compiler{
+        "lcc", "lcc %f %d %i -o %o", archive_template, "cc %f %d %i -o %o"});
+}
+
+auto read_build_scenario(const std::string& default_language) -> BuildScenario {
     const char* path = ".lbs";
     if (not std::filesystem::exists(path)) {
         printf("No build file at .lbs found, exiting\n");
@@ -109,46 +399,50 @@ int main(int argc, const char** argv) {
             "    To learn how to write one, see "
             "https://github.com/LensPlaysGames/lisp-build-system\n"
         );
-        return 1;
+        exit(1);
     }
 
-    const std::string default_language = options.language;
-
+    StatPhase read{"read"};
     std::string source = get_file_contents_or_exit(path);
+    read.end();
+    StatPhase parsing{"parse"};
     auto build_scenario = parse(source, default_language);
+    add_default_compilers(build_scenario);
+    return build_scenario;
+}
 
-    if (options.tocmake) {
-        std::string cmake = tocmake(build_scenario);
-        std::printf("%s\n", cmake.data());
-        exit(0);
-    }
-
-    const std::string archive_template = "ar crs %o %i";
-
-    build_scenario.compilers.push_back(Compiler{
-        "c", "cc -c %f %d %i -o %o", archive_template, "cc %f %d %i -o %o"});
-
-    build_scenario.compilers.push_back(Compiler{
-        "c++", "c++ -c %f %d %i -o %o", archive_template, "c++ %f %d %i -o %o"}
-    );
-
-    build_scenario.compilers.push_back(Compiler{
-        "lcc", "lcc %f %d %i -o %o", archive_template, "cc %f %d %i -o %o"});
-
+// The actions building the targets asked for in options, which are marked
+// as built.
+auto plan_targets(BuildScenario& build_scenario, const Options& options)
+    -> BuildScenario::BuildCommands {
+    const std::string& default_language = options.language;
     BuildScenario::BuildCommands build_commands{};
 
-    std::string target_to_build{""};
     if (options.targets_to_build.size()) {
         for (const auto& target_to_build : options.targets_to_build)
             build_commands.push_back(BuildScenario::Commands(
                 build_scenario, target_to_build, default_language
             ));
+    } else if (options.toninja) {
+        // A build.ninja may as well build anything.
+        for (const auto& target : build_scenario.targets)
+            build_commands.push_back(BuildScenario::Commands(
+                build_scenario, target.name,
+                target.language.empty() ? default_language : target.language
+            ));
     } else {
-        // Attempt to find a single executable target, and build that by
+        // Attempt to find a single executable target (that no other target
+        // depends on, like a helper program would be), and build that by
         // default.
+        std::unordered_set<std::string> dependencies{};
+        for (const auto& target : build_scenario.targets)
+            for (const auto& requisite : target.requisites)
+                if (requisite.kind == Target::Requisite::DEPENDENCY)
+                    dependencies.insert(requisite.text);
         const Target* single_executable_target{nullptr};
         for (const auto& target : build_scenario.targets) {
-            if (target.kind == Target::Kind::EXECUTABLE) {
+            if (target.kind == Target::Kind::EXECUTABLE
+                and not dependencies.count(target.name)) {
                 if (single_executable_target) {
                     single_executable_target = nullptr;
                     break;
@@ -173,6 +467,199 @@ int main(int argc, const char** argv) {
         ));
     }
 
+    return build_commands;
+}
+
+// Whether compiler's driver (the first word of its Object Compilation
+// Template) accepts its Time Trace Flag, which only clang's does: found out by
+// compiling an empty source with it, once (the daemon plans again and again).
+bool accepts_time_trace(const Compiler& compiler) {
+    static std::unordered_map<std::string, bool> accepted{};
+    const auto driver =
+        compiler.object_template.substr(0, compiler.object_template.find(' '));
+    const auto key = driver + ' ' + compiler.time_trace_flag;
+    auto known = accepted.find(key);
+    if (known != accepted.end()) return known->second;
+
+    // The trace is written next to the object.
+    std::error_code ec{};
+    const auto directory = std::filesystem::temp_directory_path(ec)
+                         / ("lbs_time_trace_" + std::to_string(getpid()));
+    std::filesystem::create_directories(directory, ec);
+    const auto command = driver + ' ' + compiler.time_trace_flag
+                       + " -x c -c /dev/null -o '"
+                       + (directory / "probe.o").string()
+                       + "' >/dev/null 2>&1";
+    const bool accepts = not ec and std::system(command.data()) == 0;
+    std::filesystem::remove_all(directory, ec);
+    return accepted[key] = accepts;
+}
+
+// The actions needed to build the targets asked for in options. Planning
+// marks targets as built (and adds the sources found in source directories),
+// hence the copy of the build scenario. The sources are stat'ed into
+// file_states, for checking what's outdated to find them there.
+auto plan(
+    BuildScenario build_scenario,
+    const Options& options,
+    ModuleScans& module_scans,
+    DirectoryIndex& directory_index,
+    FileStates& file_states
+) -> BuildScenario::BuildCommands {
+    build_scenario.unity = options.unity;
+    build_scenario.thin_archives = options.thin_archives;
+    // Whatever compiler rejects the flag would fail every object, so it's
+    // found out before anything is compiled.
+    for (const auto& compiler : build_scenario.compilers) {
+        if (not options.include_costs or compiler.time_trace_flag.empty())
+            continue;
+        if (accepts_time_trace(compiler))
+            build_scenario.time_trace_compilers.push_back(compiler.name);
+        else
+            printf(
+                "WARNING: %s doesn't accept %s, so it compiles objects "
+                "without it, and no include costs are reported for them\n",
+                compiler.name.data(), compiler.time_trace_flag.data()
+            );
+    }
+    if (options.response_files)
+        build_scenario.response_file_threshold = options.response_files;
+    StatPhase sources{"sources"};
+    directory_index.expand_sources(build_scenario);
+    if (not options.dry_run) directory_index.save();
+    module_scans.scan_sources(build_scenario, file_states);
+    if (not options.dry_run) module_scans.save();
+    sources.end();
+
+    StatPhase commands{"commands"};
+    BuildScenario::BuildCommands build_commands{};
+    if (options.profiles.empty())
+        build_commands = plan_targets(build_scenario, options);
+    // Each into a directory of its own, so they may all be built at once.
+    for (const auto& name : options.profiles) {
+        const auto* profile = build_scenario.profile(name);
+        if (not profile) {
+            printf("ERROR: There is no profile %s\n", name.data());
+            exit(1);
+        }
+        auto profiled = build_scenario;
+        profiled.apply_profile(*profile);
+        build_commands.push_back(plan_targets(profiled, options));
+    }
+
+    stat_count(STAT_ACTIONS_PLANNED, build_commands.actions.size());
+    return build_commands;
+}
+
+// Write the response files of build_commands whose contents differ from
+// what they should be; one that is already right is left alone, so that
+// whatever reads it stays up to date.
+void write_response_files(
+    const BuildScenario::BuildCommands& build_commands,
+    FileStates& file_states
+) {
+    for (const auto& action : build_commands.actions) {
+        if (action.response_file.empty()) continue;
+        std::string contents{};
+        if (auto f = fopen(action.response_file.data(), "rb")) {
+            char buffer[65536];
+            size_t n{0};
+            while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+                contents.append(buffer, n);
+            fclose(f);
+        }
+        if (contents == action.response_file_contents) continue;
+
+        // Written aside and renamed, so that it's never seen half-written.
+        const auto partial = action.response_file + ".partial";
+        auto f = fopen(partial.data(), "wb");
+        bool written{f != nullptr};
+        if (f) {
+            const auto& text = action.response_file_contents;
+            written = fwrite(text.data(), 1, text.size(), f) == text.size();
+            written = fclose(f) == 0 and written;
+        }
+        if (written)
+            written = rename(partial.data(), action.response_file.data()) == 0;
+        if (not written) {
+            std::remove(partial.data());
+            printf(
+                "WARNING: Cannot write response file %s\n",
+                action.response_file.data()
+            );
+        }
+        file_states.invalidate(action.response_file);
+    }
+}
+
+// Print which headers and template instantiations the traced objects of
+// build_commands spent their time on, and write it as JSON to json_path,
+// unless empty.
+void report_include_costs(
+    const BuildScenario::BuildCommands& build_commands,
+    const std::string& json_path
+) {
+    IncludeCosts costs{};
+    size_t untraced{0};
+    for (const auto& action : build_commands.actions) {
+        if (action.time_trace.empty()) continue;
+        std::string trace{};
+        auto f = fopen(action.time_trace.data(), "rb");
+        if (not f) {
+            ++untraced;
+            continue;
+        }
+        char buffer[65536];
+        size_t n{0};
+        while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+            trace.append(buffer, n);
+        fclose(f);
+
+        // Of what the dependency file lists, the headers.
+        std::vector<std::string> includes{};
+        if (action.dependency_file.size())
+            includes = read_dependency_file(action.dependency_file);
+        includes.erase(
+            std::remove_if(
+                includes.begin(), includes.end(),
+                [&](const std::string& include) {
+                    return std::find(
+                               action.inputs.begin(), action.inputs.end(),
+                               include
+                           )
+                        != action.inputs.end();
+                }
+            ),
+            includes.end()
+        );
+        if (not costs.add(trace, includes)) ++untraced;
+    }
+    if (untraced)
+        printf(
+            "WARNING: No time trace of %zu objects; does the compiler write "
+            "them?\n",
+            untraced
+        );
+    printf("\n%s", costs.text(20).data());
+
+    if (json_path.empty()) return;
+    const auto json = costs.json(SIZE_MAX);
+    auto f = fopen(json_path.data(), "wb");
+    if (not f or fwrite(json.data(), 1, json.size(), f) != json.size())
+        printf("WARNING: Cannot write include costs to %s\n", json_path.data());
+    if (f) fclose(f);
+}
+
+// Returns an exit status.
+// executor_options may carry anything not covered by options.
+auto build(
+    const Options& options,
+    const BuildScenario::BuildCommands& build_commands,
+    ActionLog& log,
+    FileStates& file_states,
+    ContentHashes& content_hashes,
+    ExecutorOptions executor_options = {}
+) -> int {
     if (options.just_clean) {
         for (auto artifact : build_commands.artifacts) {
             if (options.verbose)
@@ -184,38 +671,469 @@ int main(int argc, const char** argv) {
         return 0;
     }
 
+    StatPhase check{"check"};
+    if (not options.dry_run) write_response_files(build_commands, file_states);
+
+    // Only run what isn't up to date already.
+    // Actions that only have to run for the sake of others are told so.
+    auto marked_build_commands = build_commands;
+    std::vector<std::vector<size_t>> conditional{};
+    std::vector<std::string> reasons{};
+    const auto outdated = outdated_actions(
+        marked_build_commands, log, file_states, &conditional, &content_hashes,
+        options.explain ? &reasons : nullptr
+    );
+    for (size_t i = 0; i < outdated.size(); ++i)
+        marked_build_commands.actions[i].conditional_on =
+            std::move(conditional[i]);
+    // Those only run for the sake of others may yet be skipped.
+    for (size_t i = 0; i < reasons.size(); ++i) {
+        if (not outdated[i]) continue;
+        const auto& action = build_commands.actions[i];
+        printf(
+            "[EXPLAIN]: %s: %s%s\n",
+            action.outputs.size() ? action.outputs.front().data()
+                                  : action.command.data(),
+            reasons[i].data(),
+            marked_build_commands.actions[i].conditional_on.size()
+                ? " (unless it comes out the same)"
+                : ""
+        );
+    }
+    auto outdated_build_commands = marked_build_commands.only(outdated);
+    update_archives_in_place(
+        outdated_build_commands, log, file_states,
+        options.response_files ? options.response_files
+                               : BuildScenario{}.response_file_threshold
+    );
+    if (options.batch)
+        outdated_build_commands =
+            outdated_build_commands.batched(options.jobs);
+    stat_count(
+        STAT_ACTIONS_SKIPPED,
+        build_commands.actions.size() - outdated_build_commands.actions.size()
+    );
+    if (outdated_build_commands.actions.empty())
+        printf("Nothing to do, everything is up to date\n");
+    check.end();
+
     // Execute build commands.
-    for (const auto& command : build_commands.commands) {
-        if (options.dry_run) printf("[DRY]:[RUN]: %s\n", command.data());
-        else {
-            if (options.verbose) printf("[RUN]: %s\n", command.data());
-            // THIS IS NOT A FIRE DRILL THIS IS THE REAL DEAL
-            // Use system() from libc to run build commands.
-            auto rc = std::system(command.data());
-            if (rc) {
-                printf(
-                    "[BUILD]:ERROR: command failed with status %d\n    %s\n",
-                    int(rc),
-                    command.data()
+    StatPhase executing{"execute"};
+    bool success{true};
+    if (options.dry_run) {
+        for (const auto& action : outdated_build_commands.actions)
+            printf("[DRY]:[RUN]: %s\n", action.command.data());
+    } else {
+        // THIS IS NOT A FIRE DRILL THIS IS THE REAL DEAL
+        executor_options.log = &log;
+        executor_options.file_states = &file_states;
+        executor_options.jobs = options.jobs;
+        executor_options.failures_allowed = options.failures_allowed;
+        executor_options.verbose = options.verbose;
+        executor_options.workers = options.workers;
+        executor_options.input_hash =
+            [&](const BuildScenario::BuildCommands::Action& action,
+                int64_t started) {
+                return hash_action_inputs(
+                    action, content_hashes, file_states, started
                 );
-                break;
-            }
-        }
+            };
+        success = execute(outdated_build_commands, executor_options);
+        content_hashes.save();
     }
+    executing.end();
 
-    // To clean up the intermediates, we remove all artifacts except the last.
-    // While this isn't guaranteed to work, it's pretty damn close.
+    // Dependency files may go with the intermediates, so before those.
+    if (options.include_costs and not options.dry_run)
+        report_include_costs(build_commands, options.include_costs_json);
+
+    // To clean up the intermediates, we remove all artifacts except the last
+    // (and executables). While this isn't guaranteed to work, it's pretty damn
+    // close.
+    StatPhase cleaning{"clean"};
     if (options.clean_intermediates) {
+        const auto& executables = build_commands.executables;
         for (auto it = build_commands.artifacts.begin();
              it != build_commands.artifacts.end()
              and it != build_commands.artifacts.end() - 1;
              ++it) {
+            if (std::find(executables.begin(), executables.end(), *it)
+                != executables.end())
+                continue;
             if (options.verbose) printf("[REMOVE ARTIFACT]: %s\n", it->data());
             if (options.dry_run)
                 printf("[DRY]:[REMOVE ARTIFACT]: %s\n", it->data());
             else std::remove(it->data());
         }
     }
+    cleaning.end();
+
+    if (options.stats) stats_print();
+    return success ? 0 : 1;
+}
+
+// What a long-running lbs (the daemon, or watch mode) keeps in memory from
+// one build to the next: parsed build scenarios, planned actions and file
+// states. Whatever changes on disk in the meantime is forgotten about, as
+// inotify tells us.
+// NOTE: Like the rest of lbs, the parser exits on errors, and so a broken
+// .lbs takes a session down with it.
+struct Session {
+    // Keyed by default language.
+    std::unordered_map<std::string, BuildScenario> build_scenarios{};
+    // Keyed by language, unity batch size, then targets (each terminated by
+    // a NUL byte).
+    std::unordered_map<std::string, BuildScenario::BuildCommands> plans{};
+    // Everything any plan writes, so that we may tell changes made by a build
+    // apart from changes made to its inputs.
+    std::unordered_set<std::string> outputs{};
+    // Directories any plan lists the files in as they were while planning:
+    // those copied, and those sources are found in.
+    std::unordered_set<std::string> listed_directories{};
+    ActionLog log = ActionLog::Load(".lbs_log");
+    // Which modules sources provide and import is part of the plan.
+    ModuleScans module_scans = ModuleScans::Load(".lbs_modules");
+    DirectoryIndex directory_index = DirectoryIndex::Load(".lbs_directories");
+    ContentHashes content_hashes = ContentHashes::Load(".lbs_hashes");
+    Watcher watcher{};
+    FileStates file_states{};
+    // Hash of the environment the plans were made in (see serve()).
+    uint64_t environment{0};
+
+    Session() {
+        file_states.keep_fresh = [this](const std::string& path) {
+            return watcher.watch_directory_of(path);
+        };
+        if (not watcher.watch_directory_of(".lbs"))
+            printf("WARNING: Cannot watch for changes, so nothing is cached\n");
+    }
+    Session(const Session&) = delete;
+    Session& operator=(const Session&) = delete;
+
+    // Forget what was parsed and planned, so that it's done again.
+    void forget_plans() {
+        build_scenarios.clear();
+        plans.clear();
+        outputs.clear();
+        listed_directories.clear();
+    }
+
+    // Forget about everything that changed. Returns true iff anything we
+    // read while planning a build changed (rather than just what it wrote).
+    // As a failed action isn't checked any further, anything but what a
+    // build writes may be what fixes it; so pass any_input after a failure.
+    bool drain(bool any_input = false) {
+        bool inputs_changed{false};
+        const auto forget_plans = [&] {
+            this->forget_plans();
+            inputs_changed = true;
+        };
+        // Batches are compiled in a directory of their own.
+        const std::string batches{
+            BuildScenario::BuildCommands::batch_directory};
+        const auto within_batch_directory = [&](const std::string& path) {
+            return path.compare(0, batches.size(), batches) == 0
+               and (path.size() == batches.size()
+                    or path[batches.size()] == '/');
+        };
+        const bool complete = watcher.drain([&](const std::string& path) {
+            const auto normal = normal_path(path);
+            if (normal == ".lbs") forget_plans();
+            const auto scanned = module_scans.entries.find(normal);
+            if (scanned != module_scans.entries.end()) {
+                const auto unit = scanned->second.unit;
+                if (not (module_scans.scan(normal) == unit)) forget_plans();
+            }
+            const bool known = file_states.invalidate(normal);
+            // A file added to or removed from a listed directory changes
+            // the plan, and the directory's modification time.
+            auto directory =
+                std::filesystem::path(normal).parent_path().string();
+            if (directory.empty()) directory = ".";
+            if (listed_directories.count(directory)
+                and (not known or not std::filesystem::exists(normal))) {
+                file_states.invalidate(directory);
+                forget_plans();
+            }
+            if ((known or any_input) and not outputs.count(normal)
+                and normal != ".lbs_log" and normal != ".lbs_modules"
+                and normal != ".lbs_directories" and normal != ".lbs_hashes"
+                and not within_batch_directory(normal))
+                inputs_changed = true;
+        });
+        if (not complete) {
+            file_states.clear();
+            forget_plans();
+        }
+        return inputs_changed;
+    }
+
+    auto build_commands(const Options& options)
+        -> const BuildScenario::BuildCommands& {
+        auto build_scenario = build_scenarios.find(options.language);
+        if (build_scenario == build_scenarios.end()) {
+            auto parsed = read_build_scenario(options.language);
+            build_scenario =
+                build_scenarios.emplace(options.language, std::move(parsed))
+                    .first;
+        }
+
+        std::string plan_key{options.language};
+        plan_key += '\0';
+        plan_key += std::to_string(options.unity);
+        plan_key += '\0';
+        plan_key += options.thin_archives ? "thin" : "";
+        plan_key += '\0';
+        plan_key += options.include_costs ? "traced" : "";
+        plan_key += '\0';
+        for (const auto& profile : options.profiles) {
+            plan_key += profile;
+            plan_key += ',';
+        }
+        plan_key += '\0';
+        plan_key += std::to_string(options.response_files);
+        plan_key += '\0';
+        for (const auto& target : options.targets_to_build) {
+            plan_key += target;
+            plan_key += '\0';
+        }
+        auto build_commands = plans.find(plan_key);
+        if (build_commands == plans.end()) {
+            build_commands =
+                plans
+                    .emplace(
+                        plan_key,
+                        plan(
+                            build_scenario->second, options, module_scans,
+                            directory_index, file_states
+                        )
+                    )
+                    .first;
+            for (const auto& action : build_commands->second.actions) {
+                for (const auto& output : action.outputs)
+                    outputs.insert(normal_path(output));
+                if (action.dependency_file.size())
+                    outputs.insert(normal_path(action.dependency_file));
+                if (action.response_file.size())
+                    outputs.insert(normal_path(action.response_file));
+                // Of a copy, the inputs that aren't copied are directories.
+                for (size_t i = action.copy_sources.size();
+                     i < action.inputs.size(); ++i)
+                    listed_directories.insert(normal_path(action.inputs[i]));
+            }
+            listed_directories.insert(
+                directory_index.listed.begin(), directory_index.listed.end()
+            );
+            // Those without any file we look at wouldn't be watched yet.
+            for (const auto& directory : listed_directories)
+                watcher.watch_directory_of(directory + "/.");
+        }
+        return build_commands->second;
+    }
+};
+
+// Serve requests as the daemon of this build directory, until asked to stop.
+auto serve(const Options& daemon_options) -> int {
+    Session session{};
+
+    DaemonHandlers handlers{};
+    handlers.event_fd = session.watcher.fd();
+    handlers.event = [&] { session.drain(); };
+    handlers.request = [&](const std::vector<std::string>& arguments,
+                           const std::vector<std::string>& environment,
+                           bool& stop) {
+        session.drain();
+        // Commands run in the client's environment, in which they may well
+        // mean something else (another compiler on the PATH, say); whatever
+        // was planned in another one is planned again.
+        std::string variables{};
+        for (const auto& variable : environment) {
+            variables += variable;
+            variables += '\0';
+        }
+        const auto environment_hash = hash_command(variables);
+        if (environment_hash != session.environment) {
+            session.forget_plans();
+            session.environment = environment_hash;
+        }
+
+        // The client already made sure these are valid.
+        std::vector<const char*> argv{"lbs"};
+        for (const auto& argument : arguments) argv.push_back(argument.data());
+        auto options = parse_options(int(argv.size()), argv.data());
+        if (options.stop_daemon) {
+            printf("Stopping lbs daemon\n");
+            stop = true;
+            return 0;
+        }
+        // Rebuilding quickly is the whole point of the daemon, and for that
+        // we need the intermediates.
+        options.clean_intermediates = false;
+        if (options.stats) stats_start();
+
+        if (options.tocmake) {
+            session.build_commands(options);
+            std::string cmake =
+                tocmake(session.build_scenarios.at(options.language));
+            std::printf("%s\n", cmake.data());
+            return 0;
+        }
+
+        return build(
+            options, session.build_commands(options), session.log,
+            session.file_states, session.content_hashes
+        );
+    };
+
+    printf(
+        "lbs daemon listening on %s (language %s)\n", LBS_DAEMON_SOCKET,
+        daemon_options.language.data()
+    );
+    fflush(stdout);
+    return daemon_serve(handlers);
+}
+
+// Block until fd is readable or timeout (in milliseconds, -1 for none)
+// passes. Returns true iff fd is readable.
+static bool wait_readable(int fd, int timeout) {
+    pollfd poll_fd{fd, POLLIN, 0};
+    while (true) {
+        int rc = poll(&poll_fd, 1, timeout);
+        if (rc < 0 and errno == EINTR) continue;
+        return rc > 0;
+    }
+}
+
+// Build, then rebuild whenever something the build read changes, forever. A
+// build whose inputs change while it runs is cancelled and started over.
+auto watch(Options options) -> int {
+    // Changes tend to come in bursts (saving several files, a checkout), and
+    // we'd rather build once after the burst than once per change.
+    constexpr int quiet_period = 100;
+
+    Session session{};
+    if (session.watcher.fd() < 0) {
+        printf("ERROR: Cannot watch for changes on this system\n");
+        return 1;
+    }
+
+    // Rebuilding quickly is the whole point, and for that we need the
+    // intermediates.
+    options.clean_intermediates = false;
+
+    while (true) {
+        session.drain();
+        if (options.stats) stats_start();
+
+        bool changed_while_building{false};
+        ExecutorOptions executor_options{};
+        executor_options.cancel_fd = session.watcher.fd();
+        executor_options.cancelled = [&] {
+            return changed_while_building = session.drain();
+        };
+        const bool failed =
+            build(
+                options, session.build_commands(options), session.log,
+                session.file_states, session.content_hashes, executor_options
+            )
+            != 0;
+        // Look at everything the next build will, so that we know which
+        // changes matter to it.
+        outdated_actions(
+            session.build_commands(options), session.log, session.file_states
+        );
+
+        if (not changed_while_building) {
+            printf("[WATCH]: Waiting for changes\n");
+            fflush(stdout);
+            while (wait_readable(session.watcher.fd(), -1)
+                   and not session.drain(failed))
+                ;
+        }
+        while (wait_readable(session.watcher.fd(), quiet_period))
+            session.drain();
+        printf("[WATCH]: Rebuilding\n");
+    }
+}
+
+int main(int argc, const char** argv) {
+#ifdef LBS_TEST
+    tests_run();
+#endif
+
+    auto options = parse_options(argc, argv);
+    if (options.stats) stats_start();
+
+    if (options.daemon) return serve(options);
+    if (options.watch) return watch(options);
+
+    // Writing a build.ninja is a one-off, not worth asking the daemon for.
+    if ((options.use_daemon and not options.toninja) or options.stop_daemon) {
+        std::vector<std::string> arguments{};
+        for (int i = 1; i < argc; ++i) arguments.push_back(argv[i]);
+        int status{0};
+        if (daemon_request(arguments, status)) return status;
+        if (options.stop_daemon) {
+            printf("No lbs daemon is running in this directory\n");
+            return 1;
+        }
+    }
+
+    auto build_scenario = read_build_scenario(options.language);
+
+    if (options.tocmake) {
+        std::string cmake = tocmake(build_scenario);
+        std::printf("%s\n", cmake.data());
+        exit(0);
+    }
+
+    StatPhase load{"load"};
+    auto module_scans = ModuleScans::Load(".lbs_modules");
+    auto directory_index = DirectoryIndex::Load(".lbs_directories");
+    load.end();
+    FileStates file_states{};
+    auto build_commands = plan(
+        build_scenario, options, module_scans, directory_index, file_states
+    );
+
+    if (options.toninja) {
+        // The manifest is written again just like this.
+        std::string regenerate{};
+        for (int i = 0; i < argc; ++i) {
+            if (i) regenerate += ' ';
+            regenerate += '\'';
+            for (const char* c = argv[i]; *c; ++c) {
+                if (*c == '\'') regenerate += "'\\''";
+                else regenerate += *c;
+            }
+            regenerate += '\'';
+        }
+        std::vector<std::string> names = options.targets_to_build;
+        if (names.empty())
+            for (const auto& target : build_scenario.targets)
+                names.push_back(target.name);
+        // Targets of profiles go by their name within its directory.
+        std::vector<std::string> targets{};
+        if (options.profiles.empty()) targets = names;
+        for (const auto& profile : options.profiles)
+            for (const auto& name : names)
+                targets.push_back(profile + '/' + name);
+        const auto ninja = toninja(build_commands, targets, regenerate);
+        auto f = fopen("build.ninja", "wb");
+        if (not f
+            or fwrite(ninja.data(), 1, ninja.size(), f) != ninja.size()) {
+            printf("ERROR: Cannot write build.ninja\n");
+            exit(1);
+        }
+        fclose(f);
+        printf("Wrote build.ninja\n");
+        return 0;
+    }
 
-    return 0;
+    StatPhase loading{"load"};
+    // A dry run shouldn't leave anything behind, not even in the log.
+    auto log = ActionLog::Load(".lbs_log", not options.dry_run);
+    auto content_hashes = ContentHashes::Load(".lbs_hashes");
+    loading.end();
+    return build(options, build_commands, log, file_states, content_hashes);
 }
@@ -0,0 +1,301 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include <perf/perf.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+static constexpr const char* scenarios[]{
+    "clean", "no-op", "source-edited", "header-edited"};
+static constexpr size_t scenario_count = sizeof(scenarios) / sizeof(*scenarios);
+
+// Parse the N of an --option=N, or exit.
+auto count(std::string_view arg, size_t prefix) -> size_t {
+    const std::string value{arg.substr(prefix)};
+    char* end{nullptr};
+    const auto n = std::strtoul(value.data(), &end, 10);
+    if (value.empty() or *end) {
+        printf(
+            "ERROR: Invalid number \"%s\" for %s\n", value.data(),
+            std::string(arg.substr(0, prefix - 1)).data()
+        );
+        exit(1);
+    }
+    return n;
+}
+
+// The executable named in PATH, or empty.
+auto find_in_path(const std::string& name) -> std::string {
+    const char* path = getenv("PATH");
+    if (not path) return {};
+    std::string_view rest{path};
+    while (true) {
+        const auto colon = rest.find(':');
+        const std::string directory{rest.substr(0, colon)};
+        const auto candidate =
+            (directory.empty() ? "." : directory) + '/' + name;
+        if (access(candidate.data(), X_OK) == 0) return candidate;
+        if (colon == std::string_view::npos) return {};
+        rest.remove_prefix(colon + 1);
+    }
+}
+
+void append_edit(const std::string& path) {
+    // Let the clock move on from the modification times of the outputs, so
+    // that the edited file is newer than them.
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    auto f = fopen(path.data(), "ab");
+    if (not f or fputs("// Edited by lbs-perf.\n", f) < 0 or fclose(f) != 0) {
+        printf("ERROR: Could not edit %s\n", path.data());
+        exit(1);
+    }
+}
+
+auto json_string(const std::string& text) -> std::string {
+    std::string out{"\""};
+    for (const char c : text) {
+        if (c == '"' or c == '\\') out += '\\';
+        if ((unsigned char)c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        } else out += c;
+    }
+    return out + '"';
+}
+
+}  // namespace
+
+int main(int argc, const char** argv) {
+    if (running_as_command(argv[0])) return run_timed_command(argc, argv);
+
+    SyntheticProject project{};
+    size_t jobs{std::thread::hardware_concurrency()};
+    size_t runs{1};
+    bool just_generate{false};
+    std::string lbs{};
+    std::string ninja{"ninja"};
+    std::string json{};
+    std::string label{};
+    std::string directory{};
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string_view arg{argv[i]};
+
+        if (arg == "-h" or arg.substr(0, 6) == "--help") {
+            // clang-format off
+            printf("USAGE: %s [OPTIONS] DIRECTORY\n", argv[0]);
+            printf("Generate a project in DIRECTORY and time clean, no-op, source-edited and header-edited builds of it, with lbs and with ninja.\n");
+            printf("OPTIONS:\n");
+            printf("  --targets=<N> :: Generate N libraries, plus an executable linking them (default 8).\n");
+            printf("  --sources=<N> :: Generate N sources in each library (default 50).\n");
+            printf("  --depth=<N> :: Spread the libraries over N layers, each depending on the one below (default 3).\n");
+            printf("  --headers=<N> :: Have every source include N headers (default 4).\n");
+            printf("  --heavy :: Generate sources that use standard containers and algorithms, rather than next to nothing.\n");
+            printf("  --generate :: Only generate the project.\n");
+            printf("  --lbs=<PATH> :: Time the lbs at PATH (default is the one next to lbs-perf).\n");
+            printf("  --ninja=<PATH> :: Time the ninja at PATH (default is ninja in PATH); \"none\" times lbs alone.\n");
+            printf("  --runs=<N> :: Time every build N times, and keep the fastest (default 1).\n");
+            printf("  --json=<FILE> :: Append the results to FILE, as a line of JSON.\n");
+            printf("  --label=<TEXT> :: Record TEXT (say, the version of lbs) along with the results.\n");
+            printf("  -j <N> :: Run up to N commands at once (default is the number of CPUs).\n");
+            // clang-format on
+            return 0;
+        }
+
+        if (arg.substr(0, 10) == "--targets=") project.targets = count(arg, 10);
+        else if (arg.substr(0, 10) == "--sources=")
+            project.sources = count(arg, 10);
+        else if (arg.substr(0, 8) == "--depth=") project.depth = count(arg, 8);
+        else if (arg.substr(0, 10) == "--headers=")
+            project.headers = count(arg, 10);
+        else if (arg == "--heavy") project.heavy = true;
+        else if (arg == "--generate") just_generate = true;
+        else if (arg.substr(0, 6) == "--lbs=") lbs = arg.substr(6);
+        else if (arg.substr(0, 8) == "--ninja=") ninja = arg.substr(8);
+        else if (arg.substr(0, 7) == "--runs=") runs = count(arg, 7);
+        else if (arg.substr(0, 7) == "--json=") json = arg.substr(7);
+        else if (arg.substr(0, 8) == "--label=") label = arg.substr(8);
+        else if (arg.substr(0, 2) == "-j") {
+            // Accept both "-j N" and "-jN".
+            std::string value{arg.substr(2)};
+            if (value.empty()) {
+                if (i + 1 >= argc) {
+                    printf(
+                        "ERROR: Option -j provided at end of command line, "
+                        "expected number of jobs\n"
+                    );
+                    return 1;
+                }
+                value = argv[++i];
+            }
+            jobs = std::strtoul(value.data(), nullptr, 10);
+            if (not jobs) {
+                printf("ERROR: Invalid number of jobs \"%s\"\n", value.data());
+                return 1;
+            }
+        } else if (arg.size() and arg.data()[0] == '-') {
+            printf("ERROR: Unknown command line argument \"%s\"\n", arg.data());
+            return 1;
+        } else directory = arg;
+    }
+
+    if (directory.empty()) {
+        printf("ERROR: Expected a directory to generate into (see --help)\n");
+        return 1;
+    }
+    if (not project.targets or not project.sources or not runs) {
+        printf("ERROR: Expected at least one target, source and run\n");
+        return 1;
+    }
+    directory = fs::absolute(directory).lexically_normal().string();
+    if (just_generate) {
+        if (not generate_project(directory, project)) {
+            printf(
+                "ERROR: Could not generate a project in %s\n",
+                directory.data()
+            );
+            return 1;
+        }
+        return 0;
+    }
+
+    std::error_code error{};
+    const auto self = fs::read_symlink("/proc/self/exe", error).string();
+    if (error) {
+        printf("ERROR: Could not find lbs-perf itself\n");
+        return 1;
+    }
+    if (lbs.empty()) lbs = (fs::path(self).parent_path() / "lbs").string();
+    lbs = fs::absolute(lbs).string();
+    if (access(lbs.data(), X_OK) != 0) {
+        printf("ERROR: No lbs at %s (see --lbs)\n", lbs.data());
+        return 1;
+    }
+    if (ninja == "none") ninja.clear();
+    else if (ninja.find('/') == std::string::npos) {
+        const auto found = find_in_path(ninja);
+        if (found.empty())
+            printf("No %s in PATH, so timing lbs alone\n", ninja.data());
+        ninja = found;
+    } else ninja = fs::absolute(ninja).string();
+
+    const auto log = directory + "/commands.log";
+    fs::create_directories(directory, error);
+    if (error or not time_commands(self, directory + "/bin", log)) {
+        printf("ERROR: Could not set up %s\n", directory.data());
+        return 1;
+    }
+
+    struct Tool {
+        std::string name;
+        std::vector<std::string> build;
+        // The fastest of the runs, by wall time, of each scenario.
+        BuildTiming best[scenario_count];
+    };
+    std::vector<Tool> tools{};
+    const auto j = "-j" + std::to_string(jobs);
+    tools.push_back({"lbs", {lbs, "--noclean", "--no-daemon", j}, {}});
+    if (ninja.size()) tools.push_back({"ninja", {ninja, j}, {}});
+
+    for (size_t run = 0; run < runs; ++run) {
+        for (auto& tool : tools) {
+            const auto root = directory + '/' + tool.name;
+            if (not generate_project(root, project)) {
+                printf(
+                    "ERROR: Could not generate a project in %s\n", root.data()
+                );
+                return 1;
+            }
+            BuildTiming timing{};
+            if (tool.name == "ninja"
+                and not time_build({lbs, "--ninja"}, root, log, timing)) {
+                printf(
+                    "ERROR: %s --ninja failed in %s\n", lbs.data(),
+                    root.data()
+                );
+                return 1;
+            }
+            for (size_t scenario = 0; scenario < scenario_count; ++scenario) {
+                if (scenario == 2)
+                    append_edit(root + '/' + edited_source(project));
+                if (scenario == 3)
+                    append_edit(root + '/' + edited_header(project));
+                if (not time_build(tool.build, root, log, timing)) {
+                    printf(
+                        "ERROR: The %s build of %s failed (run %s in %s to see "
+                        "why)\n",
+                        scenarios[scenario], root.data(), tool.name.data(),
+                        root.data()
+                    );
+                    return 1;
+                }
+                auto& best = tool.best[scenario];
+                if (not run or timing.wall_ms < best.wall_ms) best = timing;
+            }
+        }
+    }
+    std::remove(log.data());
+
+    printf(
+        "%-14s %-6s %10s %10s %9s %12s %12s\n", "scenario", "tool", "wall ms",
+        "cpu ms", "commands", "command cpu", "overhead cpu"
+    );
+    for (size_t scenario = 0; scenario < scenario_count; ++scenario)
+        for (const auto& tool : tools) {
+            const auto& timing = tool.best[scenario];
+            printf(
+                "%-14s %-6s %10.1f %10.1f %9zu %12.1f %12.1f\n",
+                scenarios[scenario], tool.name.data(), timing.wall_ms,
+                timing.cpu_ms, timing.commands, timing.command_cpu_ms,
+                timing.overhead_cpu_ms()
+            );
+        }
+
+    if (json.empty()) return 0;
+    std::string line{"{\"label\":" + json_string(label)};
+    line += ",\"time\":" + std::to_string((long long)time(nullptr));
+    line += ",\"lbs\":" + json_string(lbs);
+    line += ",\"project\":{\"targets\":" + std::to_string(project.targets);
+    line += ",\"sources\":" + std::to_string(project.sources);
+    line += ",\"depth\":" + std::to_string(project.depth);
+    line += ",\"headers\":" + std::to_string(project.headers);
+    line += ",\"heavy\":" + std::string(project.heavy ? "true" : "false");
+    line += "},\"jobs\":" + std::to_string(jobs);
+    line += ",\"runs\":" + std::to_string(runs) + ",\"results\":[";
+    for (size_t scenario = 0; scenario < scenario_count; ++scenario)
+        for (const auto& tool : tools) {
+            const auto& timing = tool.best[scenario];
+            char numbers[256];
+            snprintf(
+                numbers, sizeof(numbers),
+                ",\"wall_ms\":%.3f,\"cpu_ms\":%.3f,\"commands\":%zu,"
+                "\"command_cpu_ms\":%.3f,\"command_wall_ms\":%.3f,"
+                "\"overhead_cpu_ms\":%.3f}",
+                timing.wall_ms, timing.cpu_ms, timing.commands,
+                timing.command_cpu_ms, timing.command_wall_ms,
+                timing.overhead_cpu_ms()
+            );
+            if (line.back() != '[') line += ',';
+            line += "{\"scenario\":" + json_string(scenarios[scenario]);
+            line += ",\"tool\":" + json_string(tool.name) + numbers;
+        }
+    line += "]}\n";
+    auto f = fopen(json.data(), "ab");
+    if (not f or fputs(line.data(), f) < 0 or fclose(f) != 0) {
+        printf("ERROR: Could not append the results to %s\n", json.data());
+        return 1;
+    }
+    return 0;
+}
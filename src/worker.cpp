@@ -0,0 +1,63 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include <worker/worker.h>
+
+int main(int argc, const char** argv) {
+    uint32_t capacity{std::thread::hardware_concurrency()};
+    std::string address{};
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string_view arg{argv[i]};
+
+        if (arg.substr(0, 2) == "-h" or arg.substr(0, 3) == "--h") {
+            // clang-format off
+            printf("USAGE: %s [OPTIONS] ADDRESS\n", argv[0]);
+            printf("Compile objects for lbs --workers ADDRESS, where ADDRESS is unix:<path> or [<host>]:<port>.\n");
+            printf("Only let trusted machines reach it: it runs whatever compile command it is sent.\n");
+            printf("OPTIONS:\n");
+            printf("  -j <N> :: Compile up to N objects at once (default is the number of CPUs).\n");
+            // clang-format on
+            return 0;
+        }
+
+        if (arg.substr(0, 2) == "-j") {
+            // Accept both "-j N" and "-jN".
+            std::string jobs{arg.substr(2)};
+            if (jobs.empty()) {
+                if (i + 1 >= argc) {
+                    printf(
+                        "ERROR: Option -j provided at end of command line, "
+                        "expected number of jobs\n"
+                    );
+                    return 1;
+                }
+                jobs = argv[++i];
+            }
+            char* end{nullptr};
+            const auto n = std::strtoul(jobs.data(), &end, 10);
+            capacity = uint32_t(
+                std::min<unsigned long>(n, worker_capacity_limit)
+            );
+            if (jobs.empty() or not isdigit((unsigned char)jobs[0]) or *end
+                or not capacity) {
+                printf("ERROR: Invalid number of jobs \"%s\"\n", jobs.data());
+                return 1;
+            }
+        } else if (arg.size() and arg.data()[0] == '-') {
+            printf("ERROR: Unknown command line argument \"%s\"\n", arg.data());
+            return 1;
+        } else address = arg;
+    }
+
+    if (address.empty()) {
+        printf("ERROR: Expected an address to listen on (see --help)\n");
+        return 1;
+    }
+    return worker_serve(address, capacity);
+}